@@ -10,6 +10,7 @@
 #include "2DTree.h"
 #include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
 
 CollectionImplGeneric(Object2D, Objects2D, 100)
 
@@ -26,83 +27,96 @@ void add2DObject(Objects2D* self, OsmPoint point, Offset offset, ZoomLevel minZo
     self->count++;
 }
 
-static int dimensionCompare(Object2D* object1, Object2D* object2, char dimension) {    
-    Coordinate v1 = object1->dimensions[dimension];
-    Coordinate v2 = object2->dimensions[dimension];
-    return v1 - v2;
-}
-
-typedef int (*DimensionComarator)(const void* object1, const void* object2);
+#define PARALLEL_BUILD_MIN_OBJECTS 50000
 
-static int dimension1Compare(const void* object1, const void* object2) {    
-    return dimensionCompare((Object2D*) object1, (Object2D*) object2, 0);
+static void swapObjects(Object2D* values, int i, int j) {
+    Object2D temp = values[i];
+    values[i] = values[j];
+    values[j] = temp;
 }
 
-static int dimension2Compare(const void* object1, const void* object2) {    
-    return dimensionCompare((Object2D*) object1, (Object2D*) object2, 1);
+// Partitions values so that k-th element is on its sorted place, smaller ones before it and bigger ones after it.
+static void selectKthObject(Object2D* values, int count, int k, int dimension) {
+    int left = 0;
+    int right = count - 1;
+    while(right > left) {
+        Coordinate first = values[left].dimensions[dimension];
+        Coordinate middle = values[left + (right - left) / 2].dimensions[dimension];
+        Coordinate last = values[right].dimensions[dimension];
+        Coordinate pivot = first < middle ? (middle < last ? middle : (first < last ? last : first)) :
+                                            (first < last ? first : (middle < last ? last : middle));
+        int i = left;
+        int j = right;
+        while(i <= j) {
+            while(values[i].dimensions[dimension] < pivot) {
+                i++;
+            }
+            while(values[j].dimensions[dimension] > pivot) {
+                j--;
+            }
+            if(i <= j) {
+                swapObjects(values, i, j);
+                i++;
+                j--;
+            }
+        }
+        if(k <= j) {
+            right = j;
+        } else if(k >= i) {
+            left = i;
+        } else {
+            break;
+        }
+    }
 }
 
-static DimensionComarator comparators[2] = {
-    dimension1Compare, dimension2Compare
-};
+typedef struct {
+    Object2D* values;
+    int count;
+    int level;
+    int threadsCount;
+    Tree2D* result;
+} Tree2DTask;
 
+static Tree2D* index2DObjectsInternal(Object2D* values, int count, int level, int threadsCount);
 
-Tree2D* index2DObjectsInternal(Objects2D* objects, int level) {
-    if(objects->count == 0) {
+static void* runTree2DTask(void* data) {
+    Tree2DTask* task = (Tree2DTask*) data;
+    task->result = index2DObjectsInternal(task->values, task->count, task->level, task->threadsCount);
+    return NULL;
+}
+
+static Tree2D* index2DObjectsInternal(Object2D* values, int count, int level, int threadsCount) {
+    if(count == 0) {
         return NULL;
     }
     Tree2D* self = calloc(sizeof(Tree2D), 1);
-//    Coordinate dividor;
     self->dimension = level % 2;
-    if(objects->count == 1) {
-        self->info.offset = objects->values[0].offset;
-        self->info.dimensions[0] = objects->values[0].dimensions[0];
-        self->info.dimensions[1] = objects->values[0].dimensions[1];
-        self->info.minZoomLevel = objects->values[0].minZoomLevel;
-        self->info.maxZoomLevel = objects->values[0].maxZoomLevel;
-        self->left = NULL;
-        self->right = NULL;
+    self->count = count;
+    int medianIndex = count / 2;
+    if(count > 1) {
+        selectKthObject(values, count, medianIndex, self->dimension);
+    }
+    self->info = values[medianIndex];
+    
+    Tree2DTask left = {values, medianIndex, level + 1, threadsCount / 2, NULL};
+    Tree2DTask right = {values + medianIndex + 1, count - medianIndex - 1, level + 1, threadsCount - threadsCount / 2, NULL};
+    pthread_t thread;
+    if(threadsCount > 1 && count >= PARALLEL_BUILD_MIN_OBJECTS && 0 == pthread_create(&thread, NULL, runTree2DTask, &left)) {
+        runTree2DTask(&right);
+        pthread_join(thread, NULL);
     } else {
-        qsort(objects->values, objects->count, sizeof(Object2D), comparators[self->dimension]);
-        
-        int medianIndex = objects->count / 2;
-        
-        self->info.offset = objects->values[medianIndex].offset;
-        self->info.dimensions[0] = objects->values[medianIndex].dimensions[0];
-        self->info.dimensions[1] = objects->values[medianIndex].dimensions[1];
-        self->info.minZoomLevel = objects->values[medianIndex].minZoomLevel;
-        self->info.maxZoomLevel = objects->values[medianIndex].maxZoomLevel;
-//        dividor = self->info.dimensions[self->dimension];
-        Objects2D leftObjects = {objects->values, medianIndex, medianIndex};
-        
-        self->left = index2DObjectsInternal(&leftObjects, level + 1);
-        Objects2D rightObjects = {objects->values + medianIndex + 1, objects->count - medianIndex - 1, objects->count - medianIndex - 1};
-        self->right = index2DObjectsInternal(&rightObjects, level + 1);
+        left.threadsCount = right.threadsCount = threadsCount;
+        runTree2DTask(&left);
+        runTree2DTask(&right);
     }
+    self->left = left.result;
+    self->right = right.result;
     return self;
 }
 
-Tree2D* index2DObjects(Objects2D* objects) {
-    return index2DObjectsInternal(objects, 0);
-}
-
-static int isLeaf(Tree2D* self) {
-    return !self->left && !self->right;
-}
-
-static int fullCount(Tree2D* self) {
-    if(isLeaf(self)) {
-        return 1;
-    } else {
-        int count = 1;
-        if (self->left) {
-            count += fullCount(self->left);
-        }
-        if (self->right) {
-            count += fullCount(self->right);
-        }
-        return count;
-    }
+Tree2D* index2DObjects(Objects2D* objects, int threadsCount) {
+    return index2DObjectsInternal(objects->values, objects->count, 0, threadsCount);
 }
 
 void write2DTree(Tree2D* self, FILE* file, WriteCallback write) {
@@ -114,7 +128,7 @@ void write2DTree(Tree2D* self, FILE* file, WriteCallback write) {
         info.leftOffset = self->left ? 0 : OFFSET_NOT_DEFINED;
         info.info.minZoomLevel = self->info.minZoomLevel;
         info.info.maxZoomLevel = self->info.maxZoomLevel;
-        info.rightOffset = self->right ? (self->left ? fullCount(self->left) : 0) * sizeof(Tree2DRecord) : OFFSET_NOT_DEFINED;
+        info.rightOffset = self->right ? (self->left ? self->left->count : 0) * sizeof(Tree2DRecord) : OFFSET_NOT_DEFINED;
     
 		if (write) {
 			write(file, &info, sizeof(Tree2DRecord));
@@ -32,6 +32,8 @@ typedef struct ATree2D {
     struct ATree2D* left;
     struct ATree2D* right;
     char dimension;
+    // Number of nodes in subtree including this one.
+    int count;
     Object2D info;
 } Tree2D;
 
@@ -39,7 +41,8 @@ Collection(Object2D, Objects2D)
 
 void add2DObject(Objects2D* self, OsmPoint point, Offset offset, ZoomLevel minZoomLevel, ZoomLevel maxZoomLevel);
 
-Tree2D* index2DObjects(Objects2D* objects);
+// Subtrees of big enough ranges are built on up to threadsCount threads.
+Tree2D* index2DObjects(Objects2D* objects, int threadsCount);
 void write2DTree(Tree2D* self, FILE* file, WriteCallback write);
 void free2DTree(Tree2D* self);
 #endif
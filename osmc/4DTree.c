@@ -99,6 +99,7 @@ Tree4D* index4DObjectsInternal(Objects4D* objects, int level) {
         Objects4D rightObjects = {objects->values + medianIndex + 1, objects->count - medianIndex - 1, objects->count - medianIndex - 1};
         self->right = index4DObjectsInternal(&rightObjects, level + 1);
     }
+    self->count = objects->count;
     return self;
 }
 
@@ -106,25 +107,6 @@ Tree4D* index4DObjects(Objects4D* objects) {
     return index4DObjectsInternal(objects, 0);
 }
 
-static int isLeaf(Tree4D* self) {
-    return !self->left && !self->right;
-}
-
-static int fullCount(Tree4D* self) {
-    if(isLeaf(self)) {
-        return 1;
-    } else {
-        int count = 1;
-        if(self->left) {
-            count += fullCount(self->left);
-        }
-        if(self->right) {
-            count += fullCount(self->right);
-        }
-        return count;
-    }
-}
-
 void write4DTree(Tree4D* self, FILE* file, WriteCallback write) {
     if(self) {
         Tree4DRecord info;
@@ -136,7 +118,7 @@ void write4DTree(Tree4D* self, FILE* file, WriteCallback write) {
         info.info.minZoomLevel = self->info.minZoomLevel;
         info.info.maxZoomLevel = self->info.maxZoomLevel;
         info.leftOffset = self->left ? 0 : OFFSET_NOT_DEFINED;
-        info.rightOffset = self->right ? (self->left ? fullCount(self->left) : 0) * sizeof(Tree4DRecord) : OFFSET_NOT_DEFINED;
+        info.rightOffset = self->right ? (self->left ? self->left->count : 0) * sizeof(Tree4DRecord) : OFFSET_NOT_DEFINED;
         
 		if (write) {
 			write(file, &info, sizeof(Tree4DRecord));
@@ -31,6 +31,8 @@ typedef struct ATree4D{
     struct ATree4D* left;
     struct ATree4D* right;
     char dimension;
+    // Number of nodes in subtree including this one.
+    int count;
     Object4D info;
 } Tree4D;
 
@@ -0,0 +1,73 @@
+/*
+ *  Arena.c
+ *  OSMapper
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "Arena.h"
+
+#define ARENA_ALIGNMENT sizeof(void*)
+
+void initArena(Arena* arena) {
+    arena->blocks = NULL;
+}
+
+void clearArena(Arena* arena) {
+    while(arena->blocks) {
+        ArenaBlock* previous = arena->blocks->previous;
+        free(arena->blocks);
+        arena->blocks = previous;
+    }
+}
+
+void resetArena(Arena* arena) {
+    ArenaBlock* largest = arena->blocks;
+    for(ArenaBlock* block = arena->blocks; block; block = block->previous) {
+        if(block->size > largest->size) {
+            largest = block;
+        }
+    }
+    while(arena->blocks) {
+        ArenaBlock* previous = arena->blocks->previous;
+        if(arena->blocks != largest) {
+            free(arena->blocks);
+        }
+        arena->blocks = previous;
+    }
+    if(largest) {
+        largest->previous = NULL;
+        largest->used = 0;
+        arena->blocks = largest;
+    }
+}
+
+void* arenaAlloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    ArenaBlock* block = arena->blocks;
+    if(!block || block->size - block->used < size) {
+        size_t blockSize = block ? block->size * 2 : ARENA_MIN_BLOCK_SIZE;
+        if(blockSize > ARENA_MAX_BLOCK_SIZE) {
+            blockSize = ARENA_MAX_BLOCK_SIZE;
+        }
+        if(blockSize < size) {
+            blockSize = size;
+        }
+        block = malloc(sizeof(ArenaBlock) + blockSize);
+        block->previous = arena->blocks;
+        block->size = blockSize;
+        block->used = 0;
+        arena->blocks = block;
+    }
+    void* result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+UTF8* arenaUtf8dup(Arena* arena, const UTF8* string) {
+    size_t size = strlen((const char*) string) + 1;
+    UTF8* copy = arenaAlloc(arena, size);
+    memcpy(copy, string, size);
+    return copy;
+}
@@ -0,0 +1,44 @@
+/*
+ *  Arena.h
+ *  OSMapper
+ *
+ *  Region allocator for scratch data of entities.
+ *
+ *  Memory is taken from blocks by moving pointer and is released all at once by reset,
+ *  which keeps the largest block, so reader which resets arena per entity or per batch
+ *  does not call malloc at all after the first few entities.
+ *
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include "utf.h"
+
+#define ARENA_MIN_BLOCK_SIZE 4096
+#define ARENA_MAX_BLOCK_SIZE (1 << 20)
+
+typedef struct AArenaBlock {
+    struct AArenaBlock* previous;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+// Zero filled arena is empty arena.
+typedef struct {
+    ArenaBlock* blocks;
+} Arena;
+
+void initArena(Arena* arena);
+// Frees all blocks.
+void clearArena(Arena* arena);
+// Releases everything allocated in arena. Memory is kept for next allocations.
+void resetArena(Arena* arena);
+
+// Returns pointer aligned for any type, which is valid until arena is reset.
+void* arenaAlloc(Arena* arena, size_t size);
+UTF8* arenaUtf8dup(Arena* arena, const UTF8* string);
+
+#endif
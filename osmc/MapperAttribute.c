@@ -11,6 +11,8 @@
 #include <stdlib.h>
 #include <libxml/xmlstring.h>
 #include <math.h>
+#include <string.h>
+#include "utils.h"
 
 CollectionImplGeneric(MapperAttribute, MapperAttributes, 10)
 CollectionImplGeneric(MapperPartAttribute, MapperPartAttributes, 10)
@@ -20,10 +22,12 @@ static void addMapperAtribute(MapperAttributes* attributes, int key, UTF8* value
     UTF16* value = utf8to16(value8);
     int tagSlots = ceil((double)utf16length(value)/ATTRIBUTE_VALUE_LENGTH);
 //    printf("Check for available place..\n");
+    int size = utf16size(value);
+    tagSlots = max(tagSlots, size / (ATTRIBUTE_VALUE_LENGTH - 2) + 1);
     ensureMapperAttributesCapacityForNNewElements(attributes, tagSlots);
 //    printf("Done. New capacity: %i\n", attributes->capacity);
     int index = attributes->count; 
-    int size = utf16size(value);
+    memset(attributes->values + index, 0, sizeof(MapperAttribute) * tagSlots);
     int c = 0;
     for(int i = 0; i < size; i++, c++) {
         if(c == ATTRIBUTE_VALUE_LENGTH - 2) {
@@ -51,15 +55,23 @@ void mapperAttributesFromTags(MapperAttributes* attributes, PlainTags* tags, Sim
     //printf("Done\n");
 }
 
+void mapperAttributesFromTagsWithLocalKeys(MapperAttributes* attributes, PlainTags* tags) {
+    for(int t = 0; t < tags->count; t++) {
+        addMapperAtribute(attributes, FIRST_LOCAL_ATTRIBUTE + t, tags->values[t].value);
+    }
+}
+
 
 static void addMapperPartAtribute(MapperPartAttributes* attributes, OsmId partId, int key, UTF8* value8) {
     //printf("Add tag %i = %s\n", key, value8);
     UTF16* value = utf8to16(value8);
     int tagSlots = ceil((double)utf16length(value)/ATTRIBUTE_VALUE_LENGTH);
+    int size = utf16size(value);
+    tagSlots = max(tagSlots, size / (ATTRIBUTE_VALUE_LENGTH - 2) + 1);
     ensureMapperPartAttributesCapacityForNNewElements(attributes, tagSlots);
     //printf("Capacity: %i\n", attributes->capacity);
     int index = attributes->count; 
-    int size = utf16size(value);
+    memset(attributes->values + index, 0, sizeof(MapperPartAttribute) * tagSlots);
     int c = 0;
     for(int i = 0; i < size; i++, c++) {
         if(c == ATTRIBUTE_VALUE_LENGTH - 2) {
@@ -88,3 +100,9 @@ void mapperPartAttributesFromTags(MapperPartAttributes* attributes, OsmId partId
         addMapperPartAtribute(attributes, partId, k, tags->values[t].value);
     }
 }
+
+void mapperPartAttributesFromTagsWithLocalKeys(MapperPartAttributes* attributes, OsmId partId, PlainTags* tags) {
+    for(int t = 0; t < tags->count; t++) {
+        addMapperPartAtribute(attributes, partId, FIRST_LOCAL_ATTRIBUTE + t, tags->values[t].value);
+    }
+}
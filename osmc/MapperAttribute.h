@@ -19,6 +19,8 @@
 
 #define UNUSED_ATTRIBUTE 0
 #define ATTRIBUTE_CONTINUATION 1
+// Keys from this value on refer to tag index in entity until resolved in writer attributes index.
+#define FIRST_LOCAL_ATTRIBUTE 2
 
 typedef MapperIndexedValue MapperAttributeKey;
 
@@ -39,4 +41,6 @@ Collection(MapperPartAttribute, MapperPartAttributes)
 
 void mapperAttributesFromTags(MapperAttributes* attributes, PlainTags* tags, SimpleStringIndex* keysIndex);
 void mapperPartAttributesFromTags(MapperPartAttributes* attributes, OsmId partId, PlainTags* tags, SimpleStringIndex* keysIndex);
+void mapperAttributesFromTagsWithLocalKeys(MapperAttributes* attributes, PlainTags* tags);
+void mapperPartAttributesFromTagsWithLocalKeys(MapperPartAttributes* attributes, OsmId partId, PlainTags* tags);
 #endif
@@ -0,0 +1,417 @@
+/*
+ *  MapperRules.c
+ *  OSMapper
+ *
+ *  Rules compiled into conditions grouped by key, matched in one pass over tags.
+ *
+ */
+
+// strtok_r and strdup are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include "MapperRules.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// The same classification as if-chains of pointClassByTags, getMinimalWayLevel and others in mapper.c.
+static const char* defaultMapperRules =
+    "point class Amenity amenity\n"
+    "point class Shop shop\n"
+    "point class Tourism tourism\n"
+    "point class Historic historic\n"
+    "point class Power power\n"
+    "point class Place place\n"
+    "point class TrafficSignals highway=traffic_signals\n"
+    "point class Crossing crossing\n"
+    "point class Crossing highway=crossing\n"
+    "point class Crossing railway=crossing\n"
+    "point min-zoom 5 place=city\n"
+    "point min-zoom 7 place=town\n"
+    "point min-zoom 11 place=hamlet\n"
+    "point min-zoom 14\n"
+    "point max-zoom 11 place=city\n"
+    "point max-zoom 12 place=town\n"
+    "point max-zoom 14 place=hamlet\n"
+    "point max-zoom 18\n"
+    "\n"
+    "way class PowerWay power=line\n"
+    "way class Boundary boundary\n"
+    "way class Highway highway\n"
+    "way class Railway railway\n"
+    "way class - waterway=riverbank\n"
+    "way class Waterway waterway\n"
+    "way min-zoom 4 highway=trunk\n"
+    "way min-zoom 5 highway=motorway\n"
+    "way min-zoom 5 highway=trunk_link\n"
+    "way min-zoom 7 highway=primary\n"
+    "way min-zoom 7 highway=motorway_link\n"
+    "way min-zoom 9 highway=secondary\n"
+    "way min-zoom 9 highway=primary_link\n"
+    "way min-zoom 12 highway=service\n"
+    "way min-zoom 10 highway\n"
+    "way min-zoom 0 boundary=administrative admin_level=1\n"
+    "way min-zoom 0 boundary=administrative admin_level=2\n"
+    "way min-zoom 0 boundary=administrative admin_level=3\n"
+    "way min-zoom 0 boundary=administrative admin_level=4\n"
+    "way min-zoom 4 boundary=administrative admin_level=5\n"
+    "way min-zoom 4 boundary=administrative admin_level=6\n"
+    "way min-zoom 6 boundary=administrative admin_level=7\n"
+    "way min-zoom 6 boundary=administrative admin_level=8\n"
+    "way min-zoom 8 boundary=administrative admin_level=9\n"
+    "way min-zoom 8 boundary=administrative admin_level=10\n"
+    "way min-zoom 9 boundary=administrative admin_level>10\n"
+    "way min-zoom 11\n"
+    "way max-zoom 18\n"
+    "\n"
+    "area class Building building\n"
+    "area class Landuse landuse\n"
+    "area class Leisure leisure\n"
+    "area class Water waterway=riverbank\n"
+    "area class Sport sport\n"
+    "area class Natural natural\n"
+    "area class PowerArea power\n"
+    "area class Parking amenity=parking\n"
+    "area class Area *\n"
+    "area min-zoom 12 building\n"
+    "area min-zoom 14 sport\n"
+    "area min-zoom 4 water\n"
+    "area min-zoom 4 landuse\n"
+    "area min-zoom 4 natural\n"
+    "area min-zoom 10\n"
+    "area max-zoom 18\n";
+
+static const char* ruleKinds[MAPPER_RULE_KINDS] = {"point", "way", "area"};
+static const char* ruleTargets[MAPPER_RULE_TARGETS] = {"class", "min-zoom", "max-zoom"};
+
+// Condition with id of its key, -1 for any tag, while rules are parsed.
+typedef struct {
+    int key;
+    MapperRuleCondition condition;
+} KeyedCondition;
+
+typedef struct {
+    KeyedCondition* values;
+    int count;
+    int capacity;
+} KeyedConditions;
+
+#define MAPPER_RULES_PARTIAL_MATCHES 32
+
+// Rule with more than one condition and number of its conditions matched so far.
+typedef struct {
+    int rule;
+    int matched;
+} PartialMatch;
+
+static int indexOfWord(const char** words, int count, const char* word) {
+    for(int w = 0; w < count; w++) {
+        if(strcmp(words[w], word) == 0) {
+            return w;
+        }
+    }
+    return -1;
+}
+
+static int parseInteger(const char* text, int* value) {
+    char* end;
+    long number = strtol(text, &end, 10);
+    if(!*text || *end) {
+        return 0;
+    }
+    *value = (int) number;
+    return 1;
+}
+
+static void addKeyedCondition(KeyedConditions* conditions, int key, MapperConditionType type, int value, int rule) {
+    if(conditions->count == conditions->capacity) {
+        conditions->capacity = max(conditions->capacity * 2, 64);
+        conditions->values = realloc(conditions->values, sizeof(KeyedCondition) * conditions->capacity);
+    }
+    KeyedCondition* condition = conditions->values + conditions->count++;
+    condition->key = key;
+    condition->condition.type = type;
+    condition->condition.value = value;
+    condition->condition.rule = rule;
+}
+
+static int parseCondition(MapperRules* self, char* text, int rule, KeyedConditions* conditions) {
+    if(strcmp(text, "*") == 0) {
+        addKeyedCondition(conditions, -1, MAPPER_CONDITION_ANY_VALUE, 0, rule);
+        return 1;
+    }
+    char* separator = strpbrk(text, "=>");
+    if(separator == text) {
+        return 0;
+    }
+    if(!separator) {
+        addKeyedCondition(conditions, internTagString(UTF8_CAST text, NULL), MAPPER_CONDITION_ANY_VALUE, 0, rule);
+        return 1;
+    }
+    char operator = *separator;
+    *separator = 0;
+    char* value = separator + 1;
+    TagStringId key = internTagString(UTF8_CAST text, NULL);
+    int number;
+    if(parseInteger(value, &number)) {
+        addKeyedCondition(conditions, key, operator == '>' ? MAPPER_CONDITION_GREATER : MAPPER_CONDITION_NUMBER, number, rule);
+        return 1;
+    }
+    if(operator == '>' || !*value) {
+        return 0;
+    }
+    addKeyedCondition(conditions, key, MAPPER_CONDITION_VALUE, internTagString(UTF8_CAST value, NULL), rule);
+    return 1;
+}
+
+// Parses "<kind> <target> <result> [condition]..." into new rule. Returns 0 if line is invalid.
+static int parseRule(MapperRules* self, char* line, KeyedConditions* conditions) {
+    const char* separators = " \t\r";
+    char* position;
+    char* kind = strtok_r(line, separators, &position);
+    char* target = strtok_r(NULL, separators, &position);
+    char* result = strtok_r(NULL, separators, &position);
+    if(!kind || !target || !result) {
+        return 0;
+    }
+    if(self->rulesCount == self->rulesCapacity) {
+        self->rulesCapacity = max(self->rulesCapacity * 2, 32);
+        self->rules = realloc(self->rules, sizeof(MapperRule) * self->rulesCapacity);
+    }
+    MapperRule* rule = self->rules + self->rulesCount;
+    int ruleKind = indexOfWord(ruleKinds, MAPPER_RULE_KINDS, kind);
+    int ruleTarget = indexOfWord(ruleTargets, MAPPER_RULE_TARGETS, target);
+    if(ruleKind < 0 || ruleTarget < 0) {
+        return 0;
+    }
+    rule->kind = ruleKind;
+    rule->target = ruleTarget;
+    rule->className = NULL;
+    rule->zoomLevel = 0;
+    rule->conditionsCount = 0;
+    if(rule->target == MAPPER_RULE_CLASS) {
+        if(strcmp(result, "-") != 0) {
+            int classId = simpleStringIndexOf(&(self->classes), UTF8_CAST result);
+            rule->className = self->classes.values[classId];
+        }
+    } else {
+        int zoomLevel;
+        if(!parseInteger(result, &zoomLevel) || zoomLevel < MIN_ZOOM_LEVEL || zoomLevel > MAX_ZOOM_LEVEL) {
+            return 0;
+        }
+        rule->zoomLevel = zoomLevel;
+    }
+    int conditionsCount = conditions->count;
+    char* condition;
+    while((condition = strtok_r(NULL, separators, &position))) {
+        if(!parseCondition(self, condition, self->rulesCount, conditions)) {
+            conditions->count = conditionsCount;
+            return 0;
+        }
+        rule->conditionsCount++;
+    }
+    self->rulesCount++;
+    return 1;
+}
+
+static void initMapperRules(MapperRules* self) {
+    memset(self, 0, sizeof(MapperRules));
+    initSimpleStringIndex(&(self->classes));
+}
+
+// Sorts conditions by key with counting sort and finds default rules.
+static void groupConditions(MapperRules* self, KeyedConditions* conditions) {
+    int keysCount = 0;
+    for(int c = 0; c < conditions->count; c++) {
+        keysCount = max(keysCount, conditions->values[c].key + 1);
+    }
+    self->keysCount = keysCount;
+    self->keyConditions = calloc(keysCount + 1, sizeof(int));
+    self->conditions = malloc(sizeof(MapperRuleCondition) * max(conditions->count, 1));
+    self->anyTagConditions = malloc(sizeof(MapperRuleCondition) * max(conditions->count, 1));
+    for(int c = 0; c < conditions->count; c++) {
+        if(conditions->values[c].key >= 0) {
+            self->keyConditions[conditions->values[c].key + 1]++;
+        }
+    }
+    for(int k = 0; k < keysCount; k++) {
+        self->keyConditions[k + 1] += self->keyConditions[k];
+    }
+    int* next = malloc(sizeof(int) * max(keysCount, 1));
+    memcpy(next, self->keyConditions, sizeof(int) * keysCount);
+    for(int c = 0; c < conditions->count; c++) {
+        KeyedCondition* condition = conditions->values + c;
+        if(condition->key >= 0) {
+            self->conditions[next[condition->key]++] = condition->condition;
+        } else {
+            self->anyTagConditions[self->anyTagConditionsCount++] = condition->condition;
+        }
+    }
+    self->conditionsCount = conditions->count - self->anyTagConditionsCount;
+    free(next);
+
+    for(int k = 0; k < MAPPER_RULE_KINDS; k++) {
+        for(int t = 0; t < MAPPER_RULE_TARGETS; t++) {
+            self->defaultRules[k][t] = self->rulesCount;
+        }
+    }
+    for(int r = self->rulesCount - 1; r >= 0; r--) {
+        if(!self->rules[r].conditionsCount) {
+            self->defaultRules[self->rules[r].kind][self->rules[r].target] = r;
+        }
+    }
+}
+
+static int compileMapperRules(MapperRules* self, char* text, const char* source) {
+    initMapperRules(self);
+    KeyedConditions conditions = {NULL, 0, 0};
+    int errors = 0;
+    int lineNumber = 0;
+    char* line = text;
+    while(line) {
+        char* end = strchr(line, '\n');
+        if(end) {
+            *end = 0;
+        }
+        lineNumber++;
+        char* start = line;
+        while(isspace((unsigned char) *start)) {
+            start++;
+        }
+        if(*start && *start != '#' && !parseRule(self, start, &conditions)) {
+            fprintf(stderr, "Invalid rule at line %i of %s\n", lineNumber, source);
+            errors++;
+        }
+        line = end ? end + 1 : NULL;
+    }
+    groupConditions(self, &conditions);
+    free(conditions.values);
+    return errors;
+}
+
+void initDefaultMapperRules(MapperRules* self) {
+    char* text = strdup(defaultMapperRules);
+    compileMapperRules(self, text, "default rules");
+    free(text);
+}
+
+int initMapperRulesFromFile(MapperRules* self, const char* path) {
+    FILE* file = fopen(path, "r");
+    if(!file) {
+        fprintf(stderr, "Error opening rules file %s\n", path);
+        KeyedConditions conditions = {NULL, 0, 0};
+        initMapperRules(self);
+        groupConditions(self, &conditions);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* text = calloc(length + 1, 1);
+    length = fread(text, 1, length, file);
+    fclose(file);
+    text[length] = 0;
+    int errors = compileMapperRules(self, text, path);
+    free(text);
+    return errors;
+}
+
+void clearMapperRules(MapperRules* self) {
+    clearSimpleStringIndex(&(self->classes));
+    free(self->rules);
+    free(self->conditions);
+    free(self->keyConditions);
+    free(self->anyTagConditions);
+    memset(self, 0, sizeof(MapperRules));
+}
+
+// Tag value not interned when tag was read is looked up in interned strings only once per tag,
+// and is read as number only once.
+typedef struct {
+    UTF8* value;
+    TagStringId valueId;
+    char valueFound;
+    char numberRead;
+    int number;
+} TagValue;
+
+static int tagNumber(TagValue* tagValue) {
+    if(!tagValue->numberRead) {
+        tagValue->number = atoi((const char*) tagValue->value);
+        tagValue->numberRead = 1;
+    }
+    return tagValue->number;
+}
+
+static int matchesCondition(MapperRuleCondition* condition, TagValue* tagValue) {
+    switch(condition->type) {
+        case MAPPER_CONDITION_ANY_VALUE:
+            return 1;
+        case MAPPER_CONDITION_VALUE:
+            if(!tagValue->valueFound) {
+                tagValue->valueId = findTagStringId(tagValue->value);
+                tagValue->valueFound = 1;
+            }
+            return tagValue->valueId == condition->value;
+        case MAPPER_CONDITION_NUMBER:
+            return tagNumber(tagValue) == condition->value;
+        case MAPPER_CONDITION_GREATER:
+            return tagNumber(tagValue) > condition->value;
+    }
+    return 0;
+}
+
+static void matchRule(MapperRules* self, int r, int best[MAPPER_RULE_KINDS][MAPPER_RULE_TARGETS], PartialMatch* partial, int* partialCount) {
+    MapperRule* rule = self->rules + r;
+    if(rule->conditionsCount > 1) {
+        int p = 0;
+        while(p < *partialCount && partial[p].rule != r) {
+            p++;
+        }
+        if(p == *partialCount) {
+            if(*partialCount == MAPPER_RULES_PARTIAL_MATCHES) {
+                return;
+            }
+            partial[p].rule = r;
+            partial[p].matched = 0;
+            (*partialCount)++;
+        }
+        if(++partial[p].matched < rule->conditionsCount) {
+            return;
+        }
+    }
+    if(r < best[rule->kind][rule->target]) {
+        best[rule->kind][rule->target] = r;
+    }
+}
+
+void classifyTags(MapperRules* self, PlainTags* tags, MapperClassification* result) {
+    int best[MAPPER_RULE_KINDS][MAPPER_RULE_TARGETS];
+    memcpy(best, self->defaultRules, sizeof(best));
+    PartialMatch partial[MAPPER_RULES_PARTIAL_MATCHES];
+    int partialCount = 0;
+    for(int t = 0; t < tags->count; t++) {
+        PlainTag* tag = tags->values + t;
+        int key = tag->keyId;
+        if(key >= self->keysCount) {
+            continue;
+        }
+        TagValue tagValue = {tag->value, tag->valueId, tag->valueId >= EMPTY_TAG_STRING, 0, 0};
+        for(int c = self->keyConditions[key]; c < self->keyConditions[key + 1]; c++) {
+            if(matchesCondition(self->conditions + c, &tagValue)) {
+                matchRule(self, self->conditions[c].rule, best, partial, &partialCount);
+            }
+        }
+    }
+    for(int c = 0; tags->count && c < self->anyTagConditionsCount; c++) {
+        matchRule(self, self->anyTagConditions[c].rule, best, partial, &partialCount);
+    }
+    for(int k = 0; k < MAPPER_RULE_KINDS; k++) {
+        int r = best[k][MAPPER_RULE_CLASS];
+        result->className[k] = r < self->rulesCount ? self->rules[r].className : NULL;
+        r = best[k][MAPPER_RULE_MIN_ZOOM];
+        result->minZoomLevel[k] = r < self->rulesCount ? self->rules[r].zoomLevel : MIN_ZOOM_LEVEL;
+        r = best[k][MAPPER_RULE_MAX_ZOOM];
+        result->maxZoomLevel[k] = r < self->rulesCount ? self->rules[r].zoomLevel : MAX_ZOOM_LEVEL;
+    }
+}
@@ -0,0 +1,95 @@
+/*
+ *  MapperRules.h
+ *  OSMapper
+ *
+ *  Classification of entities by tags into mapper classes and zoom levels.
+ *
+ *  Rules are read from lines "<point|way|area> <class|min-zoom|max-zoom> <result> [condition]...",
+ *  empty lines and lines starting with # are skipped. Condition is "key" for any value of key, "key=value",
+ *  "key>number" or "*" for any tag. Integer values are compared with tag values read as numbers.
+ *  Result is class name, "-" for no class, or zoom level. Rule matches if all its conditions match,
+ *  for each kind and target the first matching rule wins. Rule without conditions always matches.
+ *
+ */
+
+#ifndef _MAPPER_RULES_H_
+#define _MAPPER_RULES_H_
+
+#include "osm.h"
+#include "SimpleStringIndex.h"
+#include "utils.h"
+
+typedef enum {
+    MAPPER_RULE_POINT,
+    MAPPER_RULE_WAY,
+    MAPPER_RULE_AREA,
+    MAPPER_RULE_KINDS
+} MapperRuleKind;
+
+typedef enum {
+    MAPPER_RULE_CLASS,
+    MAPPER_RULE_MIN_ZOOM,
+    MAPPER_RULE_MAX_ZOOM,
+    MAPPER_RULE_TARGETS
+} MapperRuleTarget;
+
+typedef enum {
+    MAPPER_CONDITION_ANY_VALUE,
+    MAPPER_CONDITION_VALUE,
+    MAPPER_CONDITION_NUMBER,
+    MAPPER_CONDITION_GREATER
+} MapperConditionType;
+
+typedef struct {
+    MapperRuleKind kind;
+    MapperRuleTarget target;
+    // Class name, NULL for no class.
+    UTF8* className;
+    ZoomLevel zoomLevel;
+    int conditionsCount;
+} MapperRule;
+
+typedef struct {
+    MapperConditionType type;
+    // Interned value id or number.
+    int value;
+    int rule;
+} MapperRuleCondition;
+
+// Conditions are grouped by interned id of their key, so tags are matched by ids of their keys and values.
+typedef struct {
+    SimpleStringIndex classes;
+
+    MapperRule* rules;
+    int rulesCount;
+    int rulesCapacity;
+
+    MapperRuleCondition* conditions;
+    int conditionsCount;
+    // Conditions of key with id k are from keyConditions[k] to keyConditions[k + 1].
+    int* keyConditions;
+    // Keys with greater ids have no conditions.
+    int keysCount;
+    // Conditions matching any tag.
+    MapperRuleCondition* anyTagConditions;
+    int anyTagConditionsCount;
+    // First rule without conditions for each kind and target, or rulesCount.
+    int defaultRules[MAPPER_RULE_KINDS][MAPPER_RULE_TARGETS];
+} MapperRules;
+
+typedef struct {
+    UTF8* className[MAPPER_RULE_KINDS];
+    ZoomLevel minZoomLevel[MAPPER_RULE_KINDS];
+    ZoomLevel maxZoomLevel[MAPPER_RULE_KINDS];
+} MapperClassification;
+
+// Compiles built in rules of converter.
+void initDefaultMapperRules(MapperRules* self);
+// Compiles rules from file. Returns number of invalid lines, -1 if file can not be read.
+int initMapperRulesFromFile(MapperRules* self, const char* path);
+void clearMapperRules(MapperRules* self);
+
+// Classifies tags by all kinds at once in one pass over tags. Thread safe.
+void classifyTags(MapperRules* self, PlainTags* tags, MapperClassification* result);
+
+#endif
@@ -20,5 +20,5 @@ inline double doubleFromCoordiante(Coordinate c) {
     return ((double)c) / coordinateMultiplier;
 }*/
 
-CollectionImplGeneric(MapperWayNode, MapperWayNodes, 11)
+CollectionImplGeneric(MapperWayNode, MapperWayNodes, 16)
 CollectionImplGeneric(OsmId, OsmIds, 5)
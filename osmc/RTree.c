@@ -0,0 +1,166 @@
+/*
+ *  RTree.c
+ *  OSMapper
+ *
+ *  Packed R-tree built bottom-up with Sort-Tile-Recursive algorithm.
+ *
+ */
+
+#include "RTree.h"
+#include <stdlib.h>
+#include <string.h>
+
+static long long centerOf(const Object4D* object, int dimension) {
+    return (long long) object->dimensions[dimension] + object->dimensions[dimension + 2];
+}
+
+static int compareCenters(const Object4D* object1, const Object4D* object2, int dimension) {
+    long long c1 = centerOf(object1, dimension);
+    long long c2 = centerOf(object2, dimension);
+    if(c1 != c2) {
+        return c1 < c2 ? -1 : 1;
+    }
+    if(object1->offset != object2->offset) {
+        return object1->offset < object2->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+static int compareCentersX(const void* object1, const void* object2) {
+    return compareCenters((const Object4D*) object1, (const Object4D*) object2, 0);
+}
+
+static int compareCentersY(const void* object1, const void* object2) {
+    return compareCenters((const Object4D*) object1, (const Object4D*) object2, 1);
+}
+
+static int pagesCountFor(int count) {
+    return (count + RTREE_PAGE_SIZE - 1) / RTREE_PAGE_SIZE;
+}
+
+// Orders entries so that each following RTREE_PAGE_SIZE entries form compact page.
+static void sortTileRecursive(Objects4D* objects) {
+    int pagesCount = pagesCountFor(objects->count);
+    int slicesCount = 1;
+    while(slicesCount * slicesCount < pagesCount) {
+        slicesCount++;
+    }
+    int sliceSize = slicesCount * RTREE_PAGE_SIZE;
+    qsort(objects->values, objects->count, sizeof(Object4D), compareCentersX);
+    for(int start = 0; start < objects->count; start += sliceSize) {
+        int count = objects->count - start < sliceSize ? objects->count - start : sliceSize;
+        qsort(objects->values + start, count, sizeof(Object4D), compareCentersY);
+    }
+}
+
+// Creates one parent entry for each page of children. Offset of parent is index of child page.
+static void packLevel(Objects4D* children, Objects4D* parents) {
+    int pagesCount = pagesCountFor(children->count);
+    parents->values = malloc(sizeof(Object4D) * pagesCount);
+    parents->count = pagesCount;
+    parents->capacity = pagesCount;
+    for(int p = 0; p < pagesCount; p++) {
+        Object4D* parent = parents->values + p;
+        Object4D* child = children->values + p * RTREE_PAGE_SIZE;
+        int count = children->count - p * RTREE_PAGE_SIZE < RTREE_PAGE_SIZE ? children->count - p * RTREE_PAGE_SIZE : RTREE_PAGE_SIZE;
+        *parent = *child;
+        parent->offset = p;
+        for(int c = 1; c < count; c++) {
+            child++;
+            if(child->dimensions[0] < parent->dimensions[0]) {
+                parent->dimensions[0] = child->dimensions[0];
+            }
+            if(child->dimensions[1] < parent->dimensions[1]) {
+                parent->dimensions[1] = child->dimensions[1];
+            }
+            if(child->dimensions[2] > parent->dimensions[2]) {
+                parent->dimensions[2] = child->dimensions[2];
+            }
+            if(child->dimensions[3] > parent->dimensions[3]) {
+                parent->dimensions[3] = child->dimensions[3];
+            }
+            if(child->minZoomLevel < parent->minZoomLevel) {
+                parent->minZoomLevel = child->minZoomLevel;
+            }
+            if(child->maxZoomLevel > parent->maxZoomLevel) {
+                parent->maxZoomLevel = child->maxZoomLevel;
+            }
+        }
+    }
+}
+
+RTree* indexRTreeObjects(Objects4D* objects) {
+    RTree* self = calloc(sizeof(RTree), 1);
+    if(objects->count == 0) {
+        return self;
+    }
+    self->height = 1;
+    for(int count = objects->count; count > RTREE_PAGE_SIZE; count = pagesCountFor(count)) {
+        self->height++;
+    }
+    self->levels = calloc(sizeof(Objects4D), self->height);
+    self->levels[0] = *objects;
+    for(int level = 0; level < self->height; level++) {
+        sortTileRecursive(&(self->levels[level]));
+        if(level + 1 < self->height) {
+            packLevel(&(self->levels[level]), &(self->levels[level + 1]));
+        }
+    }
+    return self;
+}
+
+void writeRTree(RTree* self, FILE* file, WriteCallback write) {
+    RTreeHeader header;
+    memset(&header, 0, sizeof(RTreeHeader));
+    memcpy(header.magic, RTREE_MAGIC, sizeof(header.magic));
+    header.pageSize = RTREE_PAGE_SIZE;
+    header.height = self->height;
+    header.objectsCount = self->height ? self->levels[0].count : 0;
+    
+    Offset* levelOffsets = malloc(sizeof(Offset) * (self->height + 1));
+    Offset offset = sizeof(RTreeHeader);
+    for(int level = self->height - 1; level >= 0; level--) {
+        levelOffsets[level] = offset;
+        offset += pagesCountFor(self->levels[level].count) * sizeof(RTreePage);
+        header.pagesCount += pagesCountFor(self->levels[level].count);
+    }
+    
+    if(write) {
+        write(file, &header, sizeof(RTreeHeader));
+    } else {
+        fwrite(&header, sizeof(RTreeHeader), 1, file);
+    }
+    
+    RTreePage page;
+    for(int level = self->height - 1; level >= 0; level--) {
+        Objects4D* entries = &(self->levels[level]);
+        for(int start = 0; start < entries->count; start += RTREE_PAGE_SIZE) {
+            memset(&page, 0, sizeof(RTreePage));
+            page.count = entries->count - start < RTREE_PAGE_SIZE ? entries->count - start : RTREE_PAGE_SIZE;
+            page.leaf = level == 0;
+            memcpy(page.entries, entries->values + start, sizeof(Object4D) * page.count);
+            if(level > 0) {
+                for(int e = 0; e < page.count; e++) {
+                    page.entries[e].offset = levelOffsets[level - 1] + page.entries[e].offset * sizeof(RTreePage);
+                }
+            }
+            if(write) {
+                write(file, &page, sizeof(RTreePage));
+            } else {
+                fwrite(&page, sizeof(RTreePage), 1, file);
+            }
+        }
+    }
+    free(levelOffsets);
+}
+
+void freeRTree(RTree* self) {
+    if(self) {
+        // First level belongs to caller.
+        for(int level = 1; level < self->height; level++) {
+            free(self->levels[level].values);
+        }
+        free(self->levels);
+        free(self);
+    }
+}
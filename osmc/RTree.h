@@ -0,0 +1,43 @@
+/*
+ *  RTree.h
+ *  OSMapper
+ *
+ *  Packed R-tree location index for ways and areas.
+ *
+ */
+
+#ifndef _R_TREE_H_
+#define _R_TREE_H_
+
+#include "4DTree.h"
+
+#define RTREE_PAGE_SIZE 16
+#define RTREE_MAGIC "RTR1"
+
+typedef struct {
+    char magic[4];
+    int pageSize;
+    int height;
+    int objectsCount;
+    int pagesCount;
+} RTreeHeader;
+
+// Page written to file. Pages follow header level by level starting from root.
+// Entries of leaf pages point to objects, offsets of other entries are file offsets of child pages.
+// Bounds and zoom levels of non-leaf entries cover all objects below them.
+typedef struct {
+    int count;
+    int leaf;
+    Object4D entries[RTREE_PAGE_SIZE];
+} RTreePage;
+
+typedef struct {
+    int height;
+    // Entries of each level in page order. First level is objects passed to index, the last one is root page.
+    Objects4D* levels;
+} RTree;
+
+RTree* indexRTreeObjects(Objects4D* objects);
+void writeRTree(RTree* self, FILE* file, WriteCallback write);
+void freeRTree(RTree* self);
+#endif
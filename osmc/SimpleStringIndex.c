@@ -9,45 +9,120 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <strings.h>
+#include <stdint.h>
+#include <string.h>
 #include <memory.h>
+#include <unistd.h>
+#include <errno.h>
 //#include <libxml/xmlstring.h>
 #include "SimpleStringIndex.h"
+#include "utils.h"
 
-unsigned long djb2Hash(UTF8 *str)
-{
-    unsigned long hash = 5381;
-    UTF8 c;
-    
-    while ((c = *str++))
-        hash = hash * 33 + c;
-    
-    return hash;
+// FNV-1a with final mix, so low bits used for slots depend on all bytes. Measures length on the way.
+static unsigned int stringHash(const UTF8* string, int* length) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    const UTF8* c = string;
+    for(; *c; c++) {
+        hash = (hash ^ *c) * 0x100000001B3ULL;
+    }
+    *length = c - string;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    return (unsigned int) hash;
+}
+
+static UTF8* copyToArena(SimpleStringIndex* self, const UTF8* string, int size) {
+    SimpleStringIndexBlock* block = self->blocks;
+    if(!block || block->size - block->used < size) {
+        int blockSize = block ? block->size * 2 : SIMPLE_STRING_INDEX_MIN_BLOCK_SIZE;
+        if(blockSize > SIMPLE_STRING_INDEX_MAX_BLOCK_SIZE) {
+            blockSize = SIMPLE_STRING_INDEX_MAX_BLOCK_SIZE;
+        }
+        if(blockSize < size) {
+            blockSize = size;
+        }
+        block = malloc(sizeof(SimpleStringIndexBlock) + blockSize);
+        block->previous = self->blocks;
+        block->size = blockSize;
+        block->used = 0;
+        self->blocks = block;
+    }
+    UTF8* copy = block->data + block->used;
+    memcpy(copy, string, size);
+    block->used += size;
+    return copy;
+}
+
+// Richer slots, closer to their place, give way to poorer ones, so lookup can stop at first richer slot.
+static void insertSlot(SimpleStringIndex* self, SimpleStringIndexSlot entry) {
+    int mask = self->slotsCount - 1;
+    int position = entry.hash & mask;
+    int distance = 0;
+    while(self->slots[position].index) {
+        SimpleStringIndexSlot* slot = self->slots + position;
+        int slotDistance = (position - (slot->hash & mask)) & mask;
+        if(slotDistance < distance) {
+            SimpleStringIndexSlot richer = *slot;
+            *slot = entry;
+            entry = richer;
+            distance = slotDistance;
+        }
+        position = (position + 1) & mask;
+        distance++;
+    }
+    self->slots[position] = entry;
 }
 
-static void growSimpleStringIndexValues(SimpleStringIndex* index) {
-    index->valuesCapacity += 10;
-    index->values = realloc(index->values, sizeof(UTF8*) * index->valuesCapacity);
+static void growSimpleStringIndexSlots(SimpleStringIndex* self) {
+    SimpleStringIndexSlot* slots = self->slots;
+    int slotsCount = self->slotsCount;
+    self->slotsCount = slotsCount ? slotsCount * 2 : SIMPLE_STRING_INDEX_MIN_SLOTS;
+    self->slots = calloc(self->slotsCount, sizeof(SimpleStringIndexSlot));
+    for(int s = 0; s < slotsCount; s++) {
+        if(slots[s].index) {
+            insertSlot(self, slots[s]);
+        }
+    }
+    free(slots);
 }
 
-int addToSimpleStringIndex(SimpleStringIndex* index, UTF8* key) {
-    int leafIndex = djb2Hash(key) & SIMPLE_STRING_INDEX_LEAFS_COUNT_MASK;
-    if(index->valuesCapacity < index->valuesCount + 1) {
-        growSimpleStringIndexValues(index);
-    }   
-    int stringIndex = index->valuesCount++;
-    //printf("%s => %i\n", key, stringIndex);
-    index->values[stringIndex] = utf8dup(key);
-    
-    SimpleStringIndexLeaf* leaf = index->leafs[leafIndex];
-    SimpleStringIndexLeaf* keyLeaf = malloc(sizeof(SimpleStringIndexLeaf));
-    keyLeaf->value = index->values[stringIndex];
-    keyLeaf->index = stringIndex;
-    keyLeaf-> next = leaf;
-    if(leaf) {
-        leaf -> previous = keyLeaf;
-    }
-    index->leafs[leafIndex] = keyLeaf;
+static int findSimpleStringIndexWithHash(SimpleStringIndex* self, const UTF8* key, unsigned int hash) {
+    if(!self->slotsCount) {
+        return -1;
+    }
+    int mask = self->slotsCount - 1;
+    int position = hash & mask;
+    for(unsigned int distance = 0; ; distance++) {
+        SimpleStringIndexSlot* slot = self->slots + position;
+        if(!slot->index || ((position - (slot->hash & mask)) & mask) < distance) {
+            return -1;
+        }
+        if(slot->hash == hash && strcmp((const char*) self->values[slot->index - 1], (const char*) key) == 0) {
+            return slot->index - 1;
+        }
+        position = (position + 1) & mask;
+    }
+}
+
+static int addToSimpleStringIndex(SimpleStringIndex* self, const UTF8* key, int length, unsigned int hash) {
+    if(self->slotsMapped) {
+        SimpleStringIndexSlot* slots = malloc(sizeof(SimpleStringIndexSlot) * self->slotsCount);
+        memcpy(slots, self->slots, sizeof(SimpleStringIndexSlot) * self->slotsCount);
+        self->slots = slots;
+        self->slotsMapped = 0;
+    }
+    if(self->valuesCapacity < self->valuesCount + 1) {
+        self->valuesCapacity = self->valuesCapacity ? self->valuesCapacity * 2 : 16;
+        self->values = realloc(self->values, sizeof(UTF8*) * self->valuesCapacity);
+    }
+    if((self->valuesCount + 1) * 2 > self->slotsCount) {
+        growSimpleStringIndexSlots(self);
+    }
+    int stringIndex = self->valuesCount++;
+    self->values[stringIndex] = copyToArena(self, key, length + 1);
+    SimpleStringIndexSlot slot = {hash, stringIndex + 1};
+    insertSlot(self, slot);
     return stringIndex;
 }
 
@@ -63,66 +138,42 @@ int findSimpleStringIndexOf(SimpleStringIndex* index, UTF8* key) {
     if(key[0] == '\0') { // empty string 
         key = UTF8_CAST"EMPTY_STRING";
     }
-	//printf("Get key for %s\n", key);
-    int leafIndex = djb2Hash(key) & SIMPLE_STRING_INDEX_LEAFS_COUNT_MASK;
-	//printf("Hash: %i\n", leafIndex);
-    SimpleStringIndexLeaf* leaf = index->leafs[leafIndex];
-	//printf("Leaf for hash: %i\n", leaf != 0);
-    while(leaf) {
-        if(utf8equal(leaf->value, key)) {
-            return leaf -> index;
-        }
-        leaf = leaf -> next;
-    }
-    return -1;
+    int length;
+    unsigned int hash = stringHash(key, &length);
+    return findSimpleStringIndexWithHash(index, key, hash);
 }
 
 int simpleStringIndexOf(SimpleStringIndex* index, UTF8* key) {
-    int stringIndex = findSimpleStringIndexOf(index, key);
-    if(stringIndex == -1) {
-        stringIndex = addToSimpleStringIndex(index, key);
-    }
-    return stringIndex;
-}
-
-int findSimpleStringIndexOfD(SimpleStringIndex* index, UTF8* key) {
     if(key[0] == '\0') { // empty string 
         key = UTF8_CAST"EMPTY_STRING";
     }
-	printf("Get key for %s\n", key);
-    int leafIndex = djb2Hash(key) & SIMPLE_STRING_INDEX_LEAFS_COUNT_MASK;
-	printf("Hash: %i\n", leafIndex);
-    SimpleStringIndexLeaf* leaf = index->leafs[leafIndex];
-	printf("Leaf for hash: %i\n", leaf != 0);
-    while(leaf) {
-        printf("Try: %s == %s\n", leaf->value, key);
-        if(utf8equal(leaf->value, key)) {
-            return leaf -> index;
-        }
-        leaf = leaf -> next;
-    }
-    return -1;
-}
-
-
-int simpleStringIndexOfD(SimpleStringIndex* index, UTF8* key) {
-    //printf("Search for %s\n", key);
-    int stringIndex = findSimpleStringIndexOf(index, key);
+    int length;
+    unsigned int hash = stringHash(key, &length);
+    int stringIndex = findSimpleStringIndexWithHash(index, key, hash);
     if(stringIndex == -1) {
-      //  printf("Nothing found. Add.\n", key);
-        stringIndex = addToSimpleStringIndex(index, key);
+        stringIndex = addToSimpleStringIndex(index, key, length, hash);
     }
     return stringIndex;
 }
 
-
 void initSimpleStringIndex(SimpleStringIndex* index) {
-    index->valuesCount = 0;
-    index->valuesCapacity = 0;
-    index->values = 0;
-	for(int i=0; i< SIMPLE_STRING_INDEX_LEAFS_COUNT; i++){
-		index->leafs[i] = 0;
-	}
+    memset(index, 0, sizeof(SimpleStringIndex));
+}
+
+void clearSimpleStringIndex(SimpleStringIndex* index) {
+    while(index->blocks) {
+        SimpleStringIndexBlock* previous = index->blocks->previous;
+        free(index->blocks);
+        index->blocks = previous;
+    }
+    if(!index->slotsMapped) {
+        free(index->slots);
+    }
+    if(index->dictionary) {
+        unmapFile((void*) index->dictionary, 1, index->dictionaryLength);
+    }
+    free(index->values);
+    initSimpleStringIndex(index);
 }
 
 void writeSimpleStringIndex(SimpleStringIndex* index, FILE* file) {
@@ -131,12 +182,88 @@ void writeSimpleStringIndex(SimpleStringIndex* index, FILE* file) {
     }
 }
 
+// Reads string per line. Empty lines are skipped, as they were when strings were read by words.
 void initSimpleStringIndexFromFile(SimpleStringIndex* index, FILE* file) {
     initSimpleStringIndex(index);
-    while (!feof(file)) {
-        UTF8 value[255];
-        if(fscanf(file, "%s", value)) {
-           simpleStringIndexOf(index, value);
+    char line[4096];
+    while(fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if(line[0]) {
+            simpleStringIndexOf(index, UTF8_CAST line);
         }
     }
 }
+
+void writeSimpleStringIndexDictionary(SimpleStringIndex* index, const char* name, const char* directory) {
+    FILE* file = openFile(name, directory, "wb+", NO_COMPRESS);
+    if(!file) {
+        fprintf(stderr, "Error writing dictionary %s\n", name);
+        return;
+    }
+    SimpleStringIndexDictionaryHeader header;
+    memcpy(header.magic, SIMPLE_STRING_INDEX_DICTIONARY_MAGIC, 4);
+    header.valuesCount = index->valuesCount;
+    header.slotsCount = index->slotsCount;
+    header.stringsSize = 0;
+    unsigned int* offsets = malloc(sizeof(unsigned int) * (index->valuesCount + 1));
+    for(int i = 0; i < index->valuesCount; i++) {
+        offsets[i] = header.stringsSize;
+        header.stringsSize += strlen((const char*) index->values[i]) + 1;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(offsets, sizeof(unsigned int), index->valuesCount, file);
+    fwrite(index->slots, sizeof(SimpleStringIndexSlot), index->slotsCount, file);
+    for(int i = 0; i < index->valuesCount; i++) {
+        fwrite(index->values[i], 1, strlen((const char*) index->values[i]) + 1, file);
+    }
+    fclose(file);
+    free(offsets);
+}
+
+int mapSimpleStringIndexDictionary(SimpleStringIndex* index, const char* name, const char* directory) {
+    initSimpleStringIndex(index);
+    void* data;
+    size_t length;
+    char* path = fullFileName(name, directory);
+    int error = access(path, F_OK) == 0 ? mapFile(path, 1, &data, &length) : ENOENT;
+    free(path);
+    if(error) {
+        return error;
+    }
+    SimpleStringIndexDictionaryHeader header;
+    if(length < sizeof(header)) {
+        unmapFile(data, 1, length);
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+    size_t offsetsSize = sizeof(unsigned int) * header.valuesCount;
+    size_t slotsSize = sizeof(SimpleStringIndexSlot) * header.slotsCount;
+    if(memcmp(header.magic, SIMPLE_STRING_INDEX_DICTIONARY_MAGIC, 4) != 0 || header.valuesCount < 0 || header.slotsCount < 0
+       || header.stringsSize < 0 || length != sizeof(header) + offsetsSize + slotsSize + header.stringsSize) {
+        unmapFile(data, 1, length);
+        return -1;
+    }
+    const char* dictionary = (const char*) data;
+    const unsigned int* offsets = (const unsigned int*) (dictionary + sizeof(header));
+    UTF8* strings = UTF8_CAST (dictionary + sizeof(header) + offsetsSize + slotsSize);
+    // Every string must start inside strings and end there, which it does if they end with zero.
+    int invalid = header.stringsSize ? strings[header.stringsSize - 1] != '\0' : header.valuesCount > 0;
+    for(int i = 0; !invalid && i < header.valuesCount; i++) {
+        invalid = offsets[i] >= (unsigned int) header.stringsSize;
+    }
+    if(invalid) {
+        unmapFile(data, 1, length);
+        return -1;
+    }
+    index->dictionary = dictionary;
+    index->dictionaryLength = length;
+    index->slots = (SimpleStringIndexSlot*) (dictionary + sizeof(header) + offsetsSize);
+    index->slotsCount = header.slotsCount;
+    index->slotsMapped = 1;
+    index->valuesCount = index->valuesCapacity = header.valuesCount;
+    index->values = malloc(sizeof(UTF8*) * (header.valuesCount + 1));
+    for(int i = 0; i < header.valuesCount; i++) {
+        index->values[i] = strings + offsets[i];
+    }
+    return 0;
+}
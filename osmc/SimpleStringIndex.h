@@ -13,29 +13,62 @@
 #include <stdio.h>
 #include "utf.h"
 
-#define SIMPLE_STRING_INDEX_LEAFS_COUNT_BITS 8
-#define SIMPLE_STRING_INDEX_LEAFS_COUNT ((1<<(SIMPLE_STRING_INDEX_LEAFS_COUNT_BITS + 1)) - 1)
-#define SIMPLE_STRING_INDEX_LEAFS_COUNT_MASK ((1 << SIMPLE_STRING_INDEX_LEAFS_COUNT_BITS) - 1)
-
-typedef struct ASimpleStringIndexLeaf {
-    struct ASimpleStringIndexLeaf* previous;
-    struct ASimpleStringIndexLeaf* next;
-    UTF8* value;
+// Open addressing table with Robin Hood probing, grows twice when more than half full.
+#define SIMPLE_STRING_INDEX_MIN_SLOTS 64
+#define SIMPLE_STRING_INDEX_MIN_BLOCK_SIZE 1024
+#define SIMPLE_STRING_INDEX_MAX_BLOCK_SIZE (64 * 1024)
+
+typedef struct {
+    unsigned int hash;
+    // Index of value plus one, 0 for empty slot.
     int index;
-} SimpleStringIndexLeaf;
+} SimpleStringIndexSlot;
 
+// Block of arena strings are copied to. Strings never move, so values stay valid while index lives.
+typedef struct ASimpleStringIndexBlock {
+    struct ASimpleStringIndexBlock* previous;
+    int size;
+    int used;
+    UTF8 data[];
+} SimpleStringIndexBlock;
+
+// Zero filled index is empty index.
 typedef struct {
-    SimpleStringIndexLeaf* leafs[SIMPLE_STRING_INDEX_LEAFS_COUNT];
+    SimpleStringIndexSlot* slots;
+    int slotsCount;
+    SimpleStringIndexBlock* blocks;
     UTF8** values;
     int valuesCount;
     int valuesCapacity;
+    // Mapped dictionary file strings and, until something is added, slots are in.
+    const char* dictionary;
+    size_t dictionaryLength;
+    char slotsMapped;
 } SimpleStringIndex;
 
+// Binary dictionary file is header, offsets of strings from start of strings, hash table slots
+// and zero terminated strings. It is used mapped as it is, with no parsing and hashing.
+#define SIMPLE_STRING_INDEX_DICTIONARY_MAGIC "SSD1"
+
+typedef struct {
+    char magic[4];
+    int valuesCount;
+    int slotsCount;
+    int stringsSize;
+} SimpleStringIndexDictionaryHeader;
+
 int simpleStringIndexOf(SimpleStringIndex* index, UTF8* key);
+// Returns -1 if key is not in index.
+int findSimpleStringIndexOf(SimpleStringIndex* index, UTF8* key);
 UTF8* simpleStringValuesAtIndex(SimpleStringIndex* self, int index);
 
 void initSimpleStringIndex(SimpleStringIndex* index);
+void clearSimpleStringIndex(SimpleStringIndex* index);
 void initSimpleStringIndexFromFile(SimpleStringIndex* index, FILE* file);
 
 void writeSimpleStringIndex(SimpleStringIndex* index, FILE* file);
+// Writes uncompressed dictionary file with name to directory.
+void writeSimpleStringIndexDictionary(SimpleStringIndex* index, const char* name, const char* directory);
+// Maps dictionary file written by writeSimpleStringIndexDictionary. Returns 0 on success, leaves index empty otherwise.
+int mapSimpleStringIndexDictionary(SimpleStringIndex* index, const char* name, const char* directory);
 #endif
@@ -0,0 +1,93 @@
+/*
+ *  TagStrings.c
+ *  OSMapper
+ *
+ */
+
+#include "TagStrings.h"
+#include "SimpleStringIndex.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+// Id of string is its index in strings index plus one, empty string has id EMPTY_TAG_STRING.
+static SimpleStringIndex strings;
+static pthread_mutex_t stringsMutex = PTHREAD_MUTEX_INITIALIZER;
+static UTF8 emptyString[1] = {0};
+// Values not interned yet and number of times each was seen, so that rare values do not fill interner.
+static SimpleStringIndex candidates;
+static int* candidateCounts = NULL;
+static int candidateCountsCapacity = 0;
+
+// Counts value not interned yet and returns whether it is common enough to be interned. Called with strings locked.
+static char isCommonTagValue(const UTF8* value) {
+    if(strings.valuesCount >= TAG_VALUES_INTERN_LIMIT || utf8size(value) > TAG_VALUE_INTERN_MAX_SIZE) {
+        return 0;
+    }
+    int candidate = findSimpleStringIndexOf(&candidates, (UTF8*) value);
+    if(candidate < 0) {
+        if(candidates.valuesCount >= TAG_VALUE_CANDIDATES_LIMIT) {
+            return 0;
+        }
+        candidate = simpleStringIndexOf(&candidates, (UTF8*) value);
+        if(candidate >= candidateCountsCapacity) {
+            candidateCountsCapacity = candidateCountsCapacity ? candidateCountsCapacity * 2 : 1024;
+            candidateCounts = realloc(candidateCounts, sizeof(int) * candidateCountsCapacity);
+        }
+        candidateCounts[candidate] = 0;
+    }
+    return ++candidateCounts[candidate] >= TAG_VALUE_INTERN_MIN_OCCURRENCES;
+}
+
+static TagStringId intern(const UTF8* string, char force, UTF8** interned) {
+    if(!string[0]) {
+        if(interned) {
+            *interned = emptyString;
+        }
+        return EMPTY_TAG_STRING;
+    }
+    pthread_mutex_lock(&stringsMutex);
+    int index = findSimpleStringIndexOf(&strings, (UTF8*) string);
+    if(index < 0 && (force || isCommonTagValue(string))) {
+        index = simpleStringIndexOf(&strings, (UTF8*) string);
+    }
+    if(index >= 0 && interned) {
+        *interned = strings.values[index];
+    }
+    pthread_mutex_unlock(&stringsMutex);
+    return index < 0 ? NO_TAG_STRING : index + 1;
+}
+
+TagStringId internTagString(const UTF8* string, UTF8** interned) {
+    return intern(string, 1, interned);
+}
+
+TagStringId internTagValue(const UTF8* value, UTF8** interned) {
+    return intern(value, 0, interned);
+}
+
+TagStringId findTagStringId(const UTF8* string) {
+    if(!string[0]) {
+        return EMPTY_TAG_STRING;
+    }
+    pthread_mutex_lock(&stringsMutex);
+    int index = findSimpleStringIndexOf(&strings, (UTF8*) string);
+    pthread_mutex_unlock(&stringsMutex);
+    return index < 0 ? NO_TAG_STRING : index + 1;
+}
+
+UTF8* tagString(TagStringId id) {
+    if(id == EMPTY_TAG_STRING) {
+        return emptyString;
+    }
+    pthread_mutex_lock(&stringsMutex);
+    UTF8* string = strings.values[id - 1];
+    pthread_mutex_unlock(&stringsMutex);
+    return string;
+}
+
+int tagStringsCount(void) {
+    pthread_mutex_lock(&stringsMutex);
+    int count = strings.valuesCount + 1;
+    pthread_mutex_unlock(&stringsMutex);
+    return count;
+}
@@ -0,0 +1,42 @@
+/*
+ *  TagStrings.h
+ *  OSMapper
+ *
+ *  Process wide interner of tag keys and common tag values.
+ *
+ *  Interned strings live until the end of process and are shared by all tags, so tags can
+ *  borrow them and be compared by id. Keys are always interned, values only once they are
+ *  seen often enough while they are short and interner is not full, other values are owned by tags.
+ *
+ */
+
+#ifndef _TAG_STRINGS_H_
+#define _TAG_STRINGS_H_
+
+#include "utf.h"
+
+typedef int TagStringId;
+
+#define NO_TAG_STRING -1
+#define EMPTY_TAG_STRING 0
+
+// Values longer than this are not interned.
+#define TAG_VALUE_INTERN_MAX_SIZE 32
+// Values are not interned any more after so many strings are interned.
+#define TAG_VALUES_INTERN_LIMIT (1 << 18)
+// Values seen so many times are interned.
+#define TAG_VALUE_INTERN_MIN_OCCURRENCES 4
+// Values are not counted any more after so many distinct ones are seen.
+#define TAG_VALUE_CANDIDATES_LIMIT (1 << 20)
+
+// Interns string and sets interned to shared copy of it if not NULL. Thread safe.
+TagStringId internTagString(const UTF8* string, UTF8** interned);
+// Interns value if it is already interned or common enough. Returns NO_TAG_STRING and does not set interned otherwise.
+TagStringId internTagValue(const UTF8* value, UTF8** interned);
+// Returns NO_TAG_STRING if string was never interned.
+TagStringId findTagStringId(const UTF8* string);
+// Returns interned string for id.
+UTF8* tagString(TagStringId id);
+int tagStringsCount(void);
+
+#endif
@@ -27,10 +27,10 @@ void initTree16(Tree16* tree) {
     }
 }
 
-int addTree16NodeInternal(Tree16* tree, int Id, int offset, int level) {
+int addTree16NodeInternal(Tree16* tree, int Id, long offset, int level, char replace) {
     int i = Id & MASK;
     if(level == MAX_LEVEL) {
-        if(tree->node.offsets[i] == -1) {
+        if(replace || tree->node.offsets[i] == -1) {
             tree->node.offsets[i] = offset;
         }
         return 0;
@@ -42,7 +42,7 @@ int addTree16NodeInternal(Tree16* tree, int Id, int offset, int level) {
             initTree16Internal(child, level + 1);
             childrenCount++;
         }
-        childrenCount += addTree16NodeInternal(child, Id >> BITS_COUNT, offset, level + 1);
+        childrenCount += addTree16NodeInternal(child, Id >> BITS_COUNT, offset, level + 1, replace);
         tree->allChildrenCount += childrenCount;
         return childrenCount;
     }
@@ -67,7 +67,38 @@ int isInTree16(Tree16* tree, int Id) {
 }
 
 void addTree16Node(Tree16* tree, int Id, long offset) {
-    addTree16NodeInternal(tree, Id, offset, 0);
+    addTree16NodeInternal(tree, Id, offset, 0, 0);
+}
+
+void setTree16Node(Tree16* tree, int Id, long offset) {
+    addTree16NodeInternal(tree, Id, offset, 0, 1);
+}
+
+long tree16NodeOffset(Tree16* tree, int Id) {
+    for(int level = 0; level < MAX_LEVEL; level++, Id >>= BITS_COUNT) {
+        tree = tree->node.children[Id & MASK];
+        if(!tree) {
+            return -1;
+        }
+    }
+    return tree->node.offsets[Id & MASK];
+}
+
+static void forEachTree16NodeInternal(Tree16* tree, int level, long Id, Tree16NodeVisitor visitor, void* context) {
+    for(int i = 0; i < TREE_CHILDREN; i++) {
+        long childId = Id | ((long) i << (BITS_COUNT * level));
+        if(level == MAX_LEVEL) {
+            if(tree->node.offsets[i] != -1) {
+                visitor(context, childId, tree->node.offsets[i]);
+            }
+        } else if(tree->node.children[i]) {
+            forEachTree16NodeInternal(tree->node.children[i], level + 1, childId, visitor, context);
+        }
+    }
+}
+
+void forEachTree16Node(Tree16* tree, Tree16NodeVisitor visitor, void* context) {
+    forEachTree16NodeInternal(tree, 0, 0, visitor, context);
 }
 
 int allChildrenCountTree16(Tree16* tree, int level) {
@@ -197,6 +228,28 @@ long findObjectOffset(Tree16OnFile* self, long Id) {
     return findObjectOffsetInternal(self, Id >> CACHE_BITS_COUNT, start, CACHE_LEVEL);
 }
 
+static void forEachTree16FileNodeInternal(FILE* file, long recordOffset, int level, long Id, Tree16NodeVisitor visitor, void* context) {
+    TreeRecord record;
+    fseek(file, recordOffset, SEEK_SET);
+    if(!fread(&record, sizeof(TreeRecord), 1, file)) {
+        return;
+    }
+    for(int i = 0; i < TREE_CHILDREN; i++) {
+        if(record.recordNumbers[i] != -1) {
+            long childId = Id | ((long) i << (BITS_COUNT * level));
+            if(level == MAX_LEVEL) {
+                visitor(context, childId, record.recordNumbers[i]);
+            } else {
+                forEachTree16FileNodeInternal(file, record.recordNumbers[i], level + 1, childId, visitor, context);
+            }
+        }
+    }
+}
+
+void forEachTree16FileNode(FILE* file, Tree16NodeVisitor visitor, void* context) {
+    forEachTree16FileNodeInternal(file, 0, 0, 0, visitor, context);
+}
+
 void freeTree16WithFile(Tree16OnFile* tree) {
     fclose(tree->file);
 }
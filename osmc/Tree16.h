@@ -40,15 +40,26 @@ typedef struct {
     long root[CACHE_SIZE];
 } Tree16OnFile;
 
+typedef void (*Tree16NodeVisitor)(void* context, long Id, long offset);
+
 void initTree16(Tree16* tree);
+// Keeps offset of node which is already in tree.
 void addTree16Node(Tree16* tree, int Id, long offset);
+// Replaces offset of node which is already in tree.
+void setTree16Node(Tree16* tree, int Id, long offset);
 void saveTree16ToFile(Tree16* tree, FILE* file, int level, long offset);
 
 int isInTree16(Tree16* tree, int Id);
+// Returns offset of node, -1 if it is not in tree.
+long tree16NodeOffset(Tree16* tree, int Id);
+// Calls visitor for each node of tree, in no particular order. Visitor may replace offsets of visited nodes.
+void forEachTree16Node(Tree16* tree, Tree16NodeVisitor visitor, void* context);
 
 void freeTree16(Tree16* tree);
 
 void freeTree16WithFile(Tree16OnFile* tree);
 void initTree16WithFile(Tree16OnFile* self, FILE* aFile);
 long findObjectOffset(Tree16OnFile* self, long Id);
+// Calls visitor for each node of tree saved to file, in no particular order.
+void forEachTree16FileNode(FILE* file, Tree16NodeVisitor visitor, void* context);
 #endif
@@ -27,6 +27,7 @@ void ensure##name##CapacityForNNewElements(name* self, int n);
 CollectionWithCustomAdd(type, name);\
 void addTo##name(name* self, type element);\
 
+// Capacity is doubled, so adding n elements one by one copies O(n) elements, growFactor is initial capacity.
 #define CollectionImplMinimal(type, name, growFactor) \
 void init##name(name* self) {\
     self->values = NULL;\
@@ -35,7 +36,8 @@ void init##name(name* self) {\
 }\
 void ensure##name##CapacityForNNewElements(name* self, int n) {\
     if(self->capacity < self->count + n) {\
-        self->capacity = self->count + (growFactor > n ? growFactor : n);\
+        int capacity = self->capacity * 2 > growFactor ? self->capacity * 2 : growFactor;\
+        self->capacity = capacity > self->count + n ? capacity : self->count + n;\
         self->values = realloc(self->values, sizeof(type) * self->capacity);\
     }\
 }\
@@ -7,6 +7,9 @@
  *
  */
 
+// strdup is POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
 #include "mapper.h"
 #include "utf.h"
 #include "utils.h"
@@ -16,6 +19,7 @@
 #include <limits.h>
 #include <math.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include <errno.h>
 #include <sys/stat.h>
@@ -33,6 +37,56 @@ Coordinate mercatorY(Coordinate lat) {
     return coordianteFromDouble(180.0/M_PI * log(tan(M_PI/4.0+doubleFromCoordiante(lat)*(M_PI/180.0)/2.0)));
 }
 
+// Cubic Hermite segments of mercator y in coordinate units, each MERCATOR_TABLE_STEP of latitude long.
+// Interpolation error is below 0.05 of coordinate unit, so result differs from mercatorY by at most 1.
+#define MERCATOR_TABLE_SHIFT 18
+#define MERCATOR_TABLE_STEP (1 << MERCATOR_TABLE_SHIFT)
+#define MERCATOR_TABLE_HALF_SIZE 3247
+#define MERCATOR_TABLE_LIMIT ((Coordinate)MERCATOR_TABLE_HALF_SIZE * MERCATOR_TABLE_STEP)
+
+static double mercatorTable[2 * MERCATOR_TABLE_HALF_SIZE][4];
+static pthread_once_t mercatorTableOnce = PTHREAD_ONCE_INIT;
+
+static void initMercatorTable() {
+    for(int i = 0; i < 2 * MERCATOR_TABLE_HALF_SIZE; i++) {
+        double lat0 = (double)(i - MERCATOR_TABLE_HALF_SIZE) * MERCATOR_TABLE_STEP / COORDINATE_MULTIPLIER * (M_PI/180.0);
+        double lat1 = (double)(i + 1 - MERCATOR_TABLE_HALF_SIZE) * MERCATOR_TABLE_STEP / COORDINATE_MULTIPLIER * (M_PI/180.0);
+        double y0 = 180.0/M_PI * log(tan(M_PI/4.0 + lat0/2.0)) * COORDINATE_MULTIPLIER;
+        double y1 = 180.0/M_PI * log(tan(M_PI/4.0 + lat1/2.0)) * COORDINATE_MULTIPLIER;
+        double m0 = MERCATOR_TABLE_STEP / cos(lat0);
+        double m1 = MERCATOR_TABLE_STEP / cos(lat1);
+        mercatorTable[i][0] = y0;
+        mercatorTable[i][1] = m0;
+        mercatorTable[i][2] = 3 * (y1 - y0) - 2 * m0 - m1;
+        mercatorTable[i][3] = 2 * (y0 - y1) + m0 + m1;
+    }
+}
+
+static inline Coordinate interpolateMercatorY(Coordinate lat) {
+    if(lat <= -MERCATOR_TABLE_LIMIT || lat >= MERCATOR_TABLE_LIMIT) {
+        return mercatorY(lat);
+    }
+    uint32_t shifted = (uint32_t)(lat + MERCATOR_TABLE_LIMIT);
+    double* segment = mercatorTable[shifted >> MERCATOR_TABLE_SHIFT];
+    double t = (double)(shifted & (MERCATOR_TABLE_STEP - 1)) * (1.0 / MERCATOR_TABLE_STEP);
+    return (Coordinate)round(segment[0] + t * (segment[1] + t * (segment[2] + t * segment[3])));
+}
+
+Coordinate tableMercatorY(Coordinate lat) {
+    pthread_once(&mercatorTableOnce, initMercatorTable);
+    return interpolateMercatorY(lat);
+}
+
+// Projects count nodes at once with mercator table.
+void projectNodesInfo(NodeInfo* infos, MapperWayNode* nodes, int count) {
+    pthread_once(&mercatorTableOnce, initMercatorTable);
+    for(int i = 0; i < count; i++) {
+        nodes[i].id = infos[i].id;
+        nodes[i].location.x = mercatorX(infos[i].lon);
+        nodes[i].location.y = interpolateMercatorY(infos[i].lat);
+    }
+}
+
 void freeMapperPolygon(MapperPolygon* polygon) {
     //clearTags(&(polygon->tags));
     clearMapperWayNodes(&(polygon->wayNodes));
@@ -41,36 +95,33 @@ void freeMapperPolygon(MapperPolygon* polygon) {
 CollectionImplCustomElementFree(MapperPolygon, MapperPolygons, 5)
 CollectionImplAdd(MapperPolygon, MapperPolygons)
 
-static MapperAttributes pointAttributes = {NULL, 0, 0};
 static MapperAttribute emptyPointAttribute = {0, {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}};
 
-int writeMapperPointTags(FILE* file, int *current, WriteCallback write) {
-    int tagsLeft = pointAttributes.count - *current;
+int writeMapperPointTags(void* file, MapperAttributes* pointAttributes, int *current, WriteCallback write) {
+    int tagsLeft = pointAttributes->count - *current;
     if( tagsLeft > POINT_ATTRIBUTES_COUNT) {
-		write(file, pointAttributes.values + *current, sizeof(MapperAttribute) * POINT_ATTRIBUTES_COUNT);
+		write(file, pointAttributes->values + *current, sizeof(MapperAttribute) * POINT_ATTRIBUTES_COUNT);
         *current= *current + POINT_ATTRIBUTES_COUNT;
     } else {
         if(tagsLeft) {
-            write(file, pointAttributes.values + *current, sizeof(MapperAttribute)* tagsLeft);
+            write(file, pointAttributes->values + *current, sizeof(MapperAttribute)* tagsLeft);
         }
         for(int i=0; i < POINT_ATTRIBUTES_COUNT - tagsLeft; i++) {
             write(file, &emptyPointAttribute, sizeof(MapperAttribute));
         }
-        *current= pointAttributes.count;
+        *current= pointAttributes->count;
     }
-    return pointAttributes.count > *current;
+    return pointAttributes->count > *current;
 }
 
 
-long int writeMapperPoint(FILE* file, OsmId id, Coordinate x, Coordinate y, PlainTags* tags, MapperClassId class, SimpleStringIndex* attributesIndex, WriteCallback write) {
+long int writeMapperPoint(void* file, OsmId id, Coordinate x, Coordinate y, MapperAttributes* pointAttributes, MapperClassId class, WriteCallback write) {
     //printf("Write to file %i\n", file);
     MapperPointInfo point;
     point.id = id;
     point.class = class;
     point.x = x;
     point.y = y;
-    //printf("Convert tags\n", file);
-    mapperAttributesFromTags(&pointAttributes, tags, attributesIndex);
     
     int currentTag = 0;
     char tagsLeft = 1;
@@ -78,37 +129,35 @@ long int writeMapperPoint(FILE* file, OsmId id, Coordinate x, Coordinate y, Plai
     //printf("writing...\n");
     while(tagsLeft) {
         write(file, &(point), sizeof(MapperPointInfo));
-        tagsLeft = writeMapperPointTags(file, &currentTag, write);
+        tagsLeft = writeMapperPointTags(file, pointAttributes, &currentTag, write);
         offset += sizeof(MapperPoint);
     }
-    removeAllMapperAttributes(&pointAttributes);
     //printf("Done\n", file);
     return offset;
 }
 
-static MapperPartAttributes partAttributes = { NULL, 0, 0};
 static MapperPartAttribute emptyPartAttribute = {0,{0, {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}}};
 
-int writeMapperPartTags(FILE* file, int *current, int maxCount, WriteCallback write) {
-    int tagsLeft = partAttributes.count - *current;
+int writeMapperPartTags(void* file, MapperPartAttributes* partAttributes, int *current, int maxCount, WriteCallback write) {
+    int tagsLeft = partAttributes->count - *current;
     if (tagsLeft > maxCount) {
-        write(file, partAttributes.values + *current, sizeof(MapperPartAttribute) * maxCount);
+        write(file, partAttributes->values + *current, sizeof(MapperPartAttribute) * maxCount);
         *current= *current + maxCount;
     } else {
         if(tagsLeft) {
-            write(file, partAttributes.values + *current, sizeof(MapperPartAttribute) * tagsLeft);
+            write(file, partAttributes->values + *current, sizeof(MapperPartAttribute) * tagsLeft);
         }
         for(int i=0; i < maxCount - tagsLeft; i++) {
             write(file, &emptyPartAttribute, sizeof(MapperPartAttribute));
         }
-        *current= partAttributes.count;
+        *current= partAttributes->count;
     }
-    return partAttributes.count > *current;    
+    return partAttributes->count > *current;    
 }
 
 static MapperWayNode emptyWayNode = {0, {0,0}};
 
-int writeMapperWayNodes(FILE* file, MapperWayNodes* nodes, int *current, int maxCount, int count, WriteCallback write) {
+int writeMapperWayNodes(void* file, MapperWayNodes* nodes, int *current, int maxCount, int count, WriteCallback write) {
     write(file, nodes->values + *current, sizeof(MapperWayNode) * count);
     *current += count;
     for(int w=0; w < maxCount - count; w++) {
@@ -117,7 +166,7 @@ int writeMapperWayNodes(FILE* file, MapperWayNodes* nodes, int *current, int max
     return nodes->count > *current;
 }
 
-long int writeMapperWay(FILE* file, OsmId id, OsmId groupId, MapperWayNodes* nodes, BBox bbox, PlainTags* tags, MapperClassId class, SimpleStringIndex* attributesIndex, WriteCallback write) {    
+long int writeMapperWay(void* file, OsmId id, OsmId groupId, MapperWayNodes* nodes, BBox bbox, MapperPartAttributes* partAttributes, MapperClassId class, WriteCallback write) {    
     MapperWayInfo way;
     way.id = id;
     way.groupId = groupId;
@@ -130,23 +179,20 @@ long int writeMapperWay(FILE* file, OsmId id, OsmId groupId, MapperWayNodes* nod
     char tagsLeft = 1;
     char nodesLeft = 1;
     long int offset = 0;
-    //printf("Convert tags...\n"); 
-    mapperPartAttributesFromTags(&partAttributes, 0, tags, attributesIndex);
     //printf("Write...\n");
     while(tagsLeft || nodesLeft) {
 		int polygonPartNodes = min(nodes->count - currentNode, WAY_NODES_COUNT);
         write(file, &(way), sizeof(MapperWayInfo));
-        tagsLeft = writeMapperPartTags(file, &currentTag, WAY_ATTRIBUTES_COUNT, write);
+        tagsLeft = writeMapperPartTags(file, partAttributes, &currentTag, WAY_ATTRIBUTES_COUNT, write);
 	    
         nodesLeft = writeMapperWayNodes(file, nodes, &currentNode, WAY_NODES_COUNT, polygonPartNodes, write);
         offset += sizeof(MapperWay);
     }
     //printf("Done.\n");
-    removeAllMapperPartAttributes(&partAttributes);
     return offset;
 }
 
-long int writeMapperArea(FILE* file, OsmId id, MapperPolygons* polygons, BBox bbox, PlainTags* tags, MapperClassId class, SimpleStringIndex* attributesIndex, WriteCallback write) {
+long int writeMapperArea(void* file, OsmId id, MapperPolygons* polygons, BBox bbox, MapperPartAttributes* partAttributes, MapperClassId class, WriteCallback write) {
     
     MapperAreaInfo area;
     area.id = id;
@@ -159,17 +205,20 @@ long int writeMapperArea(FILE* file, OsmId id, MapperPolygons* polygons, BBox bb
     char nodesLeft = 1;
     long int offset = 0;
     
-    mapperPartAttributesFromTags(&partAttributes, 0, tags, attributesIndex);
-    
     MapperPolygon* currentPolygon = polygons->values;
     int currentPolygonIndex = 0;
     
     while(nodesLeft || tagsLeft) {
         write(file, &area, sizeof(MapperAreaInfo));
 		int polygonPartNodes = max(0, min(currentPolygon->wayNodes.count - currentNode, AREA_NODES_COUNT));
-		currentPolygon->info.nodesCount = polygonPartNodes;
-        write(file, &(currentPolygon->info), sizeof(MapperPolygonInfo));
-        tagsLeft = writeMapperPartTags(file, &currentTag, AREA_ATTRIBUTES_COUNT, write);
+        // Copied to zeroed info, so padding after bit fields is not written from uninitialized memory.
+        MapperPolygonInfo polygonInfo;
+        memset(&polygonInfo, 0, sizeof(MapperPolygonInfo));
+        polygonInfo.id = currentPolygon->info.id;
+        polygonInfo.role = currentPolygon->info.role;
+		polygonInfo.nodesCount = polygonPartNodes;
+        write(file, &polygonInfo, sizeof(MapperPolygonInfo));
+        tagsLeft = writeMapperPartTags(file, partAttributes, &currentTag, AREA_ATTRIBUTES_COUNT, write);
         nodesLeft = writeMapperWayNodes(file, &(currentPolygon->wayNodes), &currentNode, AREA_NODES_COUNT, polygonPartNodes, write);
         if(!nodesLeft) {
             if(currentPolygonIndex < polygons->count - 1) {
@@ -181,10 +230,141 @@ long int writeMapperArea(FILE* file, OsmId id, MapperPolygons* polygons, BBox bb
         }
         offset += sizeof(MapperArea);
     }
-    removeAllMapperPartAttributes(&partAttributes);
     return offset;
 }
 
+#pragma mark Compact format
+
+static int writeCompactUnsigned(void* file, uint64_t value, WriteCallback write) {
+    unsigned char buffer[VARINT_MAX_LENGTH];
+    return write(file, buffer, encodeVarint(value, buffer));
+}
+
+static int writeCompactSigned(void* file, int64_t value, WriteCallback write) {
+    return writeCompactUnsigned(file, zigzagEncode(value), write);
+}
+
+static void writeCompactBBox(void* file, BBox bbox, WriteCallback write) {
+    writeCompactSigned(file, bbox.min.x, write);
+    writeCompactSigned(file, bbox.min.y, write);
+    writeCompactSigned(file, (int64_t) bbox.max.x - bbox.min.x, write);
+    writeCompactSigned(file, (int64_t) bbox.max.y - bbox.min.y, write);
+}
+
+// Each node is written as difference from previous one, ids only if requested.
+static void writeCompactNodes(void* file, MapperWayNodes* nodes, OsmPoint* previous, OsmId* previousId, char withIds, WriteCallback write) {
+    unsigned char buffer[3 * VARINT_MAX_LENGTH];
+    for(int n = 0; n < nodes->count; n++) {
+        MapperWayNode* node = nodes->values + n;
+        int length = encodeVarint(zigzagEncode((int64_t) node->location.x - previous->x), buffer);
+        length += encodeVarint(zigzagEncode((int64_t) node->location.y - previous->y), buffer + length);
+        if(withIds) {
+            length += encodeVarint(zigzagEncode((int64_t) node->id - *previousId), buffer + length);
+            *previousId = node->id;
+        }
+        *previous = node->location;
+        write(file, buffer, length);
+    }
+}
+
+static void writeCompactPointGeometry(void* file, OsmId id, Coordinate x, Coordinate y, WriteCallback write) {
+    writeCompactUnsigned(file, id, write);
+    writeCompactSigned(file, x, write);
+    writeCompactSigned(file, y, write);
+}
+
+// Nodes of way are relative to minimum of its bbox.
+static void writeCompactWayGeometry(void* file, OsmId id, OsmId groupId, MapperWayNodes* nodes, BBox bbox, char withIds, WriteCallback write) {
+    writeCompactUnsigned(file, id, write);
+    writeCompactUnsigned(file, groupId, write);
+    writeCompactBBox(file, bbox, write);
+    writeCompactUnsigned(file, withIds ? MAPPER_COMPACT_NODE_IDS : 0, write);
+    writeCompactUnsigned(file, nodes->count, write);
+    OsmPoint previous = bbox.min;
+    OsmId previousId = 0;
+    writeCompactNodes(file, nodes, &previous, &previousId, withIds, write);
+}
+
+// Polygon nodes continue differences from last node of previous polygon.
+static void writeCompactAreaGeometry(void* file, OsmId id, MapperPolygons* polygons, BBox bbox, char withIds, WriteCallback write) {
+    writeCompactUnsigned(file, id, write);
+    writeCompactBBox(file, bbox, write);
+    writeCompactUnsigned(file, withIds ? MAPPER_COMPACT_NODE_IDS : 0, write);
+    writeCompactUnsigned(file, polygons->count, write);
+    OsmPoint previous = bbox.min;
+    OsmId previousId = 0;
+    for(int p = 0; p < polygons->count; p++) {
+        MapperPolygon* polygon = polygons->values + p;
+        writeCompactUnsigned(file, polygon->info.id, write);
+        writeCompactUnsigned(file, polygon->info.role, write);
+        writeCompactUnsigned(file, polygon->wayNodes.count, write);
+        writeCompactNodes(file, &(polygon->wayNodes), &previous, &previousId, withIds, write);
+    }
+}
+
+// Write callback appending serialized bytes to record.
+static int writeToMapperRecord(void* context, void* buffer, int len) {
+    MapperRecord* record = (MapperRecord*) context;
+    if(record->capacity < record->length + len) {
+        record->capacity = max(record->capacity * 2, record->length + len);
+        record->bytes = realloc(record->bytes, record->capacity);
+    }
+    memcpy(record->bytes + record->length, buffer, len);
+    record->length += len;
+    return len;
+}
+
+void initMapperRecord(MapperRecord* self) {
+    self->className = NULL;
+    self->bytes = NULL;
+    self->length = 0;
+    self->capacity = 0;
+    self->levelsCount = 0;
+    initMapperAttributes(&(self->pointAttributes));
+    initMapperPartAttributes(&(self->partAttributes));
+    initMapperWayNodes(&(self->wayNodes));
+    memset(&(self->generalization), 0, sizeof(MapperGeneralization));
+    initMapperWayNodes(&(self->generalization.nodes));
+}
+
+void clearMapperRecord(MapperRecord* self) {
+    free(self->bytes);
+    self->bytes = NULL;
+    self->length = 0;
+    self->capacity = 0;
+    clearMapperAttributes(&(self->pointAttributes));
+    clearMapperPartAttributes(&(self->partAttributes));
+    clearMapperWayNodes(&(self->wayNodes));
+    free(self->generalization.kept);
+    free(self->generalization.stack);
+    clearMapperWayNodes(&(self->generalization.nodes));
+    free(self->generalization.polygons);
+    memset(&(self->generalization), 0, sizeof(MapperGeneralization));
+}
+
+CollectionImplGeneric(Offset, Offsets, 1000)
+
+static void initMapperRecordsLayout(MapperRecordsLayout* self) {
+    initOffsets(&(self->starts));
+    initOffsets(&(self->dead));
+}
+
+static void clearMapperRecordsLayout(MapperRecordsLayout* self) {
+    clearOffsets(&(self->starts));
+    clearOffsets(&(self->dead));
+}
+
+static void initMapperWriterIndexes(MapperWriter* self) {
+    initTree16(&(self->pointsIndex));
+    initTree16(&(self->waysIndex));
+    initTree16(&(self->areasIndex));
+    initTree16(&(self->multipolygonsIndex));
+    self->updating = 0;
+    initMapperRecordsLayout(&(self->pointsLayout));
+    initMapperRecordsLayout(&(self->waysLayout));
+    initMapperRecordsLayout(&(self->areasLayout));
+}
+
 void initMapperWriter(MapperWriter* self, const char* outputDirectory, char compress) {
     self->dbPath = strdup(outputDirectory);
     
@@ -193,30 +373,201 @@ void initMapperWriter(MapperWriter* self, const char* outputDirectory, char comp
     }
     self->compressed = compress;
 	self->write = getWrite(compress);
+    self->legacyLocationIndex = 0;
+    self->indexThreadsCount = 1;
+    self->formatVersion = MAPPER_FORMAT_FIXED;
+    self->compactNodeIds = 0;
+    self->spatialOrderZoomLevel = -1;
 	self->mapInformation.bounds.min.x = INT_MAX;
 	self->mapInformation.bounds.min.y = INT_MAX;
     self->pointsFile = openFile("points", outputDirectory, "w+", compress);
     self->waysFile = openFile("ways", outputDirectory, "w+", compress);
     self->areasFile = openFile("areas", outputDirectory, "w+", compress);	
-    //self->pointsIndexFile = openFile("points.idx", outputDirectory, "w+");
     self->pointsLocationIndexFile = openFile("points.lidx", outputDirectory, "w+", compress);
-    //self->waysIndexFile = openFile("ways.idx", outputDirectory, "w+");
     self->waysLocationIndexFile = openFile("ways.lidx", outputDirectory, "w+", compress);
-    //self->areasIndexFile = openFile("areas.idx", outputDirectory, "w+");
     self->areasLocationIndexFile = openFile("areas.lidx", outputDirectory, "w+", compress);
     
+    initMapperWriterIndexes(self);
     initSimpleStringIndex(&(self->attributesIndex));
     simpleStringIndexOf(&(self->attributesIndex), UTF8_CAST "UNUSED");
     simpleStringIndexOf(&(self->attributesIndex), UTF8_CAST "CONTINUATION");
     simpleStringIndexOf(&(self->attributesIndex), UTF8_CAST "EMPTY_STRING");
     initSimpleStringIndex(&(self->typesIndex));
     simpleStringIndexOf(&(self->typesIndex), UTF8_CAST "UNUSED");
+    initSimpleStringIndex(&(self->valuesIndex));
     
     initObjects2D(&(self->pointsLocations));
     initObjects4D(&(self->areasLocations));
     initObjects4D(&(self->waysLocations));    
 }
 
+CollectionImplGeneric(MapperOrderedRecord, MapperOrderedRecords, 1000)
+
+void setMapperWriterSpatialOrder(MapperWriter* self, int zoomLevel) {
+    self->spatialOrderZoomLevel = min(max(zoomLevel, MIN_ZOOM_LEVEL), MAX_ZOOM_LEVEL);
+    self->pointsUnorderedFile = openFile("points.unordered", self->dbPath, "w+", NO_COMPRESS);
+    self->waysUnorderedFile = openFile("ways.unordered", self->dbPath, "w+", NO_COMPRESS);
+    self->areasUnorderedFile = openFile("areas.unordered", self->dbPath, "w+", NO_COMPRESS);
+    initMapperOrderedRecords(&(self->pointsOrder));
+    initMapperOrderedRecords(&(self->waysOrder));
+    initMapperOrderedRecords(&(self->areasOrder));
+}
+
+void setMapperWriterFormat(MapperWriter* self, int formatVersion, char compactNodeIds) {
+    self->formatVersion = formatVersion == MAPPER_FORMAT_COMPACT ? MAPPER_FORMAT_COMPACT : MAPPER_FORMAT_FIXED;
+    self->compactNodeIds = compactNodeIds;
+}
+
+static void prepareMapperRecord(MapperWriter* self, MapperRecord* record) {
+    record->formatVersion = self->formatVersion;
+    record->compactNodeIds = self->compactNodeIds;
+}
+
+static uint64_t hilbertIndex(uint32_t x, uint32_t y, uint32_t size) {
+    uint64_t index = 0;
+    for(uint32_t s = size / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        index += (uint64_t) s * s * ((3 * rx) ^ ry);
+        if(ry == 0) {
+            if(rx == 1) {
+                x = size - 1 - x;
+                y = size - 1 - y;
+            }
+            uint32_t t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return index;
+}
+
+static uint32_t tileOf(Coordinate min, Coordinate max, uint32_t size) {
+    double center = ((double) min + max) / 2 + 180.0 * COORDINATE_MULTIPLIER;
+    double tile = center / (360.0 * COORDINATE_MULTIPLIER) * size;
+    return tile < 0 ? 0 : (tile >= size ? size - 1 : (uint32_t) tile);
+}
+
+// Writes record to file, or to temporary file when records are ordered at close.
+// Records without levels take no bytes, so they are not indexed by id.
+static void writeRecordBytes(MapperWriter* self, MapperRecord* record, Offset offset, FILE* file, Tree16* index, MapperRecordsLayout* layout, FILE* unorderedFile, MapperOrderedRecords* order) {
+    OsmId id = record->id;
+    if(record->relationId) {
+        index = &(self->multipolygonsIndex);
+        id = record->relationId;
+    }
+    if(!record->length) {
+        index = NULL;
+    }
+    if(self->spatialOrderZoomLevel < 0) {
+        if(index) {
+            addTree16Node(index, id, offset);
+            if(self->updating) {
+                addToOffsets(&(layout->starts), offset);
+            }
+        }
+        self->write(file, record->bytes, record->length);
+    } else {
+        uint32_t size = 1u << self->spatialOrderZoomLevel;
+        MapperOrderedRecord ordered;
+        ordered.key = hilbertIndex(tileOf(record->bbox.min.x, record->bbox.max.x, size), tileOf(record->bbox.min.y, record->bbox.max.y, size), size);
+        ordered.id = id;
+        ordered.index = index;
+        ordered.offset = offset;
+        ordered.length = record->length;
+        ordered.orderedOffset = offset;
+        addToMapperOrderedRecords(order, ordered);
+        fwrite(record->bytes, record->length, 1, unorderedFile);
+    }
+}
+
+typedef struct {
+    uint64_t key;
+    int index;
+} MapperOrderKey;
+
+static int compareOrderKeys(const void* k1, const void* k2) {
+    const MapperOrderKey* key1 = (const MapperOrderKey*) k1;
+    const MapperOrderKey* key2 = (const MapperOrderKey*) k2;
+    if(key1->key != key2->key) {
+        return key1->key < key2->key ? -1 : 1;
+    }
+    return key1->index - key2->index;
+}
+
+// Copies records from temporary file to file ordered by key and sets their new offsets.
+static void writeInSpatialOrder(MapperWriter* self, MapperOrderedRecords* order, FILE* unorderedFile, const char* unorderedName, FILE* file) {
+    MapperOrderKey* keys = malloc(sizeof(MapperOrderKey) * max(order->count, 1));
+    Offset maxLength = 0;
+    for(int r = 0; r < order->count; r++) {
+        keys[r].key = order->values[r].key;
+        keys[r].index = r;
+        maxLength = max(maxLength, order->values[r].length);
+    }
+    qsort(keys, order->count, sizeof(MapperOrderKey), compareOrderKeys);
+    
+    fflush(unorderedFile);
+    char* buffer = malloc(max(maxLength, 1));
+    Offset offset = 0;
+    for(int k = 0; k < order->count; k++) {
+        MapperOrderedRecord* record = order->values + keys[k].index;
+        fseek(unorderedFile, record->offset, SEEK_SET);
+        if(fread(buffer, record->length, 1, unorderedFile) != 1) {
+            fprintf(stderr, "Error reading record %i from %s\n", record->id, unorderedName);
+        }
+        self->write(file, buffer, record->length);
+        record->orderedOffset = offset;
+        if(record->index) {
+            addTree16Node(record->index, record->id, offset);
+        }
+        offset += record->length;
+    }
+    free(buffer);
+    free(keys);
+    
+    fclose(unorderedFile);
+    char* unorderedPath = fullFileName(unorderedName, self->dbPath);
+    remove(unorderedPath);
+    free(unorderedPath);
+}
+
+// Maps offset inside record from input order to spatial order. Records are in input order.
+static Offset spatialOrderOffset(MapperOrderedRecords* order, Offset offset) {
+    int low = 0;
+    int high = order->count - 1;
+    while(low < high) {
+        int middle = (low + high + 1) / 2;
+        if(order->values[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    if(!order->count) {
+        return offset;
+    }
+    MapperOrderedRecord* record = order->values + low;
+    return record->orderedOffset + (offset - record->offset);
+}
+
+static void writeRecordsInSpatialOrder(MapperWriter* self) {
+    writeInSpatialOrder(self, &(self->pointsOrder), self->pointsUnorderedFile, "points.unordered", self->pointsFile);
+    writeInSpatialOrder(self, &(self->waysOrder), self->waysUnorderedFile, "ways.unordered", self->waysFile);
+    writeInSpatialOrder(self, &(self->areasOrder), self->areasUnorderedFile, "areas.unordered", self->areasFile);
+    for(int o = 0; o < self->pointsLocations.count; o++) {
+        self->pointsLocations.values[o].offset = spatialOrderOffset(&(self->pointsOrder), self->pointsLocations.values[o].offset);
+    }
+    for(int o = 0; o < self->waysLocations.count; o++) {
+        self->waysLocations.values[o].offset = spatialOrderOffset(&(self->waysOrder), self->waysLocations.values[o].offset);
+    }
+    for(int o = 0; o < self->areasLocations.count; o++) {
+        self->areasLocations.values[o].offset = spatialOrderOffset(&(self->areasOrder), self->areasLocations.values[o].offset);
+    }
+    clearMapperOrderedRecords(&(self->pointsOrder));
+    clearMapperOrderedRecords(&(self->waysOrder));
+    clearMapperOrderedRecords(&(self->areasOrder));
+}
+
 void updateBounds(BBox* result, Coordinate x, Coordinate y) {
     if(x > result->max.x) {
         result->max.x = x;
@@ -264,26 +615,175 @@ ZoomLevel getMaximalPointLevel(Node* node) {
     return MAX_ZOOM_LEVEL;
 }
 
+#pragma mark Generalization
+
+static ZoomLevel generalizedZoomBands[GENERALIZED_ZOOM_BANDS_COUNT] = {5, 8, FULL_DETAIL_ZOOM_LEVEL - 1};
+
+// Size of pixel of 256 pixels tile in mercator coordinates.
+static double pixelSize(ZoomLevel zoom) {
+    return 360.0 * COORDINATE_MULTIPLIER / (256.0 * (1 << zoom));
+}
+
+// Finds zoom levels of band visible between minZoomLevel and maxZoomLevel. Last band has full detail.
+static int zoomBand(int band, ZoomLevel minZoomLevel, ZoomLevel maxZoomLevel, ZoomLevel* bandMinZoomLevel, ZoomLevel* bandMaxZoomLevel) {
+    ZoomLevel start = band ? generalizedZoomBands[band - 1] + 1 : MIN_ZOOM_LEVEL;
+    ZoomLevel end = band < GENERALIZED_ZOOM_BANDS_COUNT ? generalizedZoomBands[band] : MAX_ZOOM_LEVEL;
+    *bandMinZoomLevel = max(start, minZoomLevel);
+    *bandMaxZoomLevel = min(end, maxZoomLevel);
+    return *bandMinZoomLevel <= *bandMaxZoomLevel;
+}
+
+static double squaredSegmentDistance(OsmPoint point, OsmPoint start, OsmPoint end) {
+    double dx = (double) end.x - start.x;
+    double dy = (double) end.y - start.y;
+    double px = (double) point.x - start.x;
+    double py = (double) point.y - start.y;
+    double length = dx * dx + dy * dy;
+    if(length > 0) {
+        double t = (px * dx + py * dy) / length;
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+        px -= t * dx;
+        py -= t * dy;
+    }
+    return px * px + py * py;
+}
+
+// Douglas-Peucker simplification. Appends kept nodes to generalization nodes and returns their count.
+static int simplifyWayNodes(MapperGeneralization* self, MapperWayNode* nodes, int count, double tolerance) {
+    ensureMapperWayNodesCapacityForNNewElements(&(self->nodes), count);
+    MapperWayNode* result = self->nodes.values + self->nodes.count;
+    if(count <= 2) {
+        memcpy(result, nodes, sizeof(MapperWayNode) * count);
+        self->nodes.count += count;
+        return count;
+    }
+    if(self->capacity < count) {
+        self->capacity = max(count, self->capacity * 2);
+        self->kept = realloc(self->kept, self->capacity);
+        self->stack = realloc(self->stack, sizeof(int) * 2 * self->capacity);
+    }
+    memset(self->kept, 0, count);
+    self->kept[0] = 1;
+    self->kept[count - 1] = 1;
+    double squaredTolerance = tolerance * tolerance;
+    int stackSize = 0;
+    self->stack[stackSize++] = 0;
+    self->stack[stackSize++] = count - 1;
+    while(stackSize) {
+        int last = self->stack[--stackSize];
+        int first = self->stack[--stackSize];
+        double maxDistance = squaredTolerance;
+        int farthest = -1;
+        for(int n = first + 1; n < last; n++) {
+            double distance = squaredSegmentDistance(nodes[n].location, nodes[first].location, nodes[last].location);
+            if(distance > maxDistance) {
+                maxDistance = distance;
+                farthest = n;
+            }
+        }
+        if(farthest >= 0) {
+            self->kept[farthest] = 1;
+            self->stack[stackSize++] = first;
+            self->stack[stackSize++] = farthest;
+            self->stack[stackSize++] = farthest;
+            self->stack[stackSize++] = last;
+        }
+    }
+    int keptCount = 0;
+    for(int n = 0; n < count; n++) {
+        if(self->kept[n]) {
+            result[keptCount++] = nodes[n];
+        }
+    }
+    self->nodes.count += keptCount;
+    return keptCount;
+}
+
+// Simplifies polygon rings into result which refers generalization buffers. Rings left with less than 4 nodes
+// are dropped, inner rings of dropped outer are dropped too. Returns number of kept nodes.
+static int generalizePolygons(MapperGeneralization* self, MapperPolygons* polygons, double tolerance, MapperPolygons* result) {
+    if(self->polygonsCapacity < polygons->count) {
+        self->polygonsCapacity = polygons->count;
+        self->polygons = realloc(self->polygons, sizeof(MapperPolygon) * self->polygonsCapacity);
+    }
+    self->nodes.count = 0;
+    int count = 0;
+    char outerDropped = 0;
+    for(int p = 0; p < polygons->count; p++) {
+        MapperPolygon* polygon = polygons->values + p;
+        if(polygon->info.role == InnerAreaPart && outerDropped) {
+            continue;
+        }
+        int kept = simplifyWayNodes(self, polygon->wayNodes.values, polygon->wayNodes.count, tolerance);
+        if(kept < 4) {
+            self->nodes.count -= kept;
+            outerDropped = outerDropped || polygon->info.role == OuterAreaPart;
+            continue;
+        }
+        if(polygon->info.role == OuterAreaPart) {
+            outerDropped = 0;
+        }
+        self->polygons[count] = *polygon;
+        self->polygons[count].wayNodes.count = kept;
+        self->polygons[count].wayNodes.capacity = kept;
+        count++;
+    }
+    // Nodes buffer could move while rings were appended, so they are pointed to it only now.
+    MapperWayNode* nodes = self->nodes.values;
+    for(int p = 0; p < count; p++) {
+        self->polygons[p].wayNodes.values = nodes;
+        nodes += self->polygons[p].wayNodes.count;
+    }
+    result->values = self->polygons;
+    result->count = count;
+    result->capacity = self->polygonsCapacity;
+    return self->nodes.count;
+}
+
+static void addDetailLevel(MapperRecord* record, int offset, int nodesCount, BBox bbox, ZoomLevel minZoomLevel, ZoomLevel maxZoomLevel) {
+    MapperDetailLevel* level = record->levels + record->levelsCount++;
+    level->offset = offset;
+    level->length = record->length - offset;
+    level->nodesCount = nodesCount;
+    level->bbox = bbox;
+    level->minZoomLevel = minZoomLevel;
+    level->maxZoomLevel = maxZoomLevel;
+}
+
+// Generalization with bigger tolerance keeps subset of nodes kept with smaller one, so the same nodes count
+// means the same geometry and previous level is just shown on more zoom levels.
+static int extendDetailLevel(MapperRecord* record, int nodesCount, ZoomLevel maxZoomLevel) {
+    if(record->levelsCount && record->levels[record->levelsCount - 1].nodesCount == nodesCount) {
+        record->levels[record->levelsCount - 1].maxZoomLevel = maxZoomLevel;
+        return 1;
+    }
+    return 0;
+}
+
 static int pointsZoomCount[MAX_ZOOM_LEVEL - MIN_ZOOM_LEVEL + 1];
 
-void writePoint(MapperWriter* self, UTF8* class, Node* node) {
-    //printf("Writing point...\n");
+void encodePoint(MapperRecord* record, UTF8* class, ZoomLevel minZoomLevel, ZoomLevel maxZoomLevel, Node* node) {
     Coordinate x = mercatorX(node->info.lon);
-    Coordinate y = mercatorY(node->info.lat);
-    //printf("Adding to location index\n");
-    ZoomLevel minZoomLevel = getMinimalPointLevel(node);
-    ZoomLevel maxZoomLevel = getMaximalPointLevel(node);
-    for(int z = minZoomLevel; z <= maxZoomLevel; z++) {
-        pointsZoomCount[z]++;
-    }
-    add2DObject(&(self->pointsLocations), OsmPointMakeRaw(x, y), self->pointsOffset, minZoomLevel, maxZoomLevel);
-    //printf("Adding to index\n");
-    addTree16Node(&(self->pointsIndex), node->info.id, self->pointsOffset);
-    //printf("Update bounds\n");
-    updateBounds(&(self->mapInformation.bounds), x, y);
-    //printf("Write to file\n");
-    self->pointsOffset += writeMapperPoint(self->pointsFile, node->info.id, x, y, &(node->tags), simpleStringIndexOf(&(self->typesIndex), class), &(self->attributesIndex), self->write);
-    //printf("Done.\n");
+    Coordinate y = tableMercatorY(node->info.lat);
+    record->kind = MAPPER_POINT_RECORD;
+    record->id = node->info.id;
+    record->relationId = 0;
+    record->className = class;
+    record->tags = &(node->tags);
+    record->bbox.min = OsmPointMakeRaw(x, y);
+    record->bbox.max = record->bbox.min;
+    record->minZoomLevel = minZoomLevel;
+    record->maxZoomLevel = maxZoomLevel;
+    record->length = 0;
+    if(record->formatVersion == MAPPER_FORMAT_COMPACT) {
+        writeCompactPointGeometry(record, node->info.id, x, y, writeToMapperRecord);
+    } else {
+        mapperAttributesFromTagsWithLocalKeys(&(record->pointAttributes), &(node->tags));
+        writeMapperPoint(record, node->info.id, x, y, &(record->pointAttributes), 0, writeToMapperRecord);
+        removeAllMapperAttributes(&(record->pointAttributes));
+    }
+    record->levelsCount = 0;
+    addDetailLevel(record, 0, 1, record->bbox, record->minZoomLevel, record->maxZoomLevel);
 }
 
 BBox* enlargeNodesBBox(BBox* result, MapperWayNodes* nodes) {
@@ -299,16 +799,9 @@ BBox nodesBBox(MapperWayNodes* nodes) {
     return *enlargeNodesBBox(&result, nodes);
 }
 
-static MapperWayNodes wayNodes = {NULL, 0, 0};
-
 void convertNodesInfoToMapperWayNodes(NodesInfo* infos, MapperWayNodes* nodes) {
     ensureMapperWayNodesCapacityForNNewElements(nodes, infos->count);
-    for(int i=0;i<infos->count;i++) {
-        nodes->values[i].id = infos->values[i].id;
-        //printf("[%i, %i]\n", infos->values[i].lon, infos->values[i].lat);
-        nodes->values[i].location.x = mercatorX(infos->values[i].lon);
-        nodes->values[i].location.y = mercatorY(infos->values[i].lat);
-    }
+    projectNodesInfo(infos->values, nodes->values, infos->count);
     nodes->count = infos->count;
 }
 
@@ -373,25 +866,45 @@ ZoomLevel getMaximalWayLevel(Way* way) {
 
 static int waysZoomCount[MAX_ZOOM_LEVEL - MIN_ZOOM_LEVEL + 1];
 
-void writeWay(MapperWriter* self, UTF8* class, OsmId groupId, Way* way) {
-    //printf("Converting nodes...\n");
-    convertNodesInfoToMapperWayNodes(&(way->wayNodes), &wayNodes);
-    //printf("Calculating bbox...\n");
-    BBox wayBox = nodesBBox(&wayNodes);
-    //printf("Enlarge map...\n");
-    enlargeNodesBBox(&(self->mapInformation.bounds), &wayNodes);
-    //printf("Location Index...\n");
-    ZoomLevel minZoomLevel = getMinimalWayLevel(way);
-    ZoomLevel maxZoomLevel = getMaximalWayLevel(way);
-    for(int z = minZoomLevel; z <= maxZoomLevel; z++) {
-        waysZoomCount[z]++;
+void encodeWay(MapperRecord* record, UTF8* class, ZoomLevel minZoomLevel, ZoomLevel maxZoomLevel, OsmId groupId, Way* way) {
+    convertNodesInfoToMapperWayNodes(&(way->wayNodes), &(record->wayNodes));
+    record->kind = MAPPER_WAY_RECORD;
+    record->id = way->info.id;
+    record->relationId = 0;
+    record->className = class;
+    record->tags = &(way->tags);
+    record->bbox = nodesBBox(&(record->wayNodes));
+    record->minZoomLevel = minZoomLevel;
+    record->maxZoomLevel = maxZoomLevel;
+    record->length = 0;
+    record->levelsCount = 0;
+    if(record->formatVersion != MAPPER_FORMAT_COMPACT) {
+        mapperPartAttributesFromTagsWithLocalKeys(&(record->partAttributes), 0, &(way->tags));
     }
-    
-    add4DObject(&(self->waysLocations), wayBox, self->waysOffset, minZoomLevel, maxZoomLevel);
-    //printf("Index...\n");
-    addTree16Node(&(self->waysIndex), way->info.id, self->waysOffset);
-    //printf("Write...\n");
-    self->waysOffset += writeMapperWay(self->waysFile, way->info.id, groupId, &wayNodes, wayBox, &(way->tags), simpleStringIndexOf(&(self->typesIndex), class), &(self->attributesIndex), self->write);
+    ZoomLevel bandMinZoomLevel, bandMaxZoomLevel;
+    for(int band = 0; band <= GENERALIZED_ZOOM_BANDS_COUNT; band++) {
+        if(!zoomBand(band, record->minZoomLevel, record->maxZoomLevel, &bandMinZoomLevel, &bandMaxZoomLevel)) {
+            continue;
+        }
+        MapperWayNodes* nodes = &(record->wayNodes);
+        if(band < GENERALIZED_ZOOM_BANDS_COUNT) {
+            record->generalization.nodes.count = 0;
+            simplifyWayNodes(&(record->generalization), nodes->values, nodes->count, pixelSize(bandMaxZoomLevel));
+            nodes = &(record->generalization.nodes);
+        }
+        if(extendDetailLevel(record, nodes->count, bandMaxZoomLevel)) {
+            continue;
+        }
+        int offset = record->length;
+        BBox bbox = nodesBBox(nodes);
+        if(record->formatVersion == MAPPER_FORMAT_COMPACT) {
+            writeCompactWayGeometry(record, way->info.id, groupId, nodes, bbox, record->compactNodeIds, writeToMapperRecord);
+        } else {
+            writeMapperWay(record, way->info.id, groupId, nodes, bbox, &(record->partAttributes), 0, writeToMapperRecord);
+        }
+        addDetailLevel(record, offset, nodes->count, bbox, bandMinZoomLevel, bandMaxZoomLevel);
+    }
+    removeAllMapperPartAttributes(&(record->partAttributes));
 }
 
 ZoomLevel getMinimalAreaLevel(PlainTags* tags, MapperPolygons* polygons) {
@@ -419,22 +932,219 @@ ZoomLevel getMaximalAreaLevel(PlainTags* tags, MapperPolygons* polygons) {
 
 static int areasZoomCount[MAX_ZOOM_LEVEL - MIN_ZOOM_LEVEL + 1];
 
-void writeArea(MapperWriter* self, UTF8* class, OsmId id, PlainTags* tags, MapperPolygons* polygons) {
-    BBox areaBox = { {INT_MAX, INT_MAX}, {INT_MIN, INT_MIN} };
+static BBox polygonsBBox(MapperPolygons* polygons) {
+    BBox bbox = { {INT_MAX, INT_MAX}, {INT_MIN, INT_MIN} };
     for(int p = 0; p < polygons->count; p++){
-        enlargeNodesBBox(&areaBox, &(polygons->values[p].wayNodes));
-        enlargeNodesBBox(&(self->mapInformation.bounds), &(polygons->values[p].wayNodes));
+        enlargeNodesBBox(&bbox, &(polygons->values[p].wayNodes));
     }
+    return bbox;
+}
+
+void encodeArea(MapperRecord* record, UTF8* class, ZoomLevel minZoomLevel, ZoomLevel maxZoomLevel, OsmId id, PlainTags* tags, MapperPolygons* polygons) {
+    BBox areaBox = polygonsBBox(polygons);
     //printf("Area %i: [(%i,%i), (%i,%i)]\n", id, areaBox.min.x, areaBox.min.y, areaBox.max.x, areaBox.max.y);
-    ZoomLevel minZoomLevel = getMinimalAreaLevel(tags, polygons);
-    ZoomLevel maxZoomLevel = getMaximalAreaLevel(tags, polygons);
-    for(int z = minZoomLevel; z <= maxZoomLevel; z++) {
-        areasZoomCount[z]++;
+    record->kind = MAPPER_AREA_RECORD;
+    record->id = id;
+    record->relationId = 0;
+    record->className = class;
+    record->tags = tags;
+    record->bbox = areaBox;
+    record->minZoomLevel = minZoomLevel;
+    record->maxZoomLevel = maxZoomLevel;
+    record->length = 0;
+    record->levelsCount = 0;
+    if(record->formatVersion != MAPPER_FORMAT_COMPACT) {
+        mapperPartAttributesFromTagsWithLocalKeys(&(record->partAttributes), 0, tags);
+    }
+    int nodesCount = 0;
+    for(int p = 0; p < polygons->count; p++) {
+        nodesCount += polygons->values[p].wayNodes.count;
+    }
+    ZoomLevel bandMinZoomLevel, bandMaxZoomLevel;
+    for(int band = 0; band <= GENERALIZED_ZOOM_BANDS_COUNT; band++) {
+        if(!zoomBand(band, record->minZoomLevel, record->maxZoomLevel, &bandMinZoomLevel, &bandMaxZoomLevel)) {
+            continue;
+        }
+        MapperPolygons generalized;
+        MapperPolygons* levelPolygons = polygons;
+        int levelNodesCount = nodesCount;
+        BBox bbox = areaBox;
+        if(band < GENERALIZED_ZOOM_BANDS_COUNT) {
+            levelNodesCount = generalizePolygons(&(record->generalization), polygons, pixelSize(bandMaxZoomLevel), &generalized);
+            if(!generalized.count) {
+                continue;
+            }
+            levelPolygons = &generalized;
+            bbox = polygonsBBox(levelPolygons);
+        }
+        if(extendDetailLevel(record, levelNodesCount, bandMaxZoomLevel)) {
+            continue;
+        }
+        int offset = record->length;
+        if(record->formatVersion == MAPPER_FORMAT_COMPACT) {
+            writeCompactAreaGeometry(record, id, levelPolygons, bbox, record->compactNodeIds, writeToMapperRecord);
+        } else {
+            writeMapperArea(record, id, levelPolygons, bbox, &(record->partAttributes), 0, writeToMapperRecord);
+        }
+        addDetailLevel(record, offset, levelNodesCount, bbox, bandMinZoomLevel, bandMaxZoomLevel);
+    }
+    removeAllMapperPartAttributes(&(record->partAttributes));
+}
+
+static MapperIndexedValue* resolvedKeys = NULL;
+static int resolvedKeysCapacity = 0;
+
+static MapperAttributeKey resolveKey(MapperAttributeKey key) {
+    return key >= FIRST_LOCAL_ATTRIBUTE ? resolvedKeys[key - FIRST_LOCAL_ATTRIBUTE] : key;
+}
+
+// Records are written chunk by chunk in the same layout as structures, so they are patched in place.
+static void patchFixedRecord(MapperRecord* record, MapperClassId class) {
+    switch(record->kind) {
+        case MAPPER_POINT_RECORD:
+            for(int offset = 0; offset < record->length; offset += sizeof(MapperPoint)) {
+                MapperPoint* point = (MapperPoint*)(record->bytes + offset);
+                point->info.class = class;
+                for(int a = 0; a < POINT_ATTRIBUTES_COUNT; a++) {
+                    point->attributes[a].key = resolveKey(point->attributes[a].key);
+                }
+            }
+            break;
+        case MAPPER_WAY_RECORD:
+            for(int offset = 0; offset < record->length; offset += sizeof(MapperWay)) {
+                MapperWay* way = (MapperWay*)(record->bytes + offset);
+                way->info.class = class;
+                for(int a = 0; a < WAY_ATTRIBUTES_COUNT; a++) {
+                    way->attributes[a].attribute.key = resolveKey(way->attributes[a].attribute.key);
+                }
+            }
+            break;
+        case MAPPER_AREA_RECORD:
+            for(int offset = 0; offset < record->length; offset += sizeof(MapperArea)) {
+                MapperArea* area = (MapperArea*)(record->bytes + offset);
+                area->area.class = class;
+                for(int a = 0; a < AREA_ATTRIBUTES_COUNT; a++) {
+                    area->attributes[a].attribute.key = resolveKey(area->attributes[a].attribute.key);
+                }
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static MapperRecord compactRecord = {0};
+static MapperRecord compactAttributes = {0};
+
+// Each level is written as its length, class, geometry and attributes as pairs of key and values table index.
+// Level offsets are moved to completed bytes.
+static void completeCompactRecord(MapperWriter* self, MapperRecord* record, MapperClassId class) {
+    compactAttributes.length = 0;
+    writeCompactUnsigned(&compactAttributes, record->tags->count, writeToMapperRecord);
+    for(int t = 0; t < record->tags->count; t++) {
+        writeCompactUnsigned(&compactAttributes, resolvedKeys[t], writeToMapperRecord);
+        writeCompactUnsigned(&compactAttributes, simpleStringIndexOf(&(self->valuesIndex), record->tags->values[t].value), writeToMapperRecord);
+    }
+    unsigned char classBytes[VARINT_MAX_LENGTH];
+    int classLength = encodeVarint(class, classBytes);
+    
+    compactRecord.length = 0;
+    for(int l = 0; l < record->levelsCount; l++) {
+        MapperDetailLevel* level = record->levels + l;
+        int offset = compactRecord.length;
+        writeCompactUnsigned(&compactRecord, classLength + level->length + compactAttributes.length, writeToMapperRecord);
+        writeToMapperRecord(&compactRecord, classBytes, classLength);
+        writeToMapperRecord(&compactRecord, record->bytes + level->offset, level->length);
+        writeToMapperRecord(&compactRecord, compactAttributes.bytes, compactAttributes.length);
+        level->offset = offset;
+        level->length = compactRecord.length - offset;
+    }
+    
+    char* bytes = record->bytes;
+    int capacity = record->capacity;
+    record->bytes = compactRecord.bytes;
+    record->length = compactRecord.length;
+    record->capacity = compactRecord.capacity;
+    compactRecord.bytes = bytes;
+    compactRecord.capacity = capacity;
+}
+
+// Resolves class and attribute keys in writer indicies, adds record to indicies and writes it.
+// Must be called in order records should appear in files.
+void commitMapperRecord(MapperWriter* self, MapperRecord* record) {
+    MapperClassId class = simpleStringIndexOf(&(self->typesIndex), record->className);
+    if(resolvedKeysCapacity < record->tags->count) {
+        resolvedKeysCapacity = record->tags->count;
+        resolvedKeys = realloc(resolvedKeys, sizeof(MapperIndexedValue) * resolvedKeysCapacity);
+    }
+    for(int t = 0; t < record->tags->count; t++) {
+        resolvedKeys[t] = simpleStringIndexOf(&(self->attributesIndex), record->tags->values[t].key);
+    }
+    if(record->bbox.min.x <= record->bbox.max.x) {
+        updateBounds(&(self->mapInformation.bounds), record->bbox.min.x, record->bbox.min.y);
+        updateBounds(&(self->mapInformation.bounds), record->bbox.max.x, record->bbox.max.y);
     }
     
-    add4DObject(&(self->areasLocations), areaBox, self->areasOffset, minZoomLevel, maxZoomLevel);
-    addTree16Node(&(self->areasIndex), id, self->areasOffset);
-    self->areasOffset += writeMapperArea(self->areasFile, id, polygons, areaBox, tags, simpleStringIndexOf(&(self->typesIndex), class), &(self->attributesIndex), self->write);
+    if(record->formatVersion == MAPPER_FORMAT_COMPACT) {
+        completeCompactRecord(self, record, class);
+    } else {
+        patchFixedRecord(record, class);
+    }
+    switch(record->kind) {
+        case MAPPER_POINT_RECORD:
+            for(int z = record->minZoomLevel; z <= record->maxZoomLevel; z++) {
+                pointsZoomCount[z]++;
+            }
+            add2DObject(&(self->pointsLocations), record->bbox.min, self->pointsOffset, record->minZoomLevel, record->maxZoomLevel);
+            writeRecordBytes(self, record, self->pointsOffset, self->pointsFile, &(self->pointsIndex), &(self->pointsLayout), self->pointsUnorderedFile, &(self->pointsOrder));
+            self->pointsOffset += record->length;
+            break;
+        case MAPPER_WAY_RECORD:
+            for(int z = record->minZoomLevel; z <= record->maxZoomLevel; z++) {
+                waysZoomCount[z]++;
+            }
+            for(int l = 0; l < record->levelsCount; l++) {
+                MapperDetailLevel* level = record->levels + l;
+                add4DObject(&(self->waysLocations), level->bbox, self->waysOffset + level->offset, level->minZoomLevel, level->maxZoomLevel);
+            }
+            writeRecordBytes(self, record, self->waysOffset, self->waysFile, &(self->waysIndex), &(self->waysLayout), self->waysUnorderedFile, &(self->waysOrder));
+            self->waysOffset += record->length;
+            break;
+        case MAPPER_AREA_RECORD:
+            for(int z = record->minZoomLevel; z <= record->maxZoomLevel; z++) {
+                areasZoomCount[z]++;
+            }
+            for(int l = 0; l < record->levelsCount; l++) {
+                MapperDetailLevel* level = record->levels + l;
+                add4DObject(&(self->areasLocations), level->bbox, self->areasOffset + level->offset, level->minZoomLevel, level->maxZoomLevel);
+            }
+            writeRecordBytes(self, record, self->areasOffset, self->areasFile, &(self->areasIndex), &(self->areasLayout), self->areasUnorderedFile, &(self->areasOrder));
+            self->areasOffset += record->length;
+            break;
+        default:
+            break;
+    }
+}
+
+static MapperRecord writerRecord = {0};
+
+void writePoint(MapperWriter* self, UTF8* class, ZoomLevel minZoomLevel, ZoomLevel maxZoomLevel, Node* node) {
+    prepareMapperRecord(self, &writerRecord);
+    encodePoint(&writerRecord, class, minZoomLevel, maxZoomLevel, node);
+    commitMapperRecord(self, &writerRecord);
+}
+
+void writeWay(MapperWriter* self, UTF8* class, ZoomLevel minZoomLevel, ZoomLevel maxZoomLevel, OsmId groupId, Way* way) {
+    prepareMapperRecord(self, &writerRecord);
+    encodeWay(&writerRecord, class, minZoomLevel, maxZoomLevel, groupId, way);
+    commitMapperRecord(self, &writerRecord);
+}
+
+void writeArea(MapperWriter* self, UTF8* class, ZoomLevel minZoomLevel, ZoomLevel maxZoomLevel, OsmId id, OsmId relationId, PlainTags* tags, MapperPolygons* polygons) {
+    prepareMapperRecord(self, &writerRecord);
+    encodeArea(&writerRecord, class, minZoomLevel, maxZoomLevel, id, tags, polygons);
+    writerRecord.relationId = relationId;
+    commitMapperRecord(self, &writerRecord);
 }
 
 void writeMapInformation(MapperWriter* self, MapInformation* mapInformation) {
@@ -447,9 +1157,204 @@ void writeMapInformation(MapperWriter* self, MapInformation* mapInformation) {
     FILE* file = openFile("map.info", self->dbPath, "w+", self->compressed);
     self->write(file, &(self->mapInformation), sizeof(MapInformation) - sizeof(UTF8*));
     self->write(file, self->mapInformation.name, sizeof(UTF8) * self->mapInformation.nameLength);
+    // Readers of fixed format only stop after name.
+    self->write(file, &(self->formatVersion), sizeof(int));
 	getClose(self->compressed)(file);
 }
 
+static void writeLocationIndex(MapperWriter* self, Objects4D* locations, FILE* file) {
+    if(self->legacyLocationIndex) {
+        Tree4D* locationTree = index4DObjects(locations);
+        write4DTree(locationTree, file, self->write);
+        free4DTree(locationTree);
+    } else {
+        RTree* locationTree = indexRTreeObjects(locations);
+        writeRTree(locationTree, file, self->write);
+        freeRTree(locationTree);
+    }
+}
+
+static int compareOffsets(const void* o1, const void* o2) {
+    Offset offset1 = *(const Offset*) o1;
+    Offset offset2 = *(const Offset*) o2;
+    return offset1 < offset2 ? -1 : (offset1 > offset2 ? 1 : 0);
+}
+
+// Index of the last record starting at or before offset, -1 if there is none.
+static int recordStartIndex(MapperRecordsLayout* layout, Offset offset) {
+    int low = -1;
+    int high = layout->starts.count - 1;
+    while(low < high) {
+        int middle = (low + high + 1) / 2;
+        if(layout->starts.values[middle] <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+static int isDeadRecord(MapperRecordsLayout* layout, int start) {
+    return start >= 0 && bsearch(layout->starts.values + start, layout->dead.values, layout->dead.count, sizeof(Offset), compareOffsets) != NULL;
+}
+
+// Record lasts until the next record, tombstoned or not.
+static Offset recordEnd(MapperRecordsLayout* layout, int start, Offset fileLength) {
+    return start + 1 < layout->starts.count ? layout->starts.values[start + 1] : fileLength;
+}
+
+// Copies live records to new file in the same order when tombstoned records take too much of file.
+// Returns new offsets of records by their start indicies, OFFSET_NOT_DEFINED for tombstoned ones, or NULL if file is kept.
+static Offset* compactRecordsFile(MapperWriter* self, MapperRecordsLayout* layout, FILE** file, int* fileLength, const char* name) {
+    long deadLength = 0;
+    for(int d = 0; d < layout->dead.count; d++) {
+        int start = recordStartIndex(layout, layout->dead.values[d]);
+        deadLength += recordEnd(layout, start, *fileLength) - layout->dead.values[d];
+    }
+    if(!deadLength || deadLength * 100 < (long) *fileLength * MAPPER_COMPACTION_DEAD_PERCENT) {
+        return NULL;
+    }
+    printf("Compacting %s, %li of %i bytes are tombstoned...\n", name, deadLength, *fileLength);
+    char compactedName[64];
+    snprintf(compactedName, sizeof(compactedName), "%s.compacted", name);
+    FILE* compacted = openFile(compactedName, self->dbPath, "w+", NO_COMPRESS);
+    Offset* moved = malloc(sizeof(Offset) * max(layout->starts.count, 1));
+    char* buffer = NULL;
+    Offset capacity = 0;
+    Offset offset = 0;
+    fflush(*file);
+    for(int s = 0; s < layout->starts.count; s++) {
+        if(isDeadRecord(layout, s)) {
+            moved[s] = OFFSET_NOT_DEFINED;
+            continue;
+        }
+        Offset length = recordEnd(layout, s, *fileLength) - layout->starts.values[s];
+        if(capacity < length) {
+            capacity = max(capacity * 2, length);
+            buffer = realloc(buffer, capacity);
+        }
+        fseek(*file, layout->starts.values[s], SEEK_SET);
+        if(fread(buffer, length, 1, *file) != 1) {
+            fprintf(stderr, "Error reading record at %u from %s\n", layout->starts.values[s], name);
+        }
+        fwrite(buffer, length, 1, compacted);
+        moved[s] = offset;
+        offset += length;
+    }
+    free(buffer);
+    fclose(*file);
+    fclose(compacted);
+    char* compactedPath = fullFileName(compactedName, self->dbPath);
+    char* path = fullFileName(name, self->dbPath);
+    if(rename(compactedPath, path)) {
+        fprintf(stderr, "Error replacing %s: %i\n", path, errno);
+    }
+    free(compactedPath);
+    free(path);
+    *file = openFile(name, self->dbPath, "r+", NO_COMPRESS);
+    fseek(*file, 0, SEEK_END);
+    *fileLength = offset;
+    return moved;
+}
+
+typedef struct {
+    MapperRecordsLayout* layout;
+    Offset* moved;
+    Tree16* index;
+} MapperIndexMove;
+
+static void moveIndexedRecord(void* context, long Id, long offset) {
+    MapperIndexMove* move = (MapperIndexMove*) context;
+    setTree16Node(move->index, (int) Id, move->moved[recordStartIndex(move->layout, offset)]);
+}
+
+// Moves id indexes to compacted file, then forgets tombstoned records.
+static void finishCompaction(MapperRecordsLayout* layout, Offset* moved, Tree16* index, Tree16* secondIndex) {
+    MapperIndexMove move = {layout, moved, index};
+    forEachTree16Node(index, moveIndexedRecord, &move);
+    if(secondIndex) {
+        move.index = secondIndex;
+        forEachTree16Node(secondIndex, moveIndexedRecord, &move);
+    }
+    int count = 0;
+    for(int s = 0; s < layout->starts.count; s++) {
+        if(moved[s] != OFFSET_NOT_DEFINED) {
+            layout->starts.values[count++] = moved[s];
+        }
+    }
+    layout->starts.count = count;
+    layout->dead.count = 0;
+    free(moved);
+}
+
+// Offsets of tombstoned records are kept until file is compacted, empty list is removed.
+static void writeDeadRecords(MapperWriter* self, MapperRecordsLayout* layout, const char* name) {
+    char deadName[64];
+    snprintf(deadName, sizeof(deadName), "%s.dead", name);
+    if(!layout->dead.count) {
+        char* path = fullFileName(deadName, self->dbPath);
+        remove(path);
+        free(path);
+        return;
+    }
+    FILE* file = openFile(deadName, self->dbPath, "w+", NO_COMPRESS);
+    fwrite(layout->dead.values, sizeof(Offset), layout->dead.count, file);
+    fclose(file);
+}
+
+static void finishPointsUpdate(MapperWriter* self) {
+    MapperRecordsLayout* layout = &(self->pointsLayout);
+    qsort(layout->dead.values, layout->dead.count, sizeof(Offset), compareOffsets);
+    Offset* moved = compactRecordsFile(self, layout, &(self->pointsFile), &(self->pointsOffset), "points");
+    int count = 0;
+    for(int o = 0; o < self->pointsLocations.count; o++) {
+        Object2D object = self->pointsLocations.values[o];
+        int start = recordStartIndex(layout, object.offset);
+        if(isDeadRecord(layout, start)) {
+            continue;
+        }
+        if(moved) {
+            object.offset = moved[start] + (object.offset - layout->starts.values[start]);
+        }
+        self->pointsLocations.values[count++] = object;
+    }
+    self->pointsLocations.count = count;
+    if(moved) {
+        finishCompaction(layout, moved, &(self->pointsIndex), NULL);
+    }
+    writeDeadRecords(self, layout, "points");
+}
+
+static void finishLocationsUpdate(MapperWriter* self, MapperRecordsLayout* layout, Objects4D* locations, FILE** file, int* fileLength, const char* name, Tree16* index, Tree16* secondIndex) {
+    qsort(layout->dead.values, layout->dead.count, sizeof(Offset), compareOffsets);
+    Offset* moved = compactRecordsFile(self, layout, file, fileLength, name);
+    int count = 0;
+    for(int o = 0; o < locations->count; o++) {
+        Object4D object = locations->values[o];
+        int start = recordStartIndex(layout, object.offset);
+        if(isDeadRecord(layout, start)) {
+            continue;
+        }
+        if(moved) {
+            object.offset = moved[start] + (object.offset - layout->starts.values[start]);
+        }
+        locations->values[count++] = object;
+    }
+    locations->count = count;
+    if(moved) {
+        finishCompaction(layout, moved, index, secondIndex);
+    }
+    writeDeadRecords(self, layout, name);
+}
+
+static void saveIdIndex(MapperWriter* self, Tree16* index, const char* name) {
+    FILE* file = openFile(name, self->dbPath, "w+", NO_COMPRESS);
+    saveTree16ToFile(index, file, 0, 0);
+    fclose(file);
+    freeTree16(index);
+}
+
 void closeMapperWriter(MapperWriter* self) {
     //printf("Write attributes index...\n");
     FILE* attributesIndexFile = openFile("attributes", self->dbPath, "w+", self->compressed);
@@ -459,31 +1364,57 @@ void closeMapperWriter(MapperWriter* self) {
     FILE* typesIndexFile = openFile("types", self->dbPath, "w+", self->compressed);
     writeSimpleStringIndex(&(self->typesIndex), typesIndexFile);
 	getClose(self->compressed)(typesIndexFile);
+    writeSimpleStringIndexDictionary(&(self->attributesIndex), "attributes.dict", self->dbPath);
+    writeSimpleStringIndexDictionary(&(self->typesIndex), "types.dict", self->dbPath);
+    if(self->formatVersion == MAPPER_FORMAT_COMPACT) {
+        // Values may contain any characters but zero, so they are written zero terminated rather than by lines.
+        FILE* valuesFile = openFile("values", self->dbPath, "w+", self->compressed);
+        for(int v = 0; v < self->valuesIndex.valuesCount; v++) {
+            UTF8* value = simpleStringValuesAtIndex(&(self->valuesIndex), v);
+            self->write(valuesFile, value, strlen((const char*) value) + 1);
+            if(value != self->valuesIndex.values[v]) {
+                free(value);
+            }
+        }
+        getClose(self->compressed)(valuesFile);
+    }
 	
-    //printf("Write points index...\n");
-    //saveTree16ToFile(&(self->pointsIndex), self->pointsIndexFile, 0, 0);
+    if(self->spatialOrderZoomLevel >= 0) {
+        writeRecordsInSpatialOrder(self);
+    }
+    if(self->updating) {
+        self->pointsLocationIndexFile = openFile("points.lidx", self->dbPath, "w+", NO_COMPRESS);
+        self->waysLocationIndexFile = openFile("ways.lidx", self->dbPath, "w+", NO_COMPRESS);
+        self->areasLocationIndexFile = openFile("areas.lidx", self->dbPath, "w+", NO_COMPRESS);
+        finishPointsUpdate(self);
+        finishLocationsUpdate(self, &(self->waysLayout), &(self->waysLocations), &(self->waysFile), &(self->waysOffset), "ways", &(self->waysIndex), NULL);
+        finishLocationsUpdate(self, &(self->areasLayout), &(self->areasLocations), &(self->areasFile), &(self->areasOffset), "areas", &(self->areasIndex), &(self->multipolygonsIndex));
+    }
+    clearMapperRecordsLayout(&(self->pointsLayout));
+    clearMapperRecordsLayout(&(self->waysLayout));
+    clearMapperRecordsLayout(&(self->areasLayout));
+    // Compressed maps can not be updated, so they need no id indexes.
+    if(!self->compressed) {
+        saveIdIndex(self, &(self->pointsIndex), "points.idx");
+        saveIdIndex(self, &(self->waysIndex), "ways.idx");
+        saveIdIndex(self, &(self->areasIndex), "areas.idx");
+        saveIdIndex(self, &(self->multipolygonsIndex), "multipolygons.idx");
+    } else {
+        freeTree16(&(self->pointsIndex));
+        freeTree16(&(self->waysIndex));
+        freeTree16(&(self->areasIndex));
+        freeTree16(&(self->multipolygonsIndex));
+    }
     //printf("Create point location index...\n");
-    Tree2D* pointsLocationTree = index2DObjects(&(self->pointsLocations));
+    Tree2D* pointsLocationTree = index2DObjects(&(self->pointsLocations), self->indexThreadsCount);
     //printf("Write point location index...\n");
     write2DTree(pointsLocationTree, self->pointsLocationIndexFile, self->write);
     free2DTree(pointsLocationTree);
 	getClose(self->compressed)(self->pointsLocationIndexFile);
-    //printf("Write ways index...\n");    
-    //saveTree16ToFile(&(self->waysIndex), self->waysIndexFile, 0, 0);
-    //printf("Create ways location index...\n");
-    Tree4D* locationTree = index4DObjects(&(self->waysLocations));
-    //printf("Write ways location index %i...\n", locationTree);
-    write4DTree(locationTree, self->waysLocationIndexFile, self->write);
-    free4DTree(locationTree);
+    writeLocationIndex(self, &(self->waysLocations), self->waysLocationIndexFile);
 	getClose(self->compressed)(self->waysLocationIndexFile);
 
-    //printf("Write areas index...\n");
-    //saveTree16ToFile(&(self->areasIndex), self->areasIndexFile, 0, 0);
-    //printf("Create areas location index...\n");    
-    locationTree = index4DObjects(&(self->areasLocations));
-    //printf("Write areas location index...\n");    
-    write4DTree(locationTree, self->areasLocationIndexFile, self->write);
-    free4DTree(locationTree);
+    writeLocationIndex(self, &(self->areasLocations), self->areasLocationIndexFile);
 	getClose(self->compressed)(self->areasLocationIndexFile);
     //printf("Closed.\n");
 	
@@ -495,27 +1426,112 @@ void closeMapperWriter(MapperWriter* self) {
 }
 
 
-void initMapperConverter(MapperConverter* self, OsmDbReader* reader, const char* outputDirectory, char compress) {
-    self->writer = calloc(sizeof(MapperWriter), 1);
+// Writer must be initialized or opened already.
+static void initMapperConverterWithWriter(MapperConverter* self, OsmDbReader* reader, int workersCount) {
+    self->workersCount = workersCount;
     initMultipolygonRelations(&(self->multipolygons));
-    initMapperWriter(self->writer, outputDirectory, compress);
+    initMultipolygonOuters(&(self->outersIndex));
+    if(workersCount > 1) {
+        self->writer->indexThreadsCount = workersCount;
+    }
     self->reader = reader;
+    setOsmDbReaderWayCacheBudget(reader, MAPPER_WAY_CACHE_BUDGET);
+    initDefaultMapperRules(&(self->rules));
+    self->typeKey = internTagString(UTF8_CAST "type", NULL);
+    self->areaKey = internTagString(UTF8_CAST "area", NULL);
+}
+
+void initMapperConverter(MapperConverter* self, OsmDbReader* reader, const char* outputDirectory, char compress, int workersCount) {
+    self->writer = calloc(sizeof(MapperWriter), 1);
+    initMapperWriter(self->writer, outputDirectory, compress);
+    initMapperConverterWithWriter(self, reader, workersCount);
+}
+
+int loadMapperConverterRules(MapperConverter* self, const char* path) {
+    clearMapperRules(&(self->rules));
+    return initMapperRulesFromFile(&(self->rules), path);
 }
 
 
 CollectionImplGeneric(PMultipolygonRelation, MultipolygonRelations, 100)
+CollectionImplGeneric(MultipolygonOuter, MultipolygonOuters, 100)
+CollectionImplGeneric(MemberWay, MemberWays, 100)
 
-void prepareIndicies(MapperConverter* self) {
-    Relation* relation;
-    printf("Preparing indicies...\n");
-    while((relation = nextRelation(self->reader))) {
-        if(utf8equal(valueForKey(&(relation->tags), UTF8_CAST "type"), UTF8_CAST "multipolygon")) {
-            //printf("Relation %i: %s with %i members\n", relation->info.id, valueForKey(&(relation->tags), UTF8_CAST "type"), relation->relationMembers.count);
-            MultipolygonRelation* multipolygon = malloc(sizeof(MultipolygonRelation));
-            multipolygon->converted = 0;
-            multipolygon->relationId = relation->info.id;
+static int compareMultipolygonOuters(const void* o1, const void* o2) {
+    const MultipolygonOuter* outer1 = (const MultipolygonOuter*) o1;
+    const MultipolygonOuter* outer2 = (const MultipolygonOuter*) o2;
+    if(outer1->wayId != outer2->wayId) {
+        return outer1->wayId < outer2->wayId ? -1 : 1;
+    }
+    if(outer1->multipolygon != outer2->multipolygon) {
+        return outer1->multipolygon - outer2->multipolygon;
+    }
+    return outer1->outer - outer2->outer;
+}
+
+static void indexMultipolygonOuters(MapperConverter* self) {
+    for(int m = 0; m < self->multipolygons.count; m++) {
+        OsmIds* outers = &(self->multipolygons.values[m]->outers);
+        ensureMultipolygonOutersCapacityForNNewElements(&(self->outersIndex), outers->count);
+        for(int o = 0; o < outers->count; o++) {
+            MultipolygonOuter outer;
+            outer.wayId = outers->values[o];
+            outer.multipolygon = m;
+            outer.outer = o;
+            addToMultipolygonOuters(&(self->outersIndex), outer);
+        }
+    }
+    qsort(self->outersIndex.values, self->outersIndex.count, sizeof(MultipolygonOuter), compareMultipolygonOuters);
+}
+
+// Returns first index entry for way or NULL if way is not outer of any multipolygon.
+static MultipolygonOuter* firstMultipolygonOuter(MapperConverter* self, OsmId wayId) {
+    int low = 0;
+    int high = self->outersIndex.count;
+    while(low < high) {
+        int middle = (low + high) / 2;
+        if(self->outersIndex.values[middle].wayId < wayId) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if(low < self->outersIndex.count && self->outersIndex.values[low].wayId == wayId) {
+        return self->outersIndex.values + low;
+    }
+    return NULL;
+}
+
+// Old style multipolygon outer ways are written as part of multipolygon instead of separate areas.
+static int isOldStyleMultipolygonOuter(MapperConverter* self, OsmId wayId) {
+    MultipolygonOuter* indexEnd = self->outersIndex.values + self->outersIndex.count;
+    for(MultipolygonOuter* outer = firstMultipolygonOuter(self, wayId); outer && outer < indexEnd && outer->wayId == wayId; outer++) {
+        if(self->multipolygons.values[outer->multipolygon]->tags.count == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void prepareIndicies(MapperConverter* self) {
+    Relation* relation;
+    printf("Preparing indicies...\n");
+    while((relation = nextRelation(self->reader))) {
+        if(utf8equal(valueForKeyId(&(relation->tags), self->typeKey), UTF8_CAST "multipolygon")) {
+            //printf("Relation %i: %s with %i members\n", relation->info.id, valueForKey(&(relation->tags), UTF8_CAST "type"), relation->relationMembers.count);
+            MultipolygonRelation* multipolygon = malloc(sizeof(MultipolygonRelation));
+            multipolygon->converted = 0;
+            multipolygon->relationId = relation->info.id;
             initOsmIds(&(multipolygon->outers));
             initOsmIds(&(multipolygon->inners));
+            initPlainTags(&(multipolygon->tags));
+            ensurePlainTagsCapacityForNNewElements(&(multipolygon->tags), relation->tags.count);
+            for(int t = 0; t < relation->tags.count; t++) {
+                PlainTag* tag = relation->tags.values + t;
+                if(tag->keyId != self->typeKey) {
+                    addPlainTagWithKeyId(&(multipolygon->tags), tag->keyId, tag->key, tag->value);
+                }
+            }
             //printf("Relation %i:\n", relation->info.id);
             for(int m=0; m < relation->relationMembers.count; m++) {
                 if(relation->relationMembers.values[m].type == OSM_ENTITY_WAY) {
@@ -539,6 +1555,7 @@ void prepareIndicies(MapperConverter* self) {
             //printf("Relation Done\n");
         }
     }
+    indexMultipolygonOuters(self);
     printf("Done.\n");
 }
 
@@ -566,26 +1583,18 @@ UTF8* pointClassByTags(PlainTags* tags) {
     return NULL;
 }
 
-void convertNodes(MapperConverter* self) {    
-    Node* node;
-    printf("Converting nodes...\n");
-    int totalCount = 0;
-    int pointsCount = 0;
-    while((node = nextNode(self->reader))) {
-        //printf("Converting node...\n");
-        if(node->tags.count > 0) {
-            //            printf("Determine class...\n");
-            UTF8* className = pointClassByTags(&(node->tags));
-            if(className) {
-                //                printf("Class: %s\n", className);
-                writePoint(self->writer, className, node);
-                pointsCount++;
-            }
+static int encodeNode(MapperConverter* self, MapperRecord* record, Node* node) {
+    prepareMapperRecord(self->writer, record);
+    if(node->tags.count > 0) {
+        MapperClassification classification;
+        classifyTags(&(self->rules), &(node->tags), &classification);
+        UTF8* className = classification.className[MAPPER_RULE_POINT];
+        if(className) {
+            encodePoint(record, className, classification.minZoomLevel[MAPPER_RULE_POINT], classification.maxZoomLevel[MAPPER_RULE_POINT], node);
+            return 1;
         }
-        //        printf("Converted...\n");
-        totalCount++;
     }
-    printf("%i of %i nodes converted.\n", pointsCount, totalCount);
+    return 0;
 }
 
 UTF8* wayClassByTags(PlainTags* tags) {
@@ -630,132 +1639,697 @@ UTF8* areaClassByTags(PlainTags* tags) {
     return NULL;
 }
 
+// Encodes closed way as area with single outer polygon.
+static void encodeSimpleArea(MapperRecord* record, MapperClassification* classification, Way* way) {
+    MapperPolygon mainPolygon;
+    mainPolygon.info.id = way->info.id;
+    mainPolygon.info.role = OuterAreaPart;
+    mainPolygon.tags = way->tags;
+    //printf("Converting wayNodes...\n");
+    initMapperWayNodes(&(mainPolygon.wayNodes));
+    convertNodesInfoToMapperWayNodes(&(way->wayNodes), &(mainPolygon.wayNodes));
+    
+    MapperPolygons polygons;
+    initMapperPolygons(&polygons);
+    addToMapperPolygons(&polygons, mainPolygon);
+    
+    encodeArea(record, classification->className[MAPPER_RULE_AREA], classification->minZoomLevel[MAPPER_RULE_AREA], classification->maxZoomLevel[MAPPER_RULE_AREA], way->info.id, &(way->tags), &polygons);
+    clearMapperPolygons(&polygons);
+}
+
+static int encodeWayOrArea(MapperConverter* self, MapperRecord* record, Way* way) {
+    prepareMapperRecord(self->writer, record);
+    if(way->tags.count > 0 && way->wayNodes.count > 0) {
+        //printf("Converting way %i with tags && nodes\n", way->info.id);
+        int cycled = way->wayNodes.count >= 3 && way->wayNodes.values[0].id == way->wayNodes.values[way->wayNodes.count-1].id;
+        //printf("  Way(%i) is %s\n",way->wayNodes.count, cycled ? "cycled" : "not cycled");
+        int area = utf8equal(valueForKeyId(&(way->tags), self->areaKey), UTF8_CAST "yes");
+        MapperClassification classification;
+        classifyTags(&(self->rules), &(way->tags), &classification);
+        
+        if(!area) {
+            UTF8* wayClassName = classification.className[MAPPER_RULE_WAY];
+            if(wayClassName) {
+                //printf("Way is %s\n", wayClassName);
+                encodeWay(record, wayClassName, classification.minZoomLevel[MAPPER_RULE_WAY], classification.maxZoomLevel[MAPPER_RULE_WAY], way->info.id, way);
+                return 1;
+            }
+        }
+        if(cycled) {
+            //printf("  Seems to be area.\n");
+            UTF8* areaClassName = classification.className[MAPPER_RULE_AREA];
+            if(areaClassName && !isOldStyleMultipolygonOuter(self, way->info.id)) {
+                //printf("Area is %s\n", areaClassName);
+                encodeSimpleArea(record, &classification, way);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+#pragma mark Pipeline
+
+static int encodeEntity(MapperConverter* self, OsmEntityType type, MapperJob* job, int index) {
+    if(type == OSM_ENTITY_NODE) {
+        return encodeNode(self, job->records + index, job->nodes + index);
+    }
+    return encodeWayOrArea(self, job->records + index, job->ways + index);
+}
+
+static void* runMapperWorker(void* context) {
+    MapperPipeline* pipeline = (MapperPipeline*) context;
+    while(1) {
+        pthread_mutex_lock(&(pipeline->mutex));
+        while(pipeline->taken >= pipeline->produced && !pipeline->finished) {
+            pthread_cond_wait(&(pipeline->changed), &(pipeline->mutex));
+        }
+        if(pipeline->taken >= pipeline->produced) {
+            pthread_mutex_unlock(&(pipeline->mutex));
+            return NULL;
+        }
+        MapperJob* job = pipeline->jobs + pipeline->taken % MAPPER_PIPELINE_LENGTH;
+        pipeline->taken++;
+        pthread_mutex_unlock(&(pipeline->mutex));
+        
+        for(int e = 0; e < job->count; e++) {
+            if(!encodeEntity(pipeline->converter, pipeline->type, job, e)) {
+                job->records[e].className = NULL;
+            }
+        }
+        
+        pthread_mutex_lock(&(pipeline->mutex));
+        job->encoded = 1;
+        pthread_cond_broadcast(&(pipeline->changed));
+        pthread_mutex_unlock(&(pipeline->mutex));
+    }
+}
+
+static void* runMapperSequencer(void* context) {
+    MapperPipeline* pipeline = (MapperPipeline*) context;
+    while(1) {
+        pthread_mutex_lock(&(pipeline->mutex));
+        MapperJob* job = pipeline->jobs + pipeline->committed % MAPPER_PIPELINE_LENGTH;
+        while(!(pipeline->committed < pipeline->produced && job->encoded) && !(pipeline->finished && pipeline->committed >= pipeline->produced)) {
+            pthread_cond_wait(&(pipeline->changed), &(pipeline->mutex));
+        }
+        if(pipeline->committed >= pipeline->produced) {
+            pthread_mutex_unlock(&(pipeline->mutex));
+            return NULL;
+        }
+        pthread_mutex_unlock(&(pipeline->mutex));
+        
+        for(int e = 0; e < job->count; e++) {
+            if(job->records[e].className) {
+                commitMapperRecord(pipeline->converter->writer, job->records + e);
+                pipeline->recordsCount[job->records[e].kind]++;
+            }
+        }
+        
+        pthread_mutex_lock(&(pipeline->mutex));
+        job->encoded = 0;
+        pipeline->committed++;
+        pthread_cond_broadcast(&(pipeline->changed));
+        pthread_mutex_unlock(&(pipeline->mutex));
+    }
+}
+
+// Copies next entities which may be converted from reader to job, as reader reuses its entities.
+// Reader is not called after it returned NULL, as some readers start over then.
+static int readMapperJob(MapperPipeline* pipeline, MapperJob* job) {
+    OsmDbReader* reader = pipeline->converter->reader;
+    job->count = 0;
+    resetArena(&(job->arena));
+    while(job->count < MAPPER_JOB_SIZE && !pipeline->endOfInput) {
+        if(pipeline->type == OSM_ENTITY_NODE) {
+            Node* node = nextNode(reader);
+            if(!node) {
+                pipeline->endOfInput = 1;
+                break;
+            }
+            pipeline->totalCount++;
+            if(node->tags.count > 0) {
+                Node* copy = job->nodes + job->count++;
+                copy->info = node->info;
+                copyPlainTagsToArena(&(node->tags), &(copy->tags), &(job->arena));
+            }
+        } else {
+            Way* way = nextWay(reader);
+            if(!way) {
+                pipeline->endOfInput = 1;
+                break;
+            }
+            pipeline->totalCount++;
+            if(way->tags.count > 0 && way->wayNodes.count > 0) {
+                Way* copy = job->ways + job->count++;
+                copy->info = way->info;
+                copyPlainTagsToArena(&(way->tags), &(copy->tags), &(job->arena));
+                removeAllNodesInfo(&(copy->wayNodes));
+                ensureNodesInfoCapacityForNNewElements(&(copy->wayNodes), way->wayNodes.count);
+                memcpy(copy->wayNodes.values, way->wayNodes.values, sizeof(NodeInfo) * way->wayNodes.count);
+                copy->wayNodes.count = way->wayNodes.count;
+            }
+        }
+    }
+    return job->count;
+}
+
+// Converts all nodes or ways with reader on current thread, workersCount encoding threads and one writing thread.
+// Returns 1 and reads nothing if no encoding thread or writing thread could be started, so they are converted sequentially.
+static int runMapperPipeline(MapperConverter* self, OsmEntityType type, int* totalCount, int* recordsCount) {
+    MapperPipeline pipeline;
+    pipeline.converter = self;
+    pipeline.type = type;
+    pipeline.jobs = calloc(MAPPER_PIPELINE_LENGTH, sizeof(MapperJob));
+    pipeline.produced = 0;
+    pipeline.taken = 0;
+    pipeline.committed = 0;
+    pipeline.finished = 0;
+    pipeline.endOfInput = 0;
+    pipeline.totalCount = 0;
+    memset(pipeline.recordsCount, 0, sizeof(pipeline.recordsCount));
+    pthread_mutex_init(&(pipeline.mutex), NULL);
+    pthread_cond_init(&(pipeline.changed), NULL);
+    
+    pthread_t* workers = malloc(sizeof(pthread_t) * self->workersCount);
+    int workersCount = 0;
+    for(int w = 0; w < self->workersCount; w++) {
+        int error = pthread_create(workers + workersCount, NULL, runMapperWorker, &pipeline);
+        if(error) {
+            fprintf(stderr, "Error starting converter thread: %i\n", error);
+        } else {
+            workersCount++;
+        }
+    }
+    pthread_t sequencer;
+    int sequencerError = pthread_create(&sequencer, NULL, runMapperSequencer, &pipeline);
+    if(sequencerError) {
+        fprintf(stderr, "Error starting writer thread: %i\n", sequencerError);
+    }
+    if(workersCount == 0 || sequencerError) {
+        // Started threads stop as soon as they see pipeline finished with nothing produced.
+        pthread_mutex_lock(&(pipeline.mutex));
+        pipeline.finished = 1;
+        pthread_cond_broadcast(&(pipeline.changed));
+        pthread_mutex_unlock(&(pipeline.mutex));
+    }
+    
+    while(!pipeline.finished) {
+        pthread_mutex_lock(&(pipeline.mutex));
+        while(pipeline.produced - pipeline.committed >= MAPPER_PIPELINE_LENGTH) {
+            pthread_cond_wait(&(pipeline.changed), &(pipeline.mutex));
+        }
+        MapperJob* job = pipeline.jobs + pipeline.produced % MAPPER_PIPELINE_LENGTH;
+        pthread_mutex_unlock(&(pipeline.mutex));
+        
+        int count = readMapperJob(&pipeline, job);
+        
+        pthread_mutex_lock(&(pipeline.mutex));
+        if(count > 0) {
+            pipeline.produced++;
+        } else {
+            pipeline.finished = 1;
+        }
+        pthread_cond_broadcast(&(pipeline.changed));
+        pthread_mutex_unlock(&(pipeline.mutex));
+        if(!count) {
+            break;
+        }
+    }
+    
+    for(int w = 0; w < workersCount; w++) {
+        pthread_join(workers[w], NULL);
+    }
+    if(!sequencerError) {
+        pthread_join(sequencer, NULL);
+    }
+    free(workers);
+    
+    for(int j = 0; j < MAPPER_PIPELINE_LENGTH; j++) {
+        for(int e = 0; e < MAPPER_JOB_SIZE; e++) {
+            clearMapperRecord(pipeline.jobs[j].records + e);
+            clearPlainTags(&(pipeline.jobs[j].nodes[e].tags));
+            clearPlainTags(&(pipeline.jobs[j].ways[e].tags));
+            clearNodesInfo(&(pipeline.jobs[j].ways[e].wayNodes));
+        }
+        clearArena(&(pipeline.jobs[j].arena));
+    }
+    free(pipeline.jobs);
+    pthread_mutex_destroy(&(pipeline.mutex));
+    pthread_cond_destroy(&(pipeline.changed));
+    
+    *totalCount = pipeline.totalCount;
+    for(int k = 0; k < MAPPER_RECORD_KINDS; k++) {
+        recordsCount[k] = pipeline.recordsCount[k];
+    }
+    return workersCount == 0 || sequencerError;
+}
+
+void convertNodes(MapperConverter* self) {    
+    printf("Converting nodes...\n");
+    int totalCount = 0;
+    int recordsCount[MAPPER_RECORD_KINDS] = {0};
+    if(self->workersCount == 0 || runMapperPipeline(self, OSM_ENTITY_NODE, &totalCount, recordsCount)) {
+        Node* node;
+        while((node = nextNode(self->reader))) {
+            if(encodeNode(self, &writerRecord, node)) {
+                commitMapperRecord(self->writer, &writerRecord);
+                recordsCount[writerRecord.kind]++;
+            }
+            totalCount++;
+        }
+    }
+    printf("%i of %i nodes converted.\n", recordsCount[MAPPER_POINT_RECORD], totalCount);
+}
+
 void convertWays(MapperConverter* self) {
     printf("Converting ways...\n");
-    Way* way;
     int totalCount = 0;
-    int waysCount = 0;
-    int areasCount = 0;
-    while ((way = nextWay(self->reader))) {
-        if(way->tags.count > 0 && way->wayNodes.count > 0) {
-            //printf("Converting way %i with tags && nodes\n", way->info.id);
-            int cycled = way->wayNodes.count >= 3 && way->wayNodes.values[0].id == way->wayNodes.values[way->wayNodes.count-1].id;
-            //printf("  Way(%i) is %s\n",way->wayNodes.count, cycled ? "cycled" : "not cycled");
-  
-
-            int area = utf8equal(valueForKey(&(way->tags), UTF8_CAST "area"), UTF8_CAST "yes");
-            int saved = 0;
-            
-            if(!area) {
-                UTF8* wayClassName = wayClassByTags(&(way->tags));
-                if(wayClassName) {
-                    //printf("Way is %s\n", wayClassName);
-                    writeWay(self->writer, wayClassName, way->info.id, way);                        
-                    //printf("Way Written\n");
-                    waysCount++;
-                    saved = 1;
+    int recordsCount[MAPPER_RECORD_KINDS] = {0};
+    if(self->workersCount == 0 || runMapperPipeline(self, OSM_ENTITY_WAY, &totalCount, recordsCount)) {
+        Way* way;
+        while ((way = nextWay(self->reader))) {
+            if(encodeWayOrArea(self, &writerRecord, way)) {
+                commitMapperRecord(self->writer, &writerRecord);
+                recordsCount[writerRecord.kind]++;
+            }
+            totalCount++;
+        }
+    }
+    printf("%i of %i ways converted.\n", recordsCount[MAPPER_WAY_RECORD], totalCount);
+    printf("%i of %i areas converted.\n", recordsCount[MAPPER_AREA_RECORD], totalCount);
+}
+
+#define MULTIPOLYGONS_BATCH_SIZE 256
+
+static int compareOsmIds(const void* id1, const void* id2) {
+    OsmId i1 = *(const OsmId*)id1;
+    OsmId i2 = *(const OsmId*)id2;
+    return i1 < i2 ? -1 : (i1 > i2 ? 1 : 0);
+}
+
+static int compareMemberWays(const void* m1, const void* m2) {
+    return compareOsmIds(&(((const MemberWay*)m1)->id), &(((const MemberWay*)m2)->id));
+}
+
+// Reads all member ways of multipolygons in [start, end) in ascending id order, each way once.
+static void fetchMemberWays(MapperConverter* self, int start, int end, MemberWays* members) {
+    OsmIds ids;
+    initOsmIds(&ids);
+    for(int m = start; m < end; m++) {
+        MultipolygonRelation* multipolygon = self->multipolygons.values[m];
+        ensureOsmIdsCapacityForNNewElements(&ids, multipolygon->outers.count + multipolygon->inners.count);
+        for(int o = 0; o < multipolygon->outers.count; o++) {
+            addToOsmIds(&ids, multipolygon->outers.values[o]);
+        }
+        for(int i = 0; i < multipolygon->inners.count; i++) {
+            addToOsmIds(&ids, multipolygon->inners.values[i]);
+        }
+    }
+    qsort(ids.values, ids.count, sizeof(OsmId), compareOsmIds);
+    for(int i = 0; i < ids.count; i++) {
+        if(i > 0 && ids.values[i] == ids.values[i - 1]) {
+            continue;
+        }
+        MemberWay member;
+        member.id = ids.values[i];
+        member.way = wayWithId(self->reader, member.id);
+        if(member.way) {
+            addToMemberWays(members, member);
+        }
+    }
+    clearOsmIds(&ids);
+}
+
+static Way* memberWayWithId(MemberWays* members, OsmId id) {
+    MemberWay key;
+    key.id = id;
+    MemberWay* member = bsearch(&key, members->values, members->count, sizeof(MemberWay), compareMemberWays);
+    return member ? member->way : NULL;
+}
+
+static void releaseMemberWays(MemberWays* members) {
+    for(int i = 0; i < members->count; i++) {
+        clearNodesInfo(&(members->values[i].way->wayNodes));
+        clearPlainTags(&(members->values[i].way->tags));
+        free(members->values[i].way);
+    }
+    removeAllMemberWays(members);
+}
+
+static void appendRingNodes(NodesInfo* ring, NodesInfo* nodes, int reversed) {
+    ensureNodesInfoCapacityForNNewElements(ring, nodes->count);
+    if(reversed) {
+        for(int n = nodes->count - 2; n >= 0; n--) {
+            addToNodesInfo(ring, nodes->values[n]);
+        }
+    } else {
+        for(int n = 1; n < nodes->count; n++) {
+            addToNodesInfo(ring, nodes->values[n]);
+        }
+    }
+}
+
+// End node of member way. Ends are sorted by node id, then by way and first end before last, so joined way
+// is found by binary search rather than by scan over all ways.
+typedef struct {
+    OsmId nodeId;
+    int way;
+    char last;
+} RingWayEnd;
+
+static int compareRingWayEnds(const void* e1, const void* e2) {
+    const RingWayEnd* end1 = (const RingWayEnd*) e1;
+    const RingWayEnd* end2 = (const RingWayEnd*) e2;
+    if(end1->nodeId != end2->nodeId) {
+        return end1->nodeId < end2->nodeId ? -1 : 1;
+    }
+    if(end1->way != end2->way) {
+        return end1->way < end2->way ? -1 : 1;
+    }
+    return end1->last - end2->last;
+}
+
+// Returns index of first end with node id, or count if there is none.
+static int firstRingWayEnd(RingWayEnd* ends, int count, OsmId nodeId) {
+    int low = 0;
+    int high = count;
+    while(low < high) {
+        int middle = (low + high) / 2;
+        if(ends[middle].nodeId < nodeId) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Joins ways end to end into closed rings. Ways which can not be closed into ring are skipped.
+static void assembleRings(OsmId relationId, Way** ways, int waysCount, MapperPolygons* rings) {
+    char* used = calloc(waysCount, 1);
+    RingWayEnd* ends = malloc(max(waysCount, 1) * 2 * sizeof(RingWayEnd));
+    int endsCount = 0;
+    for(int w = 0; w < waysCount; w++) {
+        NodesInfo* nodes = &(ways[w]->wayNodes);
+        if(nodes->count >= 2) {
+            RingWayEnd first = {nodes->values[0].id, w, 0};
+            RingWayEnd last = {nodes->values[nodes->count - 1].id, w, 1};
+            ends[endsCount++] = first;
+            ends[endsCount++] = last;
+        }
+    }
+    qsort(ends, endsCount, sizeof(RingWayEnd), compareRingWayEnds);
+    NodesInfo ring;
+    initNodesInfo(&ring);
+    for(int w = 0; w < waysCount; w++) {
+        if(used[w] || ways[w]->wayNodes.count < 2) {
+            continue;
+        }
+        used[w] = 1;
+        removeAllNodesInfo(&ring);
+        addToNodesInfo(&ring, ways[w]->wayNodes.values[0]);
+        appendRingNodes(&ring, &(ways[w]->wayNodes), 0);
+        OsmId firstId = ring.values[0].id;
+        while(ring.values[ring.count - 1].id != firstId) {
+            OsmId lastId = ring.values[ring.count - 1].id;
+            RingWayEnd* next = NULL;
+            for(int e = firstRingWayEnd(ends, endsCount, lastId); e < endsCount && ends[e].nodeId == lastId; e++) {
+                if(!used[ends[e].way]) {
+                    next = ends + e;
+                    break;
                 }
             }
-            if(!saved && cycled) {
-                //printf("  Seems to be area.\n");
-                int relationsFound = 0;
-                UTF8* areaClassName = areaClassByTags(&(way->tags));
-                if(areaClassName) {
-                    //printf("Area is %s\n", areaClassName);
-                    MapperPolygon mainPolygon;
-                    mainPolygon.info.id = way->info.id;
-                    mainPolygon.info.role = OuterAreaPart;
-                    mainPolygon.tags = way->tags;
-                    //printf("Converting wayNodes...\n");
-                    initMapperWayNodes(&(mainPolygon.wayNodes));
-                    convertNodesInfoToMapperWayNodes(&(way->wayNodes), &(mainPolygon.wayNodes));
-                    //printf("Search for multipolygons...\n"); 
-                    PMultipolygonRelation* multipolygon = self->multipolygons.values;
-                    int mcount = self->multipolygons.count;
-                    for(int m = 0; m < mcount; m++, multipolygon++) {
-                        //printf("%i\n", self->multipolygons.values[m]->relationId);
-                        OsmId* outer = multipolygon[0]->outers.values;
-                        int ocount = multipolygon[0]->outers.count;
-                        for(int o=0;o < ocount ; o++, outer++) {
-                            //printf("  %i\n", self->multipolygons.values[m]->outers.values[o]);
-                            if(!multipolygon[0]->converted && *outer == way->info.id) {
-                                //printf("Multipolygon found...\n");
-                                multipolygon[0]->converted = 1;
-                                relationsFound = 1;
-                                
-                                MapperPolygons* polygons = malloc(sizeof(MapperPolygons));
-                                initMapperPolygons(polygons);
-                                
-                                addToMapperPolygons(polygons, mainPolygon);
-                                
-                                for(int oo=0; oo < ocount; oo++) {
-                                    if(oo != o) {
-                                        Way* otherOuterWay = wayWithId(self->reader, multipolygon[0]->outers.values[oo]);
-                                        if(otherOuterWay) {
-                                            MapperPolygon otherPolygon;
-                                            otherPolygon.info.id = otherOuterWay->info.id;
-                                            otherPolygon.info.role = OuterAreaPart;
-                                            otherPolygon.tags = otherOuterWay->tags;
-                                            initMapperWayNodes(&(otherPolygon.wayNodes));
-                                            convertNodesInfoToMapperWayNodes(&(otherOuterWay->wayNodes), &(otherPolygon.wayNodes));
-                                            addToMapperPolygons(polygons, otherPolygon);
-                                            clearNodesInfo(&(otherOuterWay->wayNodes));
-                                            clearPlainTags(&(otherOuterWay->tags));
-                                            
-                                            free(otherOuterWay);
-                                        } else {
-                                            fprintf(stderr, "Multipolygon %i. Invalid reference to outer way %i in multipolygon relation.\n", self->multipolygons.values[m]->relationId, self->multipolygons.values[m]->outers.values[oo]);
-                                        }
-                                    }
-                                }
-                                
-                                for(int i=0; i < multipolygon[0]->inners.count; i++) {
-                                    Way* otherInnerWay = wayWithId(self->reader, multipolygon[0]->inners.values[i]);
-                                    if(otherInnerWay) {
-                                        MapperPolygon otherPolygon;
-                                        otherPolygon.info.id = otherInnerWay->info.id;
-                                        otherPolygon.info.role = InnerAreaPart;
-                                        otherPolygon.tags = otherInnerWay->tags;
-                                        initMapperWayNodes(&(otherPolygon.wayNodes));
-                                        convertNodesInfoToMapperWayNodes(&(otherInnerWay->wayNodes), &(otherPolygon.wayNodes));
-                                        addToMapperPolygons(polygons, otherPolygon);
-                                        clearNodesInfo(&(otherInnerWay->wayNodes));
-                                        clearPlainTags(&(otherInnerWay->tags));
-                                        free(otherInnerWay);
-                                    } else {
-                                        fprintf(stderr, "Multipolygon %i. Invalid reference to inner way %i in multipolygon relation.\n", self->multipolygons.values[m]->relationId, self->multipolygons.values[m]->outers.values[i]);
-                                    }
-                                }
-                                
-                                writeArea(self->writer, areaClassName, way->info.id, &(way->tags), polygons);
-                                
-                                polygons->values[0].wayNodes.values = NULL;
-                                freeMapperPolygons(polygons);
-                                areasCount++;
-                            }
-                        }
-                    }
-                    
-                    if(!relationsFound) {
-                        areasCount++;
-                        MapperPolygons* polygons = malloc(sizeof(MapperPolygons));
-                        initMapperPolygons(polygons);
-                        
-                        addToMapperPolygons(polygons, mainPolygon);
-
-                        writeArea(self->writer, areaClassName, way->info.id, &(way->tags), polygons);
-                        freeMapperPolygons(polygons);
-                    } else {
-                        clearMapperWayNodes(&(mainPolygon.wayNodes));
-                    }
+            if(!next) {
+                break;
+            }
+            used[next->way] = 1;
+            appendRingNodes(&ring, &(ways[next->way]->wayNodes), next->last);
+        }
+        if(ring.count >= 4 && ring.values[ring.count - 1].id == firstId) {
+            MapperPolygon polygon;
+            polygon.info.id = ways[w]->info.id;
+            polygon.info.role = OuterAreaPart;
+            initPlainTags(&(polygon.tags));
+            initMapperWayNodes(&(polygon.wayNodes));
+            convertNodesInfoToMapperWayNodes(&ring, &(polygon.wayNodes));
+            addToMapperPolygons(rings, polygon);
+        } else {
+            fprintf(stderr, "Multipolygon %i. Ring started with way %i is not closed.\n", relationId, ways[w]->info.id);
+        }
+    }
+    clearNodesInfo(&ring);
+    free(ends);
+    free(used);
+}
+
+static double ringArea(MapperWayNodes* nodes) {
+    double area = 0;
+    for(int n = 1; n < nodes->count; n++) {
+        area += (double)nodes->values[n - 1].location.x * nodes->values[n].location.y - (double)nodes->values[n].location.x * nodes->values[n - 1].location.y;
+    }
+    return fabs(area / 2);
+}
+
+static int isPointInRing(OsmPoint point, MapperWayNodes* nodes) {
+    int inside = 0;
+    for(int i = 0, j = nodes->count - 1; i < nodes->count; j = i++) {
+        OsmPoint a = nodes->values[i].location;
+        OsmPoint b = nodes->values[j].location;
+        if((a.y > point.y) != (b.y > point.y)) {
+            double x = a.x + (double)(point.y - a.y) * (b.x - a.x) / (b.y - a.y);
+            if(point.x < x) {
+                inside = !inside;
+            }
+        }
+    }
+    return inside;
+}
+
+static int isBBoxInBBox(BBox* inner, BBox* outer) {
+    return inner->min.x >= outer->min.x && inner->max.x <= outer->max.x && inner->min.y >= outer->min.y && inner->max.y <= outer->max.y;
+}
+
+// Sorted ids of ring nodes, closing node is not repeated.
+static OsmId* ringNodeIds(MapperWayNodes* nodes, int* count) {
+    *count = max(nodes->count - 1, 0);
+    OsmId* ids = malloc(max(*count, 1) * sizeof(OsmId));
+    for(int n = 0; n < *count; n++) {
+        ids[n] = nodes->values[n].id;
+    }
+    qsort(ids, *count, sizeof(OsmId), compareOsmIds);
+    return ids;
+}
+
+// Rings may touch, so their shared vertices lie on boundary of both. Ring is inside container if most of its
+// vertices which are not shared with container are inside.
+static int isRingInRing(MapperWayNodes* ring, MapperWayNodes* container, OsmId* containerIds, int containerIdsCount) {
+    int tested = 0;
+    int inside = 0;
+    for(int n = 0; n < ring->count - 1; n++) {
+        if(bsearch(&(ring->values[n].id), containerIds, containerIdsCount, sizeof(OsmId), compareOsmIds)) {
+            continue;
+        }
+        tested++;
+        inside += isPointInRing(ring->values[n].location, container);
+    }
+    return tested > 0 && inside * 2 > tested;
+}
+
+// Ring by west side of its bbox. Containers of ring are only searched among rings starting west of it.
+typedef struct {
+    Coordinate west;
+    int ring;
+} RingWestSide;
+
+static int compareRingWestSides(const void* s1, const void* s2) {
+    const RingWestSide* side1 = (const RingWestSide*) s1;
+    const RingWestSide* side2 = (const RingWestSide*) s2;
+    if(side1->west != side2->west) {
+        return side1->west < side2->west ? -1 : 1;
+    }
+    return side1->ring - side2->ring;
+}
+
+// Classifies rings by nesting depth: even depth rings are outers, odd are inners.
+// Moves rings to polygons so that each outer is followed by inners directly nested in it.
+static void nestRings(MapperPolygons* rings, MapperPolygons* polygons) {
+    int count = rings->count;
+    int* depth = calloc(max(count, 1), sizeof(int));
+    int* parent = malloc(max(count, 1) * sizeof(int));
+    double* areas = malloc(max(count, 1) * sizeof(double));
+    BBox* bboxes = malloc(max(count, 1) * sizeof(BBox));
+    OsmId** ids = malloc(max(count, 1) * sizeof(OsmId*));
+    int* idsCounts = malloc(max(count, 1) * sizeof(int));
+    RingWestSide* sides = malloc(max(count, 1) * sizeof(RingWestSide));
+    for(int r = 0; r < count; r++) {
+        areas[r] = ringArea(&(rings->values[r].wayNodes));
+        bboxes[r] = nodesBBox(&(rings->values[r].wayNodes));
+        ids[r] = ringNodeIds(&(rings->values[r].wayNodes), idsCounts + r);
+        sides[r].west = bboxes[r].min.x;
+        sides[r].ring = r;
+    }
+    qsort(sides, count, sizeof(RingWestSide), compareRingWestSides);
+    for(int r = 0; r < count; r++) {
+        parent[r] = -1;
+        for(int s = 0; s < count && sides[s].west <= bboxes[r].min.x; s++) {
+            int c = sides[s].ring;
+            if(c != r && areas[c] > areas[r] && isBBoxInBBox(bboxes + r, bboxes + c) && isRingInRing(&(rings->values[r].wayNodes), &(rings->values[c].wayNodes), ids[c], idsCounts[c])) {
+                depth[r]++;
+                if(parent[r] < 0 || areas[c] < areas[parent[r]]) {
+                    parent[r] = c;
                 }
             }
         }
-        totalCount++;
-       // printf("End way.\n");
     }
-    printf("%i of %i ways converted.\n", waysCount, totalCount);
-    printf("%i of %i areas converted.\n", areasCount, totalCount);
+    for(int r = 0; r < count; r++) {
+        free(ids[r]);
+    }
+    free(ids);
+    free(idsCounts);
+    free(sides);
+    // Inners directly nested in each ring are linked in ascending order.
+    int* firstInner = malloc(max(count, 1) * sizeof(int));
+    int* nextInner = malloc(max(count, 1) * sizeof(int));
+    for(int r = 0; r < count; r++) {
+        firstInner[r] = -1;
+    }
+    for(int i = count - 1; i >= 0; i--) {
+        if(depth[i] % 2 == 1 && parent[i] >= 0) {
+            nextInner[i] = firstInner[parent[i]];
+            firstInner[parent[i]] = i;
+        }
+    }
+    ensureMapperPolygonsCapacityForNNewElements(polygons, count);
+    for(int r = 0; r < count; r++) {
+        if(depth[r] % 2 == 0) {
+            rings->values[r].info.role = OuterAreaPart;
+            addToMapperPolygons(polygons, rings->values[r]);
+            for(int i = firstInner[r]; i >= 0; i = nextInner[i]) {
+                rings->values[i].info.role = InnerAreaPart;
+                addToMapperPolygons(polygons, rings->values[i]);
+            }
+        }
+    }
+    free(firstInner);
+    free(nextInner);
+    // Inners without outer are dropped.
+    for(int r = 0; r < count; r++) {
+        if(depth[r] % 2 == 1 && (parent[r] < 0 || depth[parent[r]] % 2 == 1)) {
+            freeMapperPolygon(rings->values + r);
+        }
+    }
+    rings->count = 0;
+    free(depth);
+    free(parent);
+    free(areas);
+    free(bboxes);
+}
+
+// Outer ways of old style multipolygon are not written as separate areas, so when multipolygon can not be converted
+// its closed outers are written as they would be without it.
+static void writeOldStyleMultipolygonOuters(MapperConverter* self, Way** outers, int outersCount) {
+    for(int o = 0; o < outersCount; o++) {
+        Way* way = outers[o];
+        int cycled = way->wayNodes.count >= 3 && way->wayNodes.values[0].id == way->wayNodes.values[way->wayNodes.count - 1].id;
+        if(!cycled || way->tags.count == 0) {
+            continue;
+        }
+        MapperClassification classification;
+        classifyTags(&(self->rules), &(way->tags), &classification);
+        int area = utf8equal(valueForKeyId(&(way->tags), self->areaKey), UTF8_CAST "yes");
+        // Such way is already written as line.
+        if(!area && classification.className[MAPPER_RULE_WAY]) {
+            continue;
+        }
+        if(classification.className[MAPPER_RULE_AREA]) {
+            prepareMapperRecord(self->writer, &writerRecord);
+            encodeSimpleArea(&writerRecord, &classification, way);
+            commitMapperRecord(self->writer, &writerRecord);
+        }
+    }
+}
+
+static int convertMultipolygon(MapperConverter* self, MultipolygonRelation* multipolygon, MemberWays* members) {
+    int waysCount = 0;
+    Way** ways = malloc((multipolygon->outers.count + multipolygon->inners.count) * sizeof(Way*));
+    PlainTags* tags = multipolygon->tags.count ? &(multipolygon->tags) : NULL;
+    OsmId areaId = multipolygon->relationId;
+    MapperClassification classification;
+    if(tags) {
+        classifyTags(&(self->rules), tags, &classification);
+    }
+    for(int o = 0; o < multipolygon->outers.count; o++) {
+        Way* way = memberWayWithId(members, multipolygon->outers.values[o]);
+        if(way) {
+            ways[waysCount++] = way;
+            if(!tags) {
+                classifyTags(&(self->rules), &(way->tags), &classification);
+                if(classification.className[MAPPER_RULE_AREA]) {
+                    tags = &(way->tags);
+                    areaId = way->info.id;
+                }
+            }
+        } else {
+            fprintf(stderr, "Multipolygon %i. Invalid reference to outer way %i in multipolygon relation.\n", multipolygon->relationId, multipolygon->outers.values[o]);
+        }
+    }
+    int outersCount = waysCount;
+    for(int i = 0; i < multipolygon->inners.count; i++) {
+        Way* way = memberWayWithId(members, multipolygon->inners.values[i]);
+        if(way) {
+            ways[waysCount++] = way;
+        } else {
+            fprintf(stderr, "Multipolygon %i. Invalid reference to inner way %i in multipolygon relation.\n", multipolygon->relationId, multipolygon->inners.values[i]);
+        }
+    }
+    
+    UTF8* areaClassName = tags ? classification.className[MAPPER_RULE_AREA] : NULL;
+    if(areaClassName) {
+        MapperPolygons rings;
+        initMapperPolygons(&rings);
+        assembleRings(multipolygon->relationId, ways, waysCount, &rings);
+        
+        MapperPolygons* polygons = malloc(sizeof(MapperPolygons));
+        initMapperPolygons(polygons);
+        nestRings(&rings, polygons);
+        clearMapperPolygons(&rings);
+        
+        if(polygons->count > 0) {
+            writeArea(self->writer, areaClassName, classification.minZoomLevel[MAPPER_RULE_AREA], classification.maxZoomLevel[MAPPER_RULE_AREA], areaId, multipolygon->relationId, tags, polygons);
+            multipolygon->converted = 1;
+        }
+        freeMapperPolygons(polygons);
+    }
+    if(!multipolygon->converted && multipolygon->tags.count == 0) {
+        writeOldStyleMultipolygonOuters(self, ways, outersCount);
+    }
+    free(ways);
+    return multipolygon->converted;
+}
+
+// Multipolygons are converted after ways, member ways are fetched for batch of relations at once.
+void convertMultipolygons(MapperConverter* self) {
+    printf("Converting multipolygons...\n");
+    int areasCount = 0;
+    MemberWays members;
+    initMemberWays(&members);
+    for(int start = 0; start < self->multipolygons.count; start += MULTIPOLYGONS_BATCH_SIZE) {
+        int end = start + MULTIPOLYGONS_BATCH_SIZE < self->multipolygons.count ? start + MULTIPOLYGONS_BATCH_SIZE : self->multipolygons.count;
+        fetchMemberWays(self, start, end, &members);
+        for(int m = start; m < end; m++) {
+            areasCount += convertMultipolygon(self, self->multipolygons.values[m], &members);
+            clearPlainTags(&(self->multipolygons.values[m]->tags));
+        }
+        releaseMemberWays(&members);
+        resetOsmDbReaderScratch(self->reader);
+    }
+    clearMemberWays(&members);
+    printf("%i of %i multipolygons converted.\n", areasCount, self->multipolygons.count);
+    printOsmDbReaderWayCacheStatistics(self->reader);
+}
+
+void printZoomStatistics() {
     printf("\n             Statistics on zoom levels\n");
     printf("---------------------------------------------------------\n");
     printf("| Level |   Points  |   Ways   |   Areas   ||   Total   |\n");
@@ -771,6 +2345,10 @@ void convertToMapper(MapperConverter* self) {
     prepareIndicies(self);
     convertNodes(self);
     convertWays(self);
+    convertMultipolygons(self);
+    printZoomStatistics();
+    clearMultipolygonOuters(&(self->outersIndex));
+    clearMapperRules(&(self->rules));
     closeMapperWriter(self->writer);
 }
 
@@ -778,30 +2356,1001 @@ void convertToMapper(MapperConverter* self) {
 
 #pragma mark Reader
 
-void initMapperReader(MapperReader* self, const char* mapDirectory) {
+CollectionImplGeneric(MapperPointView, MapperPointViews, 100)
+CollectionImplGeneric(MapperWayView, MapperWayViews, 100)
+CollectionImplGeneric(MapperAreaView, MapperAreaViews, 100)
+CollectionImplGeneric(MapperDecodedPolygon, MapperDecodedPolygons, 10)
+CollectionImplGeneric(MapperDecodedAttribute, MapperDecodedAttributes, 10)
+
+static int mapMapperFile(MapperMappedFile* self, const char* name, const char* directory) {
+    char* path = fullFileName(name, directory);
+    struct stat info;
+    void* data = NULL;
+    size_t length = 0;
+    int error = 0;
+    if(stat(path, &info) != 0) {
+        error = errno;
+    } else if(info.st_size > 0) {
+        error = mapFile(path, 1, &data, &length);
+    }
+    if(error) {
+        fprintf(stderr, "Error mapping file %s: %i\n", path, error);
+        data = NULL;
+        length = 0;
+    }
+    self->data = (const char*) data;
+    self->length = length;
+    free(path);
+    return error;
+}
+
+static void unmapMapperFile(MapperMappedFile* self) {
+    if(self->data) {
+        unmapFile((void*) self->data, 1, self->length);
+    }
+    self->data = NULL;
+    self->length = 0;
+}
+
+static void readMapInformation(MapperReader* self, const char* mapDirectory) {
+    memset(&(self->mapInformation), 0, sizeof(MapInformation));
+    self->formatVersion = MAPPER_FORMAT_FIXED;
+    FILE* file = openFile("map.info", mapDirectory, "r", NO_COMPRESS);
+    if(!file) {
+        return;
+    }
+    if(fread(&(self->mapInformation), sizeof(MapInformation) - sizeof(UTF8*), 1, file) == 1 && self->mapInformation.nameLength > 0) {
+        self->mapInformation.name = calloc(sizeof(UTF8), self->mapInformation.nameLength + 1);
+        fread(self->mapInformation.name, sizeof(UTF8), self->mapInformation.nameLength, file);
+    }
+    // Maps written before compact format have no version after name.
+    if(fread(&(self->formatVersion), sizeof(int), 1, file) != 1) {
+        self->formatVersion = MAPPER_FORMAT_FIXED;
+    }
+    fclose(file);
+}
+
+static int isRTree(MapperMappedFile* tree) {
+    if(tree->length < sizeof(RTreeHeader)) {
+        return 0;
+    }
+    const RTreeHeader* header = (const RTreeHeader*) tree->data;
+    return memcmp(header->magic, RTREE_MAGIC, sizeof(header->magic)) == 0 && header->pageSize == RTREE_PAGE_SIZE &&
+           tree->length == sizeof(RTreeHeader) + header->pagesCount * sizeof(RTreePage);
+}
+
+static void initRecordChunks(MapperRecordsFile* records, size_t chunkSize) {
+    records->chunkSize = chunkSize;
+    records->chunksCount = records->file.length / chunkSize;
+    records->recordChunks = calloc(sizeof(int), records->chunksCount + 1);
+}
+
+static void markRecordStart(MapperRecordsFile* records, Offset offset) {
+    if(offset % records->chunkSize == 0 && offset / records->chunkSize < records->chunksCount) {
+        records->recordChunks[offset / records->chunkSize] = 1;
+    }
+}
+
+// Record lasts until the next record referred from location index.
+static void countRecordChunks(MapperRecordsFile* records) {
+    long next = records->chunksCount;
+    for(long chunk = records->chunksCount - 1; chunk >= 0; chunk--) {
+        if(records->recordChunks[chunk]) {
+            records->recordChunks[chunk] = next - chunk;
+            next = chunk;
+        }
+    }
+}
+
+static void indexPointsChunks(MapperReader* self) {
+    const Tree2DRecord* nodes = (const Tree2DRecord*) self->pointsLocationIndex.data;
+    long count = self->pointsLocationIndex.length / sizeof(Tree2DRecord);
+    initRecordChunks(&(self->points), sizeof(MapperPoint));
+    for(long i = 0; i < count; i++) {
+        markRecordStart(&(self->points), nodes[i].info.offset);
+    }
+}
+
+static void indexLocationIndexChunks(MapperMappedFile* tree, MapperRecordsFile* records, size_t chunkSize) {
+    initRecordChunks(records, chunkSize);
+    if(isRTree(tree)) {
+        const RTreeHeader* header = (const RTreeHeader*) tree->data;
+        const RTreePage* pages = (const RTreePage*)(tree->data + sizeof(RTreeHeader));
+        for(int p = 0; p < header->pagesCount; p++) {
+            for(int e = 0; pages[p].leaf && e < pages[p].count && e < RTREE_PAGE_SIZE; e++) {
+                markRecordStart(records, pages[p].entries[e].offset);
+            }
+        }
+    } else {
+        const Tree4DRecord* nodes = (const Tree4DRecord*) tree->data;
+        long count = tree->length / sizeof(Tree4DRecord);
+        for(long i = 0; i < count; i++) {
+            markRecordStart(records, nodes[i].info.offset);
+        }
+    }
+}
+
+// Records tombstoned by map updates are in no location index, but they still end records before them.
+static void markDeadRecordStarts(MapperRecordsFile* records, const char* name, const char* mapDirectory) {
+    FILE* file = openFile(name, mapDirectory, "r", NO_COMPRESS);
+    if(!file) {
+        return;
+    }
+    Offset offset;
+    while(fread(&offset, sizeof(Offset), 1, file) == 1) {
+        markRecordStart(records, offset);
+    }
+    fclose(file);
+}
+
+static int recordChunksCount(MapperRecordsFile* records, Offset offset) {
+    return offset % records->chunkSize == 0 && offset / records->chunkSize < records->chunksCount ? records->recordChunks[offset / records->chunkSize] : 0;
+}
+
+static void initCompactRecords(MapperRecordsFile* records) {
+    records->formatVersion = MAPPER_FORMAT_COMPACT;
+    records->chunkSize = 0;
+    records->chunksCount = 0;
+    records->recordChunks = NULL;
+}
+
+// Values table is mapped and its zero terminated values are pointed to in place.
+static int indexValues(MapperReader* self, const char* mapDirectory) {
+    int error = mapMapperFile(&(self->valuesFile), "values", mapDirectory);
+    const char* data = self->valuesFile.data;
+    size_t length = self->valuesFile.length;
+    self->valuesCount = 0;
+    for(size_t i = 0; i < length; i++) {
+        self->valuesCount += data[i] == 0;
+    }
+    self->values = malloc(sizeof(UTF8*) * max(self->valuesCount, 1));
+    const char* value = data;
+    for(int v = 0; v < self->valuesCount; v++) {
+        self->values[v] = (const UTF8*) value;
+        value += strlen(value) + 1;
+    }
+    return error;
+}
+
+int initMapperReader(MapperReader* self, const char* mapDirectory) {
     self->dbPath = strdup(mapDirectory);
-        
-    self->pointsFile = openFile("points", mapDirectory, "r+", AUTO_COMPRESS);
-    self->waysFile = openFile("ways", mapDirectory, "r+", AUTO_COMPRESS);
-    self->areasFile = openFile("areas", mapDirectory, "r+", AUTO_COMPRESS);
-    self->pointsLocationIndexFile = openFile("points.lidx", mapDirectory, "r+", AUTO_COMPRESS);
-    self->waysLocationIndexFile = openFile("ways.lidx", mapDirectory, "r+", AUTO_COMPRESS);
-    self->areasLocationIndexFile = openFile("areas.lidx", mapDirectory, "r+", AUTO_COMPRESS);
-    FILE* attributesIndexFile = openFile("attributes", mapDirectory, "r+", AUTO_COMPRESS);
-    initSimpleStringIndexFromFile(&(self->attributesIndex), attributesIndexFile);
-    fclose(attributesIndexFile);
-    FILE* typesIndexFile = openFile("types", mapDirectory, "r+", AUTO_COMPRESS);
-    initSimpleStringIndexFromFile(&(self->typesIndex), attributesIndexFile);    
-    fclose(typesIndexFile);
-    //TODO read map information
+    
+    int errors = 0;
+    errors += 0 != mapMapperFile(&(self->points.file), "points", mapDirectory);
+    errors += 0 != mapMapperFile(&(self->ways.file), "ways", mapDirectory);
+    errors += 0 != mapMapperFile(&(self->areas.file), "areas", mapDirectory);
+    errors += 0 != mapMapperFile(&(self->pointsLocationIndex), "points.lidx", mapDirectory);
+    errors += 0 != mapMapperFile(&(self->waysLocationIndex), "ways.lidx", mapDirectory);
+    errors += 0 != mapMapperFile(&(self->areasLocationIndex), "areas.lidx", mapDirectory);
+    
+    // Maps written before dictionaries have only text indexes.
+    if(mapSimpleStringIndexDictionary(&(self->attributesIndex), "attributes.dict", mapDirectory)) {
+        FILE* attributesIndexFile = openFile("attributes", mapDirectory, "r", NO_COMPRESS);
+        if(attributesIndexFile) {
+            initSimpleStringIndexFromFile(&(self->attributesIndex), attributesIndexFile);
+            fclose(attributesIndexFile);
+        }
+    }
+    if(mapSimpleStringIndexDictionary(&(self->typesIndex), "types.dict", mapDirectory)) {
+        FILE* typesIndexFile = openFile("types", mapDirectory, "r", NO_COMPRESS);
+        if(typesIndexFile) {
+            initSimpleStringIndexFromFile(&(self->typesIndex), typesIndexFile);
+            fclose(typesIndexFile);
+        }
+    }
+    readMapInformation(self, mapDirectory);
+    
+    self->values = NULL;
+    self->valuesCount = 0;
+    memset(&(self->valuesFile), 0, sizeof(MapperMappedFile));
+    if(self->formatVersion == MAPPER_FORMAT_COMPACT) {
+        initCompactRecords(&(self->points));
+        initCompactRecords(&(self->ways));
+        initCompactRecords(&(self->areas));
+        errors += 0 != indexValues(self, mapDirectory);
+    } else {
+        self->points.formatVersion = self->ways.formatVersion = self->areas.formatVersion = MAPPER_FORMAT_FIXED;
+        indexPointsChunks(self);
+        indexLocationIndexChunks(&(self->waysLocationIndex), &(self->ways), sizeof(MapperWay));
+        indexLocationIndexChunks(&(self->areasLocationIndex), &(self->areas), sizeof(MapperArea));
+        markDeadRecordStarts(&(self->points), "points.dead", mapDirectory);
+        markDeadRecordStarts(&(self->ways), "ways.dead", mapDirectory);
+        markDeadRecordStarts(&(self->areas), "areas.dead", mapDirectory);
+        countRecordChunks(&(self->points));
+        countRecordChunks(&(self->ways));
+        countRecordChunks(&(self->areas));
+    }
+    return errors;
 }
 
 void closeMapperReader(MapperReader* self) {
-    fclose(self->pointsFile);
-    fclose(self->waysFile);
-    fclose(self->areasFile);
-    fclose(self->pointsLocationIndexFile);
-    fclose(self->waysLocationIndexFile);
-    fclose(self->areasLocationIndexFile);
+    unmapMapperFile(&(self->points.file));
+    unmapMapperFile(&(self->ways.file));
+    unmapMapperFile(&(self->areas.file));
+    free(self->points.recordChunks);
+    free(self->ways.recordChunks);
+    free(self->areas.recordChunks);
+    unmapMapperFile(&(self->pointsLocationIndex));
+    unmapMapperFile(&(self->waysLocationIndex));
+    unmapMapperFile(&(self->areasLocationIndex));
+    unmapMapperFile(&(self->valuesFile));
+    free(self->values);
+    clearSimpleStringIndex(&(self->attributesIndex));
+    clearSimpleStringIndex(&(self->typesIndex));
+    free(self->mapInformation.name);
     free(self->dbPath);
 }
+
+typedef void (*MapperRecordFound)(MapperRecordsFile* records, Offset offset, void* result);
+
+// Finds bytes of record at offset. Returns its length, 0 if there is no record.
+static int recordView(MapperRecordsFile* records, Offset offset, const char** bytes, int* chunksCount) {
+    *bytes = records->file.data + offset;
+    *chunksCount = 0;
+    if(records->formatVersion == MAPPER_FORMAT_COMPACT) {
+        const unsigned char* start = (const unsigned char*) *bytes;
+        const unsigned char* end = (const unsigned char*) records->file.data + records->file.length;
+        uint64_t length = 0;
+        int lengthSize = offset < records->file.length ? decodeVarint(start, end, &length) : 0;
+        return lengthSize && length <= (uint64_t)(end - start - lengthSize) ? lengthSize + (int) length : 0;
+    }
+    *chunksCount = recordChunksCount(records, offset);
+    return *chunksCount * records->chunkSize;
+}
+
+static void addPointView(MapperRecordsFile* records, Offset offset, void* result) {
+    MapperPointView view;
+    view.length = recordView(records, offset, &(view.bytes), &(view.chunksCount));
+    view.chunks = view.chunksCount ? (const MapperPoint*) view.bytes : NULL;
+    if(view.length) {
+        addToMapperPointViews((MapperPointViews*) result, view);
+    }
+}
+
+static void addWayView(MapperRecordsFile* records, Offset offset, void* result) {
+    MapperWayView view;
+    view.length = recordView(records, offset, &(view.bytes), &(view.chunksCount));
+    view.chunks = view.chunksCount ? (const MapperWay*) view.bytes : NULL;
+    if(view.length) {
+        addToMapperWayViews((MapperWayViews*) result, view);
+    }
+}
+
+static void addAreaView(MapperRecordsFile* records, Offset offset, void* result) {
+    MapperAreaView view;
+    view.length = recordView(records, offset, &(view.bytes), &(view.chunksCount));
+    view.chunks = view.chunksCount ? (const MapperArea*) view.bytes : NULL;
+    if(view.length) {
+        addToMapperAreaViews((MapperAreaViews*) result, view);
+    }
+}
+
+static int isVisibleOnZoom(const Object4D* object, ZoomLevel zoom) {
+    return object->minZoomLevel <= zoom && zoom <= object->maxZoomLevel;
+}
+
+static int intersectsBounds(const Object4D* object, BBox* bounds) {
+    return object->dimensions[0] <= bounds->max.x && object->dimensions[1] <= bounds->max.y &&
+           object->dimensions[2] >= bounds->min.x && object->dimensions[3] >= bounds->min.y;
+}
+
+// Tree2DRecord children follow it: left one right after it, right one rightOffset bytes later.
+static int queryPointsTree(MapperReader* self, long index, int level, BBox* bounds, ZoomLevel zoom, void* result) {
+    const Tree2DRecord* records = (const Tree2DRecord*) self->pointsLocationIndex.data;
+    long recordsCount = self->pointsLocationIndex.length / sizeof(Tree2DRecord);
+    int found = 0;
+    while(index >= 0 && index < recordsCount) {
+        const Tree2DRecord* record = records + index;
+        Coordinate x = record->info.dimensions[0];
+        Coordinate y = record->info.dimensions[1];
+        if(x >= bounds->min.x && x <= bounds->max.x && y >= bounds->min.y && y <= bounds->max.y &&
+           record->info.minZoomLevel <= zoom && zoom <= record->info.maxZoomLevel) {
+            addPointView(&(self->points), record->info.offset, result);
+            found++;
+        }
+        Coordinate divider = record->info.dimensions[level % 2];
+        Coordinate min = level % 2 ? bounds->min.y : bounds->min.x;
+        Coordinate max = level % 2 ? bounds->max.y : bounds->max.x;
+        long left = record->leftOffset != OFFSET_NOT_DEFINED && min <= divider ? index + 1 : -1;
+        long right = record->rightOffset != OFFSET_NOT_DEFINED && max >= divider ? index + 1 + record->rightOffset / sizeof(Tree2DRecord) : -1;
+        level++;
+        if(left >= 0 && right >= 0) {
+            found += queryPointsTree(self, left, level, bounds, zoom, result);
+        }
+        index = right >= 0 ? right : left;
+    }
+    return found;
+}
+
+// Legacy 4D KD-tree of ways or areas bounds. Left subtree has not bigger value in node dimension, right one not smaller.
+static int query4DTree(MapperMappedFile* tree, MapperRecordsFile* records, long index, int level, BBox* bounds, ZoomLevel zoom, MapperRecordFound add, void* result) {
+    const Tree4DRecord* nodes = (const Tree4DRecord*) tree->data;
+    long nodesCount = tree->length / sizeof(Tree4DRecord);
+    int found = 0;
+    while(index >= 0 && index < nodesCount) {
+        const Tree4DRecord* node = nodes + index;
+        if(intersectsBounds(&(node->info), bounds) && isVisibleOnZoom(&(node->info), zoom)) {
+            add(records, node->info.offset, result);
+            found++;
+        }
+        char dimension = level % 4;
+        Coordinate divider = node->info.dimensions[(int) dimension];
+        // Minimums only bound right subtree from below, maximums only bound left subtree from above.
+        int visitLeft = dimension < 2 || divider >= (dimension == 2 ? bounds->min.x : bounds->min.y);
+        int visitRight = dimension >= 2 || divider <= (dimension == 0 ? bounds->max.x : bounds->max.y);
+        long left = node->leftOffset != OFFSET_NOT_DEFINED && visitLeft ? index + 1 : -1;
+        long right = node->rightOffset != OFFSET_NOT_DEFINED && visitRight ? index + 1 + node->rightOffset / sizeof(Tree4DRecord) : -1;
+        level++;
+        if(left >= 0 && right >= 0) {
+            found += query4DTree(tree, records, left, level, bounds, zoom, add, result);
+        }
+        index = right >= 0 ? right : left;
+    }
+    return found;
+}
+
+static int queryRTreePage(MapperMappedFile* tree, MapperRecordsFile* records, Offset pageOffset, BBox* bounds, ZoomLevel zoom, MapperRecordFound add, void* result) {
+    if(pageOffset + sizeof(RTreePage) > tree->length) {
+        return 0;
+    }
+    const RTreePage* page = (const RTreePage*)(tree->data + pageOffset);
+    int found = 0;
+    for(int e = 0; e < page->count && e < RTREE_PAGE_SIZE; e++) {
+        const Object4D* entry = page->entries + e;
+        if(!intersectsBounds(entry, bounds) || !isVisibleOnZoom(entry, zoom)) {
+            continue;
+        }
+        if(page->leaf) {
+            add(records, entry->offset, result);
+            found++;
+        } else {
+            found += queryRTreePage(tree, records, entry->offset, bounds, zoom, add, result);
+        }
+    }
+    return found;
+}
+
+static int queryLocationIndex(MapperMappedFile* tree, MapperRecordsFile* records, BBox* bounds, ZoomLevel zoom, MapperRecordFound add, void* result) {
+    if(isRTree(tree)) {
+        const RTreeHeader* header = (const RTreeHeader*) tree->data;
+        return header->height ? queryRTreePage(tree, records, sizeof(RTreeHeader), bounds, zoom, add, result) : 0;
+    }
+    return query4DTree(tree, records, 0, 0, bounds, zoom, add, result);
+}
+
+int getNodesInRect(MapperReader* self, BBox bounds, ZoomLevel zoom, MapperPointViews* result) {
+    return queryPointsTree(self, 0, 0, &bounds, zoom, result);
+}
+
+int getWaysInRect(MapperReader* self, BBox bounds, ZoomLevel zoom, MapperWayViews* result) {
+    return queryLocationIndex(&(self->waysLocationIndex), &(self->ways), &bounds, zoom, addWayView, result);
+}
+
+int getAreasInRect(MapperReader* self, BBox bounds, ZoomLevel zoom, MapperAreaViews* result) {
+    return queryLocationIndex(&(self->areasLocationIndex), &(self->areas), &bounds, zoom, addAreaView, result);
+}
+
+#pragma mark Decoding
+
+void initMapperDecodedRecord(MapperDecodedRecord* self) {
+    memset(self, 0, sizeof(MapperDecodedRecord));
+    initMapperWayNodes(&(self->nodes));
+    initMapperDecodedPolygons(&(self->polygons));
+    initMapperDecodedAttributes(&(self->attributes));
+}
+
+void clearMapperDecodedRecord(MapperDecodedRecord* self) {
+    clearMapperWayNodes(&(self->nodes));
+    clearMapperDecodedPolygons(&(self->polygons));
+    clearMapperDecodedAttributes(&(self->attributes));
+}
+
+static void resetMapperDecodedRecord(MapperDecodedRecord* record) {
+    record->groupId = 0;
+    record->nodes.count = 0;
+    removeAllMapperDecodedPolygons(&(record->polygons));
+    removeAllMapperDecodedAttributes(&(record->attributes));
+}
+
+static void addDecodedNode(MapperDecodedRecord* record, OsmId id, OsmPoint location) {
+    ensureMapperWayNodesCapacityForNNewElements(&(record->nodes), 1);
+    MapperWayNode* node = record->nodes.values + record->nodes.count++;
+    node->id = id;
+    node->location = location;
+}
+
+// Varints of compact record. Reading past its end marks record failed and returns 0.
+typedef struct {
+    const unsigned char* current;
+    const unsigned char* end;
+    char failed;
+} CompactRecordReader;
+
+static uint64_t readCompactUnsigned(CompactRecordReader* reader) {
+    uint64_t value = 0;
+    int length = decodeVarint(reader->current, reader->end, &value);
+    reader->failed |= !length;
+    reader->current += length;
+    return value;
+}
+
+static int64_t readCompactSigned(CompactRecordReader* reader) {
+    uint64_t value = readCompactUnsigned(reader);
+    return zigzagDecode(value);
+}
+
+// Counted items take at least minimalSize bytes each, so larger counts than bytes left are never valid.
+static int readCompactCount(CompactRecordReader* reader, int minimalSize) {
+    uint64_t count = readCompactUnsigned(reader);
+    if(count > (uint64_t)(reader->end - reader->current) / minimalSize) {
+        reader->failed = 1;
+        return 0;
+    }
+    return (int) count;
+}
+
+static void readCompactBBox(CompactRecordReader* reader, BBox* bbox) {
+    bbox->min.x = (Coordinate) readCompactSigned(reader);
+    bbox->min.y = (Coordinate) readCompactSigned(reader);
+    bbox->max.x = (Coordinate)(bbox->min.x + readCompactSigned(reader));
+    bbox->max.y = (Coordinate)(bbox->min.y + readCompactSigned(reader));
+}
+
+static void readCompactNodes(CompactRecordReader* reader, MapperDecodedRecord* record, int count, char withIds, OsmPoint* previous, OsmId* previousId) {
+    ensureMapperWayNodesCapacityForNNewElements(&(record->nodes), count);
+    MapperWayNode* nodes = record->nodes.values + record->nodes.count;
+    for(int n = 0; n < count; n++) {
+        previous->x = (Coordinate)(previous->x + readCompactSigned(reader));
+        previous->y = (Coordinate)(previous->y + readCompactSigned(reader));
+        if(withIds) {
+            *previousId = (OsmId)(*previousId + readCompactSigned(reader));
+        }
+        nodes[n].id = *previousId;
+        nodes[n].location = *previous;
+    }
+    record->nodes.count += count;
+}
+
+// Skips length and reads class of compact record.
+static void startCompactRecord(CompactRecordReader* reader, const char* bytes, int length, MapperDecodedRecord* record) {
+    reader->current = (const unsigned char*) bytes;
+    reader->end = (const unsigned char*) bytes + length;
+    reader->failed = 0;
+    resetMapperDecodedRecord(record);
+    readCompactUnsigned(reader);
+    record->class = (MapperClassId) readCompactUnsigned(reader);
+}
+
+static int finishCompactRecord(MapperReader* self, CompactRecordReader* reader, MapperDecodedRecord* record) {
+    int count = readCompactCount(reader, 2);
+    ensureMapperDecodedAttributesCapacityForNNewElements(&(record->attributes), count);
+    for(int a = 0; a < count; a++) {
+        MapperDecodedAttribute attribute;
+        attribute.key = (MapperAttributeKey) readCompactUnsigned(reader);
+        uint64_t value = readCompactUnsigned(reader);
+        if(value >= (uint64_t) self->valuesCount) {
+            return 1;
+        }
+        attribute.value = self->values[value];
+        addToMapperDecodedAttributes(&(record->attributes), attribute);
+    }
+    return reader->failed;
+}
+
+int decodeMapperPoint(MapperReader* self, const MapperPointView* view, MapperDecodedRecord* record) {
+    if(view->chunks) {
+        resetMapperDecodedRecord(record);
+        record->id = view->chunks->info.id;
+        record->class = view->chunks->info.class;
+        record->bbox.min = OsmPointMakeRaw(view->chunks->info.x, view->chunks->info.y);
+        record->bbox.max = record->bbox.min;
+        addDecodedNode(record, record->id, record->bbox.min);
+        return 0;
+    }
+    CompactRecordReader reader;
+    startCompactRecord(&reader, view->bytes, view->length, record);
+    record->id = (OsmId) readCompactUnsigned(&reader);
+    record->bbox.min.x = (Coordinate) readCompactSigned(&reader);
+    record->bbox.min.y = (Coordinate) readCompactSigned(&reader);
+    record->bbox.max = record->bbox.min;
+    addDecodedNode(record, record->id, record->bbox.min);
+    return finishCompactRecord(self, &reader, record);
+}
+
+int decodeMapperWay(MapperReader* self, const MapperWayView* view, MapperDecodedRecord* record) {
+    if(view->chunks) {
+        resetMapperDecodedRecord(record);
+        record->id = view->chunks->info.id;
+        record->class = view->chunks->info.class;
+        record->groupId = view->chunks->info.groupId;
+        record->bbox = view->chunks->info.bbox;
+        ensureMapperWayNodesCapacityForNNewElements(&(record->nodes), view->chunksCount * WAY_NODES_COUNT);
+        // Chunks are padded with empty nodes.
+        for(int c = 0; c < view->chunksCount; c++) {
+            const MapperWay* chunk = view->chunks + c;
+            for(int n = 0; n < WAY_NODES_COUNT && chunk->nodes[n].id; n++) {
+                addDecodedNode(record, chunk->nodes[n].id, chunk->nodes[n].location);
+            }
+        }
+        return 0;
+    }
+    CompactRecordReader reader;
+    startCompactRecord(&reader, view->bytes, view->length, record);
+    record->id = (OsmId) readCompactUnsigned(&reader);
+    record->groupId = (OsmId) readCompactUnsigned(&reader);
+    readCompactBBox(&reader, &(record->bbox));
+    char withIds = (readCompactUnsigned(&reader) & MAPPER_COMPACT_NODE_IDS) != 0;
+    int count = readCompactCount(&reader, 2);
+    OsmPoint previous = record->bbox.min;
+    OsmId previousId = 0;
+    readCompactNodes(&reader, record, count, withIds, &previous, &previousId);
+    return finishCompactRecord(self, &reader, record);
+}
+
+int decodeMapperArea(MapperReader* self, const MapperAreaView* view, MapperDecodedRecord* record) {
+    if(view->chunks) {
+        resetMapperDecodedRecord(record);
+        record->id = view->chunks->area.id;
+        record->class = view->chunks->area.class;
+        record->bbox = view->chunks->area.bbox;
+        ensureMapperWayNodesCapacityForNNewElements(&(record->nodes), view->chunksCount * AREA_NODES_COUNT);
+        // Polygon continues in next chunks while they have its id.
+        for(int c = 0; c < view->chunksCount; c++) {
+            const MapperArea* chunk = view->chunks + c;
+            MapperDecodedPolygon* last = record->polygons.count ? record->polygons.values + record->polygons.count - 1 : NULL;
+            if(!last || last->id != chunk->polygon.id || last->role != chunk->polygon.role) {
+                MapperDecodedPolygon polygon = {chunk->polygon.id, chunk->polygon.role, 0};
+                addToMapperDecodedPolygons(&(record->polygons), polygon);
+                last = record->polygons.values + record->polygons.count - 1;
+            }
+            int count = min(max(chunk->polygon.nodesCount, 0), AREA_NODES_COUNT);
+            for(int n = 0; n < count; n++) {
+                addDecodedNode(record, chunk->nodes[n].id, chunk->nodes[n].location);
+            }
+            last->nodesCount += count;
+        }
+        return 0;
+    }
+    CompactRecordReader reader;
+    startCompactRecord(&reader, view->bytes, view->length, record);
+    record->id = (OsmId) readCompactUnsigned(&reader);
+    readCompactBBox(&reader, &(record->bbox));
+    char withIds = (readCompactUnsigned(&reader) & MAPPER_COMPACT_NODE_IDS) != 0;
+    int polygonsCount = readCompactCount(&reader, 3);
+    OsmPoint previous = record->bbox.min;
+    OsmId previousId = 0;
+    for(int p = 0; p < polygonsCount && !reader.failed; p++) {
+        MapperDecodedPolygon polygon;
+        polygon.id = (OsmId) readCompactUnsigned(&reader);
+        polygon.role = (AreaPartRole) readCompactUnsigned(&reader);
+        polygon.nodesCount = readCompactCount(&reader, 2);
+        readCompactNodes(&reader, record, polygon.nodesCount, withIds, &previous, &previousId);
+        addToMapperDecodedPolygons(&(record->polygons), polygon);
+    }
+    return finishCompactRecord(self, &reader, record);
+}
+
+#pragma mark Update
+
+typedef struct {
+    Tree16* index;
+    MapperRecordsLayout* layout;
+} MapperIndexLoad;
+
+static void loadIndexedRecord(void* context, long Id, long offset) {
+    MapperIndexLoad* load = (MapperIndexLoad*) context;
+    setTree16Node(load->index, (int) Id, offset);
+    addToOffsets(&(load->layout->starts), (Offset) offset);
+}
+
+static int loadIdIndex(MapperWriter* self, Tree16* index, MapperRecordsLayout* layout, const char* name) {
+    FILE* file = openFile(name, self->dbPath, "r", NO_COMPRESS);
+    if(!file) {
+        fprintf(stderr, "Map %s has no id index %s, it must be converted again to be updated\n", self->dbPath, name);
+        return 1;
+    }
+    MapperIndexLoad load = {index, layout};
+    forEachTree16FileNode(file, loadIndexedRecord, &load);
+    fclose(file);
+    return 0;
+}
+
+// Starts of live records come from id index in order of ids, so they are sorted with tombstoned ones.
+static void loadRecordsLayout(MapperWriter* self, MapperRecordsLayout* layout, const char* deadName) {
+    FILE* file = openFile(deadName, self->dbPath, "r", NO_COMPRESS);
+    if(file) {
+        Offset offset;
+        while(fread(&offset, sizeof(Offset), 1, file) == 1) {
+            addToOffsets(&(layout->dead), offset);
+            addToOffsets(&(layout->starts), offset);
+        }
+        fclose(file);
+    }
+    qsort(layout->starts.values, layout->starts.count, sizeof(Offset), compareOffsets);
+}
+
+static void addLocationObject(Objects4D* objects, const Object4D* object) {
+    BBox bounds;
+    bounds.min = OsmPointMakeRaw(object->dimensions[0], object->dimensions[1]);
+    bounds.max = OsmPointMakeRaw(object->dimensions[2], object->dimensions[3]);
+    add4DObject(objects, bounds, object->offset, object->minZoomLevel, object->maxZoomLevel);
+}
+
+static void loadLocationObjects(MapperMappedFile* tree, Objects4D* objects) {
+    if(isRTree(tree)) {
+        const RTreeHeader* header = (const RTreeHeader*) tree->data;
+        const RTreePage* pages = (const RTreePage*)(tree->data + sizeof(RTreeHeader));
+        for(int p = 0; p < header->pagesCount; p++) {
+            for(int e = 0; pages[p].leaf && e < pages[p].count && e < RTREE_PAGE_SIZE; e++) {
+                addLocationObject(objects, pages[p].entries + e);
+            }
+        }
+    } else {
+        const Tree4DRecord* nodes = (const Tree4DRecord*) tree->data;
+        long count = tree->length / sizeof(Tree4DRecord);
+        for(long i = 0; i < count; i++) {
+            addLocationObject(objects, &(nodes[i].info));
+        }
+    }
+}
+
+// Returns NULL if records file can not be opened.
+static FILE* openRecordsFileForUpdate(MapperWriter* self, const char* name, int* fileLength) {
+    FILE* file = openFile(name, self->dbPath, "r+", NO_COMPRESS);
+    if(!file) {
+        fprintf(stderr, "Error opening %s of map %s: %i\n", name, self->dbPath, errno);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *fileLength = (int) ftell(file);
+    return file;
+}
+
+// Frees writer opened for update without writing anything to its map.
+static void releaseOpenedMapperWriter(MapperWriter* self) {
+    FILE* files[] = {self->pointsFile, self->waysFile, self->areasFile};
+    for(int f = 0; f < 3; f++) {
+        if(files[f]) {
+            fclose(files[f]);
+        }
+    }
+    freeTree16(&(self->pointsIndex));
+    freeTree16(&(self->waysIndex));
+    freeTree16(&(self->areasIndex));
+    freeTree16(&(self->multipolygonsIndex));
+    clearMapperRecordsLayout(&(self->pointsLayout));
+    clearMapperRecordsLayout(&(self->waysLayout));
+    clearMapperRecordsLayout(&(self->areasLayout));
+    clearSimpleStringIndex(&(self->attributesIndex));
+    clearSimpleStringIndex(&(self->typesIndex));
+    clearSimpleStringIndex(&(self->valuesIndex));
+    clearObjects2D(&(self->pointsLocations));
+    free(self->waysLocations.values);
+    free(self->areasLocations.values);
+    free(self->mapInformation.name);
+    free(self->dbPath);
+}
+
+int openMapperWriter(MapperWriter* self, const char* mapDirectory) {
+    self->dbPath = strdup(mapDirectory);
+    self->pointsFile = self->waysFile = self->areasFile = NULL;
+    self->mapInformation.name = NULL;
+    self->compressed = NO_COMPRESS;
+    self->write = getWrite(NO_COMPRESS);
+    self->indexThreadsCount = 1;
+    self->compactNodeIds = 0;
+    self->spatialOrderZoomLevel = -1;
+    initMapperWriterIndexes(self);
+    self->updating = 1;
+    initSimpleStringIndex(&(self->attributesIndex));
+    initSimpleStringIndex(&(self->typesIndex));
+    initSimpleStringIndex(&(self->valuesIndex));
+    initObjects2D(&(self->pointsLocations));
+    initObjects4D(&(self->areasLocations));
+    initObjects4D(&(self->waysLocations));
+    
+    MapperReader map;
+    int errors = initMapperReader(&map, mapDirectory);
+    if(errors) {
+        fprintf(stderr, "Error opening map %s, only uncompressed maps can be updated\n", mapDirectory);
+    } else {
+        errors += loadIdIndex(self, &(self->pointsIndex), &(self->pointsLayout), "points.idx");
+        errors += loadIdIndex(self, &(self->waysIndex), &(self->waysLayout), "ways.idx");
+        errors += loadIdIndex(self, &(self->areasIndex), &(self->areasLayout), "areas.idx");
+        errors += loadIdIndex(self, &(self->multipolygonsIndex), &(self->areasLayout), "multipolygons.idx");
+    }
+    if(errors) {
+        closeMapperReader(&map);
+        releaseOpenedMapperWriter(self);
+        return 1;
+    }
+    
+    self->formatVersion = map.formatVersion;
+    self->legacyLocationIndex = map.waysLocationIndex.length > 0 && !isRTree(&(map.waysLocationIndex));
+    self->mapInformation = map.mapInformation;
+    map.mapInformation.name = NULL;
+    // Records refer to strings by their indicies, so they are added in the same order.
+    for(int a = 0; a < map.attributesIndex.valuesCount; a++) {
+        simpleStringIndexOf(&(self->attributesIndex), map.attributesIndex.values[a]);
+    }
+    for(int t = 0; t < map.typesIndex.valuesCount; t++) {
+        simpleStringIndexOf(&(self->typesIndex), map.typesIndex.values[t]);
+    }
+    for(int v = 0; v < map.valuesCount; v++) {
+        simpleStringIndexOf(&(self->valuesIndex), (UTF8*) map.values[v]);
+    }
+    const Tree2DRecord* points = (const Tree2DRecord*) map.pointsLocationIndex.data;
+    long pointsCount = map.pointsLocationIndex.length / sizeof(Tree2DRecord);
+    for(long p = 0; p < pointsCount; p++) {
+        addToObjects2D(&(self->pointsLocations), points[p].info);
+    }
+    loadLocationObjects(&(map.waysLocationIndex), &(self->waysLocations));
+    loadLocationObjects(&(map.areasLocationIndex), &(self->areasLocations));
+    closeMapperReader(&map);
+    
+    loadRecordsLayout(self, &(self->pointsLayout), "points.dead");
+    loadRecordsLayout(self, &(self->waysLayout), "ways.dead");
+    loadRecordsLayout(self, &(self->areasLayout), "areas.dead");
+    self->pointsFile = openRecordsFileForUpdate(self, "points", &(self->pointsOffset));
+    self->waysFile = openRecordsFileForUpdate(self, "ways", &(self->waysOffset));
+    self->areasFile = openRecordsFileForUpdate(self, "areas", &(self->areasOffset));
+    if(!self->pointsFile || !self->waysFile || !self->areasFile) {
+        releaseOpenedMapperWriter(self);
+        return 1;
+    }
+    // Location indexes are rewritten only when writer is closed, so cancelled update leaves map as it was.
+    self->pointsLocationIndexFile = NULL;
+    self->waysLocationIndexFile = NULL;
+    self->areasLocationIndexFile = NULL;
+    return 0;
+}
+
+// Tombstones record indexed by id, if there is one.
+static void removeMapperRecord(Tree16* index, MapperRecordsLayout* layout, OsmId id) {
+    long offset = tree16NodeOffset(index, id);
+    if(offset >= 0) {
+        setTree16Node(index, id, -1);
+        addToOffsets(&(layout->dead), (Offset) offset);
+    }
+}
+
+void initMapperChanges(MapperChanges* self) {
+    initOsmIds(&(self->nodes));
+    initOsmIds(&(self->ways));
+    initOsmIds(&(self->relations));
+    initOsmIds(&(self->memberWays));
+}
+
+static void addChangedNode(void* self, OsmId id, Coordinate lat, Coordinate lon, OsmTimestamp timestamp) {
+    addToOsmIds(&(((MapperChanges*) self)->nodes), id);
+}
+
+static void addChangedWay(void* self, OsmId id, OsmTimestamp timestamp) {
+    addToOsmIds(&(((MapperChanges*) self)->ways), id);
+}
+
+static void addChangedRelation(void* self, OsmId id, OsmTimestamp timestamp) {
+    addToOsmIds(&(((MapperChanges*) self)->relations), id);
+}
+
+static void addChangedRelationMember(void* self, OsmId ref, OsmEntityType type, UTF8* role) {
+    if(type == OSM_ENTITY_WAY) {
+        addToOsmIds(&(((MapperChanges*) self)->memberWays), ref);
+    }
+}
+
+int readMapperChangesFromFile(MapperChanges* self, const char* path) {
+    if(access(path, R_OK)) {
+        fprintf(stderr, "Error reading changes from %s: %i\n", path, errno);
+        return 1;
+    }
+    OsmStreamReader reader;
+    initOsmStreamReader(&reader, self);
+    reader.newNode = addChangedNode;
+    reader.newWay = addChangedWay;
+    reader.newRelation = addChangedRelation;
+    reader.newRelationMember = addChangedRelationMember;
+    readOsmFromFile(&reader, path);
+    return 0;
+}
+
+void clearMapperChanges(MapperChanges* self) {
+    clearOsmIds(&(self->nodes));
+    clearOsmIds(&(self->ways));
+    clearOsmIds(&(self->relations));
+    clearOsmIds(&(self->memberWays));
+}
+
+static void sortDistinctOsmIds(OsmIds* ids) {
+    qsort(ids->values, ids->count, sizeof(OsmId), compareOsmIds);
+    int count = 0;
+    for(int i = 0; i < ids->count; i++) {
+        if(!count || ids->values[i] != ids->values[count - 1]) {
+            ids->values[count++] = ids->values[i];
+        }
+    }
+    ids->count = count;
+}
+
+static int containsOsmId(OsmIds* ids, OsmId id) {
+    return bsearch(&id, ids->values, ids->count, sizeof(OsmId), compareOsmIds) != NULL;
+}
+
+int initMapperConverterForUpdate(MapperConverter* self, OsmDbReader* reader, const char* mapDirectory, int workersCount) {
+    self->writer = calloc(sizeof(MapperWriter), 1);
+    if(openMapperWriter(self->writer, mapDirectory)) {
+        free(self->writer);
+        self->writer = NULL;
+        return 1;
+    }
+    initMapperConverterWithWriter(self, reader, workersCount);
+    return 0;
+}
+
+void cancelMapperUpdate(MapperConverter* self) {
+    releaseOpenedMapperWriter(self->writer);
+    free(self->writer);
+    self->writer = NULL;
+    clearMapperRules(&(self->rules));
+    clearMultipolygonRelations(&(self->multipolygons));
+    clearMultipolygonOuters(&(self->outersIndex));
+    closeOsmDbReader(self->reader);
+}
+
+// Ways with changed nodes are found in one pass over ways, as readers have no index from nodes to ways.
+static void findAffectedWays(MapperConverter* self, MapperChanges* changes, OsmIds* ways) {
+    ensureOsmIdsCapacityForNNewElements(ways, changes->ways.count);
+    for(int w = 0; w < changes->ways.count; w++) {
+        addToOsmIds(ways, changes->ways.values[w]);
+    }
+    if(changes->nodes.count) {
+        printf("Looking for ways with changed nodes...\n");
+        Way* way;
+        while((way = nextWay(self->reader))) {
+            for(int n = 0; n < way->wayNodes.count; n++) {
+                if(containsOsmId(&(changes->nodes), way->wayNodes.values[n].id)) {
+                    addToOsmIds(ways, way->info.id);
+                    break;
+                }
+            }
+        }
+    }
+    sortDistinctOsmIds(ways);
+}
+
+// Multipolygon is affected if its relation changed or any of its member ways is affected.
+// Outer ways of affected multipolygons may start or stop being written as separate areas, so they are affected too.
+static char* findAffectedMultipolygons(MapperConverter* self, MapperChanges* changes, OsmIds* ways) {
+    char* affected = calloc(sizeof(char), max(self->multipolygons.count, 1));
+    OsmIds outers;
+    initOsmIds(&outers);
+    for(int m = 0; m < self->multipolygons.count; m++) {
+        MultipolygonRelation* multipolygon = self->multipolygons.values[m];
+        affected[m] = containsOsmId(&(changes->relations), multipolygon->relationId);
+        for(int o = 0; !affected[m] && o < multipolygon->outers.count; o++) {
+            affected[m] = containsOsmId(ways, multipolygon->outers.values[o]);
+        }
+        for(int i = 0; !affected[m] && i < multipolygon->inners.count; i++) {
+            affected[m] = containsOsmId(ways, multipolygon->inners.values[i]);
+        }
+        if(affected[m]) {
+            for(int o = 0; o < multipolygon->outers.count; o++) {
+                addToOsmIds(&outers, multipolygon->outers.values[o]);
+            }
+        }
+    }
+    ensureOsmIdsCapacityForNNewElements(ways, outers.count + changes->memberWays.count);
+    for(int o = 0; o < outers.count; o++) {
+        addToOsmIds(ways, outers.values[o]);
+    }
+    for(int w = 0; w < changes->memberWays.count; w++) {
+        addToOsmIds(ways, changes->memberWays.values[w]);
+    }
+    sortDistinctOsmIds(ways);
+    clearOsmIds(&outers);
+    return affected;
+}
+
+static int updatePoints(MapperConverter* self, OsmIds* nodes) {
+    MapperWriter* writer = self->writer;
+    int pointsCount = 0;
+    for(int n = 0; n < nodes->count; n++) {
+        removeMapperRecord(&(writer->pointsIndex), &(writer->pointsLayout), nodes->values[n]);
+    }
+    if(self->reader->nodeWithId) {
+        for(int n = 0; n < nodes->count; n++) {
+            Node* node = nodeWithId(self->reader, nodes->values[n]);
+            if(node) {
+                if(encodeNode(self, &writerRecord, node)) {
+                    commitMapperRecord(writer, &writerRecord);
+                    pointsCount++;
+                }
+                clearPlainTags(&(node->tags));
+                free(node);
+            }
+            resetOsmDbReaderScratch(self->reader);
+        }
+    } else if(nodes->count) {
+        Node* node;
+        while((node = nextNode(self->reader))) {
+            if(containsOsmId(nodes, node->info.id) && encodeNode(self, &writerRecord, node)) {
+                commitMapperRecord(writer, &writerRecord);
+                pointsCount++;
+            }
+        }
+    }
+    return pointsCount;
+}
+
+static void updateWays(MapperConverter* self, OsmIds* ways, int* recordsCount) {
+    MapperWriter* writer = self->writer;
+    for(int w = 0; w < ways->count; w++) {
+        removeMapperRecord(&(writer->waysIndex), &(writer->waysLayout), ways->values[w]);
+        removeMapperRecord(&(writer->areasIndex), &(writer->areasLayout), ways->values[w]);
+        Way* way = wayWithId(self->reader, ways->values[w]);
+        if(way) {
+            if(encodeWayOrArea(self, &writerRecord, way)) {
+                commitMapperRecord(writer, &writerRecord);
+                recordsCount[writerRecord.kind]++;
+            }
+            clearNodesInfo(&(way->wayNodes));
+            clearPlainTags(&(way->tags));
+            free(way);
+        }
+        resetOsmDbReaderScratch(self->reader);
+    }
+}
+
+// Only affected multipolygons are kept to be converted again, areas of changed relations are tombstoned even if
+// they are no multipolygons anymore.
+static void keepAffectedMultipolygons(MapperConverter* self, MapperChanges* changes, char* affected) {
+    MapperWriter* writer = self->writer;
+    for(int r = 0; r < changes->relations.count; r++) {
+        removeMapperRecord(&(writer->multipolygonsIndex), &(writer->areasLayout), changes->relations.values[r]);
+    }
+    int count = 0;
+    for(int m = 0; m < self->multipolygons.count; m++) {
+        MultipolygonRelation* multipolygon = self->multipolygons.values[m];
+        if(affected[m]) {
+            removeMapperRecord(&(writer->multipolygonsIndex), &(writer->areasLayout), multipolygon->relationId);
+            self->multipolygons.values[count++] = multipolygon;
+        } else {
+            clearOsmIds(&(multipolygon->outers));
+            clearOsmIds(&(multipolygon->inners));
+            clearPlainTags(&(multipolygon->tags));
+            free(multipolygon);
+        }
+    }
+    self->multipolygons.count = count;
+}
+
+void updateMapper(MapperConverter* self, MapperChanges* changes) {
+    sortDistinctOsmIds(&(changes->nodes));
+    sortDistinctOsmIds(&(changes->ways));
+    sortDistinctOsmIds(&(changes->relations));
+    printf("%i nodes, %i ways and %i relations changed.\n", changes->nodes.count, changes->ways.count, changes->relations.count);
+    prepareIndicies(self);
+    
+    OsmIds ways;
+    initOsmIds(&ways);
+    findAffectedWays(self, changes, &ways);
+    char* affected = findAffectedMultipolygons(self, changes, &ways);
+    
+    printf("Updating points...\n");
+    int pointsCount = updatePoints(self, &(changes->nodes));
+    printf("%i of %i nodes converted.\n", pointsCount, changes->nodes.count);
+    printf("Updating ways...\n");
+    int recordsCount[MAPPER_RECORD_KINDS] = {0};
+    updateWays(self, &ways, recordsCount);
+    printf("%i of %i ways converted.\n", recordsCount[MAPPER_WAY_RECORD], ways.count);
+    printf("%i of %i areas converted.\n", recordsCount[MAPPER_AREA_RECORD], ways.count);
+    // Multipolygons are converted last as outer ways are checked against all of them.
+    keepAffectedMultipolygons(self, changes, affected);
+    convertMultipolygons(self);
+    
+    free(affected);
+    clearOsmIds(&ways);
+    clearMultipolygonOuters(&(self->outersIndex));
+    clearMapperRules(&(self->rules));
+    closeMapperWriter(self->writer);
+}
@@ -12,13 +12,21 @@
 #include "SimpleStringIndex.h"
 #include "4DTree.h"
 #include "2DTree.h"
+#include "RTree.h"
+#include "MapperRules.h"
 #include "collections.h"
 #include "MapperArea.h"
 #include "MapperWay.h"
 #include "MapperPoint.h"
 #include "utils.h"
+#include <pthread.h>
 
 #pragma mark Common
+Coordinate mercatorX(Coordinate lon);
+Coordinate mercatorY(Coordinate lat);
+Coordinate tableMercatorY(Coordinate lat);
+void projectNodesInfo(NodeInfo* infos, MapperWayNode* nodes, int count);
+
 typedef struct {
     MapperPolygonInfo info;
     PlainTags tags;
@@ -34,17 +42,117 @@ typedef struct {
     UTF8* name;
 } MapInformation;
 
+// Records with fixed size chunks laid out as MapperPoint, MapperWay and MapperArea structures.
+#define MAPPER_FORMAT_FIXED 1
+// Variable length records with delta encoded coordinates and attribute values in shared values table.
+#define MAPPER_FORMAT_COMPACT 2
+// Flag of compact way or area geometry with node ids written after node coordinates.
+#define MAPPER_COMPACT_NODE_IDS 1
+
 #pragma mark Writer    
 
+typedef enum {
+    MAPPER_POINT_RECORD,
+    MAPPER_WAY_RECORD,
+    MAPPER_AREA_RECORD,
+    MAPPER_RECORD_KINDS
+} MapperRecordKind;
+
+// Ways and areas visible below full detail zoom level are also written generalized for zoom bands ending at these levels.
+#define GENERALIZED_ZOOM_BANDS_COUNT 3
+#define FULL_DETAIL_ZOOM_LEVEL 12
+#define MAPPER_DETAIL_LEVELS_COUNT (GENERALIZED_ZOOM_BANDS_COUNT + 1)
+
+// Part of record bytes with geometry for some zoom levels. Each level is indexed separately.
+typedef struct {
+    int offset;
+    int length;
+    int nodesCount;
+    BBox bbox;
+    ZoomLevel minZoomLevel;
+    ZoomLevel maxZoomLevel;
+} MapperDetailLevel;
+
+// Buffers reused by geometry generalization of records.
+typedef struct {
+    char* kept;
+    int* stack;
+    int capacity;
+    MapperWayNodes nodes;
+    MapperPolygon* polygons;
+    int polygonsCapacity;
+} MapperGeneralization;
+
+// Point, way or area serialized in file format, but with class left 0 and local attribute keys
+// (FIRST_LOCAL_ATTRIBUTE + index in tags) until it is committed to writer.
+// In compact format only geometry of levels is serialized, their class and attributes are added on commit.
+// Generalized levels of detail are serialized one after another, the least detailed first.
+typedef struct {
+    MapperRecordKind kind;
+    int formatVersion;
+    char compactNodeIds;
+    OsmId id;
+    // Multipolygon relation of area, 0 for other records. Old style multipolygons have id of their outer way.
+    OsmId relationId;
+    UTF8* className;
+    PlainTags* tags;
+    BBox bbox;
+    ZoomLevel minZoomLevel;
+    ZoomLevel maxZoomLevel;
+    
+    char* bytes;
+    int length;
+    int capacity;
+    
+    int levelsCount;
+    MapperDetailLevel levels[MAPPER_DETAIL_LEVELS_COUNT];
+    
+    MapperAttributes pointAttributes;
+    MapperPartAttributes partAttributes;
+    MapperWayNodes wayNodes;
+    MapperGeneralization generalization;
+} MapperRecord;
+
+// Record written to temporary file in spatial order mode.
+typedef struct {
+    uint64_t key;
+    OsmId id;
+    // Id index record is added to when it is ordered.
+    Tree16* index;
+    Offset offset;
+    Offset length;
+    Offset orderedOffset;
+} MapperOrderedRecord;
+
+Collection(MapperOrderedRecord, MapperOrderedRecords)
+Collection(Offset, Offsets)
+
+// Records file of map opened for update. Records of changed entities are appended and their old records are
+// tombstoned: they are dropped from id and location indexes, but stay in file until it is compacted.
+typedef struct {
+    // Starts of all records in file, tombstoned included, in ascending order.
+    Offsets starts;
+    // Starts of tombstoned records. Saved to <file>.dead, readers of fixed format need them to find record ends.
+    Offsets dead;
+} MapperRecordsLayout;
+
+// Records file is compacted when map update is closed and tombstoned records take this share of it.
+#define MAPPER_COMPACTION_DEAD_PERCENT 25
+
 typedef struct {
     char* dbPath;
     FILE* pointsFile;
     FILE* waysFile;
     FILE* areasFile;
     
-    //FILE* pointsIndexFile;
-    //FILE* waysIndexFile;
-    //FILE* areasIndexFile;
+    // Zoom level of tiles along which Hilbert curve records are ordered, or -1 to keep input order.
+    int spatialOrderZoomLevel;
+    FILE* pointsUnorderedFile;
+    FILE* waysUnorderedFile;
+    FILE* areasUnorderedFile;
+    MapperOrderedRecords pointsOrder;
+    MapperOrderedRecords waysOrder;
+    MapperOrderedRecords areasOrder;
     
     FILE* pointsLocationIndexFile;
     FILE* waysLocationIndexFile;
@@ -54,9 +162,18 @@ typedef struct {
 	
 	char compressed;
 	WriteCallback write;
+    // If to write ways and areas location indexes as 4D KD-tree instead of packed R-tree.
+    char legacyLocationIndex;
+    // Threads used to build location indexes.
+    int indexThreadsCount;
+    int formatVersion;
+    // If to keep way and area node ids in compact format.
+    char compactNodeIds;
     
     SimpleStringIndex attributesIndex;
     SimpleStringIndex typesIndex; 
+    // Attribute values of compact format records.
+    SimpleStringIndex valuesIndex;
     
     Objects2D pointsLocations;
     Objects4D waysLocations;
@@ -66,61 +183,259 @@ typedef struct {
     int waysOffset;
     int areasOffset;
     
+    // Record offsets by entity id, saved to <file>.idx for updates of uncompressed maps.
     Tree16 pointsIndex;
     Tree16 waysIndex;
     Tree16 areasIndex;
+    // Areas of multipolygon relations by relation id.
+    Tree16 multipolygonsIndex;
+    
+    // If map was opened for update rather than written from scratch.
+    char updating;
+    MapperRecordsLayout pointsLayout;
+    MapperRecordsLayout waysLayout;
+    MapperRecordsLayout areasLayout;
 } MapperWriter;
 
 void initMapperWriter(MapperWriter* self, const char* outputDirectory, char compress);
+// Records are kept in temporary files and written ordered by tiles of their centers when writer is closed.
+void setMapperWriterSpatialOrder(MapperWriter* self, int zoomLevel);
+// Must be called before records are encoded.
+void setMapperWriterFormat(MapperWriter* self, int formatVersion, char compactNodeIds);
+// Opens uncompressed map written by converter to append records of changed entities, keeping its format and
+// location index kind. Location indexes are rebuilt on close. Returns 0 on success.
+int openMapperWriter(MapperWriter* self, const char* mapDirectory);
 
 void closeMapperWriter(MapperWriter* self);
 
+void initMapperRecord(MapperRecord* self);
+void clearMapperRecord(MapperRecord* self);
+void commitMapperRecord(MapperWriter* self, MapperRecord* record);
+
 #pragma mark Converter
 
 typedef struct {
     OsmIds outers;
     OsmIds inners;
+    // Relation tags without type. Empty for old style multipolygons tagged on outer way.
+    PlainTags tags;
     int converted;
     OsmId relationId;
 } MultipolygonRelation, *PMultipolygonRelation;
     
 Collection(PMultipolygonRelation, MultipolygonRelations)
 
+// Entry of index from outer way to multipolygons it belongs to. Sorted by way id.
+typedef struct {
+    OsmId wayId;
+    int multipolygon;
+    int outer;
+} MultipolygonOuter;
+
+Collection(MultipolygonOuter, MultipolygonOuters)
+
+// Member way fetched for batch of multipolygons. Sorted by id.
+typedef struct {
+    OsmId id;
+    Way* way;
+} MemberWay;
+
+Collection(MemberWay, MemberWays)
+
 typedef struct {
     OsmDbReader* reader;
     MapperWriter* writer;
     BBox bounds;
     MultipolygonRelations multipolygons;
+    MultipolygonOuters outersIndex;
+    int workersCount;
+    MapperRules rules;
+    // Interned keys checked by converter itself.
+    TagStringId typeKey;
+    TagStringId areaKey;
 } MapperConverter;
 
-void initMapperConverter(MapperConverter* self, OsmDbReader* reader, const char* outputDirectory, char compress);
+// Default budget of reader way cache, member ways of multipolygons are shared by neighbouring relations.
+#define MAPPER_WAY_CACHE_BUDGET (64 << 20)
+
+#define MAPPER_JOB_SIZE 256
+#define MAPPER_PIPELINE_LENGTH 64
+
+// Entities copied from reader and encoded by one worker.
+typedef struct {
+    int count;
+    char encoded;
+    Node nodes[MAPPER_JOB_SIZE];
+    Way ways[MAPPER_JOB_SIZE];
+    MapperRecord records[MAPPER_JOB_SIZE];
+    // Tag values of copied entities, which are not interned.
+    Arena arena;
+} MapperJob;
+
+// Reader thread fills jobs, workers encode them and sequencer commits them to writer in reading order.
+typedef struct {
+    MapperConverter* converter;
+    OsmEntityType type;
+    MapperJob* jobs;
+    long produced;
+    long taken;
+    long committed;
+    char finished;
+    char endOfInput;
+    int totalCount;
+    int recordsCount[MAPPER_RECORD_KINDS];
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+} MapperPipeline;
+
+void initMapperConverter(MapperConverter* self, OsmDbReader* reader, const char* outputDirectory, char compress, int workersCount);
+// Replaces default classification rules with rules from file. Returns number of invalid rules, -1 if file can not be read.
+int loadMapperConverterRules(MapperConverter* self, const char* path);
+
+// Default classification written as if-chains. Converter uses compiled rules, these are kept to check them against.
+UTF8* pointClassByTags(PlainTags* tags);
+UTF8* wayClassByTags(PlainTags* tags);
+UTF8* areaClassByTags(PlainTags* tags);
+ZoomLevel getMinimalPointLevel(Node* node);
+ZoomLevel getMaximalPointLevel(Node* node);
+ZoomLevel getMinimalWayLevel(Way* way);
+ZoomLevel getMaximalWayLevel(Way* way);
+ZoomLevel getMinimalAreaLevel(PlainTags* tags, MapperPolygons* polygons);
+ZoomLevel getMaximalAreaLevel(PlainTags* tags, MapperPolygons* polygons);
 void convertToMapper(MapperConverter* self);
 
+// Ids of entities created, modified or deleted by change files.
+typedef struct {
+    OsmIds nodes;
+    OsmIds ways;
+    OsmIds relations;
+    // Way members of changed relations as listed in change files, so outers of relations that stopped being
+    // multipolygons are written as separate areas again.
+    OsmIds memberWays;
+} MapperChanges;
+
+void initMapperChanges(MapperChanges* self);
+// Adds ids of all entities in osmChange file. Returns 0 on success.
+int readMapperChangesFromFile(MapperChanges* self, const char* path);
+void clearMapperChanges(MapperChanges* self);
+
+// Like initMapperConverter, but opens existing map for update. Returns 0 on success.
+int initMapperConverterForUpdate(MapperConverter* self, OsmDbReader* reader, const char* mapDirectory, int workersCount);
+// Frees converter initialized for update and its writer and closes its reader, leaving map as it was.
+void cancelMapperUpdate(MapperConverter* self);
+// Rewrites records of changed entities, of ways with changed nodes and of multipolygons with affected member ways.
+// Reader must already have changes applied.
+void updateMapper(MapperConverter* self, MapperChanges* changes);
+
 #pragma mark Reader
+
+// Read only memory mapped file. Empty files have no data.
+typedef struct {
+    const char* data;
+    size_t length;
+} MapperMappedFile;
+
+// Mapped records file. Compact records start with their length, lengths of fixed format records
+// are counted from record start offsets taken from location index.
+typedef struct {
+    MapperMappedFile file;
+    int formatVersion;
+    size_t chunkSize;
+    long chunksCount;
+    // Number of chunks in record starting at each chunk, 0 for chunks inside records.
+    int* recordChunks;
+} MapperRecordsFile;
+
+// Record found in rect. Its bytes point to mapped file and are valid until reader is closed.
+// Chunks are set only for fixed format records.
+typedef struct {
+    const char* bytes;
+    int length;
+    const MapperPoint* chunks;
+    int chunksCount;
+} MapperPointView;
+
+typedef struct {
+    const char* bytes;
+    int length;
+    const MapperWay* chunks;
+    int chunksCount;
+} MapperWayView;
+
+typedef struct {
+    const char* bytes;
+    int length;
+    const MapperArea* chunks;
+    int chunksCount;
+} MapperAreaView;
+
+Collection(MapperPointView, MapperPointViews)
+Collection(MapperWayView, MapperWayViews)
+Collection(MapperAreaView, MapperAreaViews)
+
+typedef struct {
+    OsmId id;
+    AreaPartRole role;
+    int nodesCount;
+} MapperDecodedPolygon;
+
+typedef struct {
+    MapperAttributeKey key;
+    const UTF8* value;
+} MapperDecodedAttribute;
+
+Collection(MapperDecodedPolygon, MapperDecodedPolygons)
+Collection(MapperDecodedAttribute, MapperDecodedAttributes)
+
+// Point, way or area decoded from view. Polygon nodes follow one another in nodes.
+// Attributes are decoded only from compact records, values point to mapped values table.
+typedef struct {
+    OsmId id;
+    MapperClassId class;
+    OsmId groupId;
+    BBox bbox;
+    MapperWayNodes nodes;
+    MapperDecodedPolygons polygons;
+    MapperDecodedAttributes attributes;
+} MapperDecodedRecord;
+
 typedef struct {
     char* dbPath;
-    FILE* pointsFile;
-    FILE* waysFile;
-    FILE* areasFile;
+    int formatVersion;
+    MapperRecordsFile points;
+    MapperRecordsFile ways;
+    MapperRecordsFile areas;
         
-    FILE* pointsLocationIndexFile;
-    FILE* waysLocationIndexFile;
-    FILE* areasLocationIndexFile;
-    
-	CloseCallback* close;
-	ReadCallback* read;
+    MapperMappedFile pointsLocationIndex;
+    MapperMappedFile waysLocationIndex;
+    MapperMappedFile areasLocationIndex;
 	
     MapInformation mapInformation;
     
     SimpleStringIndex attributesIndex;
     SimpleStringIndex typesIndex;
+    
+    // Zero terminated attribute values of compact format.
+    MapperMappedFile valuesFile;
+    const UTF8** values;
+    int valuesCount;
 } MapperReader;
 
-
-void initMapperReader(MapperReader* self, const char* mapDirectory);
+// Opens uncompressed map written by converter. Returns 0 on success.
+int initMapperReader(MapperReader* self, const char* mapDirectory);
 
 void closeMapperReader(MapperReader* self);
 
-//MapperPoints* getNodesInRect(MapperReader* self, BBox bounds);
-//MapperWays* getWaysInRect(MapperReader* self, BBox bounds);
-//MapperAreas* getAreasInRect(MapperReader* self, BBox bounds);
+// Append to result records visible on zoom level which bounds intersect given bounds in mercator coordinates.
+// Return number of appended records.
+int getNodesInRect(MapperReader* self, BBox bounds, ZoomLevel zoom, MapperPointViews* result);
+int getWaysInRect(MapperReader* self, BBox bounds, ZoomLevel zoom, MapperWayViews* result);
+int getAreasInRect(MapperReader* self, BBox bounds, ZoomLevel zoom, MapperAreaViews* result);
+
+void initMapperDecodedRecord(MapperDecodedRecord* self);
+void clearMapperDecodedRecord(MapperDecodedRecord* self);
+
+// Decode record of any format into reused record. Return 0 on success.
+int decodeMapperPoint(MapperReader* self, const MapperPointView* view, MapperDecodedRecord* record);
+int decodeMapperWay(MapperReader* self, const MapperWayView* view, MapperDecodedRecord* record);
+int decodeMapperArea(MapperReader* self, const MapperAreaView* view, MapperDecodedRecord* record);
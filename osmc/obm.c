@@ -7,6 +7,9 @@
  *
  */
 
+// ftruncate and fileno are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
 #include "obm.h"
 #include "utils.h"
 #include <math.h>
@@ -15,6 +18,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <unistd.h>
 
 #pragma mark osm2obm
 
@@ -80,24 +84,27 @@ static void nprintf(const char* format, ...) {
     //do nothing
 }
 
-static void growBTags(osm2obm* self) {
-    self->tags.capacity += 10;
+static void growBTags(osm2obm* self, int n) {
+    self->tags.capacity = max(self->tags.count + n, max(10, self->tags.capacity * 2));
     self->tags.values = realloc(self->tags.values, sizeof(BTag) * self->tags.capacity);
 }
 
 static int btagSlotsCount(UTF8* value) {
     int slots = ceil(((double)utf8size(value)) / (ATTRIBUTE_VALUE_LENGTH - 2));
-    return slots;
+    // Empty value still takes one slot.
+    return max(1, slots);
 }
 
 static void addBTag(osm2obm* self, int key, UTF8* value) {
     int tagSlots = btagSlotsCount(value);
     if(self->tags.capacity < self->tags.count + tagSlots) {
-        growBTags(self);
+        growBTags(self, tagSlots);
     }
     int index = self->tags.count; 
     int size = utf8size(value);
     //    dprintf("Adding tag %i = %s (%i)\n", key, value, size);
+    // Empty value has no characters to set key with in the loop.
+    self->tags.values[index].key = key;
     int c = 0;
     for(int i = 0; i < size; i++, c++) {
         if(c == ATTRIBUTE_VALUE_LENGTH - 2) {
@@ -117,7 +124,7 @@ static void addBTag(osm2obm* self, int key, UTF8* value) {
 }
 
 static void growBWayNodes(osm2obm* self) {
-    self->wayNodes.capacity += 10;
+    self->wayNodes.capacity = max(10, self->wayNodes.capacity * 2);
     self->wayNodes.values = realloc(self->wayNodes.values, sizeof(BWayNode) * self->wayNodes.capacity);
 }
 
@@ -157,7 +164,7 @@ static void addBRelation(osm2obm* self) {
 }
 
 static void growBRelationMembers(osm2obm* self) {
-    self->relationMembers.capacity += 10;
+    self->relationMembers.capacity = max(10, self->relationMembers.capacity * 2);
     self->relationMembers.values = realloc(self->relationMembers.values, sizeof(BRelationMember) * self->relationMembers.capacity);
 }
 
@@ -171,9 +178,54 @@ static void addBRelationMember(osm2obm* self, BId ref, OsmEntityType type, int r
     self->relationMembers.count++;
 }
 
-static void newTag(void* self, OsmEntityType type, UTF8* key, UTF8* value) {
-     int keyIndex = simpleStringIndexOf(&(((osm2obm*)self)->keysIndex), key);
-     addBTag((osm2obm*)self, keyIndex, value);
+static void addDictionaryBTag(osm2obm* self, int key, int valueId) {
+    if(self->tags.capacity < self->tags.count + 1) {
+        growBTags(self, 1);
+    }
+    BTag* tag = self->tags.values + self->tags.count;
+    tag->key = -(key + 1);
+    memset(tag->value, 0, ATTRIBUTE_VALUE_LENGTH);
+    memcpy(tag->value, &valueId, sizeof(int));
+    self->tags.count++;
+}
+
+// Returns id of value in values dictionary, -1 if value is still too rare for it.
+static int dictionaryValueId(osm2obm* self, UTF8* value) {
+    int valueId = findSimpleStringIndexOf(&(self->valuesIndex), value);
+    if(valueId >= 0 || self->valuesIndexFixed) {
+        return valueId;
+    }
+    // Dictionary is also written as text index of lines, so values with line breaks stay inline.
+    if(!value[0] || utf8size(value) > DICTIONARY_VALUE_MAX_SIZE || strpbrk((const char*) value, "\r\n")) {
+        return -1;
+    }
+    int candidate = findSimpleStringIndexOf(&(self->valueCandidates), value);
+    if(candidate < 0) {
+        if(self->valueCandidates.valuesCount >= DICTIONARY_VALUE_CANDIDATES_LIMIT) {
+            return -1;
+        }
+        candidate = simpleStringIndexOf(&(self->valueCandidates), value);
+        if(candidate >= self->valueCandidateCountsCapacity) {
+            self->valueCandidateCountsCapacity = max(1024, self->valueCandidateCountsCapacity * 2);
+            self->valueCandidateCounts = realloc(self->valueCandidateCounts, sizeof(int) * self->valueCandidateCountsCapacity);
+        }
+        self->valueCandidateCounts[candidate] = 0;
+    }
+    if(++self->valueCandidateCounts[candidate] < DICTIONARY_VALUE_MIN_OCCURRENCES) {
+        return -1;
+    }
+    return simpleStringIndexOf(&(self->valuesIndex), value);
+}
+
+static void newTag(void* abstractSelf, OsmEntityType type, UTF8* key, UTF8* value) {
+    osm2obm* self = (osm2obm*)abstractSelf;
+    int keyIndex = simpleStringIndexOf(&(self->keysIndex), key);
+    int valueId = dictionaryValueId(self, value);
+    if(valueId >= 0) {
+        addDictionaryBTag(self, keyIndex, valueId);
+    } else {
+        addBTag(self, keyIndex, value);
+    }
 }
 
 static void newNode(void* self, OsmId id, Coordinate lat, Coordinate lon, OsmTimestamp timestamp) {
@@ -379,11 +431,9 @@ static void newRelationMember(void* self, OsmId ref, OsmEntityType type, UTF8* r
     addBRelationMember((osm2obm*)self, ref, type, roleIndex);
 }
 
-void initOsm2obmWithOutputDirectory(osm2obm* self, const char* outputDirectory, CountryPolygon* polygons, int polygonsCount, char compress) {
-    
+static void initOsm2obmReader(osm2obm* self) {
     initOsmStreamReader(&(self->reader), self);
     
-	self->compressed = compress;
     self->reader.newTag = newTag;
     self->reader.newNode = newNode;
     self->reader.newWayNode = newWayNode;
@@ -412,6 +462,16 @@ void initOsm2obmWithOutputDirectory(osm2obm* self, const char* outputDirectory,
     self->relations.capacity = 0;
     
     self->currentEntityType = OSM_ENTITY_NONE;
+    
+    initSimpleStringIndex(&(self->valueCandidates));
+    self->valueCandidateCounts = NULL;
+    self->valueCandidateCountsCapacity = 0;
+    self->valuesIndexFixed = 0;
+}
+
+void initOsm2obmWithOutputDirectory(osm2obm* self, const char* outputDirectory, CountryPolygon* polygons, int polygonsCount, char compress) {
+    initOsm2obmReader(self);
+	self->compressed = compress;
 	//printf("Initialize keys index...\n");
     initSimpleStringIndex(&(self->keysIndex));
 	//printf("Adding default keys...\n");
@@ -429,6 +489,8 @@ void initOsm2obmWithOutputDirectory(osm2obm* self, const char* outputDirectory,
 //    printf("CONTINUATION role: %i", );
    	//printf("Done.\n");
 
+    initSimpleStringIndex(&(self->valuesIndex));
+
     self->countries = malloc(sizeof(BCountry) * polygonsCount);
     self->countriesCount = polygonsCount;
     if(-1 == mkdir(outputDirectory, S_IRWXU) && errno != EEXIST) {  
@@ -470,6 +532,12 @@ void closeOsm2obm(osm2obm* self) {
         writeSimpleStringIndex(&(self->rolesIndex), rolesFile);
         fclose(keysFile);
         fclose(rolesFile);
+        writeSimpleStringIndexDictionary(&(self->keysIndex), "keys.dict", self->countries[c].outputDirectory);
+        writeSimpleStringIndexDictionary(&(self->rolesIndex), "roles.dict", self->countries[c].outputDirectory);
+        FILE* valuesFile = openFile("values.l", self->countries[c].outputDirectory, "w+", self->compressed);
+        writeSimpleStringIndex(&(self->valuesIndex), valuesFile);
+        fclose(valuesFile);
+        writeSimpleStringIndexDictionary(&(self->valuesIndex), "values.dict", self->countries[c].outputDirectory);
         
         FILE* nodesIndexFile = openFile("nodes.idx", self->countries[c].outputDirectory, "wb+", self->compressed);
         FILE* waysIndexFile = openFile("ways.idx", self->countries[c].outputDirectory, "wb+", self->compressed);
@@ -483,6 +551,10 @@ void closeOsm2obm(osm2obm* self) {
         fclose(relationsIndexFile);
     }    
     
+    clearSimpleStringIndex(&(self->valueCandidates));
+    free(self->valueCandidateCounts);
+    self->valueCandidateCounts = NULL;
+    self->valueCandidateCountsCapacity = 0;
     closeOsmStreamReader(&(self->reader));
 }
 
@@ -493,15 +565,437 @@ void convertOsm2ObmFromStdin(osm2obm* self) {
     readOsmFromStdin(&(self->reader));
 }
 
+#pragma mark osd2obm
+
+static void setBDeltaIndexNode(void* index, long id, long offset) {
+    setTree16Node((Tree16*) index, id, offset);
+}
+
+static void openBDeltaWriter(BDeltaWriter* self, const char* name, const char* indexName, const char* directory, size_t recordSize) {
+    self->recordSize = recordSize;
+    self->changesCount = 0;
+    initTree16(&(self->index));
+    FILE* indexFile = openFile(indexName, directory, "rb", NO_COMPRESS);
+    if(indexFile) {
+        forEachTree16FileNode(indexFile, setBDeltaIndexNode, &(self->index));
+        fclose(indexFile);
+    }
+    self->file = openFile(name, directory, "rb+", NO_COMPRESS);
+    if(!self->file) {
+        self->file = openFile(name, directory, "wb+", NO_COMPRESS);
+    }
+    fseek(self->file, 0, SEEK_END);
+    self->offset = ftell(self->file);
+    // Last entity of file takes one or more records with its id at the end of file.
+    self->lastId = 0;
+    self->lastOffset = self->offset;
+    while(self->lastOffset >= (long) recordSize) {
+        OsmId id;
+        fseek(self->file, self->lastOffset - recordSize, SEEK_SET);
+        if(!fread(&id, sizeof(OsmId), 1, self->file) || (self->lastOffset != self->offset && id != self->lastId)) {
+            break;
+        }
+        self->lastId = id;
+        self->lastOffset -= recordSize;
+    }
+    fseek(self->file, self->offset, SEEK_SET);
+}
+
+static void startBDeltaEntity(BDeltaWriter* self, OsmId id) {
+    if(self->offset > self->lastOffset && id == self->lastId) {
+        self->offset = self->lastOffset;
+        fseek(self->file, self->offset, SEEK_SET);
+    }
+    self->lastId = id;
+    self->lastOffset = self->offset;
+    setTree16Node(&(self->index), id, self->offset);
+    self->changesCount++;
+}
+
+static void deleteBDeltaEntity(BDeltaWriter* self, OsmId id) {
+    setTree16Node(&(self->index), id, OBM_DELETED_OFFSET);
+    self->changesCount++;
+}
+
+static void closeBDeltaWriter(BDeltaWriter* self, const char* indexName, const char* directory) {
+    fflush(self->file);
+    // Entity rewritten at the end may be shorter than its previous version.
+    if(ftruncate(fileno(self->file), self->offset)) {
+        fprintf(stderr, "Error truncating delta file: %i\n", errno);
+    }
+    fclose(self->file);
+    FILE* indexFile = openFile(indexName, directory, "wb+", NO_COMPRESS);
+    saveTree16ToFile(&(self->index), indexFile, 0, 0);
+    fclose(indexFile);
+    freeTree16(&(self->index));
+}
+
+// Changes write all way nodes and relation members, as base files are not checked for them.
+static char writeAllBWayNodes(osm2obm* self, int* current, FILE* file) {
+    int count = min(self->wayNodes.count - *current, WAY_NODES_COUNT);
+    fwrite(self->wayNodes.values + *current, sizeof(BWayNode), count, file);
+    for(int w = count; w < WAY_NODES_COUNT; w++) {
+        fwrite(&emptyWayNode, sizeof(BWayNode), 1, file);
+    }
+    *current += count;
+    return self->wayNodes.count > *current;
+}
+
+static char writeAllBRelationMembers(osm2obm* self, int* current, FILE* file) {
+    int count = min(self->relationMembers.count - *current, RELATION_MEMBERS_COUNT);
+    fwrite(self->relationMembers.values + *current, sizeof(BRelationMember), count, file);
+    for(int m = count; m < RELATION_MEMBERS_COUNT; m++) {
+        fwrite(&emptyRelationMember, sizeof(BRelationMember), 1, file);
+    }
+    *current += count;
+    return self->relationMembers.count > *current;
+}
+
+static void writeDeltaNode(void* abstractSelf) {
+    osd2obm* self = (osd2obm*)abstractSelf;
+    BDeltaWriter* delta = &(self->nodesDelta);
+    startBDeltaEntity(delta, self->base.node.id);
+    int currentTag = 0;
+    char tagsLeft = 1;
+    while(tagsLeft) {
+        fwrite(&(self->base.node), sizeof(NodeInfo), 1, delta->file);
+        tagsLeft = writeBTags(&(self->base), &currentTag, NODE_ATTRIBUTES_COUNT, delta->file);
+        delta->offset += sizeof(BNode);
+    }
+    self->base.tags.count = 0;
+}
+
+static void writeDeltaWay(void* abstractSelf) {
+    osd2obm* self = (osd2obm*)abstractSelf;
+    BDeltaWriter* delta = &(self->waysDelta);
+    startBDeltaEntity(delta, self->base.way.id);
+    int currentTag = 0;
+    int currentNode = 0;
+    char tagsLeft = 1;
+    char nodesLeft = 1;
+    while(tagsLeft || nodesLeft) {
+        fwrite(&(self->base.way), sizeof(WayInfo), 1, delta->file);
+        tagsLeft = writeBTags(&(self->base), &currentTag, WAY_ATTRIBUTES_COUNT, delta->file);
+        nodesLeft = writeAllBWayNodes(&(self->base), &currentNode, delta->file);
+        delta->offset += sizeof(BWay);
+    }
+    self->base.tags.count = 0;
+    self->base.wayNodes.count = 0;
+}
+
+static void writeDeltaRelation(void* abstractSelf) {
+    osd2obm* self = (osd2obm*)abstractSelf;
+    BDeltaWriter* delta = &(self->relationsDelta);
+    startBDeltaEntity(delta, self->base.relation.id);
+    int currentTag = 0;
+    int currentMember = 0;
+    char tagsLeft = 1;
+    char membersLeft = 1;
+    while(tagsLeft || membersLeft) {
+        fwrite(&(self->base.relation), sizeof(RelationInfo), 1, delta->file);
+        tagsLeft = writeBTags(&(self->base), &currentTag, RELATION_ATTRIBUTES_COUNT, delta->file);
+        membersLeft = writeAllBRelationMembers(&(self->base), &currentMember, delta->file);
+        delta->offset += sizeof(BRelation);
+    }
+    self->base.tags.count = 0;
+    self->base.relationMembers.count = 0;
+}
+
+static void deleteDeltaNode(void* abstractSelf) {
+    osd2obm* self = (osd2obm*)abstractSelf;
+    deleteBDeltaEntity(&(self->nodesDelta), self->base.node.id);
+    self->base.tags.count = 0;
+}
+
+static void deleteDeltaWay(void* abstractSelf) {
+    osd2obm* self = (osd2obm*)abstractSelf;
+    deleteBDeltaEntity(&(self->waysDelta), self->base.way.id);
+    self->base.tags.count = 0;
+    self->base.wayNodes.count = 0;
+}
+
+static void deleteDeltaRelation(void* abstractSelf) {
+    osd2obm* self = (osd2obm*)abstractSelf;
+    deleteBDeltaEntity(&(self->relationsDelta), self->base.relation.id);
+    self->base.tags.count = 0;
+    self->base.relationMembers.count = 0;
+}
+
+// Strings are copied from dictionary, as it is rewritten on close, and read by lines only from maps that have none.
+static void readStringIndex(SimpleStringIndex* index, const char* dictionaryName, const char* name, const char* directory) {
+    SimpleStringIndex dictionary;
+    if(!mapSimpleStringIndexDictionary(&dictionary, dictionaryName, directory)) {
+        initSimpleStringIndex(index);
+        for(int i = 0; i < dictionary.valuesCount; i++) {
+            simpleStringIndexOf(index, dictionary.values[i]);
+        }
+        clearSimpleStringIndex(&dictionary);
+        return;
+    }
+    FILE* file = openFile(name, directory, "r", AUTO_COMPRESS);
+    if(file) {
+        initSimpleStringIndexFromFile(index, file);
+        fclose(file);
+    } else {
+        initSimpleStringIndex(index);
+    }
+}
+
+void initOsd2Obm(osd2obm* self, const char* directory) {
+    osm2obm* base = &(self->base);
+    initOsm2obmReader(base);
+    // Plain osm file is applied as if all its entities were created.
+    for(OsmChangeType change = OSM_CHANGE_NONE; change < OSM_CHANGE_DELETE; change++) {
+        base->reader.finishNode[change] = writeDeltaNode;
+        base->reader.finishWay[change] = writeDeltaWay;
+        base->reader.finishRelation[change] = writeDeltaRelation;
+    }
+    base->reader.finishNode[OSM_CHANGE_DELETE] = deleteDeltaNode;
+    base->reader.finishWay[OSM_CHANGE_DELETE] = deleteDeltaWay;
+    base->reader.finishRelation[OSM_CHANGE_DELETE] = deleteDeltaRelation;
+    base->compressed = NO_COMPRESS;
+    base->countries = NULL;
+    base->countriesCount = 0;
+    
+    readStringIndex(&(base->keysIndex), "keys.dict", "keys.l", directory);
+    readStringIndex(&(base->rolesIndex), "roles.dict", "roles.l", directory);
+    // Values may contain line breaks, so they are mapped from dictionary rather than read by lines. Maps written
+    // before values dictionary have all values inline and leave index empty.
+    mapSimpleStringIndexDictionary(&(base->valuesIndex), "values.dict", directory);
+    base->valuesIndexFixed = 1;
+    if(!base->keysIndex.valuesCount) {
+        fprintf(stderr, "Error reading keys of map %s\n", directory);
+    }
+    
+    self->directory = directory;
+    openBDeltaWriter(&(self->nodesDelta), "nodes.delta.obm", "nodes.delta.idx", directory, sizeof(BNode));
+    openBDeltaWriter(&(self->waysDelta), "ways.delta.obm", "ways.delta.idx", directory, sizeof(BWay));
+    openBDeltaWriter(&(self->relationsDelta), "relations.delta.obm", "relations.delta.idx", directory, sizeof(BRelation));
+}
+
+void convertOsd2ObmFromFile(osd2obm* self, const char *filename) {
+    readOsmFromFile(&(self->base.reader), filename);
+}
+
+void convertOsd2ObmFromStdin(osd2obm* self) {
+    readOsmFromStdin(&(self->base.reader));
+}
+
+void closeOsd2Obm(osd2obm* self) {
+    osm2obm* base = &(self->base);
+    printf("%i nodes, %i ways and %i relations changed.\n", self->nodesDelta.changesCount, self->waysDelta.changesCount, self->relationsDelta.changesCount);
+    closeBDeltaWriter(&(self->nodesDelta), "nodes.delta.idx", self->directory);
+    closeBDeltaWriter(&(self->waysDelta), "ways.delta.idx", self->directory);
+    closeBDeltaWriter(&(self->relationsDelta), "relations.delta.idx", self->directory);
+    
+    FILE* keysFile = openFile("keys.l", self->directory, "w+", AUTO_COMPRESS);
+    FILE* rolesFile = openFile("roles.l", self->directory, "w+", AUTO_COMPRESS);
+    writeSimpleStringIndex(&(base->keysIndex), keysFile);
+    writeSimpleStringIndex(&(base->rolesIndex), rolesFile);
+    fclose(keysFile);
+    fclose(rolesFile);
+    writeSimpleStringIndexDictionary(&(base->keysIndex), "keys.dict", self->directory);
+    writeSimpleStringIndexDictionary(&(base->rolesIndex), "roles.dict", self->directory);
+    
+    clearSimpleStringIndex(&(base->keysIndex));
+    clearSimpleStringIndex(&(base->rolesIndex));
+    clearSimpleStringIndex(&(base->valuesIndex));
+    clearSimpleStringIndex(&(base->valueCandidates));
+    free(base->tags.values);
+    free(base->wayNodes.values);
+    free(base->relationMembers.values);
+    closeOsmStreamReader(&(base->reader));
+}
+
+static const char* obmFileNames[] = {
+    "nodes.obm", "ways.obm", "relations.obm", "nodes.idx", "ways.idx", "relations.idx",
+    "keys.l", "roles.l", "values.l", "keys.dict", "roles.dict", "values.dict", NULL
+};
+
+static const char* obmDeltaFileNames[] = {
+    "nodes.delta.obm", "ways.delta.obm", "relations.delta.obm", "nodes.delta.idx", "ways.delta.idx", "relations.delta.idx", NULL
+};
+
+static void removeFileInDirectory(const char* name, const char* directory) {
+    char* fileName = fullFileName(name, directory);
+    remove(fileName);
+    free(fileName);
+}
+
+// Map is written anew from its reader, which merges base and delta files, to temporary directory
+// next to it, and its files replace base files. Compressed base files are replaced with plain ones.
+int compactObm(const char* directory) {
+    char* temporaryDirectory = malloc(strlen(directory) + sizeof(".compacting"));
+    strcpy(temporaryDirectory, directory);
+    strcat(temporaryDirectory, ".compacting");
+    
+    int polygonsCount;
+    CountryPolygon* polygons = readPolygons(NULL, &polygonsCount, "FULL");
+    osm2obm writer;
+    initOsm2obmWithOutputDirectory(&writer, temporaryDirectory, polygons, polygonsCount, NO_COMPRESS);
+    
+    OsmDbReader* reader = newObmReader(directory, 0);
+    Node* node;
+    while((node = nextNode(reader))) {
+        newNode(&writer, node->info.id, node->info.lat, node->info.lon, node->info.timestamp);
+        for(int t = 0; t < node->tags.count; t++) {
+            newTag(&writer, OSM_ENTITY_NODE, node->tags.values[t].key, node->tags.values[t].value);
+        }
+        writeNode(&writer);
+    }
+    Way* way;
+    while((way = nextWay(reader))) {
+        newWay(&writer, way->info.id, way->info.timestamp);
+        for(int t = 0; t < way->tags.count; t++) {
+            newTag(&writer, OSM_ENTITY_WAY, way->tags.values[t].key, way->tags.values[t].value);
+        }
+        for(int n = 0; n < way->wayNodes.count; n++) {
+            newWayNode(&writer, way->wayNodes.values[n].id);
+        }
+        writeWay(&writer);
+    }
+    Relation* relation;
+    while((relation = nextRelation(reader))) {
+        newRelation(&writer, relation->info.id, relation->info.timestamp);
+        for(int t = 0; t < relation->tags.count; t++) {
+            newTag(&writer, OSM_ENTITY_RELATION, relation->tags.values[t].key, relation->tags.values[t].value);
+        }
+        for(int m = 0; m < relation->relationMembers.count; m++) {
+            RelationMemberInfo* member = relation->relationMembers.values + m;
+            newRelationMember(&writer, member->ref, member->type, member->role);
+        }
+        writeRelation(&writer);
+    }
+    closeOsmDbReader(reader);
+    closeOsm2obm(&writer);
+    
+    char* writtenDirectory = fullFileName(polygons[0].name, temporaryDirectory);
+    int result = 0;
+    for(int f = 0; obmFileNames[f]; f++) {
+        char* writtenName = fullFileName(obmFileNames[f], writtenDirectory);
+        char* name = fullFileName(obmFileNames[f], directory);
+        if(rename(writtenName, name)) {
+            fprintf(stderr, "Error replacing %s: %i\n", name, errno);
+            result = 1;
+        }
+        free(writtenName);
+        free(name);
+        char* compressedName = malloc(strlen(obmFileNames[f]) + sizeof(".gz"));
+        strcpy(compressedName, obmFileNames[f]);
+        strcat(compressedName, ".gz");
+        removeFileInDirectory(compressedName, directory);
+        free(compressedName);
+    }
+    if(!result) {
+        for(int f = 0; obmDeltaFileNames[f]; f++) {
+            removeFileInDirectory(obmDeltaFileNames[f], directory);
+        }
+    }
+    rmdir(writtenDirectory);
+    rmdir(temporaryDirectory);
+    free(writtenDirectory);
+    free(temporaryDirectory);
+    free(polygons);
+    return result;
+}
+
 #pragma mark Read obm
 
+static void addBDeltaEntry(void* abstractSelf, long id, long offset) {
+    BDelta* self = (BDelta*) abstractSelf;
+    if(self->count >= self->capacity) {
+        self->capacity = max(256, self->capacity * 2);
+        self->entries = realloc(self->entries, sizeof(BDeltaEntry) * self->capacity);
+    }
+    self->entries[self->count].id = id;
+    self->entries[self->count].offset = offset;
+    self->count++;
+}
+
+static int compareBDeltaEntries(const void* e1, const void* e2) {
+    OsmId id1 = ((const BDeltaEntry*)e1)->id;
+    OsmId id2 = ((const BDeltaEntry*)e2)->id;
+    return id1 < id2 ? -1 : (id1 > id2 ? 1 : 0);
+}
+
+// Map which was never updated has no delta files and empty delta.
+static void initBDelta(BDelta* self, const char* name, const char* indexName, const char* directory) {
+    memset(self, 0, sizeof(BDelta));
+    FILE* indexFile = openFile(indexName, directory, "rb", NO_COMPRESS);
+    if(!indexFile) {
+        return;
+    }
+    self->file = openFile(name, directory, "rb", NO_COMPRESS);
+    forEachTree16FileNode(indexFile, addBDeltaEntry, self);
+    fclose(indexFile);
+    qsort(self->entries, self->count, sizeof(BDeltaEntry), compareBDeltaEntries);
+}
+
+static void clearBDelta(BDelta* self) {
+    if(self->file) {
+        fclose(self->file);
+    }
+    free(self->entries);
+}
+
+static BDeltaEntry* findBDeltaEntry(BDelta* self, OsmId id) {
+    if(!self->count) {
+        return NULL;
+    }
+    BDeltaEntry key;
+    key.id = id;
+    return bsearch(&key, self->entries, self->count, sizeof(BDeltaEntry), compareBDeltaEntries);
+}
+
+// Finds file with entity and its offset in it. Returns NULL if entity is not in map or was deleted.
+static FILE* locateBEntity(BDelta* delta, Tree16OnFile* index, FILE* baseFile, OsmId id, long* offset) {
+    BDeltaEntry* entry = findBDeltaEntry(delta, id);
+    *offset = entry ? entry->offset : findObjectOffset(index, id);
+    if(*offset < 0) {
+        return NULL;
+    }
+    return entry ? delta->file : baseFile;
+}
+
+// Records of all entity types start with id of entity. Returns 0 at the end of file.
+static int peekBId(FILE* file, OsmId* id) {
+    if(!fread(id, sizeof(OsmId), 1, file)) {
+        return 0;
+    }
+    fseek(file, -(long) sizeof(OsmId), SEEK_CUR);
+    return 1;
+}
+
+// Returns file to read next entity from in ascending order of ids: base file, or delta file positioned
+// at changed entity. Base records of changed and deleted entities are skipped.
+static FILE* nextBEntityFile(BDelta* delta, FILE* baseFile, size_t recordSize) {
+    while(delta->current < delta->count) {
+        BDeltaEntry* entry = delta->entries + delta->current;
+        OsmId baseId;
+        int hasBase = peekBId(baseFile, &baseId);
+        if(hasBase && baseId < entry->id) {
+            return baseFile;
+        }
+        while(hasBase && baseId == entry->id) {
+            fseek(baseFile, recordSize, SEEK_CUR);
+            hasBase = peekBId(baseFile, &baseId);
+        }
+        delta->current++;
+        if(entry->offset != OBM_DELETED_OFFSET) {
+            fseek(delta->file, entry->offset, SEEK_SET);
+            return delta->file;
+        }
+    }
+    return baseFile;
+}
+
 void closeObm(void* abstractSelf) {
     obm* self = (obm*) abstractSelf;
     if(self->cacheNodes) {
-        clearNodes(&(self->nodes));
-    } else {
-        fclose(self->nodesFile);    
+        free(self->cachedNodeIds);
+        free(self->cachedNodeCoordinates);
     }
+    fclose(self->nodesFile);
 
     fclose(self->waysFile);
     fclose(self->relationsFile);
@@ -509,41 +1003,61 @@ void closeObm(void* abstractSelf) {
     freeTree16WithFile(&(self->nodesIndex));
     freeTree16WithFile(&(self->waysIndex));
     freeTree16WithFile(&(self->relationsIndex));
+    clearBDelta(&(self->nodesDelta));
+    clearBDelta(&(self->waysDelta));
+    clearBDelta(&(self->relationsDelta));
+    free(self->keys);
+    free(self->keyIds);
+    free(self->values);
+    free(self->valueIds);
+    clearSimpleStringIndex(&(self->keysIndex));
+    clearSimpleStringIndex(&(self->rolesIndex));
+    clearSimpleStringIndex(&(self->valuesIndex));
+    for(int w = 0; w < OBM_WAYS_BLOCK_SIZE; w++) {
+        clearPlainTags(&(self->waysBlock[w].tags));
+        clearNodesInfo(&(self->waysBlock[w].wayNodes));
+    }
+    free(self->waysBlock);
+    clearNodesInfo(&(self->blockNodes));
+    clearArena(&(self->arena));
 }
 
-static int compareNodes(const void * a, const void * b) {
-    return ((Node*)a)->info.id - ((Node*)b)->info.id;
+static int compareNodeInfoIds(const void* n1, const void* n2) {
+    OsmId id1 = ((const NodeInfo*)n1)->id;
+    OsmId id2 = ((const NodeInfo*)n2)->id;
+    return id1 < id2 ? -1 : (id1 > id2 ? 1 : 0);
 }
 
-static void appendBTags(PlainTags* tags, BTag* rawTags, int count, SimpleStringIndex* keysIndex) {
+// Not interned values are copied to arena if it is not NULL, and to heap otherwise.
+static void appendBTags(obm* self, PlainTags* tags, BTag* rawTags, int count, Arena* arena) {
     for(int a = 0; a < count; a++) {
         BTag tag = rawTags[a];
         //printf("Raw tag %i.\n", a);
         //printf("%i = %s\n", rawTags[a].key, rawTags[a].value);
         if(tag.key == ATTRIBUTE_CONTINUATION) {
-            int i = tags->count - 1;
-            tags->values[i].value = utf8cat(tags->values[i].value, tag.value);
+            appendToPlainTagValueInArena(tags->values + tags->count - 1, tag.value, arena);
+        } else if(tag.key < 0) {
+            int key = -tag.key - 1;
+            int valueId;
+            memcpy(&valueId, tag.value, sizeof(int));
+            addInternedPlainTag(tags, self->keyIds[key], self->keys[key], self->valueIds[valueId], self->values[valueId]);
         } else {
             if(tag.key != UNUSED_ATTRIBUTE) {
-                ensurePlainTagsCapacityForNNewElements(tags, 1);
-                tags->values[tags->count].key = utf8dup(simpleStringValuesAtIndex(keysIndex,tag.key));
-                tags->values[tags->count].value = utf8dup(tag.value);
-                
-                tags->count++;
+                addPlainTagWithKeyIdInArena(tags, self->keyIds[tag.key], self->keys[tag.key], tag.value, arena);
             }
         }
     }
 } 
 
-static void readBTags(obm* self, FILE* file, int count, PlainTags* tags) {
+static void readBTags(obm* self, FILE* file, int count, PlainTags* tags, Arena* arena) {
     //printf("Reading tags...\n");
     fread(self->tags, sizeof(BTag), count, file);
     //printf("Done.\n");
     //printf("Appending tags...\n");
-    appendBTags(tags, self->tags, count, &(self->keysIndex));
+    appendBTags(self, tags, self->tags, count, arena);
 }
 
-static Node* readNodeFromFile(obm* self, Node* node, FILE* nodesFile) {
+static Node* readNodeFromFile(obm* self, Node* node, FILE* nodesFile, Arena* arena) {
     NodeInfo nodeInfo;
     //printf("Reading node info...\n");
     if(!fread(&(node->info), sizeof(NodeInfo), 1, nodesFile)) {
@@ -553,7 +1067,7 @@ static Node* readNodeFromFile(obm* self, Node* node, FILE* nodesFile) {
     int readed;
     removeAllPlainTags(&(node->tags));
     do {
-        readBTags(self, nodesFile, NODE_ATTRIBUTES_COUNT, &(node->tags));
+        readBTags(self, nodesFile, NODE_ATTRIBUTES_COUNT, &(node->tags), arena);
         //printf("Reading next part...\n");
         readed = fread(&nodeInfo, sizeof(NodeInfo), 1, nodesFile);
     } while (readed && nodeInfo.id == node->info.id);
@@ -565,13 +1079,94 @@ static Node* readNodeFromFile(obm* self, Node* node, FILE* nodesFile) {
     return node;
 }
 
+// Fills subtree of Eytzinger layout rooted at k with sorted nodes starting from n in order. Returns next node.
+static int layoutCachedBNodes(obm* self, NodesInfo* nodes, int n, int k) {
+    if(k > self->cachedNodesCount) {
+        return n;
+    }
+    n = layoutCachedBNodes(self, nodes, n, 2 * k);
+    self->cachedNodeIds[k] = nodes->values[n].id;
+    self->cachedNodeCoordinates[k].lat = nodes->values[n].lat;
+    self->cachedNodeCoordinates[k].lon = nodes->values[n].lon;
+    return layoutCachedBNodes(self, nodes, n + 1, 2 * k + 1);
+}
+
+// Only ids and coordinates of nodes are read, node with many tags takes several records with the same id.
+static void cacheBNodes(obm* self) {
+    printf("Caching nodes...\n");
+    NodesInfo nodes;
+    initNodesInfo(&nodes);
+    BNode record;
+    char sorted = 1;
+    while(fread(&record, sizeof(BNode), 1, self->nodesFile)) {
+        if(nodes.count && nodes.values[nodes.count - 1].id >= record.info.id) {
+            if(nodes.values[nodes.count - 1].id == record.info.id) {
+                continue;
+            }
+            sorted = 0;
+        }
+        addToNodesInfo(&nodes, record.info);
+    }
+    fseek(self->nodesFile, 0, SEEK_SET);
+    // Changed nodes replace base ones, deleted get id 0 and are dropped with duplicates.
+    int baseCount = nodes.count;
+    for(int d = 0; d < self->nodesDelta.count; d++) {
+        BDeltaEntry* entry = self->nodesDelta.entries + d;
+        NodeInfo* node = bsearch(&(entry->id), nodes.values, baseCount, sizeof(NodeInfo), compareNodeInfoIds);
+        if(entry->offset == OBM_DELETED_OFFSET) {
+            if(node) {
+                node->id = 0;
+            }
+        } else if(!fseek(self->nodesDelta.file, entry->offset, SEEK_SET) && fread(&record, sizeof(BNode), 1, self->nodesDelta.file)) {
+            if(node) {
+                *node = record.info;
+            } else {
+                addToNodesInfo(&nodes, record.info);
+            }
+        }
+        sorted = 0;
+    }
+    if(!sorted) {
+        qsort(nodes.values, nodes.count, sizeof(NodeInfo), compareNodeInfoIds);
+        int distinct = 0;
+        for(int n = 0; n < nodes.count; n++) {
+            if(nodes.values[n].id && (!distinct || nodes.values[n].id != nodes.values[distinct - 1].id)) {
+                nodes.values[distinct++] = nodes.values[n];
+            }
+        }
+        nodes.count = distinct;
+    }
+    self->cachedNodesCount = nodes.count;
+    // Aligned to cache line, so ids of each subtree searched by findCachedBNode start at its beginning.
+    void* ids;
+    self->cachedNodeIds = posix_memalign(&ids, 64, sizeof(OsmId) * (nodes.count + 1)) ? NULL : ids;
+    self->cachedNodeCoordinates = malloc(sizeof(BNodeCoordinates) * (nodes.count + 1));
+    layoutCachedBNodes(self, &nodes, 0, 1);
+    clearNodesInfo(&nodes);
+    printf("%i nodes in memory.\n", self->cachedNodesCount);
+}
+
+// Returns place of node in cache, 0 if node is not cached. Ids of 16 nodes four levels below k are at 16k,
+// 64 bytes of 4 byte ids in one aligned cache line, so it is prefetched while upper levels are compared.
+// Wider ids would take more lines, last of them is prefetched too.
+static int findCachedBNode(obm* self, OsmId id) {
+    const OsmId* ids = self->cachedNodeIds;
+    int k = 1;
+    while(k <= self->cachedNodesCount) {
+        __builtin_prefetch(ids + 16 * k);
+        if(sizeof(OsmId) * 16 > 64) {
+            __builtin_prefetch(ids + 16 * k + 15);
+        }
+        k = 2 * k + (ids[k] < id);
+    }
+    // Path ends with right turns after last node which is not less than id, they are shifted out.
+    k >>= __builtin_ffs(~k);
+    return k && ids[k] == id ? k : 0;
+}
+
 void initObm(obm* self, const char* directory, int cacheNodes) {
-    FILE* nodesFile = openFile("nodes.obm", directory, "rb+", AUTO_COMPRESS);
-    
+    self->nodesFile = openFile("nodes.obm", directory, "rb+", AUTO_COMPRESS);
     self->cacheNodes = cacheNodes;
-    if(!self->cacheNodes) {
-        self->nodesFile = nodesFile;    
-    }
 
     self->waysFile = openFile("ways.obm", directory, "rb+", AUTO_COMPRESS);
     self->relationsFile = openFile("relations.obm", directory, "rb+", AUTO_COMPRESS);
@@ -579,10 +1174,8 @@ void initObm(obm* self, const char* directory, int cacheNodes) {
     initTree16WithFile(&(self->nodesIndex), openFile("nodes.idx", directory, "rb+", AUTO_COMPRESS));
     initTree16WithFile(&(self->waysIndex), openFile("ways.idx", directory, "rb+", AUTO_COMPRESS));
     initTree16WithFile(&(self->relationsIndex), openFile("relations.idx", directory, "rb+", AUTO_COMPRESS));
-    if(!self->cacheNodes) {
-        self->currentNode = calloc(sizeof(Node), 1);
-        initPlainTags(&(self->currentNode->tags));
-    }
+    self->currentNode = calloc(sizeof(Node), 1);
+    initPlainTags(&(self->currentNode->tags));
     self->currentWay.tags.values = NULL;
     self->currentWay.tags.count = 0;
     self->currentRelation.tags.values = NULL;
@@ -593,18 +1186,50 @@ void initObm(obm* self, const char* directory, int cacheNodes) {
     self->currentRelation.relationMembers.values = NULL;
     self->currentRelation.relationMembers.count = 0;
     
-    FILE* keysFile = openFile("keys.l", directory, "r+", AUTO_COMPRESS);
-    initSimpleStringIndexFromFile(&(self->keysIndex), keysFile);
-    fclose(keysFile);
+    initArena(&(self->arena));
+    self->waysBlock = calloc(sizeof(Way), OBM_WAYS_BLOCK_SIZE);
+    self->waysBlockCount = 0;
+    self->waysBlockCurrent = 0;
+    initNodesInfo(&(self->blockNodes));
     
-    FILE* rolesFile = openFile("roles.l", directory, "r+", AUTO_COMPRESS);
-    initSimpleStringIndexFromFile(&(self->rolesIndex), rolesFile);
-    fclose(rolesFile);
+    // Maps written before dictionaries have only text indexes.
+    if(mapSimpleStringIndexDictionary(&(self->keysIndex), "keys.dict", directory)) {
+        FILE* keysFile = openFile("keys.l", directory, "r+", AUTO_COMPRESS);
+        initSimpleStringIndexFromFile(&(self->keysIndex), keysFile);
+        fclose(keysFile);
+    }
+    self->keys = malloc(sizeof(UTF8*) * self->keysIndex.valuesCount);
+    self->keyIds = malloc(sizeof(TagStringId) * self->keysIndex.valuesCount);
+    for(int k = 0; k < self->keysIndex.valuesCount; k++) {
+        UTF8* key = self->keysIndex.values[k];
+        self->keyIds[k] = internTagString(utf8equal(key, UTF8_CAST "EMPTY_STRING") ? UTF8_CAST "" : key, self->keys + k);
+    }
+    
+    if(mapSimpleStringIndexDictionary(&(self->rolesIndex), "roles.dict", directory)) {
+        FILE* rolesFile = openFile("roles.l", directory, "r+", AUTO_COMPRESS);
+        initSimpleStringIndexFromFile(&(self->rolesIndex), rolesFile);
+        fclose(rolesFile);
+    }
+
+    // Maps written before values dictionary have all values inline.
+    if(mapSimpleStringIndexDictionary(&(self->valuesIndex), "values.dict", directory)) {
+        FILE* valuesFile = openFile("values.l", directory, "r+", AUTO_COMPRESS);
+        if(valuesFile) {
+            initSimpleStringIndexFromFile(&(self->valuesIndex), valuesFile);
+            fclose(valuesFile);
+        }
+    }
+    // Dictionary values are common by construction, so they are all interned.
+    self->values = malloc(sizeof(UTF8*) * self->valuesIndex.valuesCount);
+    self->valueIds = malloc(sizeof(TagStringId) * self->valuesIndex.valuesCount);
+    for(int v = 0; v < self->valuesIndex.valuesCount; v++) {
+        self->valueIds[v] = internTagString(self->valuesIndex.values[v], self->values + v);
+    }
 
     
     self->tags = malloc(sizeof(BTag)* max(NODE_ATTRIBUTES_COUNT, max(WAY_ATTRIBUTES_COUNT, RELATION_ATTRIBUTES_COUNT)));
 
-    if(!nodesFile) {
+    if(!self->nodesFile) {
         fprintf(stderr, "Error opening nodes file\n");
     }
         
@@ -625,106 +1250,79 @@ void initObm(obm* self, const char* directory, int cacheNodes) {
         fprintf(stderr, "Error opening relations index file\n");
     }
     
-    if(self->cacheNodes) {
-    printf("Caching nodes...\n");
-    initNodes(&(self->nodes));
-    ensureNodesCapacityForNNewElements(&(self->nodes), 1);
-    initPlainTags(&(self->nodes.values->tags));
-    while(readNodeFromFile(self, self->nodes.values + self->nodes.count, nodesFile)) {
-        self->nodes.count++;
-        ensureNodesCapacityForNNewElements(&(self->nodes), 1);
-        initPlainTags(&((self->nodes.values + self->nodes.count)->tags));
-    }
-    printf("%i nodes in memory.\n", self->nodes.count);
-    qsort(self->nodes.values, self->nodes.count, sizeof(Node), compareNodes);
-    self->currentNode = self->nodes.values;
-        
-    }
+    initBDelta(&(self->nodesDelta), "nodes.delta.obm", "nodes.delta.idx", directory);
+    initBDelta(&(self->waysDelta), "ways.delta.obm", "ways.delta.idx", directory);
+    initBDelta(&(self->relationsDelta), "relations.delta.obm", "relations.delta.idx", directory);
     
-}
-
-
-static Node* readCachedNode(obm* self, Node* node) {
-    if(self->currentNode) {
-        if(node != self->currentNode) {
-            node->info.id = self->currentNode->info.id;
-            node->info.lat = self->currentNode->info.lat;
-            node->info.lon = self->currentNode->info.lon;
-            node->tags.values = self->currentNode->tags.values;
-            node->tags.count = self->currentNode->tags.count;
-            node->tags.capacity = self->currentNode->tags.capacity;
-        }
-        if(self->currentNode - self->nodes.values >= self->nodes.count) {
-            self->currentNode = NULL;
-        } else {
-            self->currentNode++;    
-        }
-        return node;
-    } else {
-        return NULL;
-    }
-}
-
-static Node* readNode(obm* self, Node* node) {
-    if(self->cacheNodes) {
-        return readCachedNode(self, node);
+    if(self->cacheNodes && self->nodesFile) {
+        cacheBNodes(self);
     }
-    return readNodeFromFile(self, node, self->nodesFile);
 }
 
-static Node* bNodeWithIdCached(void* self, OsmId id) {
-    Node* originalNode = ((obm*)self)->currentNode;
-    ((obm*)self)->currentNode = (Node*)bsearch(&id, ((obm*)self)->nodes.values, ((obm*)self)->nodes.count, sizeof(Node), compareNodes);
-    Node* node = NULL;
-    if(((obm*)self)->currentNode) {
-        node = calloc(sizeof(Node), 1);
-        readNode(((obm*)self), node);
-    } else {
-        fprintf(stderr, "Node %i was not found.\n", id);
+// Nodes are read from file even when they are cached, as their tags are not.
+static Node* bNodeWithId(void* abstractSelf, OsmId id) {
+    obm* self = (obm*)abstractSelf;
+    long offset;
+    FILE* file = locateBEntity(&(self->nodesDelta), &(self->nodesIndex), self->nodesFile, id, &offset);
+    if(!file) {
+        return NULL;
     }
-    ((obm*)self)->currentNode = originalNode;
-    return node;
-}
-
-
-static Node* bNodeWithIdNotCached(void* self, OsmId id) {
-    long offset = findObjectOffset(&(((obm*)self)->nodesIndex), id);
-    long oldOffset = ftell(((obm*)self)->nodesFile);
-    fseek(((obm*)self)->nodesFile, offset, SEEK_SET);
+    long oldOffset = ftell(file);
+    fseek(file, offset, SEEK_SET);
     Node* node = calloc(sizeof(Node), 1);
-    if(!readNode(((obm*)self), node)) {
+    if(!readNodeFromFile(self, node, file, &(self->arena))) {
         free(node);
         node = NULL;
     }
-    fseek(((obm*)self)->nodesFile, oldOffset, SEEK_SET);
+    fseek(file, oldOffset, SEEK_SET);
     return node;
 }
 
-
-static Node* bNodeWithId(void* self, OsmId id) {
-    if(((obm*)self)->cacheNodes) {
-        return bNodeWithIdCached(self, id);
+// Reads first record of node, which has its coordinates, keeping position in its file.
+static int readBNodeRecord(obm* self, OsmId id, BNode* record) {
+    long offset;
+    FILE* file = locateBEntity(&(self->nodesDelta), &(self->nodesIndex), self->nodesFile, id, &offset);
+    if(!file) {
+        return 0;
     }
-    return bNodeWithIdNotCached(self, id);
+    long oldOffset = ftell(file);
+    int found = !fseek(file, offset, SEEK_SET) && fread(record, sizeof(BNode), 1, file) && record->info.id == id;
+    fseek(file, oldOffset, SEEK_SET);
+    return found;
 }
 
 
-static void readBWayNodes(obm* self, Way* way) {
+// Finds coordinates of way node without reading its tags. Returns 0 if node is not found.
+static int lookupBNodeCoordinates(obm* self, OsmId id, Coordinate* lat, Coordinate* lon) {
+    if(self->cacheNodes) {
+        int k = findCachedBNode(self, id);
+        if(k) {
+            *lat = self->cachedNodeCoordinates[k].lat;
+            *lon = self->cachedNodeCoordinates[k].lon;
+        }
+        return k;
+    }
+    BNode record;
+    int found = readBNodeRecord(self, id, &record);
+    if(found) {
+        *lat = record.info.lat;
+        *lon = record.info.lon;
+    }
+    return found;
+}
+
+// Coordinates of way nodes are left for resolveBWayNodes unless resolve is set.
+static void readBWayNodes(obm* self, FILE* file, Way* way, char resolve) {
     BWayNode nodes[WAY_NODES_COUNT];
-    fread(nodes, sizeof(BWayNode), WAY_NODES_COUNT, self->waysFile);
+    fread(nodes, sizeof(BWayNode), WAY_NODES_COUNT, file);
     for(int n=0;n<WAY_NODES_COUNT;n++) {
         if(nodes[n].ref) {
-            if(way->wayNodes.capacity < way->wayNodes.count + 1) {
-                way->wayNodes.capacity += WAY_NODES_COUNT;
-                way->wayNodes.values = realloc(way->wayNodes.values, sizeof(NodeInfo)* way->wayNodes.capacity);
-            }
-            way->wayNodes.values[way->wayNodes.count].id = nodes[n].ref;
-            Node* node = bNodeWithId(self, nodes[n].ref);
-            if(node) {
-                way->wayNodes.values[way->wayNodes.count].lat = node->info.lat;
-                way->wayNodes.values[way->wayNodes.count].lon = node->info.lon;
-                free(node);                
-            } else {
+            ensureNodesInfoCapacityForNNewElements(&(way->wayNodes), 1);
+            NodeInfo* wayNode = way->wayNodes.values + way->wayNodes.count;
+            wayNode->id = nodes[n].ref;
+            wayNode->lat = 0;
+            wayNode->lon = 0;
+            if(resolve && !lookupBNodeCoordinates(self, wayNode->id, &(wayNode->lat), &(wayNode->lon))) {
                 fprintf(stderr, "Node %li was not found.\n", nodes[n].ref);
             }
             way->wayNodes.count++;
@@ -732,29 +1330,28 @@ static void readBWayNodes(obm* self, Way* way) {
     }
 }
 
-static void readBRelationMembers(obm* self, Relation* relation) {
+static void readBRelationMembers(obm* self, FILE* file, Relation* relation) {
     BRelationMember members[RELATION_MEMBERS_COUNT];
-    fread(members, sizeof(BRelationMember), RELATION_MEMBERS_COUNT, self->relationsFile);
+    fread(members, sizeof(BRelationMember), RELATION_MEMBERS_COUNT, file);
     for(int m=0;m<RELATION_MEMBERS_COUNT;m++) {
         if(members[m].role != UNUSED_ATTRIBUTE) {
-            if(relation->relationMembers.capacity < relation->relationMembers.count + 1) {
-                relation->relationMembers.capacity += RELATION_MEMBERS_COUNT;
-                relation->relationMembers.values = realloc(relation->relationMembers.values, sizeof(RelationMemberInfo)* relation->relationMembers.capacity);
-            }
+            ensureRelationMembersCapacityForNNewElements(&(relation->relationMembers), 1);
             relation->relationMembers.values[relation->relationMembers.count].ref = members[m].ref;
             relation->relationMembers.values[relation->relationMembers.count].type = members[m].type;
             //printf("Relation %i. Member ref %i. Role %i.\n", relation->info.id, members[m].ref, members[m].role);
-            relation->relationMembers.values[relation->relationMembers.count].role = utf8dup(simpleStringValuesAtIndex(&(self->rolesIndex), members[m].role));
+            // Roles index lives as long as reader.
+            relation->relationMembers.values[relation->relationMembers.count].role = simpleStringValuesAtIndex(&(self->rolesIndex), members[m].role);
+            relation->relationMembers.values[relation->relationMembers.count].roleBorrowed = 1;
             relation->relationMembers.count++;
         }
     }
 }
 
 
-static Way* readWay(obm* self, Way* way) {
+static Way* readWay(obm* self, FILE* file, Way* way, char resolve) {
     //printf("Reading way...\n");
     WayInfo wayInfo;
-    if(!fread(&(way->info), sizeof(WayInfo), 1, self->waysFile)) {
+    if(!fread(&(way->info), sizeof(WayInfo), 1, file)) {
         return NULL;
     }
     
@@ -765,81 +1362,157 @@ static Way* readWay(obm* self, Way* way) {
     removeAllNodesInfo(&(way->wayNodes));
     //printf("  Read..\n");
     do {
-        readBTags(self, self->waysFile, WAY_ATTRIBUTES_COUNT, &(way->tags));
-        readBWayNodes(self, way);
-        readed = fread(&wayInfo, sizeof(WayInfo), 1, self->waysFile);
+        readBTags(self, file, WAY_ATTRIBUTES_COUNT, &(way->tags), &(self->arena));
+        readBWayNodes(self, file, way, resolve);
+        readed = fread(&wayInfo, sizeof(WayInfo), 1, file);
     } while (readed && wayInfo.id == way->info.id);
 
     if(readed) {
         //printf("  Back..\n");
-        fseek(self->waysFile, -sizeof(WayInfo), SEEK_CUR);
+        fseek(file, -sizeof(WayInfo), SEEK_CUR);
     }  
     //printf("Done.\n");
     return way;
 }
 
-Relation* readRelation(obm* self, Relation* relation) {
+Relation* readRelation(obm* self, FILE* file, Relation* relation) {
     RelationInfo relationInfo;
-    if(!fread(&(relation->info), sizeof(RelationInfo), 1, self->relationsFile)) {
+    if(!fread(&(relation->info), sizeof(RelationInfo), 1, file)) {
         return NULL;
     }
     int readed;
     removeAllPlainTags(&(relation->tags));
     removeAllRelationMembers(&(relation->relationMembers));
     do {
-        readBTags(self, self->relationsFile, RELATION_ATTRIBUTES_COUNT, &(relation->tags));
-        readBRelationMembers(self, relation);
-        readed = fread(&relationInfo, sizeof(RelationInfo), 1, self->relationsFile);
+        readBTags(self, file, RELATION_ATTRIBUTES_COUNT, &(relation->tags), &(self->arena));
+        readBRelationMembers(self, file, relation);
+        readed = fread(&relationInfo, sizeof(RelationInfo), 1, file);
     } while (readed && relationInfo.id == relation->info.id);
     if(readed) {
-        fseek(self->relationsFile, -sizeof(RelationInfo), SEEK_CUR);   
+        fseek(file, -sizeof(RelationInfo), SEEK_CUR);   
     }
     
     return relation;
 }
 
-static Node* nextBNode(void* self) {
-    return readNode((obm*)self, (((obm*)self)->currentNode));
+static Node* nextBNode(void* abstractSelf) {
+    obm* self = (obm*)abstractSelf;
+    resetArena(&(self->arena));
+    FILE* file = nextBEntityFile(&(self->nodesDelta), self->nodesFile, sizeof(BNode));
+    return readNodeFromFile(self, self->currentNode, file, &(self->arena));
 }
 
-static Way* nextBWay(void* self) {
-    return readWay((obm*)self, &(((obm*)self)->currentWay));
-}
-
-static Relation* nextBRelation(void* self) {
-    return readRelation((obm*)self, &(((obm*)self)->currentRelation));
-}
-
-Nodes* nodesForWayCached(obm* self, Way* way) {
-    int count = way->wayNodes.count;
-    Node* nodes = malloc(sizeof(Node) * way->wayNodes.count);
-    Node* originalNode = self->currentNode;
-    for(int i = 0; i< count; i++) {
-        self->currentNode = bsearch(&(way->wayNodes.values[i].id), self->nodes.values, self->nodes.count, sizeof(Node), compareNodes);
-        if(self->currentNode) {
-            readNode(self, nodes + i);
-        } else {
-            fprintf(stderr, "Node %i was not found.\n", way->wayNodes.values[i].id);
+void resolveBWayNodes(obm* self, Way* ways, int count) {
+    NodesInfo* nodes = &(self->blockNodes);
+    removeAllNodesInfo(nodes);
+    for(int w = 0; w < count; w++) {
+        ensureNodesInfoCapacityForNNewElements(nodes, ways[w].wayNodes.count);
+        memcpy(nodes->values + nodes->count, ways[w].wayNodes.values, sizeof(NodeInfo) * ways[w].wayNodes.count);
+        nodes->count += ways[w].wayNodes.count;
+    }
+    qsort(nodes->values, nodes->count, sizeof(NodeInfo), compareNodeInfoIds);
+    int distinct = 0;
+    for(int n = 0; n < nodes->count; n++) {
+        if(!distinct || nodes->values[n].id != nodes->values[distinct - 1].id) {
+            nodes->values[distinct++] = nodes->values[n];
         }
-        
     }
-    self->currentNode = originalNode;
+    nodes->count = distinct;
     
-    Nodes* result = malloc(sizeof(Nodes));
-    result->count = count;
-    result->values = nodes;
+    // Nodes are written in order of input, which is sorted by id, so next node is usually found by reading
+    // nodes file forward, index is looked up only for far nodes.
+    long oldOffset = ftell(self->nodesFile);
+    char positioned = 0;
+    for(int n = 0; n < nodes->count; n++) {
+        NodeInfo* node = nodes->values + n;
+        BNode record;
+        BDeltaEntry* entry = findBDeltaEntry(&(self->nodesDelta), node->id);
+        if(entry) {
+            // Changed nodes are read from delta, base file stays positioned for the next node.
+            if(entry->offset >= 0 && !fseek(self->nodesDelta.file, entry->offset, SEEK_SET) && fread(&record, sizeof(BNode), 1, self->nodesDelta.file)) {
+                node->lat = record.info.lat;
+                node->lon = record.info.lon;
+            } else {
+                fprintf(stderr, "Node %u was not found.\n", node->id);
+            }
+            continue;
+        }
+        char found = 0;
+        for(int s = 0; positioned && s < OBM_NODES_SCAN_LIMIT && fread(&record, sizeof(BNode), 1, self->nodesFile); s++) {
+            if(record.info.id >= node->id) {
+                found = record.info.id == node->id;
+                break;
+            }
+        }
+        if(!found) {
+            long offset = findObjectOffset(&(self->nodesIndex), node->id);
+            found = offset >= 0 && !fseek(self->nodesFile, offset, SEEK_SET) && fread(&record, sizeof(BNode), 1, self->nodesFile) && record.info.id == node->id;
+        }
+        positioned = found;
+        if(found) {
+            node->lat = record.info.lat;
+            node->lon = record.info.lon;
+        } else {
+            fprintf(stderr, "Node %u was not found.\n", node->id);
+        }
+    }
+    fseek(self->nodesFile, oldOffset, SEEK_SET);
     
-    return result;
+    for(int w = 0; w < count; w++) {
+        for(int n = 0; n < ways[w].wayNodes.count; n++) {
+            NodeInfo* wayNode = ways[w].wayNodes.values + n;
+            NodeInfo* node = bsearch(wayNode, nodes->values, nodes->count, sizeof(NodeInfo), compareNodeInfoIds);
+            wayNode->lat = node->lat;
+            wayNode->lon = node->lon;
+        }
+    }
+}
+
+static Way* nextBWay(void* abstractSelf) {
+    obm* self = (obm*)abstractSelf;
+    if(self->cacheNodes) {
+        resetArena(&(self->arena));
+        return readWay(self, nextBEntityFile(&(self->waysDelta), self->waysFile, sizeof(BWay)), &(self->currentWay), 1);
+    }
+    // Ways are read by blocks, so their nodes are resolved in one pass over nodes file.
+    if(self->waysBlockCurrent >= self->waysBlockCount) {
+        resetArena(&(self->arena));
+        self->waysBlockCurrent = 0;
+        self->waysBlockCount = 0;
+        while(self->waysBlockCount < OBM_WAYS_BLOCK_SIZE && readWay(self, nextBEntityFile(&(self->waysDelta), self->waysFile, sizeof(BWay)), self->waysBlock + self->waysBlockCount, 0)) {
+            self->waysBlockCount++;
+        }
+        if(!self->waysBlockCount) {
+            return NULL;
+        }
+        resolveBWayNodes(self, self->waysBlock, self->waysBlockCount);
+    }
+    return self->waysBlock + (self->waysBlockCurrent++);
 }
 
-Nodes* nodesForWayNotCached(obm* self, Way* way) {
+static Relation* nextBRelation(void* abstractSelf) {
+    obm* self = (obm*)abstractSelf;
+    resetArena(&(self->arena));
+    FILE* file = nextBEntityFile(&(self->relationsDelta), self->relationsFile, sizeof(BRelation));
+    return readRelation(self, file, &(self->currentRelation));
+}
+
+static void resetBScratch(void* self) {
+    resetArena(&(((obm*)self)->arena));
+}
+
+Nodes* nodesForWay(obm* self, Way* way) {
     int count = way->wayNodes.count;
     Node* nodes = malloc(sizeof(Node) * way->wayNodes.count);
     long originalOffset = ftell(self->nodesFile);
     for(int i = 0; i< count; i++) {
-        long offset = findObjectOffset(&(self->nodesIndex), way->wayNodes.values[i].id);
-        fseek(self->nodesFile, offset, SEEK_SET);
-        readNode(self, nodes + i);
+        long offset;
+        FILE* file = locateBEntity(&(self->nodesDelta), &(self->nodesIndex), self->nodesFile, way->wayNodes.values[i].id, &offset);
+        memset(nodes + i, 0, sizeof(Node));
+        if(file) {
+            fseek(file, offset, SEEK_SET);
+            readNodeFromFile(self, nodes + i, file, &(self->arena));
+        }
     }
     fseek(self->nodesFile, originalOffset, SEEK_SET);
     
@@ -850,54 +1523,58 @@ Nodes* nodesForWayNotCached(obm* self, Way* way) {
     return result;
 }
 
-Nodes* nodesForWay(obm* self, Way* way) {
-    if(self->cacheNodes) {
-        return nodesForWayCached(self, way);
+static Way* bWayWithId(void* abstractSelf, OsmId id) {
+    obm* self = (obm*)abstractSelf;
+    long offset;
+    FILE* file = locateBEntity(&(self->waysDelta), &(self->waysIndex), self->waysFile, id, &offset);
+    if(!file) {
+        return NULL;
     }
-    return nodesForWayNotCached(self, way);
-}
-
-static Way* bWayWithId(void* self, OsmId id) {
-    long offset = findObjectOffset(&(((obm*)self)->waysIndex), id);
-    long oldOffset = ftell(((obm*)self)->waysFile);
-    fseek(((obm*)self)->waysFile, offset, SEEK_SET);
+    long oldOffset = ftell(file);
+    fseek(file, offset, SEEK_SET);
     Way* way = calloc(sizeof(Way), 1);
-    if(!readWay(((obm*)self), way)){
+    if(!readWay(self, file, way, 1)){
         free(way);
         way = NULL;
     }
-    fseek(((obm*)self)->waysFile, oldOffset, SEEK_SET);
+    fseek(file, oldOffset, SEEK_SET);
     return way;
 }
 
 
-static Relation* bRelationWithId(void* self, OsmId id) {
-    long offset = findObjectOffset(&(((obm*)self)->relationsIndex), id);
-    long oldOffset = ftell(((obm*)self)->relationsFile);
-    fseek(((obm*)self)->relationsFile, offset, SEEK_SET);
+static Relation* bRelationWithId(void* abstractSelf, OsmId id) {
+    obm* self = (obm*)abstractSelf;
+    long offset;
+    FILE* file = locateBEntity(&(self->relationsDelta), &(self->relationsIndex), self->relationsFile, id, &offset);
+    if(!file) {
+        return NULL;
+    }
+    long oldOffset = ftell(file);
+    fseek(file, offset, SEEK_SET);
     Relation* relation = calloc(sizeof(Relation), 1);
-    if(!readRelation(((obm*)self), relation)) {
+    if(!readRelation(self, file, relation)) {
         free(relation);
         relation = NULL;
     }
-    fseek(((obm*)self)->relationsFile, oldOffset, SEEK_SET);
+    fseek(file, oldOffset, SEEK_SET);
     return relation;
 }
 
 static void restartBNodes(void* self) {
-    if(((obm*) self)->cacheNodes) {
-        ((obm*) self)->currentNode = ((obm*) self)->nodes.values;    
-    } else {
-        fseek(((obm*) self)->nodesFile, 0, SEEK_SET);    
-    }
+    fseek(((obm*) self)->nodesFile, 0, SEEK_SET);
+    ((obm*) self)->nodesDelta.current = 0;
 }
 
 static void restartBWays(void* self) {
     fseek(((obm*) self)->waysFile, 0, SEEK_SET);
+    ((obm*) self)->waysDelta.current = 0;
+    ((obm*) self)->waysBlockCount = 0;
+    ((obm*) self)->waysBlockCurrent = 0;
 }
 
 static void restartBRelations(void* self) {
     fseek(((obm*) self)->relationsFile, 0, SEEK_SET);
+    ((obm*) self)->relationsDelta.current = 0;
 }
 
 OsmDbReader* newObmReader(const char* directory, int cacheNodes) {
@@ -918,6 +1595,8 @@ OsmDbReader* newObmReader(const char* directory, int cacheNodes) {
     reader->wayWithId = bWayWithId;
     reader->relationWithId = bRelationWithId;
     
+    reader->resetScratch = resetBScratch;
+    
     reader->close = closeObm;
     return reader;
 }
@@ -21,10 +21,22 @@
 #define RELATION_MEMBERS_COUNT 2
 #define WAY_NODES_COUNT 11
 #define ATTRIBUTE_VALUE_LENGTH 32
+// Ways read ahead, so nodes of all of them are looked up in one pass.
+#define OBM_WAYS_BLOCK_SIZE 1024
+// Nodes file is read forward up to so many records before node is looked up in index.
+#define OBM_NODES_SCAN_LIMIT 32
+
+// Tag values seen so many times are written as ids in values dictionary.
+#define DICTIONARY_VALUE_MIN_OCCURRENCES 4
+// Values longer than this are always written inline. Must fit line buffer of initSimpleStringIndexFromFile.
+#define DICTIONARY_VALUE_MAX_SIZE 255
+// Values are not counted any more after so many distinct ones are seen.
+#define DICTIONARY_VALUE_CANDIDATES_LIMIT (1 << 20)
 
 typedef long int BId;
 #define atobid atol
 
+// Tag with value from values dictionary has key -(key + 1) and value id in the beginning of value.
 typedef struct {
     int key;
     UTF8 value[ATTRIBUTE_VALUE_LENGTH];
@@ -45,6 +57,12 @@ typedef struct {
     BTag tags[NODE_ATTRIBUTES_COUNT];
 } BNode;
 
+// Coordinates of cached node, kept apart from its id, so search over ids touches only ids.
+typedef struct {
+    Coordinate lat;
+    Coordinate lon;
+} BNodeCoordinates;
+
 typedef struct {
     BId ref;
 } BWayNode;
@@ -110,6 +128,14 @@ typedef struct {
     
     SimpleStringIndex keysIndex;
     SimpleStringIndex rolesIndex;
+    SimpleStringIndex valuesIndex;
+    
+    // Values not yet in values index and number of their occurrences.
+    SimpleStringIndex valueCandidates;
+    int* valueCandidateCounts;
+    int valueCandidateCountsCapacity;
+    // Values dictionary of map being updated is not changed, as readers map it.
+    char valuesIndexFixed;
     
     WayInfo way;
     NodeInfo node;
@@ -138,9 +164,53 @@ typedef struct {
     OsmEntityType currentEntityType;
 } osm2obm;
 
+// Changes are appended to delta files <type>.delta.obm, which have the same records as base files.
+// Their Tree16 indexes <type>.delta.idx have offset of the last version of each changed entity
+// and OBM_DELETED_OFFSET for deleted entities. Readers take changed entities from delta files.
+#define OBM_DELETED_OFFSET -2
+
+typedef struct {
+    FILE* file;
+    // End of written records.
+    long offset;
+    Tree16 index;
+    // Records of entity are read until id changes, so entity written twice in a row replaces its last records.
+    OsmId lastId;
+    long lastOffset;
+    size_t recordSize;
+    int changesCount;
+} BDeltaWriter;
+
+typedef struct {
+    osm2obm base;
+    const char* directory;
+    BDeltaWriter nodesDelta;
+    BDeltaWriter waysDelta;
+    BDeltaWriter relationsDelta;
+} osd2obm;
+
+typedef struct {
+    OsmId id;
+    long offset;
+} BDeltaEntry;
+
+// Changed entities sorted by id. Base files are sorted by id too, so they are read merged with delta in one pass.
+typedef struct {
+    FILE* file;
+    BDeltaEntry* entries;
+    int count;
+    int capacity;
+    // Next entry in order of ids.
+    int current;
+} BDelta;
+
 typedef struct {
     int cacheNodes;
-    Nodes nodes;
+    // Ids of cached nodes in Eytzinger layout, children of k are at 2k and 2k + 1, root is at 1.
+    // Coordinates of node are at the same place as its id. Tags are not cached, they are read with nodes.
+    OsmId* cachedNodeIds;
+    BNodeCoordinates* cachedNodeCoordinates;
+    int cachedNodesCount;
     Node* currentNode;
     FILE* nodesFile;
     FILE* waysFile;
@@ -150,6 +220,9 @@ typedef struct {
     Tree16OnFile waysIndex;
     Tree16OnFile relationsIndex;
     
+    BDelta nodesDelta;
+    BDelta waysDelta;
+    BDelta relationsDelta;
 
     Way currentWay;
     Relation currentRelation;
@@ -158,6 +231,23 @@ typedef struct {
     
     SimpleStringIndex keysIndex;
     SimpleStringIndex rolesIndex;    
+    // Interned strings and their ids for keys index.
+    UTF8** keys;
+    TagStringId* keyIds;
+    // Values dictionary, empty for maps written without it.
+    SimpleStringIndex valuesIndex;
+    UTF8** values;
+    TagStringId* valueIds;
+    
+    // Scratch data of entities, reset when next entity is read.
+    Arena arena;
+    
+    // Ways read ahead when nodes are not cached.
+    Way* waysBlock;
+    int waysBlockCount;
+    int waysBlockCurrent;
+    // Distinct nodes of ways block sorted by id.
+    NodesInfo blockNodes;
 } obm;
 
 #pragma mark osm2obm
@@ -166,6 +256,16 @@ void convertOsm2ObmFromFile(osm2obm* self, const char *filename);
 void convertOsm2ObmFromStdin(osm2obm* self);
 void closeOsm2obm(osm2obm* self);
 
+#pragma mark osd2obm
+void initOsd2Obm(osd2obm* self, const char* directory);
+void convertOsd2ObmFromFile(osd2obm* self, const char *filename);
+void convertOsd2ObmFromStdin(osd2obm* self);
+void closeOsd2Obm(osd2obm* self);
+// Rewrites base files of map with its changes and removes delta files. Returns 0 on success.
+int compactObm(const char* directory);
+
 #pragma mark Read obm
 
 OsmDbReader* newObmReader(const char* directory, int cacheNodes);
+// Sets coordinates of nodes of ways with ids read, looking up all distinct nodes in ascending order of ids.
+void resolveBWayNodes(obm* self, Way* ways, int count);
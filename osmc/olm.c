@@ -232,10 +232,7 @@ static void writeWay(void* abstractSelf) {
 
 static void newWayNode(void* abstractSelf, OsmId ref) {
     osm2olm* self = (osm2olm*) abstractSelf;
-    if(self->wayNodes.capacity < self->wayNodes.count + 1) {
-        self->wayNodes.capacity += 10;
-        self->wayNodes.values = realloc(self->wayNodes.values, self->wayNodes.capacity * sizeof(WayNodeInfo));
-    }
+    ensureWayNodesCapacityForNNewElements(&(self->wayNodes), 1);
     self->wayNodes.values[self->wayNodes.count].ref = ref;
     self->wayNodes.count++;
 }
@@ -249,10 +246,7 @@ static void newRelation(void* abstractSelf, OsmId id, OsmTimestamp timestamp) {
 static void writeRelationInternal(void* abstractSelf, OsmChangeType change) {
     osm2olm* self = (osm2olm*) abstractSelf;
     
-    if(self->relations.capacity < self->relations.count + 1) {
-        self->relations.capacity += 10;
-        self->relations.values = realloc(self->relations.values, self->relations.capacity * sizeof(RelationChange));
-    }
+    ensureRelationChangesCapacityForNNewElements(&(self->relations), 1);
     RelationChange* relation = self->relations.values + self->relations.count;
 
     relation->base.info.id = self->relation.id;
@@ -263,14 +257,11 @@ static void writeRelationInternal(void* abstractSelf, OsmChangeType change) {
         relation->base.relationMembers.values[m].ref = self->relationMembers.values[m].ref;
         relation->base.relationMembers.values[m].type = self->relationMembers.values[m].type;
         relation->base.relationMembers.values[m].role = utf8dup(self->relationMembers.values[m].role);
+        relation->base.relationMembers.values[m].roleBorrowed = 0;
     }
     
-    relation->base.tags.values = malloc(sizeof(PlainTag) * self->tags.count);
-    relation->base.tags.count = relation->base.tags.capacity = self->tags.count;
-    for(int t=0; t< self->tags.count;t++) {
-        relation->base.tags.values[t].key = utf8dup(self->tags.values[t].key);
-        relation->base.tags.values[t].value = utf8dup(self->tags.values[t].value);
-    }
+    initPlainTags(&(relation->base.tags));
+    copyPlainTags(&(self->tags), &(relation->base.tags));
     relation->change = change;
     
     self->relations.count++;
@@ -285,26 +276,18 @@ static void writeRelation(void* abstractSelf) {
 
 static void newRelationMember(void* abstractSelf, OsmId ref, OsmEntityType type, UTF8* role) {
     osm2olm* self = (osm2olm*) abstractSelf;
-    if(self->relationMembers.capacity < self->relationMembers.count + 1) {
-        self->relationMembers.capacity += 10;
-        self->relationMembers.values = realloc(self->relationMembers.values, self->relationMembers.capacity * sizeof(RelationMemberInfo));
-    }
+    ensureRelationMembersCapacityForNNewElements(&(self->relationMembers), 1);
     self->relationMembers.values[self->relationMembers.count].ref = ref;
     self->relationMembers.values[self->relationMembers.count].type = type;
     self->relationMembers.values[self->relationMembers.count].role = utf8dup(role);
+    self->relationMembers.values[self->relationMembers.count].roleBorrowed = 0;
     self->relationMembers.count++;
 }
 
 static void newTag(void* abstractSelf, OsmEntityType type, UTF8* key, UTF8* value) {
     //printf("New tag\n");
     osm2olm* self = (osm2olm*) abstractSelf;
-    if(self->tags.capacity < self->tags.count + 1) {
-        self->tags.capacity += 10;
-        self->tags.values = realloc(self->tags.values, self->tags.capacity * sizeof(PlainTag));
-    }
-    self->tags.values[self->tags.count].key = utf8dup(key);
-    self->tags.values[self->tags.count].value = utf8dup(value);
-    self->tags.count++;
+    addPlainTag(&(self->tags), key, value);
     //printf("End New tag\n");
 }
 
@@ -632,6 +615,7 @@ static void initOlm(olm* self, const char* fileName) {
     self->currentWay.wayNodes.count = 0;
     self->currentRelation.relationMembers.values = NULL;
     self->currentRelation.relationMembers.count = 0;    
+    initArena(&(self->arena));
     sqlite3_open(fileName, &(self->db));
     prepareStatement(self->db, "SELECT id, latitude, longitude FROM current_nodes", &(self->nodeStatement));
     prepareStatement(self->db, "SELECT id FROM current_ways", &(self->wayStatement));
@@ -653,22 +637,16 @@ static void readLTags(olm* self, sqlite3_stmt* statement, PlainTags* tags, OsmId
     sqlite3_bind_int(statement, 1, ownerId);
     removeAllPlainTags(tags);
     while(sqlite3_step(statement) == SQLITE_ROW) {
-        if(tags->capacity < tags->count + 1) {
-            tags->capacity += 10;
-            tags->values = realloc(tags->values, tags->capacity * sizeof(PlainTag));
-        }
-        tags->values[tags->count].key = utf8dup(sqlite3_column_text(statement, 0));
-        tags->values[tags->count].value = utf8dup(sqlite3_column_text(statement, 1));
-        tags->count++;
+        addPlainTagInArena(tags, sqlite3_column_text(statement, 0), sqlite3_column_text(statement, 1), &(self->arena));
     }
     sqlite3_reset(statement);
 }
 
-static Node* readLNode(olm* self, Node* node) {
+static Node* readLNode(olm* self, sqlite3_stmt* statement, Node* node) {
     //printf("Reading node...\n");
-    node->info.id = sqlite3_column_int(self->nodeStatement, 0);
-    node->info.lat = sqlite3_column_int(self->nodeStatement, 1);
-    node->info.lon = sqlite3_column_int(self->nodeStatement, 2);
+    node->info.id = sqlite3_column_int(statement, 0);
+    node->info.lat = sqlite3_column_int(statement, 1);
+    node->info.lon = sqlite3_column_int(statement, 2);
     //printf("Reading node tags...\n");
     readLTags(self, self->nodeTagsStatement, &(node->tags), node->info.id);
     //printf("Read.\n");
@@ -682,10 +660,7 @@ static void readLWayNodes(olm* self, Way* way) {
     removeAllNodesInfo(&(way->wayNodes));
     //printf("Reading..");
     while(sqlite3_step(self->wayNodesStatement) == SQLITE_ROW) {
-        if(way->wayNodes.capacity < way->wayNodes.count + 1) {
-            way->wayNodes.capacity += 10;
-            way->wayNodes.values = realloc(way->wayNodes.values, way->wayNodes.capacity * sizeof(NodeInfo));
-        }
+        ensureNodesInfoCapacityForNNewElements(&(way->wayNodes), 1);
         way->wayNodes.values[way->wayNodes.count].id = sqlite3_column_int(self->wayNodesStatement, 0);
         way->wayNodes.values[way->wayNodes.count].lat = sqlite3_column_int(self->wayNodesStatement, 1);
         way->wayNodes.values[way->wayNodes.count].lon = sqlite3_column_int(self->wayNodesStatement, 2);
@@ -695,9 +670,9 @@ static void readLWayNodes(olm* self, Way* way) {
     sqlite3_reset(self->wayNodesStatement);
 }
 
-static Way* readLWay(olm* self, Way* way) {
+static Way* readLWay(olm* self, sqlite3_stmt* statement, Way* way) {
     //printf("Reading way...\n");
-    way->info.id = sqlite3_column_int(self->wayStatement, 0);
+    way->info.id = sqlite3_column_int(statement, 0);
     //printf("Reading way tags...\n");
     readLTags(self, self->wayTagsStatement, &(way->tags), way->info.id);
     //printf("Reading nodes...\n");
@@ -710,13 +685,11 @@ static void readLRelationMembers(olm* self, Relation* relation) {
     sqlite3_bind_int(self->relationMembersStatement, 1, relation->info.id);
     removeAllRelationMembers(&(relation->relationMembers));
     while(sqlite3_step(self->relationMembersStatement) == SQLITE_ROW) {
-        if(relation->relationMembers.capacity < relation->relationMembers.count + 1) {
-            relation->relationMembers.capacity += 10;
-            relation->relationMembers.values = realloc(relation->relationMembers.values, relation->relationMembers.capacity * sizeof(RelationMemberInfo));
-        }
+        ensureRelationMembersCapacityForNNewElements(&(relation->relationMembers), 1);
         relation->relationMembers.values[relation->relationMembers.count].type = string2relationMemberType((UTF8*)sqlite3_column_text(self->relationMembersStatement, 0));
         relation->relationMembers.values[relation->relationMembers.count].ref = sqlite3_column_int(self->relationMembersStatement, 1);
-        relation->relationMembers.values[relation->relationMembers.count].role = utf8dup(sqlite3_column_text(self->relationMembersStatement, 2));
+        relation->relationMembers.values[relation->relationMembers.count].role = arenaUtf8dup(&(self->arena), sqlite3_column_text(self->relationMembersStatement, 2));
+        relation->relationMembers.values[relation->relationMembers.count].roleBorrowed = 1;
         relation->relationMembers.count++;
     }
     sqlite3_reset(self->relationMembersStatement);
@@ -730,24 +703,27 @@ static Relation* readLRelation(olm* self, Relation* relation) {
 }
 
 static Node* nextLNode(void* self) {
+    resetArena(&(((olm*)self)->arena));
     //printf("Retrive next node..\n");
     if(sqlite3_step(((olm*)self)->nodeStatement) == SQLITE_ROW) {
-        return readLNode((olm*) self, &(((olm*)self)->currentNode));
+        return readLNode((olm*) self, ((olm*)self)->nodeStatement, &(((olm*)self)->currentNode));
     }    
     //printf("No more nodes..\n");
     return NULL;
 }
 
 static Way* nextLWay(void* self) {
+    resetArena(&(((olm*)self)->arena));
     //printf("Next way...\n");
     if(sqlite3_step(((olm*)self)->wayStatement) == SQLITE_ROW) {
-        return readLWay((olm*) self, &(((olm*)self)->currentWay));
+        return readLWay((olm*) self, ((olm*)self)->wayStatement, &(((olm*)self)->currentWay));
     }
     //printf("No more ways...\n");
     return NULL;
 }
 
 static Relation* nextLRelation(void* self) {
+    resetArena(&(((olm*)self)->arena));
     if(sqlite3_step(((olm*)self)->relationStatement) == SQLITE_ROW) {
         return readLRelation((olm*) self, &(((olm*)self)->currentRelation));
     }
@@ -768,6 +744,7 @@ void closeOlmReader(void* abstractSelf) {
     free(self->currentNode.tags.values);
     free(self->currentWay.tags.values);
     free(self->currentRelation.tags.values);
+    clearArena(&(self->arena));
 }
 
 static void restartLNodes(void* self) {
@@ -782,15 +759,33 @@ static void restartLRelations(void* self) {
     sqlite3_reset(((olm*) self)->relationStatement);
 }
 
+static void resetLScratch(void* self) {
+    resetArena(&(((olm*)self)->arena));
+}
+
 static Way* lWayWithId(void* self, OsmId id) {
     Way* way = calloc(sizeof(Way), 1);
     sqlite3_bind_int(((olm*)self)->wayWithIdStatement, 1, id);
     if(sqlite3_step(((olm*)self)->wayWithIdStatement) == SQLITE_ROW) {
-        readLWay((olm*) self, way);
+        readLWay((olm*) self, ((olm*)self)->wayWithIdStatement, way);
         sqlite3_reset(((olm*)self)->wayWithIdStatement);
         return way;
     }
     sqlite3_reset(((olm*)self)->wayWithIdStatement);
+    free(way);
+    return NULL;
+}
+
+static Node* lNodeWithId(void* self, OsmId id) {
+    Node* node = calloc(sizeof(Node), 1);
+    sqlite3_bind_int(((olm*)self)->nodeWithIdStatement, 1, id);
+    if(sqlite3_step(((olm*)self)->nodeWithIdStatement) == SQLITE_ROW) {
+        readLNode((olm*) self, ((olm*)self)->nodeWithIdStatement, node);
+        sqlite3_reset(((olm*)self)->nodeWithIdStatement);
+        return node;
+    }
+    sqlite3_reset(((olm*)self)->nodeWithIdStatement);
+    free(node);
     return NULL;
 }
 
@@ -808,8 +803,11 @@ OsmDbReader* newOlmReader(const char* fileName) {
     reader->restartWays = restartLWays;
     reader->restartRelations = restartLRelations;
     
+    reader->nodeWithId = lNodeWithId;
     reader->wayWithId = lWayWithId;
     
+    reader->resetScratch = resetLScratch;
+    
     reader->close = closeOlmReader;
     return reader;    
 }
@@ -927,14 +925,11 @@ static void updateRelation(void* abstractSelf) {
             relation->base.relationMembers.values[m].ref = self->relationMembers.values[m].ref;
             relation->base.relationMembers.values[m].type = self->relationMembers.values[m].type;
             relation->base.relationMembers.values[m].role = utf8dup(self->relationMembers.values[m].role);
+            relation->base.relationMembers.values[m].roleBorrowed = 0;
         }
         
-        relation->base.tags.values = malloc(sizeof(PlainTag) * self->tags.count);
-        relation->base.tags.count = relation->base.tags.capacity = self->tags.count;
-        for(int t=0; t< self->tags.count;t++) {
-            relation->base.tags.values[t].key = utf8dup(self->tags.values[t].key);
-            relation->base.tags.values[t].value = utf8dup(self->tags.values[t].value);
-        }
+        initPlainTags(&(relation->base.tags));
+        copyPlainTags(&(self->tags), &(relation->base.tags));
         
         removeAllPlainTags(&(self->tags));
         removeAllRelationMembers(&(self->relationMembers));        
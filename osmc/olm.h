@@ -97,6 +97,9 @@ typedef struct {
     Node currentNode;
     Way currentWay;
     Relation currentRelation;
+    
+    // Scratch data of entities, reset when next entity is read.
+    Arena arena;
 } olm;
 
 #pragma mark osm2olm
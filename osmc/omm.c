@@ -33,69 +33,201 @@ static int mysql_query_with_error(MYSQL* db, const char* query) {
 }
 
 
-static void init_multiInsert(multiInsert* mi, mysql_stmt* statement) {
+static void* runMysqlWriter(void* abstractWriter) {
+    mysql_writer* writer = (mysql_writer*) abstractWriter;
+    mysql_thread_init();
+    pthread_mutex_lock(&(writer->mutex));
+    while(1) {
+        while(!writer->queueCount && !writer->stopping) {
+            pthread_cond_wait(&(writer->changed), &(writer->mutex));
+        }
+        if(!writer->queueCount) {
+            break;
+        }
+        mysql_batch batch = writer->queue[writer->queueStart];
+        writer->queueStart = (writer->queueStart + 1) % MYSQL_WRITER_QUEUE_LENGTH;
+        writer->queueCount--;
+        writer->busy = 1;
+        pthread_cond_broadcast(&(writer->changed));
+        pthread_mutex_unlock(&(writer->mutex));
+        
+        int result = mysql_real_query_with_error(&(writer->db), batch.query, batch.length);
+        
+        pthread_mutex_lock(&(writer->mutex));
+        if(result) {
+            writer->errors++;
+        }
+        if(writer->spareCount < MYSQL_WRITER_QUEUE_LENGTH) {
+            writer->spare[writer->spareCount++] = batch;
+        } else {
+            free(batch.query);
+        }
+        writer->busy = 0;
+        pthread_cond_broadcast(&(writer->changed));
+    }
+    pthread_mutex_unlock(&(writer->mutex));
+    mysql_thread_end();
+    return NULL;
+}
+
+static char connectMysqlWriter(mysql_writer* writer, const char* host, const char* user, const char* password) {
+    MYSQL* db = &(writer->db);
+    mysql_init(db);
+    mysql_options(db, MYSQL_SET_CHARSET_NAME, "UTF8");
+    if(!mysql_real_connect(db, host, user, password, NULL, 0, NULL, 0)) {
+        fprintf(stderr, "Error connect ro db server %s:%s@%s: %s\n", user, password, host, mysql_error(db));
+        mysql_close(db);
+        return 0;
+    }
+    writer->queueStart = 0;
+    writer->queueCount = 0;
+    writer->spareCount = 0;
+    writer->busy = 0;
+    writer->stopping = 0;
+    writer->errors = 0;
+    return 1;
+}
+
+static char startMysqlWriter(mysql_writer* writer) {
+    pthread_mutex_init(&(writer->mutex), NULL);
+    pthread_cond_init(&(writer->changed), NULL);
+    if(pthread_create(&(writer->thread), NULL, runMysqlWriter, writer)) {
+        fprintf(stderr, "Unable to start mysql writer thread.\n");
+        pthread_cond_destroy(&(writer->changed));
+        pthread_mutex_destroy(&(writer->mutex));
+        return 0;
+    }
+    return 1;
+}
+
+// Hands batch to writer, waiting while its queue is full. Returns buffer to build next batch in.
+static mysql_batch queueMysqlBatch(mysql_writer* writer, mysql_batch batch) {
+    mysql_batch empty = {NULL, 0, 0};
+    pthread_mutex_lock(&(writer->mutex));
+    while(writer->queueCount == MYSQL_WRITER_QUEUE_LENGTH) {
+        pthread_cond_wait(&(writer->changed), &(writer->mutex));
+    }
+    writer->queue[(writer->queueStart + writer->queueCount) % MYSQL_WRITER_QUEUE_LENGTH] = batch;
+    writer->queueCount++;
+    if(writer->spareCount) {
+        empty = writer->spare[--writer->spareCount];
+        empty.length = 0;
+    }
+    pthread_cond_broadcast(&(writer->changed));
+    pthread_mutex_unlock(&(writer->mutex));
+    return empty;
+}
+
+static int waitMysqlWriter(mysql_writer* writer) {
+    pthread_mutex_lock(&(writer->mutex));
+    while(writer->queueCount || writer->busy) {
+        pthread_cond_wait(&(writer->changed), &(writer->mutex));
+    }
+    int errors = writer->errors;
+    writer->errors = 0;
+    pthread_mutex_unlock(&(writer->mutex));
+    return errors;
+}
+
+static void stopMysqlWriter(mysql_writer* writer) {
+    pthread_mutex_lock(&(writer->mutex));
+    writer->stopping = 1;
+    pthread_cond_broadcast(&(writer->changed));
+    pthread_mutex_unlock(&(writer->mutex));
+    pthread_join(writer->thread, NULL);
+    
+    for(int i = 0; i < writer->spareCount; i++) {
+        free(writer->spare[i].query);
+    }
+    writer->spareCount = 0;
+    pthread_cond_destroy(&(writer->changed));
+    pthread_mutex_destroy(&(writer->mutex));
+}
+
+static int multiInsertMaxBytes = MULTI_INSERT_DEFAULT_MAX_BYTES;
+static int multiInsertMaxRows = MULTI_INSERT_DEFAULT_MAX_ROWS;
+
+void setOmmMultiInsertLimits(int maxBytes, int maxRows) {
+    if(maxBytes > 0) {
+        multiInsertMaxBytes = maxBytes;
+    }
+    if(maxRows > 0) {
+        multiInsertMaxRows = maxRows;
+    }
+}
+
+static void init_multiInsert(multiInsert* mi, mysql_stmt* statement, mysql_writer* writer) {
     if(!statement->multiInsert) {
         fprintf(stderr, "Using not multiinsert statement for multiinsert.\n");
     }
     mi->statement = statement;
     mi->query = NULL;
-    mi->queryEnd = NULL;
+    mi->length = 0;
     mi->capacity = 0;
     mi->rowsCount = 0;
+    mi->maxBytes = multiInsertMaxBytes;
+    mi->maxRows = multiInsertMaxRows;
+    mi->writer = writer;
 }
 
-//static char miquery[1024*1024*10];
-//static int micapacity = 1048576*10;
-
 static void ensure_enough_space(multiInsert* mi, int to_be_added) {
-    int qlen = 0;
-    if(!mi->query || ((qlen = strlen(mi->query)) + to_be_added >= mi->capacity)) {
-        mi->capacity = qlen + to_be_added + 1;
+    if(mi->length + to_be_added >= mi->capacity) {
+        mi->capacity = max(mi->capacity * 2, mi->length + to_be_added + 1);
         mi->query = realloc(mi->query, sizeof(char) * mi->capacity);
-        
-        mi->queryEnd = mi->query + qlen;
-    } else if (!mi->queryEnd) {
-        mi->queryEnd = mi->query;
     }
 }
 
 static void append(multiInsert* mi, const char* string) {
     int len = strlen(string);
     ensure_enough_space(mi, len);
-    strcpy(mi->queryEnd, string);
-    mi->queryEnd += len;
+    memcpy(mi->query + mi->length, string, len + 1);
+    mi->length += len;
 }
 
 static void append_char(multiInsert* mi, char c) {
     ensure_enough_space(mi, 1);
-    *(mi->queryEnd++) = c;
-    *(mi->queryEnd) = '\0';
+    mi->query[mi->length++] = c;
+    mi->query[mi->length] = '\0';
 }
 
 static void append_long(multiInsert* mi, long l) {
-    mi->queryEnd += sprintf(mi->queryEnd, "%li", l);
+    ensure_enough_space(mi, 21);
+    mi->length += sprintf(mi->query + mi->length, "%li", l);
 }
 
 static void append_int(multiInsert* mi, int i) {
-    mi->queryEnd += sprintf(mi->queryEnd, "%i", i);
+    ensure_enough_space(mi, 11);
+    mi->length += sprintf(mi->query + mi->length, "%i", i);
 }
 
 static void append_quoted_string(multiInsert* mi, mysql_stmt* statement, const char* str) {
     append_char(mi, '\'');
     int len = strlen(str);
     ensure_enough_space(mi, len * 2);
-    mi->queryEnd += mysql_real_escape_string(statement->db, mi->queryEnd, str, len);
+    mi->length += mysql_real_escape_string(statement->db, mi->query + mi->length, str, len);
     append_char(mi, '\'');
 }
 
+static int flush_multiInsert(multiInsert* mi) {
+    int result = 0;
+    if(!mi->rowsCount) {
+        return result;
+    }
+    if(mi->writer) {
+        mysql_batch batch = {mi->query, mi->length, mi->capacity};
+        batch = queueMysqlBatch(mi->writer, batch);
+        mi->query = batch.query;
+        mi->capacity = batch.capacity;
+    } else {
+        result = mysql_real_query_with_error(mi->statement->db, mi->query, mi->length);
+    }
+    mi->length = 0;
+    mi->rowsCount = 0;
+    return result;
+}
 
 static void add_multiInsert(multiInsert* mi, ...) {
-    char first = 0;
     mysql_stmt* statement = mi->statement;
-    if(!mi->queryEnd) {
-        append(mi, statement->templateParts[0]);
-        first = 1;
-    }
     
     va_list args;
     va_start(args, mi);
@@ -116,6 +248,16 @@ static void add_multiInsert(multiInsert* mi, ...) {
         }
     }
     va_end(args);
+    
+    if(mi->rowsCount && (mi->rowsCount >= mi->maxRows || mi->length + length > mi->maxBytes)) {
+        flush_multiInsert(mi);
+    }
+    
+    char first = 0;
+    if(!mi->rowsCount) {
+        append(mi, statement->templateParts[0]);
+        first = 1;
+    }
     ensure_enough_space(mi, length);
     int i = 0;
     if (!first) {
@@ -155,24 +297,20 @@ static void add_multiInsert(multiInsert* mi, ...) {
     va_end(args);
 }
 
-static void reinit_multiInsert(multiInsert* mi, mysql_stmt* statement) {
-    if(!statement->multiInsert) {
-        fprintf(stderr, "Using not multiinsert statement for multiinsert.\n");
-        return;
-    }
-    mi->queryEnd = NULL;
-    mi->statement = statement;
-    mi->rowsCount = 0;
-}
-
 static int exec_multiInsert(multiInsert* mi) {
-    int result = 0;
-    if(mi->queryEnd) {
-        result = mysql_query_with_error(mi->statement->db, mi->query);
+    int result = flush_multiInsert(mi);
+    if(mi->writer) {
+        result = waitMysqlWriter(mi->writer) || result;
     }
     return result;
 }
 
+static void free_multiInsert(multiInsert* mi) {
+    free(mi->query);
+    mi->query = NULL;
+    mi->capacity = 0;
+}
+
 static int mysql_exec(mysql_stmt* statement, ...) {
     va_list args;
     va_start(args, statement);
@@ -333,6 +471,7 @@ static char deleteFromDbById(MYSQL* db, mysql_stmt* deleteStatement, OsmId id) {
 }
 
 static void deleteNodeFromCountry(MCountry* country, OsmId id) {
+    exec_multiInsert(&(country->nodesInsert));
     beginTransaction(&(country->db));
     if(deleteFromDbById(&(country->db), country->deleteNodeTagsStatement, id) &&
        deleteFromDbById(&(country->db), country->deleteNodeStatement, id)) {
@@ -374,18 +513,23 @@ static void newNode(void* abstractSelf, OsmId id, Coordinate lat, Coordinate lon
     //printf("New node, %i - End\n", id);
 }
 
-static multiInsert tagInsert = {NULL, NULL, 0, NULL, 0};
+// While importing rows are collected in batches for writer threads, updates need them in db right away.
+static void entityWritten(MCountry* country, multiInsert* mi) {
+    if(!country->pipelined) {
+        exec_multiInsert(mi);
+    }
+}
 
-static void writeTags(osm2omm* self, PlainTags* tags, mysql_stmt* statement, OsmId ownerId) {
-    reinit_multiInsert(&tagInsert, statement);
+static void writeTags(MCountry* country, multiInsert* tagsInsert, PlainTags* tags, OsmId ownerId) {
+    TagStringId createdBy = internTagString(UTF8_CAST "created_by", NULL);
     for(int t = 0; t < tags->count; t++) {
         //printf("Writing tag %s=%s.\n", (char*) tags->values[t].key, (char*) tags->values[t].value);
-        if(!utf8equal(tags->values[t].key, UTF8_CAST "created_by")) {
-            add_multiInsert(&tagInsert, ownerId, tags->values[t].key, tags->values[t].value);
+        if(tags->values[t].keyId != createdBy) {
+            add_multiInsert(tagsInsert, ownerId, tags->values[t].key, tags->values[t].value);
             //mysql_exec(statement, ownerId, tags->values[t].key, tags->values[t].value);
         }
     }
-    exec_multiInsert(&tagInsert);
+    entityWritten(country, tagsInsert);
 }
 
 static void writeNode(void* abstractSelf) {
@@ -393,17 +537,11 @@ static void writeNode(void* abstractSelf) {
     for(int c = 0; c < self->countriesCount; c++) {
         if(nodeBelongsCountry(self, self->countries + c)) {
             addTree16Node(&(self->countries[c].nodesIndex), self->node.id, self->node.id);
+            add_multiInsert(&(self->countries[c].nodesInsert), self->node.id, self->node.lat, self->node.lon, self->node.timestamp);
             if(self->tags.count) {
                 beginTransaction(&(self->countries[c].db));
-                mysql_exec(self->countries[c].insertNodeStatement, self->node.id, self->node.lat, self->node.lon, self->node.timestamp);
-                writeTags(self, &(self->tags), self->countries[c].insertNodeTagStatement, self->node.id);
+                writeTags(self->countries + c, &(self->countries[c].nodeTagsInsert), &(self->tags), self->node.id);
                 commitTransaction(&(self->countries[c].db));
-            } else {
-                add_multiInsert(&(self->countries[c].taglessNodesInsert), self->node.id, self->node.lat, self->node.lon, self->node.timestamp);
-                if(self->countries[c].taglessNodesInsert.rowsCount > 2000) {
-                    exec_multiInsert(&(self->countries[c].taglessNodesInsert));
-                    reinit_multiInsert(&(self->countries[c].taglessNodesInsert), self->countries[c].insertNodeStatement);
-                }
             }
 
         }
@@ -417,19 +555,15 @@ static void newWay(void* abstractSelf, OsmId id, OsmTimestamp timestamp) {
     self->way.timestamp = timestamp;
 }
 
-static multiInsert wayNodesInsert = {NULL, NULL, 0, NULL, 0};
-
 static void writeWayNodes(osm2omm* self, MCountry* country) {
-    mysql_stmt* statement = country->insertWayNodeStatement;
-    reinit_multiInsert(&wayNodesInsert, statement);
     int i = 0;
     for(int n = 0; n < self->wayNodes.count; n++) {
         if(country->ifNodeExists(country, self->wayNodes.values[n].ref)) {
-            add_multiInsert(&wayNodesInsert, self->way.id, self->wayNodes.values[n].ref, i++);
+            add_multiInsert(&(country->wayNodesInsert), self->way.id, self->wayNodes.values[n].ref, i++);
             //mysql_exec(statement, self->way.id, self->wayNodes.values[n].ref, i++);
         }
     }
-    exec_multiInsert(&wayNodesInsert);
+    entityWritten(country, &(country->wayNodesInsert));
 }
 
 static void writeWay(void* abstractSelf) {
@@ -439,8 +573,9 @@ static void writeWay(void* abstractSelf) {
         if(wayBelongsMCountry(self, self->countries + c)) {
             addTree16Node(&(self->countries[c].waysIndex), self->way.id, self->way.id);
             beginTransaction(&(self->countries[c].db));
-            mysql_exec(self->countries[c].insertWayStatement, self->way.id, self->way.timestamp);
-            writeTags(self, &(self->tags), self->countries[c].insertWayTagStatement, self->way.id);
+            add_multiInsert(&(self->countries[c].waysInsert), self->way.id, self->way.timestamp);
+            entityWritten(self->countries + c, &(self->countries[c].waysInsert));
+            writeTags(self->countries + c, &(self->countries[c].wayTagsInsert), &(self->tags), self->way.id);
             writeWayNodes(self, self->countries+c);
             commitTransaction(&(self->countries[c].db));
         }
@@ -451,10 +586,7 @@ static void writeWay(void* abstractSelf) {
 
 static void newWayNode(void* abstractSelf, OsmId ref) {
     osm2omm* self = (osm2omm*) abstractSelf;
-    if(self->wayNodes.capacity < self->wayNodes.count + 1) {
-        self->wayNodes.capacity += 10;
-        self->wayNodes.values = realloc(self->wayNodes.values, self->wayNodes.capacity * sizeof(WayNodeInfo));
-    }
+    ensureWayNodesCapacityForNNewElements(&(self->wayNodes), 1);
     self->wayNodes.values[self->wayNodes.count].ref = ref;
     self->wayNodes.count++;
 }
@@ -468,10 +600,7 @@ static void newRelation(void* abstractSelf, OsmId id, OsmTimestamp timestamp) {
 static void writeRelationInternal(void* abstractSelf, OsmChangeType change) {
     osm2omm* self = (osm2omm*) abstractSelf;
     
-    if(self->relations.capacity < self->relations.count + 1) {
-        self->relations.capacity += 10;
-        self->relations.values = realloc(self->relations.values, self->relations.capacity * sizeof(RelationChange));
-    }
+    ensureRelationChangesCapacityForNNewElements(&(self->relations), 1);
     RelationChange* relation = self->relations.values + self->relations.count;
     
     relation->base.info.id = self->relation.id;
@@ -482,14 +611,11 @@ static void writeRelationInternal(void* abstractSelf, OsmChangeType change) {
         relation->base.relationMembers.values[m].ref = self->relationMembers.values[m].ref;
         relation->base.relationMembers.values[m].type = self->relationMembers.values[m].type;
         relation->base.relationMembers.values[m].role = utf8dup(self->relationMembers.values[m].role);
+        relation->base.relationMembers.values[m].roleBorrowed = 0;
     }
     
-    relation->base.tags.values = malloc(sizeof(PlainTag) * self->tags.count);
-    relation->base.tags.count = relation->base.tags.capacity = self->tags.count;
-    for(int t=0; t< self->tags.count;t++) {
-        relation->base.tags.values[t].key = utf8dup(self->tags.values[t].key);
-        relation->base.tags.values[t].value = utf8dup(self->tags.values[t].value);
-    }
+    initPlainTags(&(relation->base.tags));
+    copyPlainTags(&(self->tags), &(relation->base.tags));
     relation->change = change;
     
     self->relations.count++;
@@ -504,34 +630,23 @@ static void writeRelation(void* abstractSelf) {
 
 static void newRelationMember(void* abstractSelf, OsmId ref, OsmEntityType type, UTF8* role) {
     osm2omm* self = (osm2omm*) abstractSelf;
-    if(self->relationMembers.capacity < self->relationMembers.count + 1) {
-        self->relationMembers.capacity += 10;
-        self->relationMembers.values = realloc(self->relationMembers.values, self->relationMembers.capacity * sizeof(RelationMemberInfo));
-    }
+    ensureRelationMembersCapacityForNNewElements(&(self->relationMembers), 1);
     self->relationMembers.values[self->relationMembers.count].ref = ref;
     self->relationMembers.values[self->relationMembers.count].type = type;
     self->relationMembers.values[self->relationMembers.count].role = utf8dup(role);
+    self->relationMembers.values[self->relationMembers.count].roleBorrowed = 0;
     self->relationMembers.count++;
 }
 
 static void newTag(void* abstractSelf, OsmEntityType type, UTF8* key, UTF8* value) {
     //printf("New tag\n");
     osm2omm* self = (osm2omm*) abstractSelf;
-    if(self->tags.capacity < self->tags.count + 1) {
-        self->tags.capacity += 10;
-        self->tags.values = realloc(self->tags.values, self->tags.capacity * sizeof(PlainTag));
-    }
-    self->tags.values[self->tags.count].key = utf8dup(key);
-    self->tags.values[self->tags.count].value = utf8dup(value);
-    self->tags.count++;
+    addPlainTag(&(self->tags), key, value);
     //printf("End New tag\n");
 }
 
-static multiInsert relationMembersInsert = {NULL, NULL, 0, NULL, 0};
-
 static void writeRelationMembers(RelationChange* relation, MCountry* country) {
     int i=0;
-    reinit_multiInsert(&relationMembersInsert, country->insertRelationMemberStatement);
     for(int m=0;m<relation->base.relationMembers.count;m++) {
         RelationMemberInfo* member = relation->base.relationMembers.values + m;
         int inMap = 0;
@@ -555,7 +670,7 @@ static void writeRelationMembers(RelationChange* relation, MCountry* country) {
                        relation->base.relationMembers.values[m].ref, 
                        (char*)relation->base.relationMembers.values[m].role, 
                        i);*/
-            add_multiInsert(&relationMembersInsert, relation->base.info.id, 
+            add_multiInsert(&(country->relationMembersInsert), relation->base.info.id, 
                             relationMemberType2String(relation->base.relationMembers.values[m].type), 
                             relation->base.relationMembers.values[m].ref, 
                             (char*)relation->base.relationMembers.values[m].role, 
@@ -563,7 +678,7 @@ static void writeRelationMembers(RelationChange* relation, MCountry* country) {
             i++;
         }
     }
-    exec_multiInsert(&relationMembersInsert);
+    entityWritten(country, &(country->relationMembersInsert));
 }
 
 static void writeRelations(osm2omm* self, MCountry* country) {
@@ -607,14 +722,14 @@ static void writeRelations(osm2omm* self, MCountry* country) {
             addTree16Node(&(country->relationsIndex), self->relations.values[r].base.info.id, self->relations.values[r].base.info.id);
             if (self->relations.values[r].change == OSM_CHANGE_CREATE) {
                 mysql_exec(country->insertRelationStatement, self->relations.values[r].base.info.id, self->relations.values[r].base.info.timestamp);
-                writeTags(self, &(self->relations.values[r].base.tags), country->insertRelationTagStatement, self->relations.values[r].base.info.id);
+                writeTags(country, &(country->relationTagsInsert), &(self->relations.values[r].base.tags), self->relations.values[r].base.info.id);
                 writeRelationMembers(self->relations.values + r, country);
             } else if (self->relations.values[r].change == OSM_CHANGE_DELETE) {
                 deleteRelationFromCountry(country, self->relations.values[r].base.info.id);
             } else if (self->relations.values[r].change == OSM_CHANGE_MODIFY) {
                 mysql_exec(country->updateRelationStatement, self->relations.values[r].base.info.id, self->relations.values[r].base.info.timestamp);
                 deleteFromDbById(&(country->db), country->deleteRelationTagsStatement, self->relations.values[r].base.info.id);
-                writeTags(self, &(self->relations.values[r].base.tags), country->insertRelationTagStatement, self->relations.values[r].base.info.id);
+                writeTags(country, &(country->relationTagsInsert), &(self->relations.values[r].base.tags), self->relations.values[r].base.info.id);
                 deleteFromDbById(&(country->db), country->deleteRelationMembersStatement, self->relations.values[r].base.info.id);
                 writeRelationMembers(self->relations.values + r, country);
             }
@@ -730,7 +845,7 @@ static void mysql_finalize(mysql_stmt* statement) {
 
 typedef void (*CountryInitializer)(MCountry* self);
 
-void initOsm2OmmInternal(osm2omm* self, const char* host, const char* user, const char* password, CountryPolygon* polygons, int polygonsCount, CountryInitializer initCountry) {
+void initOsm2OmmInternal(osm2omm* self, const char* host, const char* user, const char* password, CountryPolygon* polygons, int polygonsCount, CountryInitializer initCountry, char pipelined) {
     initOsmStreamReader(&(self->reader), self);
     
     self->reader.newTag = newTag;
@@ -784,6 +899,21 @@ void initOsm2OmmInternal(osm2omm* self, const char* host, const char* user, cons
         
         printf("Connected to db with charset %s\n", mysql_character_set_name(db));
         
+        if(pipelined) {
+            int w = 0;
+            while(w < MYSQL_WRITERS_COUNT && connectMysqlWriter(self->countries[p].writers + w, host, user, password)) {
+                w++;
+            }
+            if(w == MYSQL_WRITERS_COUNT) {
+                self->countries[p].pipelined = 1;
+            } else {
+                fprintf(stderr, "Inserts will not be pipelined.\n");
+                while(w--) {
+                    mysql_close(&(self->countries[p].writers[w].db));
+                }
+            }
+        }
+        
         initCountry(self->countries + p);
         
         printf("Done.\n");
@@ -798,7 +928,7 @@ static void initInsertStatements(MCountry* country) {
     prepareMutiInsertStatement(db, "INSERT INTO current_node_tags(id, k, v) VALUES (?l, ?s, ?s)", 
                      &(country->insertNodeTagStatement));
     
-    prepareStatement(db, "INSERT INTO current_ways(id, visible, timestamp, user_id) VALUES (?l, 1, ?l, -1)", 
+    prepareMutiInsertStatement(db, "INSERT INTO current_ways(id, visible, timestamp, user_id) VALUES (?l, 1, ?l, -1)", 
                      &(country->insertWayStatement));
     prepareMutiInsertStatement(db, "INSERT INTO current_way_tags(id, k, v) VALUES (?l, ?s, ?s)", 
                      &(country->insertWayTagStatement));
@@ -815,12 +945,77 @@ static void initInsertStatements(MCountry* country) {
     country->nodeExistsStatement = NULL;
     country->wayExistsStatement = NULL;
     country->relationExistsStatement = NULL;
+    
+    mysql_writer* writers = country->pipelined ? country->writers : NULL;
+    init_multiInsert(&(country->nodesInsert), country->insertNodeStatement, writers ? writers + MYSQL_WRITER_NODES : NULL);
+    init_multiInsert(&(country->waysInsert), country->insertWayStatement, writers ? writers + MYSQL_WRITER_WAYS : NULL);
+    init_multiInsert(&(country->wayNodesInsert), country->insertWayNodeStatement, writers ? writers + MYSQL_WRITER_WAYS : NULL);
+    init_multiInsert(&(country->nodeTagsInsert), country->insertNodeTagStatement, writers ? writers + MYSQL_WRITER_TAGS : NULL);
+    init_multiInsert(&(country->wayTagsInsert), country->insertWayTagStatement, writers ? writers + MYSQL_WRITER_TAGS : NULL);
+    init_multiInsert(&(country->relationTagsInsert), country->insertRelationTagStatement, writers ? writers + MYSQL_WRITER_TAGS : NULL);
+    init_multiInsert(&(country->relationMembersInsert), country->insertRelationMemberStatement, NULL);
+}
+
+static void freeInserts(MCountry* country) {
+    free_multiInsert(&(country->nodesInsert));
+    free_multiInsert(&(country->waysInsert));
+    free_multiInsert(&(country->wayNodesInsert));
+    free_multiInsert(&(country->nodeTagsInsert));
+    free_multiInsert(&(country->wayTagsInsert));
+    free_multiInsert(&(country->relationTagsInsert));
+    free_multiInsert(&(country->relationMembersInsert));
 }
 
 static void prepareForBulkImport(MYSQL* db) {
     mysql_query_with_error(db, "LOCK TABLES current_nodes WRITE, current_ways WRITE, current_way_nodes WRITE, current_relations WRITE, current_relation_members WRITE, current_node_tags WRITE, current_way_tags WRITE, current_relation_tags WRITE");
 }
 
+static const char* writerLocks[MYSQL_WRITERS_COUNT] = {
+    "LOCK TABLES current_nodes WRITE",
+    "LOCK TABLES current_ways WRITE, current_way_nodes WRITE",
+    "LOCK TABLES current_node_tags WRITE, current_way_tags WRITE, current_relation_tags WRITE"
+};
+
+// Each writer locks only tables of its group, main connection keeps relations which are written on close.
+static void prepareForPipelinedImport(MCountry* country) {
+    int w = 0;
+    for(; w < MYSQL_WRITERS_COUNT; w++) {
+        mysql_writer* writer = country->writers + w;
+        mysql_select_db(&(writer->db), country->polygon->name);
+        mysql_query_with_error(&(writer->db), writerLocks[w]);
+        if(!startMysqlWriter(writer)) {
+            break;
+        }
+    }
+    if(w < MYSQL_WRITERS_COUNT) {
+        fprintf(stderr, "Inserts will not be pipelined.\n");
+        for(int i = 0; i < MYSQL_WRITERS_COUNT; i++) {
+            if(i < w) {
+                stopMysqlWriter(country->writers + i);
+            }
+            mysql_query_with_error(&(country->writers[i].db), "UNLOCK TABLES");
+            mysql_close(&(country->writers[i].db));
+        }
+        country->pipelined = 0;
+        prepareForBulkImport(&(country->db));
+    } else {
+        mysql_query_with_error(&(country->db), "LOCK TABLES current_relations WRITE, current_relation_members WRITE");
+    }
+}
+
+static void closePipelinedImport(MCountry* country) {
+    for(int w = 0; w < MYSQL_WRITERS_COUNT; w++) {
+        mysql_writer* writer = country->writers + w;
+        if(waitMysqlWriter(writer)) {
+            fprintf(stderr, "Some inserts to %s failed.\n", writerLocks[w] + strlen("LOCK TABLES "));
+        }
+        stopMysqlWriter(writer);
+        mysql_query_with_error(&(writer->db), "UNLOCK TABLES");
+        mysql_close(&(writer->db));
+    }
+    country->pipelined = 0;
+}
+
 static void initCountryForInserts(MCountry* country) {
     MYSQL* db = &(country->db);
     
@@ -852,21 +1047,21 @@ static void initCountryForInserts(MCountry* country) {
     mysql_query_with_error(db, "CREATE TABLE current_way_tags         (id INTEGER, k nvarchar(255), v nvarchar(255), UNIQUE KEY (id, k))");
     mysql_query_with_error(db, "CREATE TABLE current_relation_tags    (id INTEGER, k nvarchar(255), v nvarchar(255), UNIQUE KEY (id, k))");
     
-    prepareForBulkImport(db);
+    if(country->pipelined) {
+        prepareForPipelinedImport(country);
+    } else {
+        prepareForBulkImport(db);
+    }
     
     country->ifNodeExists = checkNodeInTree16;
     country->ifWayExists = checkWayInTree16;
     country->ifRelationExists = checkRelationInTree16;
     
     initInsertStatements(country);
-    
-    init_multiInsert(&(country->taglessNodesInsert), country->insertNodeStatement);
-/*    country->taglessNodesInsert.query = malloc(sizeof(char) * 16001000);
-    country->taglessNodesInsert.capacity = 16001000;*/
 }
 
 void initOsm2Omm(osm2omm* self, const char* host, const char* user, const char* password, CountryPolygon* polygons, int polygonsCount) {
-    initOsm2OmmInternal(self, host, user, password, polygons, polygonsCount, initCountryForInserts);
+    initOsm2OmmInternal(self, host, user, password, polygons, polygonsCount, initCountryForInserts, 1);
 }
 
 void convertOsm2OmmFromFile(osm2omm* self, const char *filename) {
@@ -879,13 +1074,22 @@ void convertOsm2OmmFromStdin(osm2omm* self) {
 
 void closeOsm2OmmInternal(osm2omm* self, char createIndicies) {
     for(int c=0;c < self->countriesCount; c++) {
-        if(self->countries[c].taglessNodesInsert.rowsCount > 0) {
-            exec_multiInsert(&(self->countries[c].taglessNodesInsert));
-        }
+        MCountry* country = self->countries + c;
+        flush_multiInsert(&(country->nodesInsert));
+        flush_multiInsert(&(country->waysInsert));
+        flush_multiInsert(&(country->wayNodesInsert));
+        flush_multiInsert(&(country->nodeTagsInsert));
+        flush_multiInsert(&(country->wayTagsInsert));
         
-        writeRelations(self, self->countries + c);
+        writeRelations(self, country);
+        
+        flush_multiInsert(&(country->relationTagsInsert));
+        flush_multiInsert(&(country->relationMembersInsert));
+        if(country->pipelined) {
+            closePipelinedImport(country);
+        }
+        freeInserts(country);
         
-        MCountry* country = self->countries + c;
         freeTree16(&(country->nodesIndex));
         freeTree16(&(country->waysIndex));
         freeTree16(&(country->relationsIndex));
@@ -940,186 +1144,322 @@ void closeOsm2Omm(osm2omm* self) {
     closeOsm2OmmInternal(self, 1);
 }
 
-static void initOmm(omm* self, const char* host, const char* user, const char* password, const char* database) {
-    self->currentNode.tags.values = NULL;
-    self->currentNode.tags.count = 0;
-    self->currentWay.tags.values = NULL;
-    self->currentWay.tags.count = 0;
-    self->currentRelation.tags.values = NULL;
-    self->currentRelation.tags.count = 0;
-    
-    self->currentWay.wayNodes.values = NULL;
-    self->currentWay.wayNodes.count = 0;
-    self->currentRelation.relationMembers.values = NULL;
-    self->currentRelation.relationMembers.count = 0;    
-    MYSQL* db = &(self->db);
+static char connectOmm(MYSQL* db, const char* host, const char* user, const char* password, const char* database) {
     mysql_init(db);
-    mysql_real_connect(db, host, user, password, database, 0, NULL, 0);
-    prepareStatement(db, "SELECT id, latitude, longitude FROM current_nodes", &(self->nodeStatement));
-    prepareStatement(db, "SELECT id FROM current_ways", &(self->wayStatement));
-    prepareStatement(db, "SELECT id FROM current_relations", &(self->relationStatement));
-    
-    prepareStatement(db, "SELECT k, v FROM current_node_tags WHERE id = ?l", &(self->nodeTagsStatement));
-    prepareStatement(db, "SELECT k, v FROM current_way_tags WHERE id = ?l", &(self->wayTagsStatement));
-    prepareStatement(db, "SELECT k, v FROM current_relation_tags WHERE id = ?l", &(self->relationTagsStatement));
+    mysql_options(db, MYSQL_SET_CHARSET_NAME, "UTF8");
+    if(!mysql_real_connect(db, host, user, password, database, 0, NULL, 0)) {
+        fprintf(stderr, "Error connect ro db server %s:%s@%s: %s\n", user, password, host, mysql_error(db));
+        return 0;
+    }
+    return 1;
+}
+
+static void initOmm(omm* self, const char* host, const char* user, const char* password, const char* database) {
+    // Parents are streamed on first connection, so children and single objects are read through second one.
+    connectOmm(&(self->db), host, user, password, database);
+    connectOmm(&(self->childDb), host, user, password, database);
     
-    prepareStatement(db, "SELECT current_nodes.id, latitude, longitude FROM current_way_nodes JOIN current_nodes ON node_id = current_nodes.id WHERE current_way_nodes.id = ?l ORDER BY sequence_id ASC", &(self->wayNodesStatement));
-    prepareStatement(db, "SELECT member_type, member_id, member_role FROM current_relation_members WHERE id = ?l", &(self->relationMembersStatement));
+    self->nodes = calloc(sizeof(Node), OMM_BLOCK_SIZE);
+    self->ways = calloc(sizeof(Way), OMM_BLOCK_SIZE);
+    self->relations = calloc(sizeof(Relation), OMM_BLOCK_SIZE);
     
-    prepareStatement(db, "SELECT id FROM current_ways WHERE id = ?l", &(self->wayWithIdStatement));
-    prepareStatement(db, "SELECT id, latitude, longitude FROM current_nodes WHERE id = ?l", &(self->nodeWithIdStatement));
-    prepareStatement(db, "SELECT id FROM current_relations WHERE id = ?l", &(self->relationWithIdStatement));
+    self->query = malloc(sizeof(char) * (OMM_BLOCK_SIZE * 11 + 512));
+    initArena(&(self->arena));
 }
-/*
-static void readMTags(omm* self, mysql_stmt* statement, PlainTags* tags, OsmId ownerId) {
-    MYSQL_bind_int(statement, 1, ownerId);
-    removeAllPlainTags(tags);
-    while(MYSQL_step(statement) == SQLITE_ROW) {
-        if(tags->capacity < tags->count + 1) {
-            tags->capacity += 10;
-            tags->values = realloc(tags->values, tags->capacity * sizeof(PlainTag));
+
+static int compareOmmBlockEntries(const void* e1, const void* e2) {
+    OsmId id1 = ((OmmBlockEntry*)e1)->id;
+    OsmId id2 = ((OmmBlockEntry*)e2)->id;
+    return id1 < id2 ? -1 : (id1 > id2 ? 1 : 0);
+}
+
+static OmmBlockEntry* findOmmBlockEntry(OmmStream* stream, OsmId id) {
+    OmmBlockEntry key;
+    key.id = id;
+    return bsearch(&key, stream->index, stream->count, sizeof(OmmBlockEntry), compareOmmBlockEntries);
+}
+
+// Builds "<select> WHERE <column> IN (<ids of block>) <suffix>" query.
+static const char* blockQuery(omm* self, OmmStream* stream, const char* select, const char* column, const char* suffix) {
+    char* end = self->query + sprintf(self->query, "%s WHERE %s IN (", select, column);
+    for(int i = 0; i < stream->count; i++) {
+        end += sprintf(end, i ? ",%u" : "%u", stream->index[i].id);
+    }
+    sprintf(end, ") %s", suffix);
+    return self->query;
+}
+
+static MYSQL_RES* queryOmmChildren(omm* self, OmmStream* stream, const char* select, const char* column, const char* suffix) {
+    if(mysql_query_with_error(&(self->childDb), blockQuery(self, stream, select, column, suffix))) {
+        return NULL;
+    }
+    return mysql_use_result(&(self->childDb));
+}
+
+static void readMTagsBlock(omm* self, OmmStream* stream, const char* table) {
+    char select[64];
+    sprintf(select, "SELECT id, k, v FROM %s", table);
+    MYSQL_RES* result = queryOmmChildren(self, stream, select, "id", "");
+    if(!result) {
+        return;
+    }
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(result))) {
+        OmmBlockEntry* entry = findOmmBlockEntry(stream, atol(row[0]));
+        if(entry) {
+            addPlainTagInArena(entry->tags, UTF8_CAST row[1], UTF8_CAST (row[2] ? row[2] : ""), &(self->arena));
         }
-        tags->values[tags->count].key = utf8dup(MYSQL_column_text(statement, 0));
-        tags->values[tags->count].value = utf8dup(MYSQL_column_text(statement, 1));
-        tags->count++;
     }
-    MYSQL_reset(statement);
+    mysql_free_result(result);
 }
 
-static Node* readMNode(omm* self, Node* node) {
-    //printf("Reading node...\n");
-    node->info.id = MYSQL_column_int(self->nodeStatement, 0);
-    node->info.lat = MYSQL_column_int(self->nodeStatement, 1);
-    node->info.lon = MYSQL_column_int(self->nodeStatement, 2);
-    //printf("Reading node tags...\n");
-    readMTags(self, self->nodeTagsStatement, &(node->tags), node->info.id);
-    //printf("Read.\n");
-    return node;
+static void readMWayNodesBlock(omm* self, OmmStream* stream) {
+    MYSQL_RES* result = queryOmmChildren(self, stream, 
+                                         "SELECT current_way_nodes.id, current_nodes.id, latitude, longitude FROM current_way_nodes JOIN current_nodes ON node_id = current_nodes.id", 
+                                         "current_way_nodes.id", "ORDER BY current_way_nodes.id, sequence_id");
+    if(!result) {
+        return;
+    }
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(result))) {
+        OmmBlockEntry* entry = findOmmBlockEntry(stream, atol(row[0]));
+        if(entry) {
+            NodeInfo node;
+            node.id = atol(row[1]);
+            node.lat = atol(row[2]);
+            node.lon = atol(row[3]);
+            node.timestamp = 0;
+            addToNodesInfo((NodesInfo*)entry->children, node);
+        }
+    }
+    mysql_free_result(result);
 }
 
-static void readMWayNodes(omm* self, Way* way) {
-    //printf("Bind id...\n");
-    MYSQL_bind_int(self->wayNodesStatement, 1, way->info.id);
-    //printf("Clear old nodes...\n");
-    removeAllNodesInfo(&(way->wayNodes));
-    //printf("Reading..");
-    while(MYSQL_step(self->wayNodesStatement) == SQLITE_ROW) {
-        if(way->wayNodes.capacity < way->wayNodes.count + 1) {
-            way->wayNodes.capacity += 10;
-            way->wayNodes.values = realloc(way->wayNodes.values, way->wayNodes.capacity * sizeof(NodeInfo));
+static void readMRelationMembersBlock(omm* self, OmmStream* stream) {
+    MYSQL_RES* result = queryOmmChildren(self, stream, "SELECT id, member_type, member_id, member_role FROM current_relation_members", 
+                                         "id", "ORDER BY id, sequence_id");
+    if(!result) {
+        return;
+    }
+    MYSQL_ROW row;
+    while((row = mysql_fetch_row(result))) {
+        OmmBlockEntry* entry = findOmmBlockEntry(stream, atol(row[0]));
+        if(entry) {
+            RelationMembers* members = (RelationMembers*)entry->children;
+            RelationMemberInfo member;
+            member.type = string2relationMemberType(UTF8_CAST row[1]);
+            member.ref = atol(row[2]);
+            member.role = arenaUtf8dup(&(self->arena), UTF8_CAST (row[3] ? row[3] : ""));
+            member.roleBorrowed = 1;
+            ensureRelationMembersCapacityForNNewElements(members, 1);
+            members->values[members->count++] = member;
         }
-        way->wayNodes.values[way->wayNodes.count].id = MYSQL_column_int(self->wayNodesStatement, 0);
-        way->wayNodes.values[way->wayNodes.count].lat = MYSQL_column_int(self->wayNodesStatement, 1);
-        way->wayNodes.values[way->wayNodes.count].lon = MYSQL_column_int(self->wayNodesStatement, 2);
-        way->wayNodes.count++;
-    }
-    //printf("Nodes read\n");
-    MYSQL_reset(self->wayNodesStatement);
-}
-
-static Way* readMWay(omm* self, Way* way) {
-    //printf("Reading way...\n");
-    way->info.id = MYSQL_column_int(self->wayStatement, 0);
-    //printf("Reading way tags...\n");
-    readLTags(self, self->wayTagsStatement, &(way->tags), way->info.id);
-    //printf("Reading nodes...\n");
-    readLWayNodes(self, way);
-    //printf("Read\n");
-    return way;
+    }
+    mysql_free_result(result);
 }
 
-static void readMRelationMembers(omm* self, Relation* relation) {
-    MYSQL_bind_int(self->relationMembersStatement, 1, relation->info.id);
-    removeAllRelationMembers(&(relation->relationMembers));
-    while(MYSQL_step(self->relationMembersStatement) == SQLITE_ROW) {
-        if(relation->relationMembers.capacity < relation->relationMembers.count + 1) {
-            relation->relationMembers.capacity += 10;
-            relation->relationMembers.values = realloc(relation->relationMembers.values, relation->relationMembers.capacity * sizeof(RelationMemberInfo));
+static void closeOmmStream(OmmStream* stream) {
+    if(stream->result) {
+        mysql_free_result(stream->result);
+        stream->result = NULL;
+    }
+    stream->count = 0;
+    stream->current = 0;
+}
+
+static void restartOmmStream(OmmStream* stream) {
+    closeOmmStream(stream);
+    stream->finished = 0;
+}
+
+// Reads next block of parent rows. Only one stream can be read at a time on connection so others are closed.
+static int readOmmStreamBlock(omm* self, OmmStream* stream, const char* query, void (*readRow)(omm* self, OmmBlockEntry* entry, int position, MYSQL_ROW row)) {
+    stream->count = 0;
+    stream->current = 0;
+    if(stream->finished) {
+        return 0;
+    }
+    // Only one block is read at a time, so entities of previous one are not used any more.
+    resetArena(&(self->arena));
+    if(!stream->result) {
+        OmmStream* streams[] = {&(self->nodesStream), &(self->waysStream), &(self->relationsStream)};
+        for(int s = 0; s < 3; s++) {
+            if(streams[s] != stream) {
+                closeOmmStream(streams[s]);
+            }
+        }
+        if(mysql_query_with_error(&(self->db), query) || !(stream->result = mysql_use_result(&(self->db)))) {
+            stream->finished = 1;
+            return 0;
         }
-        relation->relationMembers.values[relation->relationMembers.count].type = string2relationMemberType((UTF8*)MYSQL_column_text(self->relationMembersStatement, 0));
-        relation->relationMembers.values[relation->relationMembers.count].ref = MYSQL_column_int(self->relationMembersStatement, 1);
-        relation->relationMembers.values[relation->relationMembers.count].role = utf8dup(MYSQL_column_text(self->relationMembersStatement, 2));
-        relation->relationMembers.count++;
     }
-    MYSQL_reset(self->relationMembersStatement);
+    MYSQL_ROW row;
+    while(stream->count < OMM_BLOCK_SIZE && (row = mysql_fetch_row(stream->result))) {
+        readRow(self, stream->index + stream->count, stream->count, row);
+        stream->count++;
+    }
+    if(stream->count < OMM_BLOCK_SIZE) {
+        mysql_free_result(stream->result);
+        stream->result = NULL;
+        stream->finished = 1;
+    }
+    qsort(stream->index, stream->count, sizeof(OmmBlockEntry), compareOmmBlockEntries);
+    return stream->count;
+}
+
+static void readMNodeRow(omm* self, OmmBlockEntry* entry, int position, MYSQL_ROW row) {
+    Node* node = self->nodes + position;
+    node->info.id = atol(row[0]);
+    node->info.lat = atol(row[1]);
+    node->info.lon = atol(row[2]);
+    node->info.timestamp = row[3] ? atol(row[3]) : 0;
+    removeAllPlainTags(&(node->tags));
+    entry->id = node->info.id;
+    entry->tags = &(node->tags);
+    entry->children = NULL;
+}
+
+static void readMWayRow(omm* self, OmmBlockEntry* entry, int position, MYSQL_ROW row) {
+    Way* way = self->ways + position;
+    way->info.id = atol(row[0]);
+    way->info.timestamp = row[1] ? atol(row[1]) : 0;
+    removeAllPlainTags(&(way->tags));
+    removeAllNodesInfo(&(way->wayNodes));
+    entry->id = way->info.id;
+    entry->tags = &(way->tags);
+    entry->children = &(way->wayNodes);
 }
 
-static Relation* readMRelation(omm* self, Relation* relation) {
-    relation->info.id = MYSQL_column_int(self->relationStatement, 0);
-    readLTags(self, self->relationTagsStatement, &(relation->tags), relation->info.id);
-    readLRelationMembers(self, relation);
-    return relation;
+static void readMRelationRow(omm* self, OmmBlockEntry* entry, int position, MYSQL_ROW row) {
+    Relation* relation = self->relations + position;
+    relation->info.id = atol(row[0]);
+    relation->info.timestamp = row[1] ? atol(row[1]) : 0;
+    removeAllPlainTags(&(relation->tags));
+    removeAllRelationMembers(&(relation->relationMembers));
+    entry->id = relation->info.id;
+    entry->tags = &(relation->tags);
+    entry->children = &(relation->relationMembers);
 }
 
-static Node* nextMNode(void* self) {
-    //printf("Retrive next node..\n");
-    if(MYSQL_step(((omm*)self)->nodeStatement) == SQLITE_ROW) {
-        return readMNode((omm*) self, &(((omm*)self)->currentNode));
-    }    
-    //printf("No more nodes..\n");
-    return NULL;
+static Node* nextMNode(void* abstractSelf) {
+    omm* self = (omm*) abstractSelf;
+    OmmStream* stream = &(self->nodesStream);
+    if(stream->current >= stream->count) {
+        if(!readOmmStreamBlock(self, stream, "SELECT id, latitude, longitude, timestamp FROM current_nodes", readMNodeRow)) {
+            return NULL;
+        }
+        readMTagsBlock(self, stream, "current_node_tags");
+    }
+    return self->nodes + (stream->current++);
+}
+
+static void readMWaysChildren(omm* self, OmmStream* stream) {
+    readMTagsBlock(self, stream, "current_way_tags");
+    readMWayNodesBlock(self, stream);
 }
 
-static Way* nextMWay(void* self) {
-    //printf("Next way...\n");
-    if(MYSQL_step(((omm*)self)->wayStatement) == SQLITE_ROW) {
-        return readMWay((omm*) self, &(((omm*)self)->currentWay));
+static Way* nextMWay(void* abstractSelf) {
+    omm* self = (omm*) abstractSelf;
+    OmmStream* stream = &(self->waysStream);
+    if(stream->current >= stream->count) {
+        if(!readOmmStreamBlock(self, stream, "SELECT id, timestamp FROM current_ways", readMWayRow)) {
+            return NULL;
+        }
+        readMWaysChildren(self, stream);
     }
-    //printf("No more ways...\n");
-    return NULL;
+    return self->ways + (stream->current++);
 }
 
-static Relation* nextMRelation(void* self) {
-    if(MYSQL_step(((omm*)self)->relationStatement) == SQLITE_ROW) {
-        return readMRelation((omm*) self, &(((omm*)self)->currentRelation));
+static Relation* nextMRelation(void* abstractSelf) {
+    omm* self = (omm*) abstractSelf;
+    OmmStream* stream = &(self->relationsStream);
+    if(stream->current >= stream->count) {
+        if(!readOmmStreamBlock(self, stream, "SELECT id, timestamp FROM current_relations", readMRelationRow)) {
+            return NULL;
+        }
+        readMTagsBlock(self, stream, "current_relation_tags");
+        readMRelationMembersBlock(self, stream);
     }
-    return NULL;
+    return self->relations + (stream->current++);
 }
-*/
-void closeOmmReader(void* abstractSelf) {
-    omm* self = (omm*)abstractSelf;
-    mysql_finalize(self->nodeStatement);
-    mysql_finalize(self->wayStatement);
-    mysql_finalize(self->relationStatement);
-    mysql_finalize(self->nodeTagsStatement);
-    mysql_finalize(self->wayTagsStatement);
-    mysql_finalize(self->relationTagsStatement);
-    mysql_finalize(self->wayNodesStatement);
-    mysql_finalize(self->relationMembersStatement);
-    mysql_close(&(self->db));
-    free(self->currentNode.tags.values);
-    free(self->currentWay.tags.values);
-    free(self->currentRelation.tags.values);
-}/*
 
 static void restartMNodes(void* self) {
-    MYSQL_reset(((omm*) self)->nodeStatement);
+    restartOmmStream(&(((omm*) self)->nodesStream));
 }
 
 static void restartMWays(void* self) {
-    MYSQL_reset(((omm*) self)->wayStatement);
+    restartOmmStream(&(((omm*) self)->waysStream));
 }
 
 static void restartMRelations(void* self) {
-    MYSQL_reset(((omm*) self)->relationStatement);
+    restartOmmStream(&(((omm*) self)->relationsStream));
+}
+
+static void resetMScratch(void* self) {
+    resetArena(&(((omm*)self)->arena));
 }
 
-static Way* mWayWithId(void* self, OsmId id) {
+static Way* mWayWithId(void* abstractSelf, OsmId id) {
+    omm* self = (omm*) abstractSelf;
+    char query[64];
+    sprintf(query, "SELECT id, timestamp FROM current_ways WHERE id = %u", id);
+    if(mysql_query_with_error(&(self->childDb), query)) {
+        return NULL;
+    }
+    MYSQL_RES* result = mysql_store_result(&(self->childDb));
+    MYSQL_ROW row = result ? mysql_fetch_row(result) : NULL;
+    if(!row) {
+        if(result) {
+            mysql_free_result(result);
+        }
+        return NULL;
+    }
     Way* way = calloc(sizeof(Way), 1);
-    MYSQL_bind_int(((omm*)self)->wayWithIdStatement, 1, id);
-    if(MYSQL_step(((omm*)self)->wayWithIdStatement) == SQLITE_ROW) {
-        readMWay((omm*) self, way);
-        return way;
+    way->info.id = atol(row[0]);
+    way->info.timestamp = row[1] ? atol(row[1]) : 0;
+    mysql_free_result(result);
+    
+    // Single way is read as one-element block.
+    OmmStream single;
+    single.count = 1;
+    single.index[0].id = way->info.id;
+    single.index[0].tags = &(way->tags);
+    single.index[0].children = &(way->wayNodes);
+    readMWaysChildren(self, &single);
+    return way;
+}
+
+static void freeOmmBlock(omm* self) {
+    for(int i = 0; i < OMM_BLOCK_SIZE; i++) {
+        clearPlainTags(&(self->nodes[i].tags));
+        clearPlainTags(&(self->ways[i].tags));
+        clearNodesInfo(&(self->ways[i].wayNodes));
+        clearPlainTags(&(self->relations[i].tags));
+        clearRelationMembers(&(self->relations[i].relationMembers));
     }
-    return NULL;
-}*/
+    free(self->nodes);
+    free(self->ways);
+    free(self->relations);
+}
+
+void closeOmmReader(void* abstractSelf) {
+    omm* self = (omm*)abstractSelf;
+    closeOmmStream(&(self->nodesStream));
+    closeOmmStream(&(self->waysStream));
+    closeOmmStream(&(self->relationsStream));
+    mysql_close(&(self->db));
+    mysql_close(&(self->childDb));
+    freeOmmBlock(self);
+    clearArena(&(self->arena));
+    free(self->query);
+}
 
 OsmDbReader* newOmmReader(const char* host, const char* user, const char* password, const char* db) {
     OsmDbReader* reader = calloc(sizeof(OsmDbReader), 1);
     
     omm* self = calloc(sizeof(omm), 1);
     initOmm(self, host, user, password, db);
-    initOsmDbReader(reader, self);/*
+    initOsmDbReader(reader, self);
     reader->nextNode = nextMNode;
     reader->nextWay = nextMWay;
     reader->nextRelation = nextMRelation;
@@ -1128,7 +1468,9 @@ OsmDbReader* newOmmReader(const char* host, const char* user, const char* passwo
     reader->restartWays = restartMWays;
     reader->restartRelations = restartMRelations;
     
-    reader->wayWithId = mWayWithId;*/
+    reader->wayWithId = mWayWithId;
+    
+    reader->resetScratch = resetMScratch;
     
     reader->close = closeOmmReader;
     return reader;    
@@ -1148,11 +1490,12 @@ static void updateNode(void* abstractSelf) {
             addTree16Node(&(self->countries[c].nodesIndex), self->node.id, self->node.id);
             //printf("Added to index\n");
             //printf("Adding to db with statement: %x\n", self->countries[c].insertNodeStatement);
+            exec_multiInsert(&(self->countries[c].nodesInsert));
             beginTransaction(&(self->countries[c].db));
             mysql_exec(self->countries[c].updateNodeStatement, self->node.id, self->node.lat, self->node.lon);
 
             deleteFromDbById(&(self->countries[c].db), self->countries[c].deleteNodeTagsStatement, self->node.id);
-            writeTags(self, &(self->tags), self->countries[c].insertNodeTagStatement, self->node.id);
+            writeTags(self->countries + c, &(self->countries[c].nodeTagsInsert), &(self->tags), self->node.id);
             //printf("Writing tags\n");
             commitTransaction(&(self->countries[c].db));
         } else {
@@ -1187,7 +1530,7 @@ static void updateWay(void* abstractSelf) {
             beginTransaction(&(self->countries[c].db));
             mysql_exec(self->countries[c].updateWayStatement, 1);
             deleteFromDbById(&(self->countries[c].db), self->countries[c].deleteWayTagsStatement, self->way.id);
-            writeTags(self, &(self->tags), self->countries[c].insertWayTagStatement, self->way.id);
+            writeTags(self->countries + c, &(self->countries[c].wayTagsInsert), &(self->tags), self->way.id);
             deleteFromDbById(&(self->countries[c].db), self->countries[c].deleteWayNodesStatement, self->way.id);
             writeWayNodes(self, self->countries+c);
             commitTransaction(&(self->countries[c].db));
@@ -1240,14 +1583,11 @@ static void updateRelation(void* abstractSelf) {
             relation->base.relationMembers.values[m].ref = self->relationMembers.values[m].ref;
             relation->base.relationMembers.values[m].type = self->relationMembers.values[m].type;
             relation->base.relationMembers.values[m].role = utf8dup(self->relationMembers.values[m].role);
+            relation->base.relationMembers.values[m].roleBorrowed = 0;
         }
         
-        relation->base.tags.values = malloc(sizeof(PlainTag) * self->tags.count);
-        relation->base.tags.count = relation->base.tags.capacity = self->tags.count;
-        for(int t=0; t< self->tags.count;t++) {
-            relation->base.tags.values[t].key = utf8dup(self->tags.values[t].key);
-            relation->base.tags.values[t].value = utf8dup(self->tags.values[t].value);
-        }
+        initPlainTags(&(relation->base.tags));
+        copyPlainTags(&(self->tags), &(relation->base.tags));
         
         removeAllPlainTags(&(self->tags));
         removeAllRelationMembers(&(self->relationMembers));        
@@ -1307,7 +1647,6 @@ static void initCountryForUpdatesCommon(MCountry* country) {
                      &(country->deleteRelationTagsStatement));
     prepareStatement(db, "DELETE FROM current_relation_members WHERE id = ?l", 
                      &(country->deleteRelationMembersStatement));
-    init_multiInsert(&(country->taglessNodesInsert), country->insertNodeStatement);
 }
 
 static char checkInDb(mysql_stmt* statement, OsmId id) {
@@ -1373,7 +1712,7 @@ static void initCountryForUpdates(MCountry* country) {
 }
 
 void initOsd2Omm(osd2omm* self, const char* host, const char* user, const char* password, CountryPolygon* polygon, char fullMemory) {
-    initOsm2OmmInternal((osm2omm*)self, host, user, password, polygon, 1, fullMemory ? initCountryForUpdates : initCountryForUpdatesNoCache);
+    initOsm2OmmInternal((osm2omm*)self, host, user, password, polygon, 1, fullMemory ? initCountryForUpdates : initCountryForUpdatesNoCache, 0);
     
     if (fullMemory) {
         MYSQL* db = &(self->base.countries->db);
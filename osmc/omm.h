@@ -10,6 +10,18 @@
 #include "osm.h"
 #include "Tree16.h"
 #include <mysql.h>
+#include <pthread.h>
+
+#define MULTI_INSERT_DEFAULT_MAX_BYTES 1000000
+#define MULTI_INSERT_DEFAULT_MAX_ROWS 5000
+#define MYSQL_WRITER_QUEUE_LENGTH 4
+
+typedef enum {
+    MYSQL_WRITER_NODES = 0,
+    MYSQL_WRITER_WAYS,
+    MYSQL_WRITER_TAGS,
+    MYSQL_WRITERS_COUNT
+} MysqlWriterGroup;
 
 typedef enum {
     MYSQL_PARAM_INTEGER,
@@ -29,15 +41,47 @@ typedef struct {
 
 typedef struct {
     char* query;
-    char* queryEnd;
+    int length;
+    int capacity;
+} mysql_batch;
+
+// Connection with own thread which executes queued batches for one group of tables.
+typedef struct {
+    MYSQL db;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    
+    mysql_batch queue[MYSQL_WRITER_QUEUE_LENGTH];
+    int queueStart;
+    int queueCount;
+    mysql_batch spare[MYSQL_WRITER_QUEUE_LENGTH];
+    int spareCount;
+    
+    char busy;
+    char stopping;
+    int errors;
+} mysql_writer;
+
+typedef struct {
+    char* query;
+    int length;
     int capacity;
     mysql_stmt* statement;
     int rowsCount;
+    
+    int maxBytes;
+    int maxRows;
+    
+    // If set full batches are queued to this writer instead of being executed on statement connection.
+    mysql_writer* writer;
 } multiInsert;
 
 typedef struct {
     CountryPolygon* polygon;
     MYSQL db;
+    mysql_writer writers[MYSQL_WRITERS_COUNT];
+    char pipelined;
     
     mysql_stmt* insertNodeStatement;
     mysql_stmt* insertWayNodeStatement;
@@ -68,7 +112,13 @@ typedef struct {
     mysql_stmt* wayExistsStatement;
     mysql_stmt* relationExistsStatement;
     
-    multiInsert taglessNodesInsert;
+    multiInsert nodesInsert;
+    multiInsert waysInsert;
+    multiInsert wayNodesInsert;
+    multiInsert nodeTagsInsert;
+    multiInsert wayTagsInsert;
+    multiInsert relationTagsInsert;
+    multiInsert relationMembersInsert;
     
     Tree16 nodesIndex;
     Tree16 waysIndex;
@@ -103,31 +153,43 @@ typedef struct {
     osm2omm base;
 } osd2omm;
 
+#define OMM_BLOCK_SIZE 1000
+
+typedef struct {
+    OsmId id;
+    PlainTags* tags;
+    void* children;
+} OmmBlockEntry;
+
+// Parent rows streamed with mysql_use_result, read by blocks which children are fetched for with one query per table.
+typedef struct {
+    MYSQL_RES* result;
+    char finished;
+    int count;
+    int current;
+    OmmBlockEntry index[OMM_BLOCK_SIZE];
+} OmmStream;
+
 typedef struct {
     MYSQL db;
+    MYSQL childDb;
     
-    mysql_stmt* nodeStatement;
-    mysql_stmt* nodeTagsStatement;
-    
-    mysql_stmt* wayStatement;
-    mysql_stmt* wayTagsStatement;
-    mysql_stmt* wayNodesStatement;
+    OmmStream nodesStream;
+    OmmStream waysStream;
+    OmmStream relationsStream;
     
-    mysql_stmt* relationStatement;
-    mysql_stmt* relationTagsStatement;
-    mysql_stmt* relationMembersStatement;
+    Node* nodes;
+    Way* ways;
+    Relation* relations;
     
-    mysql_stmt* wayWithIdStatement;
-    mysql_stmt* nodeWithIdStatement;
-    mysql_stmt* relationWithIdStatement;
+    // Scratch data of entities, reset when next block is read.
+    Arena arena;
     
-    
-    Node currentNode;
-    Way currentWay;
-    Relation currentRelation;
+    char* query;
 } omm;
 
 #pragma mark osm2olm
+void setOmmMultiInsertLimits(int maxBytes, int maxRows);
 void initOsm2Omm(osm2omm* self, const char* host, const char* user, const char* password, CountryPolygon* polygons, int polygonsCount);
 void convertOsm2OmmFromFile(osm2omm* self, const char *filename);
 void convertOsm2OmmFromStdin(osm2omm* self);
@@ -8,6 +8,7 @@
  */
 
 #include "osm.h"
+#include <stdlib.h>
 #include <unistd.h>
 #include <libxml/xmlreader.h>
 #include <memory.h>
@@ -42,19 +43,109 @@ OsmTimestamp parseTimestamp(char* timestamp) {
 
 
 void freePlainTag(PlainTag* tag) {
-    free(tag->key);
-    free(tag->value);
+    if(tag->valueId == NO_TAG_STRING) {
+        free(tag->value);
+    }
+}
+CollectionImplCustomElementFree(PlainTag, PlainTags, 8)
+
+void addPlainTag(PlainTags* tags, const UTF8* key, const UTF8* value) {
+    addPlainTagInArena(tags, key, value, NULL);
+}
+
+void addPlainTagWithKeyId(PlainTags* tags, TagStringId keyId, UTF8* key, const UTF8* value) {
+    addPlainTagWithKeyIdInArena(tags, keyId, key, value, NULL);
+}
+
+void addPlainTagInArena(PlainTags* tags, const UTF8* key, const UTF8* value, Arena* arena) {
+    UTF8* internedKey;
+    TagStringId keyId = internTagString(key, &internedKey);
+    addPlainTagWithKeyIdInArena(tags, keyId, internedKey, value, arena);
+}
+
+void addPlainTagWithKeyIdInArena(PlainTags* tags, TagStringId keyId, UTF8* key, const UTF8* value, Arena* arena) {
+    ensurePlainTagsCapacityForNNewElements(tags, 1);
+    PlainTag* tag = tags->values + tags->count++;
+    tag->key = key;
+    tag->keyId = keyId;
+    tag->valueId = internTagValue(value, &(tag->value));
+    if(tag->valueId == NO_TAG_STRING) {
+        if(arena) {
+            tag->value = arenaUtf8dup(arena, value);
+            tag->valueId = BORROWED_TAG_VALUE;
+        } else {
+            tag->value = utf8dup(value);
+        }
+    }
+}
+
+void addInternedPlainTag(PlainTags* tags, TagStringId keyId, UTF8* key, TagStringId valueId, UTF8* value) {
+    ensurePlainTagsCapacityForNNewElements(tags, 1);
+    PlainTag* tag = tags->values + tags->count++;
+    tag->key = key;
+    tag->keyId = keyId;
+    tag->value = value;
+    tag->valueId = valueId;
+}
+
+void appendToPlainTagValue(PlainTag* tag, const UTF8* value) {
+    appendToPlainTagValueInArena(tag, value, NULL);
+}
+
+void appendToPlainTagValueInArena(PlainTag* tag, const UTF8* value, Arena* arena) {
+    if(arena) {
+        // Parts may end inside of character, so they are measured in bytes.
+        size_t size = strlen((const char*) tag->value);
+        UTF8* joined = arenaAlloc(arena, size + strlen((const char*) value) + 1);
+        memcpy(joined, tag->value, size);
+        strcpy((char*) joined + size, (const char*) value);
+        if(tag->valueId == NO_TAG_STRING) {
+            free(tag->value);
+        }
+        tag->value = joined;
+        tag->valueId = BORROWED_TAG_VALUE;
+        return;
+    }
+    if(tag->valueId != NO_TAG_STRING) {
+        tag->value = utf8dup(tag->value);
+        tag->valueId = NO_TAG_STRING;
+    }
+    tag->value = utf8cat(tag->value, value);
+}
+
+void copyPlainTags(PlainTags* source, PlainTags* target) {
+    copyPlainTagsToArena(source, target, NULL);
+}
+
+void copyPlainTagsToArena(PlainTags* source, PlainTags* target, Arena* arena) {
+    removeAllPlainTags(target);
+    ensurePlainTagsCapacityForNNewElements(target, source->count);
+    for(int t = 0; t < source->count; t++) {
+        PlainTag* tag = target->values + t;
+        *tag = source->values[t];
+        if(tag->valueId == NO_TAG_STRING || tag->valueId == BORROWED_TAG_VALUE) {
+            if(arena) {
+                tag->value = arenaUtf8dup(arena, tag->value);
+                tag->valueId = BORROWED_TAG_VALUE;
+            } else {
+                tag->value = utf8dup(tag->value);
+                tag->valueId = NO_TAG_STRING;
+            }
+        }
+    }
+    target->count = source->count;
 }
-CollectionImplCustomElementFree(PlainTag, PlainTags, 5)
 
 void freeRelationMemberInfo(RelationMemberInfo* member) {
-    free(member->role);
+    if(!member->roleBorrowed) {
+        free(member->role);
+    }
 }
 CollectionImplCustomElementFree(RelationMemberInfo, RelationMembers, 5)
 
-CollectionImplGeneric(WayNodeInfo, WayNodes, 10)
+CollectionImplGeneric(WayNodeInfo, WayNodes, 16)
 
-CollectionImplGeneric(NodeInfo, NodesInfo, 10)
+CollectionImplGeneric(NodeInfo, NodesInfo, 16)
 
 void freeRelation(Relation* relation){
     clearRelationMembers(&(relation->relationMembers));
@@ -402,6 +493,7 @@ void initOsmStreamReader(OsmStreamReader* reader, void* target) {
     reader->newNode = NULL;
     reader->newWay = NULL;
     reader->newRelation = NULL;
+    reader->newTag = NULL;
     reader->newRelationMember = NULL;
     reader->newWayNode = NULL;
     reader->currentChangeType = OSM_CHANGE_NONE;
@@ -419,8 +511,8 @@ void initOsmStreamReader(OsmStreamReader* reader, void* target) {
     reader->finishRelation[OSM_CHANGE_MODIFY] = NULL;
     
     reader->finishWay[OSM_CHANGE_DELETE] = NULL;
-    reader->finishNode[OSM_CHANGE_MODIFY] = NULL;
-    reader->finishRelation[OSM_CHANGE_MODIFY] = NULL;
+    reader->finishNode[OSM_CHANGE_DELETE] = NULL;
+    reader->finishRelation[OSM_CHANGE_DELETE] = NULL;
 }
 
 void closeOsmStreamReader(OsmStreamReader* reader) {
@@ -454,8 +546,12 @@ void initOsmDbReader(OsmDbReader* reader, void* target) {
     reader->wayWithId = NULL;
     reader->relationWithId = NULL;
     
+    reader->resetScratch = NULL;
+    
     reader->close = NULL;
     
+    memset(&(reader->wayCache), 0, sizeof(WayCache));
+    
     reader->target = target;
 }
 
@@ -498,14 +594,198 @@ void restartRelations(OsmDbReader* self) {
     }
 }
 
+void resetOsmDbReaderScratch(OsmDbReader* self) {
+    if(self->resetScratch) {
+        self->resetScratch(self->target);
+    }
+}
+
+static void copyWayTo(Way* way, Way* copy) {
+    copy->info = way->info;
+    initPlainTags(&(copy->tags));
+    copyPlainTags(&(way->tags), &(copy->tags));
+    initNodesInfo(&(copy->wayNodes));
+    ensureNodesInfoCapacityForNNewElements(&(copy->wayNodes), way->wayNodes.count);
+    memcpy(copy->wayNodes.values, way->wayNodes.values, sizeof(NodeInfo) * way->wayNodes.count);
+    copy->wayNodes.count = way->wayNodes.count;
+}
+
+static Way* copyWay(Way* way) {
+    Way* copy = malloc(sizeof(Way));
+    copyWayTo(way, copy);
+    return copy;
+}
+
+static size_t wayCacheEntrySize(Way* way) {
+    size_t size = sizeof(WayCacheEntry) + sizeof(NodeInfo) * way->wayNodes.count + sizeof(PlainTag) * way->tags.count;
+    // Copies own values which are not interned, borrowed ones included.
+    for(int t = 0; t < way->tags.count; t++) {
+        if(way->tags.values[t].valueId == NO_TAG_STRING || way->tags.values[t].valueId == BORROWED_TAG_VALUE) {
+            size += strlen((const char*) way->tags.values[t].value) + 1;
+        }
+    }
+    return size;
+}
+
+// Ids of ways are dense, so low bits spread them over buckets well enough.
+static WayCacheEntry** wayCacheBucket(WayCache* self, OsmId id) {
+    return self->buckets + (id & (self->bucketsCount - 1));
+}
+
+static void growWayCacheBuckets(WayCache* self) {
+    WayCacheEntry** buckets = self->buckets;
+    int bucketsCount = self->bucketsCount;
+    self->bucketsCount = bucketsCount ? bucketsCount * 2 : WAY_CACHE_MIN_BUCKETS;
+    self->buckets = calloc(self->bucketsCount, sizeof(WayCacheEntry*));
+    for(int b = 0; b < bucketsCount; b++) {
+        WayCacheEntry* entry = buckets[b];
+        while(entry) {
+            WayCacheEntry* next = entry->nextInBucket;
+            WayCacheEntry** bucket = wayCacheBucket(self, entry->way.info.id);
+            entry->nextInBucket = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(buckets);
+}
+
+static void unlinkWayCacheEntry(WayCache* self, WayCacheEntry* entry) {
+    if(entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        self->newest = entry->older;
+    }
+    if(entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        self->oldest = entry->newer;
+    }
+}
+
+static void linkNewestWayCacheEntry(WayCache* self, WayCacheEntry* entry) {
+    entry->newer = NULL;
+    entry->older = self->newest;
+    if(self->newest) {
+        self->newest->newer = entry;
+    } else {
+        self->oldest = entry;
+    }
+    self->newest = entry;
+}
+
+static WayCacheEntry* findWayCacheEntry(WayCache* self, OsmId id) {
+    if(!self->count) {
+        return NULL;
+    }
+    for(WayCacheEntry* entry = *wayCacheBucket(self, id); entry; entry = entry->nextInBucket) {
+        if(entry->way.info.id == id) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void evictOldestWayCacheEntry(WayCache* self) {
+    WayCacheEntry* entry = self->oldest;
+    unlinkWayCacheEntry(self, entry);
+    WayCacheEntry** link = wayCacheBucket(self, entry->way.info.id);
+    while(*link != entry) {
+        link = &((*link)->nextInBucket);
+    }
+    *link = entry->nextInBucket;
+    self->size -= entry->size;
+    self->count--;
+    clearPlainTags(&(entry->way.tags));
+    clearNodesInfo(&(entry->way.wayNodes));
+    free(entry);
+}
+
+// Way larger than whole budget is not cached.
+static void addToWayCache(WayCache* self, Way* way) {
+    size_t size = wayCacheEntrySize(way);
+    if(size > self->budget) {
+        return;
+    }
+    while(self->size + size > self->budget) {
+        evictOldestWayCacheEntry(self);
+    }
+    if(self->count >= self->bucketsCount) {
+        growWayCacheBuckets(self);
+    }
+    WayCacheEntry* entry = malloc(sizeof(WayCacheEntry));
+    copyWayTo(way, &(entry->way));
+    entry->size = size;
+    WayCacheEntry** bucket = wayCacheBucket(self, way->info.id);
+    entry->nextInBucket = *bucket;
+    *bucket = entry;
+    linkNewestWayCacheEntry(self, entry);
+    self->size += size;
+    self->count++;
+}
+
+static void clearWayCache(WayCache* self) {
+    while(self->oldest) {
+        evictOldestWayCacheEntry(self);
+    }
+    free(self->buckets);
+    self->buckets = NULL;
+    self->bucketsCount = 0;
+}
+
+Node* nodeWithId(OsmDbReader* self, OsmId id) {
+    if(self->nodeWithId) {
+        return self->nodeWithId(self->target, id);
+    }
+    return NULL;
+}
+
+// Cached way is copied rather than lent, as callers free ways they got and cache may evict it while they use it.
 Way* wayWithId(OsmDbReader* self, OsmId id) {
+    WayCache* cache = &(self->wayCache);
+    if(cache->budget) {
+        WayCacheEntry* entry = findWayCacheEntry(cache, id);
+        if(entry) {
+            cache->hits++;
+            unlinkWayCacheEntry(cache, entry);
+            linkNewestWayCacheEntry(cache, entry);
+            return copyWay(&(entry->way));
+        }
+        cache->misses++;
+    }
     if(self->wayWithId) {
-        return self->wayWithId(self->target, id);
+        Way* way = self->wayWithId(self->target, id);
+        if(way && cache->budget) {
+            addToWayCache(cache, way);
+        }
+        return way;
     }
     return NULL;
 }
 
+void setOsmDbReaderWayCacheBudget(OsmDbReader* self, size_t budget) {
+    WayCache* cache = &(self->wayCache);
+    cache->budget = budget;
+    while(cache->size > budget) {
+        evictOldestWayCacheEntry(cache);
+    }
+    if(!budget) {
+        clearWayCache(cache);
+    }
+}
+
+void printOsmDbReaderWayCacheStatistics(OsmDbReader* self) {
+    WayCache* cache = &(self->wayCache);
+    long requests = cache->hits + cache->misses;
+    if(!requests) {
+        return;
+    }
+    printf("Way cache: %li of %li ways found (%.1f%%), %i ways in %zu of %zu bytes.\n", cache->hits, requests,
+           100.0 * cache->hits / requests, cache->count, cache->size, cache->budget);
+}
+
 void closeOsmDbReader(OsmDbReader* reader) {
+    clearWayCache(&(reader->wayCache));
     if(reader->close) {
         reader->close(reader->target);
     }
@@ -519,3 +799,12 @@ UTF8* valueForKey(PlainTags* tags, UTF8* key) {
     }
     return NULL;
 }
+
+UTF8* valueForKeyId(PlainTags* tags, TagStringId key) {
+    for(int t=0;t<tags->count;t++) {
+        if(tags->values[t].keyId == key) {
+            return tags->values[t].value;
+        }
+    }
+    return NULL;
+}
@@ -15,6 +15,8 @@
 #include "CountryPolygon.h"
 #include "MapperTypes.h"
 #include "collections.h"
+#include "TagStrings.h"
+#include "Arena.h"
 #include <time.h>
 
 typedef enum {
@@ -57,9 +59,11 @@ typedef struct {
     OsmTimestamp timestamp;
 } RelationInfo;
 
+// Role is owned by member unless it is borrowed from reader.
 typedef struct {
     OsmId ref;
     OsmEntityType type;
+    char roleBorrowed;
     UTF8* role;
 } RelationMemberInfo;
 
@@ -71,14 +75,36 @@ typedef struct {
 
 Collection(WayNodeInfo, WayNodes)
 
+// Value of tag which is neither interned nor owned by tag, but lives in arena of its reader.
+#define BORROWED_TAG_VALUE -2
+
+// Key is interned string, value is interned if valueId is not NO_TAG_STRING or BORROWED_TAG_VALUE and is owned by tag if it is NO_TAG_STRING.
 typedef struct {
     UTF8* key;
     UTF8* value;
+    TagStringId keyId;
+    TagStringId valueId;
 } PlainTag;
 
 CollectionWithCustomAdd(PlainTag, PlainTags)
 
+void addPlainTag(PlainTags* tags, const UTF8* key, const UTF8* value);
+// Key must be interned string with keyId.
+void addPlainTagWithKeyId(PlainTags* tags, TagStringId keyId, UTF8* key, const UTF8* value);
+// Same as above, but not interned value is copied to arena and is borrowed by tag.
+void addPlainTagInArena(PlainTags* tags, const UTF8* key, const UTF8* value, Arena* arena);
+void addPlainTagWithKeyIdInArena(PlainTags* tags, TagStringId keyId, UTF8* key, const UTF8* value, Arena* arena);
+// Adds tag borrowing already interned key and value.
+void addInternedPlainTag(PlainTags* tags, TagStringId keyId, UTF8* key, TagStringId valueId, UTF8* value);
+void appendToPlainTagValue(PlainTag* tag, const UTF8* value);
+void appendToPlainTagValueInArena(PlainTag* tag, const UTF8* value, Arena* arena);
+void copyPlainTags(PlainTags* source, PlainTags* target);
+// Copies not interned values to arena instead of heap.
+void copyPlainTagsToArena(PlainTags* source, PlainTags* target, Arena* arena);
+
 UTF8* valueForKey(PlainTags* tags, UTF8* key);
+// Faster than valueForKey, key is compared by interned id.
+UTF8* valueForKeyId(PlainTags* tags, TagStringId key);
 
 typedef struct {
     RelationInfo info;
@@ -161,7 +187,36 @@ typedef Relation* (*GetRelation)(void* self, OsmId id);
 typedef void (*DbReaderCloser)(void* self);
 
 typedef void (*Restarter)(void* self);
+typedef void (*ScratchResetter)(void* self);
+
+// Ways in cache are owned copies, linked into bucket chain by id and into list from most to least recently used.
+typedef struct AWayCacheEntry {
+    Way way;
+    size_t size;
+    struct AWayCacheEntry* nextInBucket;
+    struct AWayCacheEntry* newer;
+    struct AWayCacheEntry* older;
+} WayCacheEntry;
+
+#define WAY_CACHE_MIN_BUCKETS 1024
 
+// Least recently used ways read by wayWithId, kept while their total size fits into budget.
+// Zero filled cache is empty cache with no budget, which caches nothing.
+typedef struct {
+    WayCacheEntry** buckets;
+    int bucketsCount;
+    int count;
+    WayCacheEntry* newest;
+    WayCacheEntry* oldest;
+    size_t size;
+    size_t budget;
+    long hits;
+    long misses;
+} WayCache;
+
+// Tag values and roles of entities returned by reader may be borrowed from scratch arena of reader.
+// They stay valid until next call of nextNode, nextWay or nextRelation or until resetOsmDbReaderScratch,
+// copyPlainTags makes tags which outlive them.
 typedef struct {
     void* target;
     
@@ -177,8 +232,11 @@ typedef struct {
     Restarter restartWays;
     Restarter restartRelations;
     
+    ScratchResetter resetScratch;
     
     DbReaderCloser close;
+    
+    WayCache wayCache;
 } OsmDbReader;
 
 void initOsmDbReader(OsmDbReader* reader, void* target);
@@ -188,12 +246,21 @@ Node* nextNode(OsmDbReader* self);
 Way* nextWay(OsmDbReader* self);
 Relation* nextRelation(OsmDbReader* self);
 
+// Returned node is owned by caller. Returns NULL if reader can not read nodes by id.
+Node* nodeWithId(OsmDbReader* self, OsmId id);
+// Returned way is owned by caller. It is copied from way cache of reader if it is there.
 Way* wayWithId(OsmDbReader* self, OsmId id);
+// Sets how many bytes decoded ways in cache may take, 0 disables cache. Evicts ways which do not fit.
+void setOsmDbReaderWayCacheBudget(OsmDbReader* self, size_t budget);
+void printOsmDbReaderWayCacheStatistics(OsmDbReader* self);
 
 void restartNodes(OsmDbReader* self);
 void restartWays(OsmDbReader* self);
 void restartRelations(OsmDbReader* self);
 
+// Releases scratch data of all entities returned by reader, for clients which read many entities by id only.
+void resetOsmDbReaderScratch(OsmDbReader* self);
+
 
 OsmEntityType string2relationMemberType(UTF8* typeString);
 const char* relationMemberType2String(OsmEntityType type);
@@ -22,6 +22,8 @@
 #include <zlib.h>
 #include <time.h>
 #include <stdarg.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static int convertOsm2Obm(const char* inputFile, const char* outputDirectory, const char* polygonsDirectory, char compress) {
  	//printf("Reading polygons...");
@@ -48,6 +50,39 @@ static int convertOsm2Obm(const char* inputFile, const char* outputDirectory, co
     return 0;
 }
 
+static int convertOsd2Obm(const char* inputDirectory, char** changeFiles, int changeFilesCount) {
+    osd2obm converter;
+    printf("Initialize converter...\n");
+    initOsd2Obm(&converter, inputDirectory);
+	printf("Done.\n");
+    if(!changeFiles) {
+		printf("Converting from stdin...\n");
+        convertOsd2ObmFromStdin(&converter);
+    } else {
+        for(int fi=0; fi < changeFilesCount; fi++) {
+            if(changeFiles[fi]) {
+                printf("Converting from file %s...\n", changeFiles[fi]);
+                convertOsd2ObmFromFile(&converter, changeFiles[fi]);
+            }
+        }
+    }
+	printf("Done.\n");
+	printf("Finishing...\n");
+    closeOsd2Obm(&converter);
+	printf("Done.\n");
+    return 0;
+}
+
+static int compactObmMap(const char* inputDirectory) {
+    printf("Compacting %s...\n", inputDirectory);
+    if(compactObm(inputDirectory)) {
+        fprintf(stderr, "Compacting %s failed.\n", inputDirectory);
+        return 1;
+    }
+	printf("Done.\n");
+    return 0;
+}
+
 static int convertOsm2Olm(const char* inputFile, const char* outputDirectory, const char* polygonsDirectory) {
     osm2olm converter;
     
@@ -76,7 +111,7 @@ static int convertOsm2Olm(const char* inputFile, const char* outputDirectory, co
     return 0;
 }
 
-static int convertOsm2Omm(const char* inputFile, const char* host, const char* user, const char* password, const char* database, const char* polygonsDirectory) {
+static int convertOsm2Omm(const char* inputFile, const char* host, const char* user, const char* password, const char* database, const char* polygonsDirectory, int batchBytes, int batchRows) {
     osm2omm converter;
     
     int count;
@@ -88,6 +123,7 @@ static int convertOsm2Omm(const char* inputFile, const char* host, const char* u
      sqlite3_close(db);*/
     
 	printf("Initialize converter...\n");
+    setOmmMultiInsertLimits(batchBytes, batchRows);
     initOsm2Omm(&converter, host, user, password, polygons, count);
 	printf("Done.\n");
     if(!inputFile) {
@@ -630,25 +666,97 @@ static int convertOsd2Olm(const char* inputFile, char** changeFiles, int changeF
     return 0;
 }
 
-static int convertOlm2Mapper(const char* inputFile, const char* outputDirectory, char compress) {
+// Map keeps format and location index kind it was converted with, so options of them are not used.
+static int updateMapperMap(OsmDbReader* reader, const char* mapDirectory, int workersCount, char compactNodeIds, const char* rulesFile, int wayCacheMegabytes, char** changeFiles, int changeFilesCount) {
+    MapperConverter converter;
+    if(initMapperConverterForUpdate(&converter, reader, mapDirectory, workersCount)) {
+        closeOsmDbReader(reader);
+        return 1;
+    }
+    setMapperWriterFormat(converter.writer, converter.writer->formatVersion, compactNodeIds);
+    if(rulesFile && loadMapperConverterRules(&converter, rulesFile) < 0) {
+        cancelMapperUpdate(&converter);
+        return 1;
+    }
+    if(wayCacheMegabytes >= 0) {
+        setOsmDbReaderWayCacheBudget(converter.reader, (size_t) wayCacheMegabytes << 20);
+    }
+    MapperChanges changes;
+    initMapperChanges(&changes);
+    for(int fi = 0; fi < changeFilesCount; fi++) {
+        printf("Reading changes from file %s...\n", changeFiles[fi]);
+        if(readMapperChangesFromFile(&changes, changeFiles[fi])) {
+            clearMapperChanges(&changes);
+            cancelMapperUpdate(&converter);
+            return 1;
+        }
+    }
+    updateMapper(&converter, &changes);
+    clearMapperChanges(&changes);
+    return 0;
+}
+
+static int convertOlm2Mapper(const char* inputFile, const char* outputDirectory, char compress, int workersCount, char legacyLocationIndex, int spatialOrderZoomLevel, int formatVersion, char compactNodeIds, const char* rulesFile, int wayCacheMegabytes, char** changeFiles, int changeFilesCount) {
+    if(changeFiles) {
+        return updateMapperMap(newOlmReader(inputFile), outputDirectory, workersCount, compactNodeIds, rulesFile, wayCacheMegabytes, changeFiles, changeFilesCount);
+    }
     MapperConverter converter;
-    initMapperConverter(&converter, newOlmReader(inputFile), outputDirectory, compress);
+    initMapperConverter(&converter, newOlmReader(inputFile), outputDirectory, compress, workersCount);
+    converter.writer->legacyLocationIndex = legacyLocationIndex;
+    setMapperWriterFormat(converter.writer, formatVersion, compactNodeIds);
+    if(rulesFile && loadMapperConverterRules(&converter, rulesFile) < 0) {
+        return 1;
+    }
+    if(spatialOrderZoomLevel >= 0) {
+        setMapperWriterSpatialOrder(converter.writer, spatialOrderZoomLevel);
+    }
+    if(wayCacheMegabytes >= 0) {
+        setOsmDbReaderWayCacheBudget(converter.reader, (size_t) wayCacheMegabytes << 20);
+    }
     convertToMapper(&converter);
     return 0;
 }
 
-static int convertOmm2Mapper(const char* host, const char* user, const char* password, const char* database, const char* outputDirectory, char compress) {
+static int convertOmm2Mapper(const char* host, const char* user, const char* password, const char* database, const char* outputDirectory, char compress, int workersCount, char legacyLocationIndex, int spatialOrderZoomLevel, int formatVersion, char compactNodeIds, const char* rulesFile, int wayCacheMegabytes, char** changeFiles, int changeFilesCount) {
+    if(changeFiles) {
+        return updateMapperMap(newOmmReader(host, user, password, database), outputDirectory, workersCount, compactNodeIds, rulesFile, wayCacheMegabytes, changeFiles, changeFilesCount);
+    }
     MapperConverter converter;
-    initMapperConverter(&converter, newOmmReader(host, user, password, database), outputDirectory, compress);
+    initMapperConverter(&converter, newOmmReader(host, user, password, database), outputDirectory, compress, workersCount);
+    converter.writer->legacyLocationIndex = legacyLocationIndex;
+    setMapperWriterFormat(converter.writer, formatVersion, compactNodeIds);
+    if(rulesFile && loadMapperConverterRules(&converter, rulesFile) < 0) {
+        return 1;
+    }
+    if(spatialOrderZoomLevel >= 0) {
+        setMapperWriterSpatialOrder(converter.writer, spatialOrderZoomLevel);
+    }
+    if(wayCacheMegabytes >= 0) {
+        setOsmDbReaderWayCacheBudget(converter.reader, (size_t) wayCacheMegabytes << 20);
+    }
     convertToMapper(&converter);
     return 0;
 }
 
 
-static int convertObm2Mapper(const char* inputDirectory, const char* outputDirectory, int cacheNodes, char compress) {
+static int convertObm2Mapper(const char* inputDirectory, const char* outputDirectory, int cacheNodes, char compress, int workersCount, char legacyLocationIndex, int spatialOrderZoomLevel, int formatVersion, char compactNodeIds, const char* rulesFile, int wayCacheMegabytes, char** changeFiles, int changeFilesCount) {
     //printf("Converting Binary map from %s to mapper map in")
+    if(changeFiles) {
+        return updateMapperMap(newObmReader(inputDirectory, cacheNodes), outputDirectory, workersCount, compactNodeIds, rulesFile, wayCacheMegabytes, changeFiles, changeFilesCount);
+    }
     MapperConverter converter;
-    initMapperConverter(&converter, newObmReader(inputDirectory, cacheNodes), outputDirectory, compress);
+    initMapperConverter(&converter, newObmReader(inputDirectory, cacheNodes), outputDirectory, compress, workersCount);
+    converter.writer->legacyLocationIndex = legacyLocationIndex;
+    setMapperWriterFormat(converter.writer, formatVersion, compactNodeIds);
+    if(rulesFile && loadMapperConverterRules(&converter, rulesFile) < 0) {
+        return 1;
+    }
+    if(spatialOrderZoomLevel >= 0) {
+        setMapperWriterSpatialOrder(converter.writer, spatialOrderZoomLevel);
+    }
+    if(wayCacheMegabytes >= 0) {
+        setOsmDbReaderWayCacheBudget(converter.reader, (size_t) wayCacheMegabytes << 20);
+    }
     convertToMapper(&converter);
     return 0;
 }
@@ -748,7 +856,693 @@ static int printHelp(int help, const char* progname, ...) {
     return 0;
 }
 
-static int runTest(const char* testName) {    
+// Compares table mercator projection with scalar one and measures both on way nodes.
+static int testMercator() {
+    int maxError = 0;
+    long differences = 0;
+    long checked = 0;
+    for(long lat = -900000000L; lat <= 900000000L; lat += 997) {
+        int error = abs(tableMercatorY((Coordinate)lat) - mercatorY((Coordinate)lat));
+        if(error > maxError) {
+            maxError = error;
+        }
+        differences += error > 0;
+        checked++;
+    }
+    printf("Accuracy: %li latitudes checked, %li differ, max error %i.\n", checked, differences, maxError);
+    
+    int count = 1000000;
+    NodeInfo* infos = malloc(sizeof(NodeInfo) * count);
+    MapperWayNode* nodes = malloc(sizeof(MapperWayNode) * count);
+    srand(1);
+    for(int i = 0; i < count; i++) {
+        infos[i].id = i;
+        infos[i].lat = (Coordinate)((double)rand() / RAND_MAX * 1700000000.0 - 850000000.0);
+        infos[i].lon = (Coordinate)((double)rand() / RAND_MAX * 3600000000.0 - 1800000000.0);
+    }
+    projectNodesInfo(infos, nodes, 1);
+    
+    clock_t start = clock();
+    for(int i = 0; i < count; i++) {
+        nodes[i].id = infos[i].id;
+        nodes[i].location.x = mercatorX(infos[i].lon);
+        nodes[i].location.y = mercatorY(infos[i].lat);
+    }
+    double scalarTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+    
+    start = clock();
+    projectNodesInfo(infos, nodes, count);
+    double tableTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+    
+    printf("Scalar: %.1f ns per node.\n", scalarTime * 1e9 / count);
+    printf("Table:  %.1f ns per node.\n", tableTime * 1e9 / count);
+    free(infos);
+    free(nodes);
+    return maxError > 1;
+}
+
+static int testQuery(const char* mapDirectory) {
+    if(!mapDirectory) {
+        fprintf(stderr, "Path to mapper map is required for query test.\n");
+        return 1;
+    }
+    MapperReader reader;
+    if(initMapperReader(&reader, mapDirectory)) {
+        closeMapperReader(&reader);
+        return 1;
+    }
+    BBox map = reader.mapInformation.bounds;
+    long width = (long) map.max.x - map.min.x + 1;
+    long height = (long) map.max.y - map.min.y + 1;
+    
+    MapperPointViews points;
+    MapperWayViews ways;
+    MapperAreaViews areas;
+    initMapperPointViews(&points);
+    initMapperWayViews(&ways);
+    initMapperAreaViews(&areas);
+    
+    int queries = 10000;
+    long pointsFound = 0;
+    long waysFound = 0;
+    long areasFound = 0;
+    long bytes = 0;
+    srand(1);
+    clock_t start = clock();
+    for(int q = 0; q < queries; q++) {
+        // Whole map is shown on zoom 8, every next level shows half of previous viewport.
+        ZoomLevel zoom = 8 + rand() % (MAX_ZOOM_LEVEL - 7);
+        long viewportWidth = max(1, width >> (zoom - 8));
+        long viewportHeight = max(1, height >> (zoom - 8));
+        BBox viewport;
+        viewport.min.x = map.min.x + (Coordinate)((double) rand() / RAND_MAX * (width - viewportWidth));
+        viewport.min.y = map.min.y + (Coordinate)((double) rand() / RAND_MAX * (height - viewportHeight));
+        viewport.max.x = viewport.min.x + viewportWidth - 1;
+        viewport.max.y = viewport.min.y + viewportHeight - 1;
+        
+        removeAllMapperPointViews(&points);
+        removeAllMapperWayViews(&ways);
+        removeAllMapperAreaViews(&areas);
+        pointsFound += getNodesInRect(&reader, viewport, zoom, &points);
+        waysFound += getWaysInRect(&reader, viewport, zoom, &ways);
+        areasFound += getAreasInRect(&reader, viewport, zoom, &areas);
+        for(int i = 0; i < points.count; i++) {
+            bytes += points.values[i].length;
+        }
+        for(int i = 0; i < ways.count; i++) {
+            bytes += ways.values[i].length;
+        }
+        for(int i = 0; i < areas.count; i++) {
+            bytes += areas.values[i].length;
+        }
+    }
+    double time = (double)(clock() - start) / CLOCKS_PER_SEC;
+    
+    printf("%i viewports queried in %.3f s, %.0f queries per second.\n", queries, time, time > 0 ? queries / time : 0);
+    printf("Found per query: %.1f points, %.1f ways, %.1f areas, %.1f kB.\n", (double) pointsFound / queries, (double) waysFound / queries, (double) areasFound / queries, (double) bytes / 1024 / queries);
+    clearMapperPointViews(&points);
+    clearMapperWayViews(&ways);
+    clearMapperAreaViews(&areas);
+    closeMapperReader(&reader);
+    return 0;
+}
+
+static long mapFileSize(const char* name, const char* mapDirectory) {
+    char* path = fullFileName(name, mapDirectory);
+    struct stat info;
+    long size = stat(path, &info) == 0 ? (long) info.st_size : 0;
+    free(path);
+    return size;
+}
+
+// Decodes all records visible on the most detailed zoom level in a loop and reports sizes and decoding speed.
+static int testDecode(const char* mapDirectory) {
+    if(!mapDirectory) {
+        fprintf(stderr, "Path to mapper map is required for decode test.\n");
+        return 1;
+    }
+    MapperReader reader;
+    if(initMapperReader(&reader, mapDirectory)) {
+        closeMapperReader(&reader);
+        return 1;
+    }
+    printf("Format %i. Points %li B, ways %li B, areas %li B, values %li B.\n", reader.formatVersion,
+           mapFileSize("points", mapDirectory), mapFileSize("ways", mapDirectory), mapFileSize("areas", mapDirectory), mapFileSize("values", mapDirectory));
+    
+    MapperPointViews points;
+    MapperWayViews ways;
+    MapperAreaViews areas;
+    initMapperPointViews(&points);
+    initMapperWayViews(&ways);
+    initMapperAreaViews(&areas);
+    getNodesInRect(&reader, reader.mapInformation.bounds, MAX_ZOOM_LEVEL, &points);
+    getWaysInRect(&reader, reader.mapInformation.bounds, MAX_ZOOM_LEVEL, &ways);
+    getAreasInRect(&reader, reader.mapInformation.bounds, MAX_ZOOM_LEVEL, &areas);
+    
+    MapperDecodedRecord record;
+    initMapperDecodedRecord(&record);
+    long records = 0;
+    long nodes = 0;
+    long bytes = 0;
+    int errors = 0;
+    int passes = 0;
+    clock_t start = clock();
+    double time = 0;
+    while(time < 1 || !passes) {
+        for(int i = 0; i < points.count; i++) {
+            errors += decodeMapperPoint(&reader, points.values + i, &record) != 0;
+            nodes += record.nodes.count;
+            bytes += points.values[i].length;
+        }
+        for(int i = 0; i < ways.count; i++) {
+            errors += decodeMapperWay(&reader, ways.values + i, &record) != 0;
+            nodes += record.nodes.count;
+            bytes += ways.values[i].length;
+        }
+        for(int i = 0; i < areas.count; i++) {
+            errors += decodeMapperArea(&reader, areas.values + i, &record) != 0;
+            nodes += record.nodes.count;
+            bytes += areas.values[i].length;
+        }
+        records += points.count + ways.count + areas.count;
+        passes++;
+        time = (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+    
+    printf("%i points, %i ways, %i areas with %li nodes decoded %i times in %.3f s.\n", points.count, ways.count, areas.count, nodes / passes, passes, time);
+    printf("%.0f records per second, %.1f M nodes per second, %.1f MB per second. %i errors.\n", records / time, nodes / time / 1e6, bytes / time / 1e6, errors / passes);
+    clearMapperDecodedRecord(&record);
+    clearMapperPointViews(&points);
+    clearMapperWayViews(&ways);
+    clearMapperAreaViews(&areas);
+    closeMapperReader(&reader);
+    return errors > 0;
+}
+
+static int compareClassification(UTF8* chainClass, ZoomLevel chainMinZoomLevel, ZoomLevel chainMaxZoomLevel, MapperClassification* classification, MapperRuleKind kind) {
+    UTF8* ruleClass = classification->className[kind];
+    int sameClass = chainClass && ruleClass ? utf8equal(chainClass, ruleClass) : chainClass == ruleClass;
+    return sameClass && chainMinZoomLevel == classification->minZoomLevel[kind] && chainMaxZoomLevel == classification->maxZoomLevel[kind];
+}
+
+// Classifies tags of all nodes and ways of sqlite map with if-chains and with compiled rules.
+static int testRules(const char* mapFile) {
+    if(!mapFile) {
+        fprintf(stderr, "Path to sqlite map is required for rules test.\n");
+        return 1;
+    }
+    MapperRules rules;
+    initDefaultMapperRules(&rules);
+    OsmDbReader* reader = newOlmReader(mapFile);
+    int nodesCount = 0;
+    int waysCount = 0;
+    int capacity = 1000;
+    Node* nodes = malloc(sizeof(Node) * capacity);
+    Node* node;
+    while((node = nextNode(reader))) {
+        if(node->tags.count) {
+            if(nodesCount == capacity) {
+                capacity *= 2;
+                nodes = realloc(nodes, sizeof(Node) * capacity);
+            }
+            nodes[nodesCount].info = node->info;
+            initPlainTags(&(nodes[nodesCount].tags));
+            copyPlainTags(&(node->tags), &(nodes[nodesCount++].tags));
+        }
+    }
+    capacity = 1000;
+    Way* ways = malloc(sizeof(Way) * capacity);
+    Way* way;
+    while((way = nextWay(reader))) {
+        if(way->tags.count) {
+            if(waysCount == capacity) {
+                capacity *= 2;
+                ways = realloc(ways, sizeof(Way) * capacity);
+            }
+            memset(ways + waysCount, 0, sizeof(Way));
+            ways[waysCount].info = way->info;
+            copyPlainTags(&(way->tags), &(ways[waysCount++].tags));
+        }
+    }
+    closeOsmDbReader(reader);
+    
+    MapperClassification classification;
+    int mismatches = 0;
+    for(int n = 0; n < nodesCount; n++) {
+        classifyTags(&rules, &(nodes[n].tags), &classification);
+        UTF8* className = pointClassByTags(&(nodes[n].tags));
+        mismatches += !compareClassification(className, getMinimalPointLevel(nodes + n), getMaximalPointLevel(nodes + n), &classification, MAPPER_RULE_POINT);
+    }
+    for(int w = 0; w < waysCount; w++) {
+        classifyTags(&rules, &(ways[w].tags), &classification);
+        PlainTags* tags = &(ways[w].tags);
+        mismatches += !compareClassification(wayClassByTags(tags), getMinimalWayLevel(ways + w), getMaximalWayLevel(ways + w), &classification, MAPPER_RULE_WAY);
+        mismatches += !compareClassification(areaClassByTags(tags), getMinimalAreaLevel(tags, NULL), getMaximalAreaLevel(tags, NULL), &classification, MAPPER_RULE_AREA);
+    }
+    
+    int passes = max(1, 2000000 / max(nodesCount + waysCount, 1));
+    long classified = 0;
+    clock_t start = clock();
+    for(int p = 0; p < passes; p++) {
+        for(int n = 0; n < nodesCount; n++) {
+            classified += pointClassByTags(&(nodes[n].tags)) != NULL;
+            classified += getMinimalPointLevel(nodes + n) + getMaximalPointLevel(nodes + n);
+        }
+        for(int w = 0; w < waysCount; w++) {
+            PlainTags* tags = &(ways[w].tags);
+            classified += wayClassByTags(tags) != NULL;
+            classified += getMinimalWayLevel(ways + w) + getMaximalWayLevel(ways + w);
+            classified += areaClassByTags(tags) != NULL;
+            classified += getMinimalAreaLevel(tags, NULL) + getMaximalAreaLevel(tags, NULL);
+        }
+    }
+    double chainsTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+    
+    start = clock();
+    for(int p = 0; p < passes; p++) {
+        for(int n = 0; n < nodesCount; n++) {
+            classifyTags(&rules, &(nodes[n].tags), &classification);
+            classified += classification.className[MAPPER_RULE_POINT] != NULL;
+        }
+        for(int w = 0; w < waysCount; w++) {
+            classifyTags(&rules, &(ways[w].tags), &classification);
+            classified += classification.className[MAPPER_RULE_WAY] != NULL;
+        }
+    }
+    double rulesTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+    
+    long entities = (long) passes * (nodesCount + waysCount);
+    printf("%i tagged nodes, %i tagged ways, %i mismatches.\n", nodesCount, waysCount, mismatches);
+    printf("If-chains: %.1f ns per entity.\n", chainsTime * 1e9 / entities);
+    printf("Rules:     %.1f ns per entity.\n", rulesTime * 1e9 / entities);
+    
+    clearMapperRules(&rules);
+    for(int n = 0; n < nodesCount; n++) {
+        clearPlainTags(&(nodes[n].tags));
+    }
+    for(int w = 0; w < waysCount; w++) {
+        clearPlainTags(&(ways[w].tags));
+    }
+    free(nodes);
+    free(ways);
+    return mismatches > 0 || classified < 0;
+}
+
+// String index with chained buckets and djb2 hash, as SimpleStringIndex was before open addressing.
+#define CHAINED_STRING_INDEX_BUCKETS 255
+
+typedef struct AChainedStringIndexLeaf {
+    struct AChainedStringIndexLeaf* next;
+    UTF8* value;
+    int index;
+} ChainedStringIndexLeaf;
+
+typedef struct {
+    ChainedStringIndexLeaf* leafs[CHAINED_STRING_INDEX_BUCKETS + 1];
+    int valuesCount;
+} ChainedStringIndex;
+
+static int chainedStringIndexOf(ChainedStringIndex* self, UTF8* key) {
+    unsigned long hash = 5381;
+    for(UTF8* c = key; *c; c++) {
+        hash = hash * 33 + *c;
+    }
+    ChainedStringIndexLeaf** bucket = self->leafs + (hash & CHAINED_STRING_INDEX_BUCKETS);
+    for(ChainedStringIndexLeaf* leaf = *bucket; leaf; leaf = leaf->next) {
+        if(utf8equal(leaf->value, key)) {
+            return leaf->index;
+        }
+    }
+    ChainedStringIndexLeaf* leaf = malloc(sizeof(ChainedStringIndexLeaf));
+    leaf->value = utf8dup(key);
+    leaf->index = self->valuesCount++;
+    leaf->next = *bucket;
+    *bucket = leaf;
+    return leaf->index;
+}
+
+static void clearChainedStringIndex(ChainedStringIndex* self) {
+    for(int b = 0; b <= CHAINED_STRING_INDEX_BUCKETS; b++) {
+        while(self->leafs[b]) {
+            ChainedStringIndexLeaf* next = self->leafs[b]->next;
+            free(self->leafs[b]->value);
+            free(self->leafs[b]);
+            self->leafs[b] = next;
+        }
+    }
+}
+
+// Looks up keys with frequencies of "key<tab>count" lines of file, or of generated keys with Zipf distribution.
+static int testStrings(const char* keysFile) {
+    int keysCount = 0;
+    int capacity = 1024;
+    UTF8** keys = malloc(sizeof(UTF8*) * capacity);
+    double* weights = malloc(sizeof(double) * capacity);
+    if(keysFile) {
+        FILE* file = fopen(keysFile, "r");
+        if(!file) {
+            fprintf(stderr, "Error opening keys file %s\n", keysFile);
+            return 1;
+        }
+        char line[1024];
+        while(fgets(line, sizeof(line), file)) {
+            char* tab = strchr(line, '\t');
+            line[strcspn(line, "\r\n")] = 0;
+            if(tab) {
+                *tab = 0;
+            }
+            if(!line[0]) {
+                continue;
+            }
+            if(keysCount == capacity) {
+                capacity *= 2;
+                keys = realloc(keys, sizeof(UTF8*) * capacity);
+                weights = realloc(weights, sizeof(double) * capacity);
+            }
+            keys[keysCount] = utf8dup(UTF8_CAST line);
+            weights[keysCount++] = tab ? max(atof(tab + 1), 1.0) : 1.0;
+        }
+        fclose(file);
+    } else {
+        // Planet has about 80000 distinct keys, few of them are most of tags.
+        const char* prefixes[] = {"name:", "addr:", "tiger:", "source:", "ref:", "note:", "gnis:", "building:", "roof:", "seamark:"};
+        keysCount = capacity = 100000;
+        keys = realloc(keys, sizeof(UTF8*) * capacity);
+        weights = realloc(weights, sizeof(double) * capacity);
+        char key[64];
+        for(int k = 0; k < keysCount; k++) {
+            sprintf(key, "%s%x", prefixes[k % 10], k * 2654435761u);
+            keys[k] = utf8dup(UTF8_CAST key);
+            weights[k] = 1.0 / (k + 1);
+        }
+    }
+    for(int k = 1; k < keysCount; k++) {
+        weights[k] += weights[k - 1];
+    }
+    int lookupsCount = 5000000;
+    int* lookups = malloc(sizeof(int) * lookupsCount);
+    srand(1);
+    for(int l = 0; l < lookupsCount; l++) {
+        double r = (double) rand() / RAND_MAX * weights[keysCount - 1];
+        int low = 0;
+        int high = keysCount - 1;
+        while(low < high) {
+            int middle = (low + high) / 2;
+            if(weights[middle] < r) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        lookups[l] = low;
+    }
+
+    ChainedStringIndex chained;
+    memset(&chained, 0, sizeof(ChainedStringIndex));
+    clock_t start = clock();
+    for(int k = 0; k < keysCount; k++) {
+        chainedStringIndexOf(&chained, keys[k]);
+    }
+    double chainedBuildTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+    long checksum = 0;
+    start = clock();
+    for(int l = 0; l < lookupsCount; l++) {
+        checksum += chainedStringIndexOf(&chained, keys[lookups[l]]);
+    }
+    double chainedLookupTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    SimpleStringIndex index;
+    initSimpleStringIndex(&index);
+    start = clock();
+    for(int k = 0; k < keysCount; k++) {
+        simpleStringIndexOf(&index, keys[k]);
+    }
+    double buildTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+    start = clock();
+    for(int l = 0; l < lookupsCount; l++) {
+        checksum -= simpleStringIndexOf(&index, keys[lookups[l]]);
+    }
+    double lookupTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%i distinct keys of %i, %i lookups.\n", index.valuesCount, keysCount, lookupsCount);
+    printf("Chained: build %.1f ns per key, lookup %.1f ns.\n", chainedBuildTime * 1e9 / keysCount, chainedLookupTime * 1e9 / lookupsCount);
+    printf("Open:    build %.1f ns per key, lookup %.1f ns.\n", buildTime * 1e9 / keysCount, lookupTime * 1e9 / lookupsCount);
+
+    // Loading of index saved as text and as dictionary.
+    FILE* textFile = openFile("osmc-test-strings", "/tmp", "w+", NO_COMPRESS);
+    writeSimpleStringIndex(&index, textFile);
+    fclose(textFile);
+    writeSimpleStringIndexDictionary(&index, "osmc-test-strings.dict", "/tmp");
+    SimpleStringIndex loaded;
+    start = clock();
+    textFile = openFile("osmc-test-strings", "/tmp", "r", NO_COMPRESS);
+    initSimpleStringIndexFromFile(&loaded, textFile);
+    fclose(textFile);
+    double textLoadTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+    clearSimpleStringIndex(&loaded);
+    start = clock();
+    int error = mapSimpleStringIndexDictionary(&loaded, "osmc-test-strings.dict", "/tmp");
+    double dictionaryLoadTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+    for(int l = 0; !error && l < lookupsCount; l += 100) {
+        checksum += findSimpleStringIndexOf(&loaded, keys[lookups[l]]) != findSimpleStringIndexOf(&index, keys[lookups[l]]);
+    }
+    clearSimpleStringIndex(&loaded);
+    printf("Load: text %.2f ms, dictionary %.2f ms.\n", textLoadTime * 1e3, dictionaryLoadTime * 1e3);
+    char* path = fullFileName("osmc-test-strings", "/tmp");
+    remove(path);
+    free(path);
+    path = fullFileName("osmc-test-strings.dict", "/tmp");
+    remove(path);
+    free(path);
+
+    clearChainedStringIndex(&chained);
+    clearSimpleStringIndex(&index);
+    for(int k = 0; k < keysCount; k++) {
+        free(keys[k]);
+    }
+    free(keys);
+    free(weights);
+    free(lookups);
+    if(checksum) {
+        fprintf(stderr, "Indexes returned different indicies.\n");
+    }
+    return checksum != 0 || error;
+}
+
+// Compares copying of tag values to heap and to arena reset per entity, alone and with tags they are added to.
+static int testArena() {
+    int valuesCount = 4096;
+    int entitiesCount = 1000000;
+    const UTF8* keys[] = {UTF8_CAST "name", UTF8_CAST "highway", UTF8_CAST "addr:street", UTF8_CAST "note", UTF8_CAST "source", UTF8_CAST "description", UTF8_CAST "ref", UTF8_CAST "fixme"};
+    // Values longer than TAG_VALUE_INTERN_MAX_SIZE are copied for each tag.
+    UTF8** values = malloc(sizeof(UTF8*) * valuesCount);
+    char value[64];
+    for(int v = 0; v < valuesCount; v++) {
+        sprintf(value, "Value %08x of tag which is too long to intern", v * 2654435761u);
+        values[v] = utf8dup(UTF8_CAST value);
+    }
+    UTF8* copies[8];
+    PlainTags tags;
+    initPlainTags(&tags);
+    long checksum[2] = {0, 0};
+    double copyTimes[2];
+    double tagTimes[2];
+    for(int useArena = 0; useArena < 2; useArena++) {
+        Arena arena;
+        initArena(&arena);
+        clock_t start = clock();
+        for(int e = 0; e < entitiesCount; e++) {
+            int copiesCount = 1 + e % 8;
+            for(int c = 0; c < copiesCount; c++) {
+                const UTF8* copied = values[(e * 7 + c * 13) % valuesCount];
+                copies[c] = useArena ? arenaUtf8dup(&arena, copied) : utf8dup(copied);
+            }
+            checksum[useArena] += copies[copiesCount - 1][6];
+            if(useArena) {
+                resetArena(&arena);
+            } else {
+                for(int c = 0; c < copiesCount; c++) {
+                    free(copies[c]);
+                }
+            }
+        }
+        copyTimes[useArena] = (double)(clock() - start) / CLOCKS_PER_SEC;
+        start = clock();
+        for(int e = 0; e < entitiesCount; e++) {
+            if(useArena) {
+                resetArena(&arena);
+            }
+            removeAllPlainTags(&tags);
+            int tagsCount = 1 + e % 8;
+            for(int t = 0; t < tagsCount; t++) {
+                const UTF8* tagValue = values[(e * 7 + t * 13) % valuesCount];
+                if(useArena) {
+                    addPlainTagInArena(&tags, keys[t], tagValue, &arena);
+                } else {
+                    addPlainTag(&tags, keys[t], tagValue);
+                }
+            }
+            checksum[useArena] += tags.values[tags.count - 1].value[6];
+        }
+        removeAllPlainTags(&tags);
+        tagTimes[useArena] = (double)(clock() - start) / CLOCKS_PER_SEC;
+        clearArena(&arena);
+    }
+    printf("Copies of values of %i entities: heap %.3f s, arena %.3f s.\n", entitiesCount, copyTimes[0], copyTimes[1]);
+    printf("Tags of %i entities: heap %.3f s, arena %.3f s.\n", entitiesCount, tagTimes[0], tagTimes[1]);
+    clearPlainTags(&tags);
+    for(int v = 0; v < valuesCount; v++) {
+        free(values[v]);
+    }
+    free(values);
+    if(checksum[0] != checksum[1]) {
+        fprintf(stderr, "Values copied to heap and arena are different.\n");
+    }
+    return checksum[0] != checksum[1];
+}
+
+// Adds to array growing it by fixed step, as collections did before, for comparison.
+static void addWithFixedStep(NodesInfo* self, NodeInfo node, int step) {
+    if(self->capacity < self->count + 1) {
+        self->capacity = self->count + step;
+        self->values = realloc(self->values, sizeof(NodeInfo) * self->capacity);
+    }
+    self->values[self->count++] = node;
+}
+
+// Compares growth of way nodes and tags by fixed step and geometric, collections made for each entity and reused.
+static int testCollections() {
+    int waysCount = 200000;
+    int* lengths = malloc(sizeof(int) * waysCount);
+    int* tagCounts = malloc(sizeof(int) * waysCount);
+    long nodesCount = 0;
+    srand(1);
+    for(int w = 0; w < waysCount; w++) {
+        double r = (double) (rand() + 1) / ((double) RAND_MAX + 1);
+        // Most ways have about ten nodes, one of hundred is long, up to 2000 nodes.
+        lengths[w] = rand() % 100 ? 2 + (int)(-log(r) * 10) : 2 + rand() % 1999;
+        tagCounts[w] = min(1 + (int)(-log(r) * 3), 64);
+        nodesCount += lengths[w];
+    }
+    NodeInfo node = {0, 0, 0, 0};
+    double times[3];
+    long checksum = 0;
+    for(int variant = 0; variant < 3; variant++) {
+        NodesInfo nodes;
+        initNodesInfo(&nodes);
+        clock_t start = clock();
+        for(int w = 0; w < waysCount; w++) {
+            for(int n = 0; n < lengths[w]; n++) {
+                node.id = n;
+                if(variant == 0) {
+                    addWithFixedStep(&nodes, node, 10);
+                } else {
+                    if(nodes.capacity < nodes.count + 1) {
+                        ensureNodesInfoCapacityForNNewElements(&nodes, 1);
+                    }
+                    nodes.values[nodes.count++] = node;
+                }
+            }
+            checksum += nodes.values[nodes.count - 1].id;
+            if(variant == 2) {
+                removeAllNodesInfo(&nodes);
+            } else {
+                clearNodesInfo(&nodes);
+            }
+        }
+        clearNodesInfo(&nodes);
+        times[variant] = (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+    printf("Way nodes of %i ways (%li nodes): fixed step %.3f s, geometric %.3f s, reused %.3f s.\n", waysCount, nodesCount, times[0], times[1], times[2]);
+    
+    PlainTag tag = {UTF8_CAST "", UTF8_CAST "", EMPTY_TAG_STRING, EMPTY_TAG_STRING};
+    for(int variant = 0; variant < 3; variant++) {
+        PlainTags tags;
+        initPlainTags(&tags);
+        clock_t start = clock();
+        for(int w = 0; w < waysCount; w++) {
+            for(int t = 0; t < tagCounts[w]; t++) {
+                if(variant == 0 && tags.capacity < tags.count + 1) {
+                    tags.capacity = tags.count + 5;
+                    tags.values = realloc(tags.values, sizeof(PlainTag) * tags.capacity);
+                } else if(variant > 0 && tags.capacity < tags.count + 1) {
+                    ensurePlainTagsCapacityForNNewElements(&tags, 1);
+                }
+                tags.values[tags.count++] = tag;
+            }
+            checksum += tags.count;
+            if(variant == 2) {
+                removeAllPlainTags(&tags);
+            } else {
+                clearPlainTags(&tags);
+            }
+        }
+        clearPlainTags(&tags);
+        times[variant] = (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+    printf("Tags of %i ways: fixed step %.3f s, geometric %.3f s, reused %.3f s.\n", waysCount, times[0], times[1], times[2]);
+    free(lengths);
+    free(tagCounts);
+    return checksum < 0;
+}
+
+// Applies change to map which has key with line break, all keys must keep their ids.
+static int testChanges() {
+    const char* directory = "/tmp/osmc-test-changes";
+    char* mapDirectory = fullFileName("FULL", directory);
+    char* osmFile = fullFileName("osmc-test-changes.osm", "/tmp");
+    char* changeFile = fullFileName("osmc-test-changes.osc", "/tmp");
+    FILE* file = fopen(osmFile, "w");
+    fprintf(file, "<osm version=\"0.6\">\n"
+            "<node id=\"1\" timestamp=\"2009-01-01T00:00:00Z\" lat=\"53.9\" lon=\"27.5\"><tag k=\"odd&#10;key\" v=\"1\"/><tag k=\"amenity\" v=\"cafe\"/></node>\n"
+            "<node id=\"2\" timestamp=\"2009-01-01T00:00:00Z\" lat=\"53.8\" lon=\"27.6\"><tag k=\"name\" v=\"Minsk\"/></node>\n"
+            "</osm>\n");
+    fclose(file);
+    file = fopen(changeFile, "w");
+    fprintf(file, "<osmChange version=\"0.6\"><create>\n"
+            "<node id=\"3\" timestamp=\"2009-01-01T00:00:00Z\" lat=\"53.7\" lon=\"27.7\"><tag k=\"amenity\" v=\"pub\"/><tag k=\"name\" v=\"Bar\"/></node>\n"
+            "</create></osmChange>\n");
+    fclose(file);
+    mkdir(directory, S_IRWXU);
+    convertOsm2Obm(osmFile, directory, NULL, NO_COMPRESS);
+    convertOsd2Obm(mapDirectory, &changeFile, 1);
+    
+    int failures = 0;
+    OsmDbReader* reader = newObmReader(mapDirectory, 0);
+    Node* node;
+    while((node = nextNode(reader))) {
+        const char* expected[][2] = {{"odd\nkey", "amenity"}, {"name", NULL}, {"amenity", "name"}};
+        int n = node->info.id - 1;
+        for(int t = 0; t < 2; t++) {
+            const char* key = t < node->tags.count ? (const char*) node->tags.values[t].key : NULL;
+            if(n < 0 || n > 2 || (key && !expected[n][t]) || (!key && expected[n][t]) || (key && strcmp(key, expected[n][t]))) {
+                fprintf(stderr, "Node %i has key %s instead of %s.\n", (int) node->info.id, key ? key : "(none)", n < 0 || n > 2 || !expected[n][t] ? "(none)" : expected[n][t]);
+                failures++;
+            }
+        }
+        printTags(&(node->tags));
+    }
+    closeOsmDbReader(reader);
+    
+    const char* names[] = {"nodes.obm", "ways.obm", "relations.obm", "nodes.idx", "ways.idx", "relations.idx",
+        "nodes.delta.obm", "ways.delta.obm", "relations.delta.obm", "nodes.delta.idx", "ways.delta.idx", "relations.delta.idx",
+        "keys.l", "roles.l", "values.l", "keys.dict", "roles.dict", "values.dict", NULL};
+    for(int f = 0; names[f]; f++) {
+        char* path = fullFileName(names[f], mapDirectory);
+        remove(path);
+        free(path);
+    }
+    rmdir(mapDirectory);
+    rmdir(directory);
+    remove(osmFile);
+    remove(changeFile);
+    free(mapDirectory);
+    free(osmFile);
+    free(changeFile);
+    return failures;
+}
+
+static int runTest(const char* testName, const char* input) {    
     
     if(strcmp(testName, "reader")==0) {
         return testReader();
@@ -758,6 +1552,38 @@ static int runTest(const char* testName) {
         return testUtf();
     }
     
+    if(strcmp(testName, "mercator")==0) {
+        return testMercator();
+    }
+    
+    if(strcmp(testName, "query")==0) {
+        return testQuery(input);
+    }
+    
+    if(strcmp(testName, "decode")==0) {
+        return testDecode(input);
+    }
+    
+    if(strcmp(testName, "rules")==0) {
+        return testRules(input);
+    }
+    
+    if(strcmp(testName, "strings")==0) {
+        return testStrings(input);
+    }
+    
+    if(strcmp(testName, "changes")==0) {
+        return testChanges();
+    }
+    
+    if(strcmp(testName, "arena")==0) {
+        return testArena();
+    }
+    
+    if(strcmp(testName, "collections")==0) {
+        return testCollections();
+    }
+    
     if(strcmp(testName, "curl") == 0) {
         time_t timestamp = readTimestamp("minsk.sqlite");
         time_t now;
@@ -821,10 +1647,12 @@ int main(int argc, char* argv[]) {
     struct arg_file* user1b = arg_file1("u", "user", "<input>", "User on mysql server.");
     struct arg_file* password1b = arg_file0("w", "password", "<input>", "Password on mysql server.");
     struct arg_file* database1b = arg_file0("d", "database", "<input>", "DB name.");
+    struct arg_int* batch_bytes1b = arg_int0("b", "batch-bytes", "<n>", "Maximal size of multi insert query in bytes.");
+    struct arg_int* batch_rows1b = arg_int0("r", "batch-rows", "<n>", "Maximal number of rows in multi insert query.");
     struct arg_end* end1b = arg_end(20);
     
     void * argtable1b[] = {
-        s2m, input_file1b, polygons_dir1b, host1b, user1b, password1b, database1b, end1b
+        s2m, input_file1b, polygons_dir1b, host1b, user1b, password1b, database1b, batch_bytes1b, batch_rows1b, end1b
     };
     int nerrors1b;
     
@@ -858,16 +1686,45 @@ int main(int argc, char* argv[]) {
     };
     int nerrors2;
     
+    /* XML change -> binary syntax */
+    struct arg_rex* d2b = arg_rex1(NULL, NULL, "d2b", NULL, REG_ICASE, "Updates binary map with diff.");
+    struct arg_file* input_dir2a = arg_file1("i", "input", "<input>", "Path to directory with binary map.");
+    struct arg_file* diff_file2a = arg_filen("c", "change", "<input>", 0, 10, "Path to change file. If not present stdin will be used.");
+    struct arg_end* end2a = arg_end(20);
+    
+    void * argtable2a[] = {
+        d2b, input_dir2a, diff_file2a, end2a
+    };
+    int nerrors2a;
+    
+    /* compact binary syntax */
+    struct arg_rex* compact = arg_rex1(NULL, NULL, "compact", NULL, REG_ICASE, "Merges changes of binary map into its files.");
+    struct arg_file* input_dir2b = arg_file1("i", "input", "<input>", "Path to directory with binary map.");
+    struct arg_end* end2b = arg_end(20);
+    
+    void * argtable2b[] = {
+        compact, input_dir2b, end2b
+    };
+    int nerrors2b;
+    
     /* bianry -> mapper syntax */
     struct arg_rex* b2m = arg_rex1(NULL, NULL, "b2m", NULL, REG_ICASE, "Convert from binary map to mapper format.");
     struct arg_file* input_dir3 = arg_file1("i", "input", "<input>", "Path to directory with binary map.");
     struct arg_lit* memory_nodes3 = arg_lit0("m", "memory-nodes", "If to read all nodes in memory.");
     struct arg_lit* compress_output3 = arg_lit0("c", "compress", "If to compress resulting files.");
     struct arg_file* output_dir3 = arg_file1("o", "output", "<output>", "Path to directory with converted files.");
+    struct arg_int* workers3 = arg_int0("j", "workers", "<n>", "Number of threads encoding entities in parallel.");
+    struct arg_lit* kd_tree3 = arg_lit0("k", "kd-tree", "Write ways and areas location indexes as legacy KD-tree.");
+    struct arg_int* spatial_order3 = arg_int0("s", "spatial-order", "<zoom>", "Order records along Hilbert curve of tiles on zoom level.");
+    struct arg_int* format3 = arg_int0("f", "format", "<version>", "Records format: 1 fixed size chunks, 2 compact.");
+    struct arg_lit* node_ids3 = arg_lit0("n", "node-ids", "If to keep way node ids in compact format.");
+    struct arg_file* rules3 = arg_file0("r", "rules", "<file>", "Classification rules to use instead of built in ones.");
+    struct arg_int* way_cache3 = arg_int0(NULL, "way-cache", "<MB>", "Memory for decoded member ways of multipolygons, 0 to disable cache.");
+    struct arg_file* update3 = arg_filen(NULL, "update", "<change>", 0, 10, "Change file applied to input since output map was converted. Only records it affects are rewritten.");
     struct arg_end* end3 = arg_end(20);
     
     void * argtable3[] = {
-        b2m, input_dir3, memory_nodes3, compress_output3, output_dir3, end3
+        b2m, input_dir3, memory_nodes3, compress_output3, output_dir3, workers3, kd_tree3, spatial_order3, format3, node_ids3, rules3, way_cache3, update3, end3
     };
     int nerrors3;
     
@@ -876,10 +1733,18 @@ int main(int argc, char* argv[]) {
     struct arg_file* input_file4 = arg_file1("i", "input", "<input>", "Path to file with sqlite map.");
     struct arg_file* output_dir4 = arg_file1("o", "output", "<output>", "Path to directory with converted files.");
 	struct arg_lit* compress_output4 = arg_lit0("c", "compress", "If to compress resulting files.");
+    struct arg_int* workers4 = arg_int0("j", "workers", "<n>", "Number of threads encoding entities in parallel.");
+    struct arg_lit* kd_tree4 = arg_lit0("k", "kd-tree", "Write ways and areas location indexes as legacy KD-tree.");
+    struct arg_int* spatial_order4 = arg_int0("s", "spatial-order", "<zoom>", "Order records along Hilbert curve of tiles on zoom level.");
+    struct arg_int* format4 = arg_int0("f", "format", "<version>", "Records format: 1 fixed size chunks, 2 compact.");
+    struct arg_lit* node_ids4 = arg_lit0("n", "node-ids", "If to keep way node ids in compact format.");
+    struct arg_file* rules4 = arg_file0("r", "rules", "<file>", "Classification rules to use instead of built in ones.");
+    struct arg_int* way_cache4 = arg_int0(NULL, "way-cache", "<MB>", "Memory for decoded member ways of multipolygons, 0 to disable cache.");
+    struct arg_file* update4 = arg_filen(NULL, "update", "<change>", 0, 10, "Change file applied to input since output map was converted. Only records it affects are rewritten.");
     struct arg_end* end4 = arg_end(20);
     
     void * argtable4[] = {
-        l2m, input_file4, output_dir4, compress_output4, end4
+        l2m, input_file4, output_dir4, compress_output4, workers4, kd_tree4, spatial_order4, format4, node_ids4, rules4, way_cache4, update4, end4
     };
     int nerrors4;
     
@@ -891,20 +1756,29 @@ int main(int argc, char* argv[]) {
     struct arg_file* password4a = arg_file0("w", "password", "<input>", "Password on mysql server.");
     struct arg_file* database4a = arg_file1("d", "database", "<input>", "DB name.");
     struct arg_file* output_dir4a = arg_file1("o", "output", "<output>", "Path to directory with converted files.");
+    struct arg_int* workers4a = arg_int0("j", "workers", "<n>", "Number of threads encoding entities in parallel.");
+    struct arg_lit* kd_tree4a = arg_lit0("k", "kd-tree", "Write ways and areas location indexes as legacy KD-tree.");
+    struct arg_int* spatial_order4a = arg_int0("s", "spatial-order", "<zoom>", "Order records along Hilbert curve of tiles on zoom level.");
+    struct arg_int* format4a = arg_int0("f", "format", "<version>", "Records format: 1 fixed size chunks, 2 compact.");
+    struct arg_lit* node_ids4a = arg_lit0("n", "node-ids", "If to keep way node ids in compact format.");
+    struct arg_file* rules4a = arg_file0("r", "rules", "<file>", "Classification rules to use instead of built in ones.");
+    struct arg_int* way_cache4a = arg_int0(NULL, "way-cache", "<MB>", "Memory for decoded member ways of multipolygons, 0 to disable cache.");
+    struct arg_file* update4a = arg_filen(NULL, "update", "<change>", 0, 10, "Change file applied to input since output map was converted. Only records it affects are rewritten.");
     struct arg_end* end4a = arg_end(20);
 
     void * argtable4a[] = {
-        m2m, host4a, user4a, password4a, database4a, output_dir4a, compress_output4a, end4a
+        m2m, host4a, user4a, password4a, database4a, output_dir4a, compress_output4a, workers4a, kd_tree4a, spatial_order4a, format4a, node_ids4a, rules4a, way_cache4a, update4a, end4a
     };
     int nerrors4a;
     
     /* test syntax */
     struct arg_rex* test = arg_rex1(NULL, NULL, "test", NULL, REG_ICASE, "Run tests.");
-    struct arg_rex* testTarget = arg_rex1(NULL, NULL, "utf|reader|curl", NULL, REG_ICASE | REG_EXTENDED, "What to test.");
+    struct arg_rex* testTarget = arg_rex1(NULL, NULL, "utf|reader|curl|mercator|query|decode|rules|strings|changes|arena|collections", NULL, REG_ICASE | REG_EXTENDED, "What to test.");
+    struct arg_file* testInput = arg_file0("i", "input", "<input>", "Path to test data.");
     struct arg_end* end5 = arg_end(20);
     
     void * argtable5[] = {
-        test, testTarget, end5
+        test, testTarget, testInput, end5
     };
     int nerrors5;
     
@@ -951,6 +1825,8 @@ int main(int argc, char* argv[]) {
         arg_nullcheck(argtable1b)!=0 ||
         arg_nullcheck(argtable1c)!=0 ||
         arg_nullcheck(argtable2)!=0 ||
+        arg_nullcheck(argtable2a)!=0 ||
+        arg_nullcheck(argtable2b)!=0 ||
         arg_nullcheck(argtable3)!=0 ||
         arg_nullcheck(argtable4)!=0 ||
         arg_nullcheck(argtable4a)!=0 ||
@@ -967,6 +1843,8 @@ int main(int argc, char* argv[]) {
         arg_freetable(argtable1b,sizeof(argtable1b)/sizeof(argtable1b[0]));
         arg_freetable(argtable1c,sizeof(argtable1c)/sizeof(argtable1c[0]));
         arg_freetable(argtable2,sizeof(argtable2)/sizeof(argtable2[0]));
+        arg_freetable(argtable2a,sizeof(argtable2a)/sizeof(argtable2a[0]));
+        arg_freetable(argtable2b,sizeof(argtable2b)/sizeof(argtable2b[0]));
         arg_freetable(argtable3,sizeof(argtable3)/sizeof(argtable3[0]));
         arg_freetable(argtable4,sizeof(argtable4)/sizeof(argtable4[0]));
         arg_freetable(argtable4a,sizeof(argtable4a)/sizeof(argtable4a[0]));
@@ -982,6 +1860,8 @@ int main(int argc, char* argv[]) {
     nerrors1b = arg_parse(argc, argv,argtable1b);
     nerrors1c = arg_parse(argc, argv,argtable1c);
     nerrors2 = arg_parse(argc, argv,argtable2);
+    nerrors2a = arg_parse(argc, argv,argtable2a);
+    nerrors2b = arg_parse(argc, argv,argtable2b);
     nerrors3 = arg_parse(argc, argv,argtable3);
     nerrors4 = arg_parse(argc, argv,argtable4);
     nerrors4a = arg_parse(argc, argv,argtable4a);
@@ -998,21 +1878,25 @@ int main(int argc, char* argv[]) {
     else if (nerrors1a ==0)
         exitcode = convertOsd2Olm(input_file1a->filename[0], diff_file1a->count ? (char**)diff_file1a->filename : NULL, diff_file1a->count, polygon_file1a->count ? polygon_file1a->filename[0] : NULL, fullMemory1a->count);
     else if (nerrors1b ==0)
-        exitcode = convertOsm2Omm(input_file1b->count ? input_file1b->filename[0] : NULL, host1b->filename[0], user1b->filename[0], password1b->filename[0], database1b->count ? database1b->filename[0] : NULL, polygons_dir1b->count ? polygons_dir1b->filename[0] : NULL);
+        exitcode = convertOsm2Omm(input_file1b->count ? input_file1b->filename[0] : NULL, host1b->filename[0], user1b->filename[0], password1b->filename[0], database1b->count ? database1b->filename[0] : NULL, polygons_dir1b->count ? polygons_dir1b->filename[0] : NULL, batch_bytes1b->count ? batch_bytes1b->ival[0] : 0, batch_rows1b->count ? batch_rows1b->ival[0] : 0);
     else if (nerrors1c ==0)
         exitcode = convertOsd2Omm(host1c->filename[0], user1c->filename[0], password1c->filename[0], database1c->filename[0], diff_file1c->count ? (char**)diff_file1c->filename : NULL, diff_file1c->count, polygon_file1c->count ? polygon_file1c->filename[0] : NULL, fullMemory1c->count);
     else if (nerrors2==0)
         exitcode = convertOsm2Obm(input_file2->count ? input_file2->filename[0] : NULL, output_dir2->filename[0], polygons_dir2->count ? polygons_dir2->filename[0] : NULL, compress_output2->count > 0 ? DO_COMPRESS : NO_COMPRESS);
+    else if (nerrors2a==0)
+        exitcode = convertOsd2Obm(input_dir2a->filename[0], diff_file2a->count ? (char**)diff_file2a->filename : NULL, diff_file2a->count);
+    else if (nerrors2b==0)
+        exitcode = compactObmMap(input_dir2b->filename[0]);
     else if (nerrors3==0)
-        exitcode = convertObm2Mapper(input_dir3->filename[0], output_dir3->filename[0], memory_nodes3->count, compress_output3->count > 0 ? DO_COMPRESS : NO_COMPRESS);
+        exitcode = convertObm2Mapper(input_dir3->filename[0], output_dir3->filename[0], memory_nodes3->count, compress_output3->count > 0 ? DO_COMPRESS : NO_COMPRESS, workers3->count ? workers3->ival[0] : 0, kd_tree3->count > 0, spatial_order3->count ? spatial_order3->ival[0] : -1, format3->count ? format3->ival[0] : MAPPER_FORMAT_FIXED, node_ids3->count > 0, rules3->count ? rules3->filename[0] : NULL, way_cache3->count ? way_cache3->ival[0] : -1, update3->count ? (char**)update3->filename : NULL, update3->count);
     else if (nerrors4==0)
-        exitcode = convertOlm2Mapper(input_file4->filename[0], output_dir4->filename[0], compress_output4->count > 0 ? DO_COMPRESS : NO_COMPRESS);
+        exitcode = convertOlm2Mapper(input_file4->filename[0], output_dir4->filename[0], compress_output4->count > 0 ? DO_COMPRESS : NO_COMPRESS, workers4->count ? workers4->ival[0] : 0, kd_tree4->count > 0, spatial_order4->count ? spatial_order4->ival[0] : -1, format4->count ? format4->ival[0] : MAPPER_FORMAT_FIXED, node_ids4->count > 0, rules4->count ? rules4->filename[0] : NULL, way_cache4->count ? way_cache4->ival[0] : -1, update4->count ? (char**)update4->filename : NULL, update4->count);
     else if (nerrors4a==0)
-        exitcode = convertOmm2Mapper(host4a->filename[0], user4a->filename[0], password4a->filename[0], database4a->filename[0], output_dir4->filename[0], compress_output4a->count > 0 ? DO_COMPRESS : NO_COMPRESS);
+        exitcode = convertOmm2Mapper(host4a->filename[0], user4a->filename[0], password4a->filename[0], database4a->filename[0], output_dir4a->filename[0], compress_output4a->count > 0 ? DO_COMPRESS : NO_COMPRESS, workers4a->count ? workers4a->ival[0] : 0, kd_tree4a->count > 0, spatial_order4a->count ? spatial_order4a->ival[0] : -1, format4a->count ? format4a->ival[0] : MAPPER_FORMAT_FIXED, node_ids4a->count > 0, rules4a->count ? rules4a->filename[0] : NULL, way_cache4a->count ? way_cache4a->ival[0] : -1, update4a->count ? (char**)update4a->filename : NULL, update4a->count);
     else if (nerrors5==0)
-        exitcode = runTest(testTarget->sval[0]);
+        exitcode = runTest(testTarget->sval[0], testInput->count ? testInput->filename[0] : NULL);
     else if (nerrors6==0)
-        exitcode = printHelp(help6->count, progname, argtable1, argtable1a, argtable1b, argtable1c, argtable2, argtable3, argtable4, argtable4a, argtable5, argtable6, argtable7, argtable8, NULL);
+        exitcode = printHelp(help6->count, progname, argtable1, argtable1a, argtable1b, argtable1c, argtable2, argtable2a, argtable2b, argtable3, argtable4, argtable4a, argtable5, argtable6, argtable7, argtable8, NULL);
     else if (nerrors7==0)
         exitcode = runUpdateSqlite3(updateTarget->sval[0], input_file7->filename[0], polygon_file7->count ? polygon_file7->filename[0] : NULL, fullMemory7->count);
     else if (nerrors8==0)
@@ -1044,6 +1928,14 @@ int main(int argc, char* argv[]) {
             arg_print_errors(stdout,end2,progname);
             printf("usage: %s ", progname);
             arg_print_syntax(stdout,argtable2,"\n");
+        } else if (d2b->count > 0) {
+            arg_print_errors(stdout,end2a,progname);
+            printf("usage: %s ", progname);
+            arg_print_syntax(stdout,argtable2a,"\n");
+        } else if (compact->count > 0) {
+            arg_print_errors(stdout,end2b,progname);
+            printf("usage: %s ", progname);
+            arg_print_syntax(stdout,argtable2b,"\n");
         } else if (b2m->count > 0) {
             /* here the cmd3 argument was correct, so presume syntax 3 was intended target */ 
             arg_print_errors(stdout,end3,progname);
@@ -1076,19 +1968,21 @@ int main(int argc, char* argv[]) {
             arg_print_syntax(stdout, argtable8,"\n");
         } else {
             /* no correct cmd literals were given, so we cant presume which syntax was intended */
-            printf("%s: missing <s2b|s2l|s2m|d2l|d2m|b2l|b2m|l2m|test|update|updateMysql|-h> command.\n",progname); 
+            printf("%s: missing <s2b|d2b|compact|s2l|s2m|d2l|d2m|b2l|b2m|l2m|test|update|updateMysql|-h> command.\n",progname); 
             printf("usage  1: %s ", progname);  arg_print_syntax(stdout,argtable1,"\n");
             printf("usage  2: %s ", progname);  arg_print_syntax(stdout,argtable1a,"\n");
             printf("usage  3: %s ", progname);  arg_print_syntax(stdout,argtable1b,"\n");
             printf("usage  4: %s ", progname);  arg_print_syntax(stdout,argtable1c,"\n");
             printf("usage  5: %s ", progname);  arg_print_syntax(stdout,argtable2,"\n");
-            printf("usage  6: %s ", progname);  arg_print_syntax(stdout,argtable3,"\n");
-            printf("usage  7: %s",  progname);  arg_print_syntax(stdout,argtable4,"\n");
-            printf("usage  8: %s",  progname);  arg_print_syntax(stdout,argtable4a,"\n");
-            printf("usage  9: %s",  progname);  arg_print_syntax(stdout,argtable5,"\n");
-            printf("usage 10: %s",  progname);  arg_print_syntax(stdout,argtable7,"\n");
-            printf("usage 11: %s",  progname);  arg_print_syntax(stdout,argtable8,"\n");
-            printf("usage 12: %s",  progname);  arg_print_syntax(stdout,argtable6,"\n");
+            printf("usage  6: %s ", progname);  arg_print_syntax(stdout,argtable2a,"\n");
+            printf("usage  7: %s ", progname);  arg_print_syntax(stdout,argtable2b,"\n");
+            printf("usage  8: %s ", progname);  arg_print_syntax(stdout,argtable3,"\n");
+            printf("usage  9: %s",  progname);  arg_print_syntax(stdout,argtable4,"\n");
+            printf("usage 10: %s",  progname);  arg_print_syntax(stdout,argtable4a,"\n");
+            printf("usage 11: %s",  progname);  arg_print_syntax(stdout,argtable5,"\n");
+            printf("usage 12: %s",  progname);  arg_print_syntax(stdout,argtable7,"\n");
+            printf("usage 13: %s",  progname);  arg_print_syntax(stdout,argtable8,"\n");
+            printf("usage 14: %s",  progname);  arg_print_syntax(stdout,argtable6,"\n");
         }
     }
     
@@ -1099,6 +1993,8 @@ int main(int argc, char* argv[]) {
     arg_freetable(argtable1b,sizeof(argtable1b)/sizeof(argtable1b[0]));
     arg_freetable(argtable1c,sizeof(argtable1c)/sizeof(argtable1c[0]));
     arg_freetable(argtable2,sizeof(argtable2)/sizeof(argtable2[0]));
+    arg_freetable(argtable2a,sizeof(argtable2a)/sizeof(argtable2a[0]));
+    arg_freetable(argtable2b,sizeof(argtable2b)/sizeof(argtable2b[0]));
     arg_freetable(argtable3,sizeof(argtable3)/sizeof(argtable3[0]));
     arg_freetable(argtable4,sizeof(argtable4)/sizeof(argtable4[0]));
     arg_freetable(argtable4a,sizeof(argtable4a)/sizeof(argtable4a[0]));
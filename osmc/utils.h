@@ -40,4 +40,33 @@ void unmapFile(void * dataPtr, size_t record_size, size_t recordsCount);
 #define min(a,b) ((a)<(b)?(a):(b))
 #define max(a,b) ((a)>(b)?(a):(b))
 
+// Variable length integers: 7 bits per byte, least significant first, high bit set on all bytes but the last.
+#define VARINT_MAX_LENGTH 10
+#define zigzagEncode(v) ((((uint64_t)(v)) << 1) ^ (uint64_t)((int64_t)(v) >> 63))
+#define zigzagDecode(v) ((int64_t)((v) >> 1) ^ -(int64_t)((v) & 1))
+
+static inline int encodeVarint(uint64_t value, unsigned char* buffer) {
+    int length = 0;
+    while(value >= 0x80) {
+        buffer[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[length++] = (unsigned char) value;
+    return length;
+}
+
+// Returns number of bytes read, or 0 if value does not end before end.
+static inline int decodeVarint(const unsigned char* buffer, const unsigned char* end, uint64_t* value) {
+    uint64_t result = 0;
+    for(int length = 0, shift = 0; buffer + length < end && shift < 64; shift += 7) {
+        unsigned char byte = buffer[length++];
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+            *value = result;
+            return length;
+        }
+    }
+    return 0;
+}
+
 #endif